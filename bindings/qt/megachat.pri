@@ -88,6 +88,7 @@ HEADERS  += asyncTest-framework.h \
             chatdICrypto.h \
             db.h \
             karereId.h \
+            idMap.h \
             presenced.h \
             serverListProvider.h \
             autoHandle.h \
@@ -124,6 +125,7 @@ HEADERS  += asyncTest-framework.h \
             base/promise.h \
             base/services.h \
             base/timers.hpp \
+            base/timerWheel.h \
             base/trackDelete.h \
             net/libwebsocketsIO.h \
             net/websocketsIO.h \
@@ -136,6 +138,7 @@ HEADERS  += asyncTest-framework.h \
             rtcModule/messages.h \
             rtcModule/rtcmPrivate.h \
             rtcModule/rtcStats.h \
+            rtcModule/rtcStatsStore.h \
             rtcModule/streamPlayer.h \
             rtcModule/webrtc.h \
             rtcModule/webrtcAdapter.h \
@@ -218,6 +218,21 @@ public:
      */
     virtual void onPresenceChanged(Id /*userid*/, Presence /*pres*/, bool /*inProgress*/) {}
 
+    /**
+     * @brief Called with the presence changes of peers collected during a window,
+     * when coalescing is enabled (see presenced::Client::setPresenceCoalescing).
+     * Only the last presence of each user is included.
+     *
+     * By default, it calls \c onPresenceChanged for every user.
+     */
+    virtual void onPresencesChanged(const presenced::PresenceChanges& changes)
+    {
+        for (auto& change: changes)
+        {
+            onPresenceChanged(change.first, change.second, false);
+        }
+    }
+
     /**
      * @brief Called when the presence preferences have changed due to
      * our or another client of our account updating them.
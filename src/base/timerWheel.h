@@ -0,0 +1,538 @@
+#ifndef _MEGA_BASE_TIMERWHEEL_INCLUDED
+#define _MEGA_BASE_TIMERWHEEL_INCLUDED
+/**
+ * @file timerWheel.h
+ * @brief Hierarchical timing wheel, that drives all the timers of an event loop
+ * with a single libuv timer
+ *
+ * (c) 2020 by Mega Limited, Wellsford, New Zealand
+ *
+ * This file is part of the MEGA SDK - Client Access Engine.
+ *
+ * Applications using the MEGA API must present a valid application key
+ * and comply with the the rules set forth in the Terms of Service.
+ *
+ * The MEGA SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * @copyright Simplified (2-clause) BSD License.
+ *
+ * You should have received a copy of the license along with this
+ * program.
+ */
+#include "cservices.h"
+#include "idMap.h"
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace karere
+{
+/** @brief The timers of an event loop, driven by a single uv timer
+ *
+ * Timers are kept in a hierarchical timing wheel of \c kLevels levels of \c kSlots
+ * slots each, with a resolution of 1 ms. The level of a timer is given by the most
+ * significant byte in which its expiration time differs from the current time, and its
+ * slot by the value of that byte. When the current time reaches the start of a slot of
+ * an upper level, its timers are moved down, until they expire at level 0.
+ *
+ * Adding and cancelling a timer are O(1). Timer nodes are recycled, so once the pool
+ * has grown, timers don't allocate (other than the captures of large callbacks). The
+ * uv timer is armed for the next tick in which a slot has to be processed, so the loop
+ * doesn't wake up while there is nothing to do.
+ *
+ * The nodes and slots are only accessed from the thread of the event loop. The handles
+ * are guarded by a mutex of their own, so \c reserveHandle(), \c cancel() and \c size()
+ * can be called from any thread: a timer cancelled from another thread doesn't fire,
+ * and its node is released by \c releaseCanceled(). Callbacks are called from the uv
+ * timer, holding the mutex of the owner of the loop, like the rest of its events.
+ */
+class TimerWheel
+{
+public:
+    typedef std::function<void()> Callback;
+    enum { kLevelBits = 8, kSlots = 1 << kLevelBits, kLevels = 4 };
+
+    /** Must be created before the loop runs, or from its thread */
+    TimerWheel(uv_loop_t* loop, std::recursive_mutex& mutex)
+        : mLoop(loop), mMutex(mutex), mNow(uv_now(loop))
+    {
+        mHeads.assign(kLevels * kSlots, kNil);
+        memset(mOccupied, 0, sizeof(mOccupied));
+        mUvTimer = new uv_timer_t();
+        uv_timer_init(mLoop, mUvTimer);
+        mUvTimer->data = this;
+    }
+    ~TimerWheel()
+    {
+        if (mUvTimer)
+        {
+            close();    // the handle is freed only if the loop runs again
+        }
+    }
+
+    /** Stops the uv timer and closes it. Must be called from the thread of the loop,
+     * before the loop exits: the handle is freed by its next iteration. Timers don't
+     * fire anymore */
+    void close()
+    {
+        assert(isLoopThread() && mUvTimer);
+        uv_timer_stop(mUvTimer);
+        uv_close((uv_handle_t*)mUvTimer, [](uv_handle_t* handle)
+        {
+            delete (uv_timer_t*)handle;
+        });
+        mUvTimer = nullptr;
+        mArmedAt = kNever;
+    }
+
+    /** Must be called from the thread that runs the loop, before any timer is added from it */
+    void setLoopThread() { mThreadId = std::this_thread::get_id(); }
+    bool isLoopThread() const { return std::this_thread::get_id() == mThreadId.load(); }
+
+    /** Returns a new handle for a timer that will be added by \c add(handle, ...).
+     * It can be called from any thread. Until the timer is added, it can be cancelled */
+    megaHandle reserveHandle()
+    {
+        megaHandle handle = newHandle();
+        std::lock_guard<std::mutex> lock(mHandlesMutex);
+        mReserved[handle] = false;
+        return handle;
+    }
+
+    /** Adds a timer that expires in \c timeMs, and then every \c timeMs if \c repeat */
+    megaHandle add(Callback&& cb, unsigned timeMs, bool repeat)
+    {
+        assert(isLoopThread());
+        megaHandle handle = newHandle();
+        addNode(handle, std::move(cb), timeMs, repeat);
+        return handle;
+    }
+    /** Same as above, for a handle returned by \c reserveHandle(). The timer is
+     * dropped if it has been cancelled in the meantime */
+    void add(megaHandle handle, Callback&& cb, unsigned timeMs, bool repeat)
+    {
+        assert(isLoopThread());
+        {
+            std::lock_guard<std::mutex> lock(mHandlesMutex);
+            bool* canceled = mReserved.find(handle);
+            assert(canceled);
+            bool drop = !canceled || *canceled;
+            mReserved.erase(handle);
+            if (drop)
+            {
+                return;
+            }
+        }
+        addNode(handle, std::move(cb), timeMs, repeat);
+    }
+
+    /** @return False if the timer is not found, i.e. a one-shot timer that already
+     * expired, or a timer already cancelled. It can be called from any thread, but a
+     * callback that is already running is not interrupted */
+    bool cancel(megaHandle handle)
+    {
+        uint32_t index;
+        {
+            std::lock_guard<std::mutex> lock(mHandlesMutex);
+            uint32_t* found = mHandles.find(handle);
+            if (!found)
+            {
+                // a timer set from another thread, not added yet
+                bool* canceled = mReserved.find(handle);
+                if (!canceled || *canceled)
+                {
+                    return false;
+                }
+                *canceled = true;
+                return true;
+            }
+
+            index = *found;
+            mHandles.erase(handle);
+            if (!isLoopThread())
+            {
+                // it doesn't fire without its handle. The node is released by releaseCanceled()
+                mPendingCancels.emplace_back(index, handle);
+                return true;
+            }
+        }
+
+        if (index == mFiring)
+        {
+            return true;    // freed once its callback returns
+        }
+        // the uv timer is not re-armed: at most, it will wake up for nothing
+        unlink(index);
+        freeNode(index);
+        return true;
+    }
+
+    /** Releases the nodes of the timers cancelled from other threads */
+    void releaseCanceled()
+    {
+        assert(isLoopThread());
+        std::vector<std::pair<uint32_t, megaHandle>> canceled;
+        {
+            std::lock_guard<std::mutex> lock(mHandlesMutex);
+            canceled.swap(mPendingCancels);
+        }
+        for (auto& entry: canceled)
+        {
+            // the node may have been released when it was due, and reused since then
+            Node& node = mNodes[entry.first];
+            if (node.handle == entry.second && node.list != kNil)
+            {
+                unlink(entry.first);
+                freeNode(entry.first);
+            }
+        }
+    }
+
+    /** Number of active timers */
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mHandlesMutex);
+        return mHandles.size();
+    }
+    /** Number of timer nodes allocated, active or not */
+    size_t poolSize() const { return mNodes.size(); }
+
+protected:
+    enum: uint32_t { kNil = 0xffffffff };
+    enum { kSlotMask = kSlots - 1 };
+    static const uint64_t kNever = ~((uint64_t)0);
+
+    struct Node
+    {
+        Callback cb;
+        uint64_t expiry = 0;    // tick (ms of the loop time) in which it expires
+        uint32_t prev = kNil;
+        uint32_t next = kNil;   // next node of the slot, or of the free list
+        uint32_t list = kNil;   // index of the slot in mHeads
+        unsigned period = 0;    // 0 for one-shot timers
+        megaHandle handle = 0;
+    };
+
+    uv_loop_t* mLoop;
+    uv_timer_t* mUvTimer;           // null once closed
+    std::recursive_mutex& mMutex;
+    std::atomic<std::thread::id> mThreadId{std::thread::id()};   // none until setLoopThread()
+    std::atomic<megaHandle> mLastHandle{0};
+    uint64_t mNow;                  // last tick processed
+    uint64_t mArmedAt = kNever;     // tick for which the uv timer is armed
+    std::deque<Node> mNodes;        // deque: references remain valid while callbacks add timers
+    uint32_t mFreeList = kNil;
+    std::vector<uint32_t> mHeads;   // first node of every slot, by level
+    uint64_t mOccupied[kLevels][kSlots / 64];  // non-empty slots, to find the next one to process
+    mutable std::mutex mHandlesMutex;   // guards mHandles, mReserved and mPendingCancels
+    IdMap<uint32_t> mHandles;       // handle to index of the node
+    IdMap<bool> mReserved;          // handles reserved for timers not added yet, and if cancelled
+    std::vector<std::pair<uint32_t, megaHandle>> mPendingCancels;  // nodes cancelled from other threads
+    uint32_t mFiring = kNil;        // node of the repeating timer whose callback is running
+
+    megaHandle newHandle()
+    {
+        megaHandle handle;
+        do
+        {
+            handle = ++mLastHandle;
+        } while (!handle); // 0 is the invalid handle
+        return handle;
+    }
+
+    void addNode(megaHandle handle, Callback&& cb, unsigned timeMs, bool repeat)
+    {
+        uint32_t index = allocNode();
+        Node& node = mNodes[index];
+        node.cb = std::move(cb);
+        node.handle = handle;
+        node.period = repeat ? (timeMs ? timeMs : 1) : 0;
+        // relative to the time of the loop, like uv timers. It may be ahead of mNow
+        node.expiry = uv_now(mLoop) + timeMs;
+        if (node.expiry <= mNow)
+        {
+            node.expiry = mNow + 1;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mHandlesMutex);
+            mHandles[handle] = index;
+        }
+        link(index);
+
+        if (node.expiry < mArmedAt)
+        {
+            arm(node.expiry);
+        }
+    }
+
+
+    static unsigned countTrailingZeros(uint64_t bits)
+    {
+        assert(bits);
+#if defined(__GNUC__)
+        return __builtin_ctzll(bits);
+#elif defined(_MSC_VER) && defined(_WIN64)
+        unsigned long index;
+        _BitScanForward64(&index, bits);
+        return index;
+#else
+        unsigned count = 0;
+        while (!(bits & 1))
+        {
+            bits >>= 1;
+            count++;
+        }
+        return count;
+#endif
+    }
+
+    uint32_t allocNode()
+    {
+        if (mFreeList == kNil)
+        {
+            mNodes.emplace_back();
+            return static_cast<uint32_t>(mNodes.size() - 1);
+        }
+        uint32_t index = mFreeList;
+        mFreeList = mNodes[index].next;
+        return index;
+    }
+    bool hasHandle(megaHandle handle) const
+    {
+        std::lock_guard<std::mutex> lock(mHandlesMutex);
+        return mHandles.contains(handle);
+    }
+    bool eraseHandle(megaHandle handle)
+    {
+        std::lock_guard<std::mutex> lock(mHandlesMutex);
+        return mHandles.erase(handle);
+    }
+
+    void freeNode(uint32_t index)
+    {
+        Node& node = mNodes[index];
+        node.cb = nullptr;  // release the captures now
+        node.handle = 0;
+        node.list = kNil;
+        node.next = mFreeList;
+        mFreeList = index;
+    }
+
+    void link(uint32_t index)
+    {
+        Node& node = mNodes[index];
+        uint64_t diff = node.expiry ^ mNow;
+        unsigned level = 0;
+        // timers too far in the future stay in the last level, and are moved again when it wraps
+        while (level < kLevels - 1 && (diff >> ((level + 1) * kLevelBits)))
+        {
+            level++;
+        }
+        unsigned slot = (node.expiry >> (level * kLevelBits)) & kSlotMask;
+        uint32_t list = level * kSlots + slot;
+        node.list = list;
+        node.prev = kNil;
+        node.next = mHeads[list];
+        if (node.next != kNil)
+        {
+            mNodes[node.next].prev = index;
+        }
+        mHeads[list] = index;
+        mOccupied[level][slot / 64] |= (uint64_t)1 << (slot % 64);
+    }
+    void unlink(uint32_t index)
+    {
+        Node& node = mNodes[index];
+        assert(node.list != kNil);
+        if (node.prev != kNil)
+        {
+            mNodes[node.prev].next = node.next;
+        }
+        else
+        {
+            mHeads[node.list] = node.next;
+            if (node.next == kNil)
+            {
+                unsigned slot = node.list % kSlots;
+                mOccupied[node.list / kSlots][slot / 64] &= ~((uint64_t)1 << (slot % 64));
+            }
+        }
+        if (node.next != kNil)
+        {
+            mNodes[node.next].prev = node.prev;
+        }
+        node.list = kNil;
+    }
+
+    /** First non-empty slot of the level, from \c from, or -1 */
+    int findSlot(unsigned level, unsigned from) const
+    {
+        for (unsigned word = from / 64; word < kSlots / 64; word++)
+        {
+            uint64_t bits = mOccupied[level][word];
+            if (word == from / 64)
+            {
+                bits &= ~((uint64_t)0) << (from % 64);
+            }
+            if (bits)
+            {
+                return static_cast<int>(word * 64 + countTrailingZeros(bits));
+            }
+        }
+        return -1;
+    }
+
+    /** The next tick in which a slot has to be processed: timers expire, or move down a level */
+    uint64_t nextEventTick() const
+    {
+        uint64_t next = kNever;
+        for (unsigned level = 0; level < kLevels; level++)
+        {
+            unsigned shift = level * kLevelBits;
+            unsigned windowShift = shift + kLevelBits;
+            uint64_t windowStart = (mNow >> windowShift) << windowShift;
+            unsigned current = (mNow >> shift) & kSlotMask;
+            int slot = findSlot(level, current + 1);
+            if (slot < 0)
+            {
+                // only timers of the last level can be in a slot that has already started
+                slot = findSlot(level, 0);
+                if (slot < 0)
+                {
+                    continue;
+                }
+                windowStart += (uint64_t)1 << windowShift;
+            }
+            uint64_t tick = windowStart + ((uint64_t)slot << shift);
+            if (tick < next)
+            {
+                next = tick;
+            }
+        }
+        return next;
+    }
+
+    void arm(uint64_t tick)
+    {
+        if (!mUvTimer)
+        {
+            return; // closed
+        }
+        mArmedAt = tick;
+        if (tick == kNever)
+        {
+            uv_timer_stop(mUvTimer);
+            return;
+        }
+        uint64_t now = uv_now(mLoop);
+        uv_timer_start(mUvTimer, [](uv_timer_t* handle)
+        {
+            static_cast<TimerWheel*>(handle->data)->onTimer();
+        }, (tick > now) ? tick - now : 0, 0);
+    }
+
+    void onTimer()
+    {
+        std::lock_guard<std::recursive_mutex> lock(mMutex);
+        mArmedAt = kNever;
+        releaseCanceled();
+        uint64_t now = uv_now(mLoop);
+        for (uint64_t tick = nextEventTick(); tick <= now; tick = nextEventTick())
+        {
+            mNow = tick;
+            processTick();
+        }
+        if (now > mNow)
+        {
+            mNow = now; // no slot starts in between
+        }
+        arm(nextEventTick());
+    }
+
+    void processTick()
+    {
+        // upper levels first, as their timers may move down to the slots starting now
+        for (unsigned level = kLevels - 1; level > 0; level--)
+        {
+            unsigned shift = level * kLevelBits;
+            if (!(mNow & (((uint64_t)1 << shift) - 1)))
+            {
+                cascade(level * kSlots + ((mNow >> shift) & kSlotMask));
+            }
+        }
+
+        // callbacks can add timers, but not to this slot: they expire after mNow
+        uint32_t list = mNow & kSlotMask;
+        uint32_t index;
+        while ((index = mHeads[list]) != kNil)
+        {
+            unlink(index);
+            fire(index);
+        }
+    }
+
+    void cascade(uint32_t list)
+    {
+        uint32_t index = mHeads[list];
+        if (index == kNil)
+        {
+            return;
+        }
+
+        mHeads[list] = kNil;
+        unsigned slot = list % kSlots;
+        mOccupied[list / kSlots][slot / 64] &= ~((uint64_t)1 << (slot % 64));
+        while (index != kNil)
+        {
+            uint32_t next = mNodes[index].next;
+            link(index);
+            index = next;
+        }
+    }
+
+    void fire(uint32_t index)
+    {
+        Node& node = mNodes[index];
+        if (!node.period)
+        {
+            if (!eraseHandle(node.handle))
+            {
+                freeNode(index);    // cancelled from another thread
+                return;
+            }
+            Callback cb(std::move(node.cb));
+            freeNode(index);
+            cb();
+            return;
+        }
+
+        if (!hasHandle(node.handle))
+        {
+            freeNode(index);
+            return;
+        }
+        mFiring = index;
+        node.cb();
+        mFiring = kNil;
+        if (!hasHandle(node.handle))
+        {
+            freeNode(index);    // cancelled by its callback, or meanwhile
+            return;
+        }
+        node.expiry = mNow + node.period;
+        link(index);
+    }
+};
+}
+#endif
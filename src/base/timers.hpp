@@ -23,97 +23,33 @@
  */
 #include "cservices.h"
 #include "gcmpp.h"
+#include "timerWheel.h"
 #include <memory>
 #include <assert.h>
 
 namespace karere
 {
 
-struct TimerMsg: public megaMessage
-{
-    timerevent* timerEvent = nullptr;
-    bool canceled = false;
-    megaHandle handle;
-    TimerMsg(megaMessageFunc aFunc)
-        :megaMessage(aFunc),
-          handle(services_hstore_add_handle(MEGA_HTYPE_TIMER, this))
-    {}
-   ~TimerMsg()
-    {
-        services_hstore_remove_handle(MEGA_HTYPE_TIMER, handle);
-        if (timerEvent)
-        {            
-            uv_close((uv_handle_t *)timerEvent, [](uv_handle_t* handle)
-            {
-                delete handle;
-            });
-        }
-    }
-};
-
-void init_uv_timer(void *ctx, uv_timer_t *timer);
-
-extern std::recursive_mutex timerMutex;
+/** The timers of the event loop of the app context \c ctx */
+TimerWheel& timerWheel(void *ctx);
 
 template <int persist, class CB>
 inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
 {
-    struct Msg: public TimerMsg
+    TimerWheel& wheel = timerWheel(ctx);
+    if (wheel.isLoopThread())
     {
-        CB cb;
-        void *appCtx;
-        Msg(CB&& aCb, megaMessageFunc cFunc)
-        :TimerMsg(cFunc), cb(aCb)
-        {}
-        unsigned time;
-        int loop;
-    };
-    megaMessageFunc cfunc = persist
-        ? (megaMessageFunc) [](void* arg)
-          {
-              Msg* msg = static_cast<Msg*>(arg);
-              if (msg->canceled)
-                  return;
-              msg->cb();
-          }
-        : (megaMessageFunc) [](void* arg)
-          {
-              timerMutex.lock();
-              Msg* msg = static_cast<Msg*>(arg);
-              if (msg->canceled)
-              {
-                  timerMutex.unlock();
-                  return;
-              }
-              msg->cb();
-              if (msg->canceled)
-              {
-                  timerMutex.unlock();
-                  return;
-              }
-              delete msg;
-              timerMutex.unlock();
-          };
-
-    timerMutex.lock();
-    Msg* pMsg = new Msg(std::forward<CB>(callback), cfunc);
-    timerMutex.unlock();
+        return wheel.add(TimerWheel::Callback(std::forward<CB>(callback)), time, persist != 0);
+    }
 
-    pMsg->appCtx = ctx;
-    pMsg->time = time;
-    pMsg->loop = persist;  
-    marshallCall([pMsg, ctx]()
+    // the handle is returned now, the timer is added by the thread of the loop
+    megaHandle handle = wheel.reserveHandle();
+    auto cb = std::make_shared<TimerWheel::Callback>(std::forward<CB>(callback));
+    marshallCall([&wheel, handle, cb, time]()
     {
-        pMsg->timerEvent = new uv_timer_t();
-        pMsg->timerEvent->data = pMsg;
-        init_uv_timer(ctx, pMsg->timerEvent);
-        uv_timer_start(pMsg->timerEvent,
-                       [](uv_timer_t* handle)
-                       {
-                           megaPostMessageToGui(handle->data, ((Msg*)handle->data)->appCtx);
-                       }, pMsg->time, pMsg->loop ? pMsg->time : 0);
-    }, ctx);    
-    return pMsg->handle;
+        wheel.add(handle, std::move(*cb), time, persist != 0);
+    }, ctx);
+    return handle;
 }
 /** Cancels a previously set timeout with setTimeout()
  * @return \c false if the handle is not valid. This can happen if the timeout
@@ -122,31 +58,21 @@ inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
  */
 static inline bool cancelTimeout(megaHandle handle, void *ctx)
 {
-    timerMutex.lock();
-
     assert(handle);
-    TimerMsg* timer = static_cast<TimerMsg*>(services_hstore_get_handle(MEGA_HTYPE_TIMER, handle));
-    if (!timer)
+    TimerWheel& wheel = timerWheel(ctx);
+    if (!wheel.cancel(handle))
     {
-        timerMutex.unlock();
-        return false; //not valid anymore
+        return false;
     }
 
-//we have to make sure that we delete the timer only after all possibly queued
-//timer messages in the app's message queue are processed. For this purpose,
-//we first stop the timer, and only then post a call to delete the timer.
-//That call should be processed after all timer messages
-    timer->canceled = true; //disable timer callback being called by possibly queued messages, and message freeing in one-shot timer handler
-    timerMutex.unlock();    
-    marshallCall([timer, ctx]()
+    if (!wheel.isLoopThread())
     {
-        uv_timer_stop(timer->timerEvent);
-
-        marshallCall([timer, ctx]()
+        // the timer won't fire, but its node is released by the thread of the loop
+        marshallCall([&wheel]()
         {
-            delete timer;
+            wheel.releaseCanceled();
         }, ctx);
-    }, ctx);
+    }
     return true;
 }
 /** @brief Cancels a previously set timer with setInterval.
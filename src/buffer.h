@@ -5,6 +5,8 @@
 #include <stdexcept>
 #include <string.h>
 #include <vector>
+#include <mutex>
+#include <atomic>
 
 #if !defined(__arm__) && !defined(__aarch64__)
     #define BUFFER_ALLOW_UNALIGNED_MEMORY_ACCESS 1
@@ -161,10 +163,157 @@ public:
     }
 };
 
+/** @brief Allocator for the data block of a \c Buffer.
+ *
+ * A Buffer without allocator uses malloc/realloc/free. Since buffers may be
+ * moved between threads and outlive the object that created them, an allocator
+ * must accept \c free() calls from any thread and must outlive all the buffers
+ * that use it.
+ */
+class BufferAllocator
+{
+public:
+    /** Allocates a block of at least \c size bytes. The real capacity of the block,
+     * which can be larger than requested, is returned in \c capacity */
+    virtual void* alloc(size_t size, size_t& capacity) = 0;
+    /** Grows a block of \c oldCapacity bytes (as returned by a previous call) to at
+     * least \c size bytes, preserving its contents */
+    virtual void* realloc(void* ptr, size_t oldCapacity, size_t size, size_t& capacity) = 0;
+    virtual void free(void* ptr, size_t capacity) = 0;
+    /** Allocator that takes over when a buffer stops referencing a block of this one.
+     * It differs from \c this only for allocators of blocks that a buffer doesn't own
+     * exclusively (see \c SharedBuffer), which can't be grown or reassigned in place */
+    virtual BufferAllocator* detachAllocator() { return this; }
+    virtual ~BufferAllocator() {}
+};
+
+/** @brief Size-class pool for small, frequently allocated buffers (i.e. message payloads).
+ *
+ * Requests up to \c kMaxClassSize bytes are rounded up to the next power of two
+ * and freed blocks are kept in a per-class free list (up to \c maxCachedPerClass
+ * blocks), so that the steady state of a message stream needs no calls to malloc.
+ * Larger requests are forwarded to malloc/realloc/free.
+ */
+class BufferPool: public BufferAllocator
+{
+public:
+    enum { kMinClassShift = 6, kMaxClassShift = 12, kClassCount = kMaxClassShift - kMinClassShift + 1 };
+    enum { kMinClassSize = 1 << kMinClassShift, kMaxClassSize = 1 << kMaxClassShift };
+    struct Stats
+    {
+        uint64_t allocs = 0;    // blocks handed out (including grown blocks)
+        uint64_t mallocs = 0;   // blocks obtained from malloc/realloc
+        uint64_t cached = 0;    // blocks currently held in the free lists
+    };
+    explicit BufferPool(size_t maxCachedPerClass = 256)
+        : mMaxCachedPerClass(maxCachedPerClass) {}
+    ~BufferPool()
+    {
+        for (FreeBlock* head: mFreeLists)
+        {
+            while (head)
+            {
+                FreeBlock* next = head->next;
+                ::free(head);
+                head = next;
+            }
+        }
+    }
+    virtual void* alloc(size_t size, size_t& capacity)
+    {
+        mAllocs.fetch_add(1, std::memory_order_relaxed);
+        if (size > kMaxClassSize)
+        {
+            mMallocs.fetch_add(1, std::memory_order_relaxed);
+            capacity = size;
+            return ::malloc(size);
+        }
+        int cls = sizeClass(size);
+        capacity = (size_t)kMinClassSize << cls;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            FreeBlock* block = mFreeLists[cls];
+            if (block)
+            {
+                mFreeLists[cls] = block->next;
+                mCachedCount[cls]--;
+                return block;
+            }
+        }
+        mMallocs.fetch_add(1, std::memory_order_relaxed);
+        return ::malloc(capacity);
+    }
+    virtual void* realloc(void* ptr, size_t oldCapacity, size_t size, size_t& capacity)
+    {
+        if (size <= oldCapacity)
+        {
+            capacity = oldCapacity;
+            return ptr;
+        }
+        if (oldCapacity > kMaxClassSize) // not a pooled block, and the new one won't be either
+        {
+            mAllocs.fetch_add(1, std::memory_order_relaxed);
+            mMallocs.fetch_add(1, std::memory_order_relaxed);
+            capacity = size;
+            return ::realloc(ptr, size);
+        }
+        void* newPtr = alloc(size, capacity);
+        if (!newPtr)
+            return nullptr;
+        memcpy(newPtr, ptr, oldCapacity);
+        free(ptr, oldCapacity);
+        return newPtr;
+    }
+    virtual void free(void* ptr, size_t capacity)
+    {
+        if (capacity <= kMaxClassSize)
+        {
+            int cls = sizeClass(capacity);
+            assert(capacity == ((size_t)kMinClassSize << cls));
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mCachedCount[cls] < mMaxCachedPerClass)
+            {
+                FreeBlock* block = static_cast<FreeBlock*>(ptr);
+                block->next = mFreeLists[cls];
+                mFreeLists[cls] = block;
+                mCachedCount[cls]++;
+                return;
+            }
+        }
+        ::free(ptr);
+    }
+    Stats stats() const
+    {
+        Stats result;
+        result.allocs = mAllocs.load(std::memory_order_relaxed);
+        result.mallocs = mMallocs.load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (size_t count: mCachedCount)
+            result.cached += count;
+        return result;
+    }
+protected:
+    struct FreeBlock { FreeBlock* next; };
+    static int sizeClass(size_t size)
+    {
+        int cls = 0;
+        while (((size_t)kMinClassSize << cls) < size)
+            cls++;
+        return cls;
+    }
+    size_t mMaxCachedPerClass;
+    mutable std::mutex mMutex;
+    FreeBlock* mFreeLists[kClassCount] = {};
+    size_t mCachedCount[kClassCount] = {};
+    std::atomic<uint64_t> mAllocs{0};
+    std::atomic<uint64_t> mMallocs{0};
+};
+
 class Buffer: public StaticBuffer
 {
 protected:
     size_t mBufSize;
+    BufferAllocator* mAllocator = nullptr;
     enum {kMinBufSize = 64};
     void zero()
     {
@@ -172,22 +321,75 @@ protected:
         mBufSize = 0;
         mDataSize = 0;
     }
+    // All (re)allocations of the data block go through these, so that mAllocator is honoured
+    char* allocBlock(size_t size, size_t& capacity)
+    {
+        if (!mAllocator)
+        {
+            capacity = size;
+            return (char*)::malloc(size);
+        }
+        return (char*)mAllocator->alloc(size, capacity);
+    }
+    char* reallocBlock(size_t size, size_t& capacity)
+    {
+        if (!mAllocator)
+        {
+            capacity = size;
+            return (char*)::realloc(mBuf, size);
+        }
+        if (isShared())
+            return reallocShared(size, capacity);
+        return (char*)mAllocator->realloc(mBuf, mBufSize, size, capacity);
+    }
+    char* reallocShared(size_t size, size_t& capacity)
+    {
+        BufferAllocator* target = mAllocator->detachAllocator();
+        char* newBuf = target ? (char*)target->alloc(size, capacity) : (char*)::malloc(capacity = size);
+        if (!newBuf)
+            return nullptr;
+        memcpy(newBuf, mBuf, (mDataSize < size) ? mDataSize : size);
+        freeBlock();
+        return newBuf;
+    }
+    void freeBlock()
+    {
+        if (!mAllocator)
+        {
+            ::free(mBuf);
+            return;
+        }
+        // The allocator may be gone after free() if it was a SharedBuffer
+        BufferAllocator* allocator = mAllocator;
+        mAllocator = allocator->detachAllocator();
+        allocator->free(mBuf, mBufSize);
+    }
+    void zeroMoved()
+    {
+        if (isShared())
+            mAllocator = mAllocator->detachAllocator();
+        zero();
+    }
+    friend class SharedBuffer;
 public:
     char* buf() { return mBuf;}
     const char* buf() const { return mBuf;}
     size_t bufSize() const { return mBufSize;}
-    Buffer(size_t size=kMinBufSize, size_t dataSize=0)
+    BufferAllocator* allocator() const { return mAllocator; }
+    /** True if the data block is not owned exclusively by this buffer (i.e. a slice of a SharedBuffer) */
+    bool isShared() const { return mAllocator && mAllocator->detachAllocator() != mAllocator; }
+    Buffer(size_t size=kMinBufSize, size_t dataSize=0, BufferAllocator* allocator=nullptr)
+        : mAllocator(allocator)
     {
         assert(dataSize <= size);
         if (size)
         {
-            mBuf = (char*)malloc(size);
+            mBuf = allocBlock(size, mBufSize);
             if (!mBuf)
             {
                 zero();
                 throw std::runtime_error("Out of memory allocating block of size "+ std::to_string(size));
             }
-            mBufSize = size;
             mDataSize = dataSize;
         }
         else
@@ -195,12 +397,12 @@ public:
             zero();
         }
     }
-    Buffer(const char* data, size_t datalen)
+    Buffer(const char* data, size_t datalen, BufferAllocator* allocator=nullptr)
+        : mAllocator(allocator)
     {
         if (data && datalen)
         {
-            mBuf = (char*)malloc(datalen);
-            mBufSize = datalen;
+            mBuf = allocBlock(datalen, mBufSize);
             memcpy(mBuf, data, datalen);
             mDataSize = datalen;
         }
@@ -210,30 +412,42 @@ public:
         }
     }
     Buffer(Buffer&& other)
-        :StaticBuffer(other.mBuf, other.mDataSize), mBufSize(other.mBufSize) { other.zero(); }
+        :StaticBuffer(other.mBuf, other.mDataSize), mBufSize(other.mBufSize), mAllocator(other.mAllocator) { other.zeroMoved(); }
+    Buffer& operator=(Buffer&& other)
+    {
+        if (this == &other)
+            return *this;
+        if (mBuf)
+            freeBlock();
+        mBuf = other.mBuf;
+        mBufSize = other.mBufSize;
+        mDataSize = other.mDataSize;
+        mAllocator = other.mAllocator;
+        other.zeroMoved();
+        return *this;
+    }
 
     template <bool withNull>
     Buffer(const std::string& src)
     {
-        mBufSize = withNull ? src.size()+1 : src.size();
-        mBuf = (char*)malloc(mBufSize);
-        memcpy(mBuf, src.c_str(), mBufSize);
-        mDataSize = mBufSize;
+        size_t size = withNull ? src.size()+1 : src.size();
+        mBuf = allocBlock(size, mBufSize);
+        memcpy(mBuf, src.c_str(), size);
+        mDataSize = size;
     }
     void assign(const void* data, size_t datalen)
     {
         if (mBuf)
         {
-            if (datalen <= mBufSize)
+            if (datalen <= mBufSize && !isShared())
             {
                 memcpy(mBuf, data, datalen);
                 mDataSize = datalen;
                 return;
             }
-            ::free(mBuf);
+            freeBlock();
         }
-        mBufSize = (kMinBufSize > datalen) ? (size_t) kMinBufSize : datalen;
-        mBuf = (char*)malloc(mBufSize);
+        mBuf = allocBlock((kMinBufSize > datalen) ? (size_t) kMinBufSize : datalen, mBufSize);
         if (!mBuf)
         {
             zero();
@@ -249,8 +463,7 @@ public:
     {
         if (!mBuf)
         {
-            mBuf = (char*)::malloc(size);
-            mBufSize = size;
+            mBuf = allocBlock(size, mBufSize);
             assert(mDataSize == 0);
         }
         else
@@ -258,14 +471,12 @@ public:
             size_t newsize = mDataSize+size;
             if (newsize <= mBufSize)
                 return;
-            char* save = mBuf;
-            mBuf = (char*)::realloc(mBuf, newsize);
-            if (!mBuf)
-            {
-                mBuf = save;
+            size_t capacity;
+            char* newBuf = reallocBlock(newsize, capacity);
+            if (!newBuf)
                 throw std::runtime_error("Buffer::reserve: Out of memory");
-            }
-            mBufSize = newsize;
+            mBuf = newBuf;
+            mBufSize = capacity;
         }
     }
     void setDataSize(size_t size)
@@ -307,14 +518,12 @@ public:
         {
             if (reqdSize > mBufSize)
             {
-                auto save = mBuf;
-                mBuf = (char*)::realloc(mBuf, reqdSize);
-                if (!mBuf)
-                {
-                    mBuf = save;
+                size_t capacity;
+                char* newBuf = mBuf ? reallocBlock(reqdSize, capacity) : allocBlock(reqdSize, capacity);
+                if (!newBuf)
                     throw std::runtime_error("Buffer::write: error reallocating block of size "+std::to_string(reqdSize));
-                }
-                mBufSize = reqdSize;
+                mBuf = newBuf;
+                mBufSize = capacity;
             }
             memcpy(mBuf+offset, data, datalen);
             mDataSize = reqdSize;
@@ -342,11 +551,28 @@ public:
         memset(appendPtr(count), value, count);
     }
     void clear() { mDataSize = 0; }
+    /** Makes sure the data block is owned exclusively by this buffer, copying it if shared */
+    void detach()
+    {
+        if (!isShared())
+            return;
+        if (!mDataSize)
+        {
+            free();
+            return;
+        }
+        size_t capacity;
+        char* newBuf = reallocShared(mDataSize, capacity);
+        if (!newBuf)
+            throw std::runtime_error("Buffer::detach: Out of memory");
+        mBuf = newBuf;
+        mBufSize = capacity;
+    }
     void free()
     {
         if (!mBuf)
             return;
-        ::free(mBuf);
+        freeBlock();
         mBuf = nullptr;
         mBufSize = mDataSize = 0;
     }
@@ -354,7 +580,77 @@ public:
     ~Buffer()
     {
         if (mBuf)
-            ::free(mBuf);
+            freeBlock();
+    }
+};
+
+/** @brief Refcounted block (i.e. a received frame) that buffers can reference
+ * slices of, without copying them.
+ *
+ * Every slice holds a reference to the frame, that is released when the slice
+ * is destroyed, freed or detached. Slices can be read and written in place, but
+ * they are copied to a block of \c detachAllocator (or malloc) as soon as they
+ * are reassigned or need to grow, so that the frame is not kept alive by buffers
+ * whose contents were replaced (i.e. decrypted messages).
+ */
+class SharedBuffer: public BufferAllocator
+{
+public:
+    /** Returns a buffer that references the whole \c frame, whose block is taken
+     * over (without copying) by a new SharedBuffer */
+    static Buffer create(Buffer&& frame, BufferAllocator* detachAllocator = nullptr)
+    {
+        if (frame.empty())
+            return Buffer((size_t)0);
+        SharedBuffer* shared = new SharedBuffer(std::move(frame), detachAllocator);
+        return shared->adopt(shared->mFrame.buf(), shared->mFrame.dataSize());
+    }
+    /** Returns a buffer that references \c len bytes at \c offset of \c frame,
+     * which must be a buffer returned by \c create() or another slice */
+    static Buffer slice(const Buffer& frame, size_t offset, size_t len)
+    {
+        if (!len)
+            return Buffer((size_t)0);
+        if (!frame.isShared())
+            throw std::runtime_error("SharedBuffer::slice: buffer doesn't reference a SharedBuffer");
+        return static_cast<SharedBuffer*>(frame.mAllocator)->adopt(frame.readPtr(offset, len), len);
+    }
+    int refCount() const { return mRefs.load(); }
+    virtual void* alloc(size_t size, size_t& capacity)
+    {
+        // buffers switch to mDetachAllocator before allocating, so this is not expected
+        assert(false);
+        return mDetachAllocator ? mDetachAllocator->alloc(size, capacity) : ::malloc(capacity = size);
+    }
+    virtual void* realloc(void*, size_t, size_t, size_t&)
+    {
+        throw std::runtime_error("SharedBuffer: can't reallocate a slice in place");
+    }
+    virtual void free(void* ptr, size_t)
+    {
+        assert(ptr >= mFrame.buf() && ptr <= mFrame.buf() + mFrame.dataSize());
+        (void)ptr;
+        if (--mRefs == 0)
+            delete this;
+    }
+    virtual BufferAllocator* detachAllocator() { return mDetachAllocator; }
+protected:
+    Buffer mFrame;
+    BufferAllocator* mDetachAllocator;
+    std::atomic<int> mRefs{0};
+    SharedBuffer(Buffer&& frame, BufferAllocator* detachAllocator)
+        : mFrame(std::move(frame)), mDetachAllocator(detachAllocator)
+    {
+        mFrame.detach(); // a SharedBuffer can't be built over a slice of another one
+    }
+    Buffer adopt(char* data, size_t len)
+    {
+        mRefs++;
+        Buffer result((size_t)0);
+        result.mBuf = data;
+        result.mBufSize = result.mDataSize = len;
+        result.mAllocator = this;
+        return result;
     }
 };
 #endif
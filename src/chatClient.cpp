@@ -24,6 +24,9 @@
 #include "sdkApi.h"
 #include <serverListProvider.h>
 #include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 #include <chatd.h>
 #include <db.h>
 #include <buffer.h>
@@ -79,6 +82,7 @@ Client::Client(::mega::MegaApi& sdk, WebsocketsIO *websocketsIO, IApp& aApp, con
           api(sdk, ctx),
           app(aApp),
           mDnsCache(db, chatd::Client::chatdVersion),
+          mDecryptWorkers(new strongvelope::DecryptWorkerPool()),
           mContactList(new ContactList(*this)),
           chats(new ChatRoomList(*this)),
           mPresencedClient(&api, this, *this, caps)
@@ -354,6 +358,21 @@ bool Client::openDb(const std::string& sid)
                     KR_LOG_WARNING("Database version has been updated to %s", gDbSchemaVersionSuffix);
                 }
             }
+            else if (cachedVersionSuffix == "10" && (strcmp(gDbSchemaVersionSuffix, "11") == 0))
+            {
+                KR_LOG_WARNING("Updating schema of MEGAchat cache...");
+
+                // Add unread_count to chats table (null means unknown, it will be calculated on demand)
+                db.query("ALTER TABLE `chats` ADD unread_count int");
+
+                // Add index for retention-time and oldest-timestamp lookups
+                db.simpleQuery("CREATE INDEX IF NOT EXISTS history_chatid_ts ON history(chatid, ts, idx)");
+
+                db.query("update vars set value = ? where name = 'schema_version'", currentVersion);
+                db.commit();
+                ok = true;
+                KR_LOG_WARNING("Database version has been updated to %s", gDbSchemaVersionSuffix);
+            }
         }
     }
 
@@ -368,6 +387,55 @@ bool Client::openDb(const std::string& sid)
     return true;
 }
 
+bool Client::readCacheInParallel(CacheRows& rows)
+{
+    std::string path = dbPath(mSid);
+    std::atomic<bool> failed(false);
+    mega::dstime elapsed[3] = {};
+
+    // each reader uses its own connection: connections can't be shared between threads
+    auto read = [&path, &failed, &elapsed](int index, const std::function<void(SqliteDb&)>& readTable)
+    {
+        mega::dstime start = InitStats::currentTime();
+        SqliteDb readerDb;
+        if (!readerDb.openReadOnly(path.c_str()))
+        {
+            failed = true;
+            return;
+        }
+        try
+        {
+            readTable(readerDb);
+        }
+        catch (std::exception& e)
+        {
+            KR_LOG_ERROR("Error reading the local cache: %s", e.what());
+            failed = true;
+        }
+        readerDb.close();
+        elapsed[index] = InitStats::currentTime() - start;
+    };
+
+    std::thread userAttrsReader(read, 0, [&rows](SqliteDb& readerDb) { UserAttrCache::readFromDb(readerDb, rows.userAttrs); });
+    std::thread contactsReader(read, 1, [&rows](SqliteDb& readerDb) { ContactList::readFromDb(readerDb, rows.contacts); });
+    std::thread chatsReader(read, 2, [&rows](SqliteDb& readerDb) { ChatRoomList::readFromDb(readerDb, rows.chats); });
+    userAttrsReader.join();
+    contactsReader.join();
+    chatsReader.join();
+
+    if (failed)
+    {
+        KR_LOG_WARNING("Failed to read the local cache in parallel, reading it sequentially");
+        rows = CacheRows();
+        return false;
+    }
+
+    mInitStats.setLoadStageElapsed(InitStats::kStatsLoadUserAttrs, elapsed[0]);
+    mInitStats.setLoadStageElapsed(InitStats::kStatsLoadContacts, elapsed[1]);
+    mInitStats.setLoadStageElapsed(InitStats::kStatsLoadChats, elapsed[2]);
+    return true;
+}
+
 void Client::createDbSchema()
 {
     mMyHandle = Id::inval();
@@ -726,6 +794,7 @@ void Client::createPublicChatRoom(uint64_t chatId, uint64_t ph, int shard, const
 {
     GroupChatRoom *room = new GroupChatRoom(*chats, chatId, shard, chatd::Priv::PRIV_RDONLY, ts, false, decryptedTitle, ph, unifiedKey);
     chats->emplace(chatId, room);
+    chats->indexRoom(*room);
     if (!mDnsCache.hasRecord(shard))
     {
         // If DNS cache doesn't contains a record for this shard, addRecord otherwise skip.
@@ -1031,8 +1100,27 @@ promise::Promise<void> Client::initWithNewSession(const char* sid, const std::st
     });
 }
 
+void Client::setDecryptThreads(unsigned count)
+{
+    KR_LOG_DEBUG("Setting %u threads to decrypt history", count);
+    mDecryptWorkers->setThreadCount(count);
+}
+
 void Client::setCommitMode(bool commitEach)
 {
+    if (commitEach && !db.commitEach())
+    {
+        const SqliteDb::CommitStats& stats = db.commitStats();
+        KR_LOG_DEBUG("Leaving transactional mode. Group commits: %llu (timer: %llu, size: %llu, barrier: %llu), "
+                     "rows: %llu, max batch: %llu rows, avg latency: %llu us, max latency: %llu us",
+                     (unsigned long long)stats.commits,
+                     (unsigned long long)stats.byReason[SqliteDb::kCommitTimer],
+                     (unsigned long long)stats.byReason[SqliteDb::kCommitSize],
+                     (unsigned long long)stats.byReason[SqliteDb::kCommitBarrier],
+                     (unsigned long long)stats.rows, (unsigned long long)stats.maxBatchRows,
+                     (unsigned long long)(stats.commits ? stats.totalLatencyUs / stats.commits : 0),
+                     (unsigned long long)stats.maxLatencyUs);
+    }
     db.setCommitMode(commitEach);
 }
 
@@ -1114,7 +1202,17 @@ void Client::initWithDbSession(const char* sid)
         }
         assert(db);
         assert(!mSid.empty());
-        mUserAttrCache.reset(new UserAttrCache(*this));
+
+        // the largest tables are read concurrently by background readers, while they
+        // are applied in this thread. Readers only see committed data: commit the
+        // transaction open by openDb(), after the clean-up of previews
+        chats->cleanupPreviewsFromDb();
+        db.commit();
+        CacheRows rows;
+        bool cacheRead = readCacheInParallel(rows);
+
+        mega::dstime applyStart = InitStats::currentTime();
+        mUserAttrCache.reset(cacheRead ? new UserAttrCache(*this, &rows.userAttrs) : new UserAttrCache(*this));
         api.sdk.addGlobalListener(this);
 
         mMyHandle = getMyHandleFromDb();
@@ -1135,9 +1233,24 @@ void Client::initWithDbSession(const char* sid)
 
         loadOwnKeysFromDb();
         mDnsCache.loadFromDb();
-        mContactList->loadFromDb();
+        if (cacheRead)
+        {
+            mContactList->loadFromRows(rows.contacts);
+        }
+        else
+        {
+            mContactList->loadFromDb();
+        }
         mChatdClient.reset(new chatd::Client(this));
-        chats->loadFromDb();
+        if (cacheRead)
+        {
+            chats->loadFromRows(rows.chats);
+        }
+        else
+        {
+            chats->loadFromDb();
+        }
+        mInitStats.setLoadStageElapsed(InitStats::kStatsApplyCache, InitStats::currentTime() - applyStart);
 
         // Get aliases from cache
         mAliasAttrHandle = mUserAttrCache->getAttr(mMyHandle,
@@ -1774,6 +1887,16 @@ void Client::onPresenceChange(Id userid, Presence pres, bool inProgress)
     app.onPresenceChanged(userid, pres, inProgress);
 }
 
+void Client::onPresencesChange(const presenced::PresenceChanges& changes)
+{
+    if (isTerminated())
+    {
+        return;
+    }
+
+    app.onPresencesChanged(changes);
+}
+
 void Client::onPresenceConfigChanged(const presenced::Config& state, bool pending)
 {
     app.onPresenceConfigChanged(state, pending);
@@ -2077,6 +2200,14 @@ ChatRoom::ChatRoom(ChatRoomList& aParent, const uint64_t& chatid, bool aIsGroup,
     mOwnPriv(aOwnPriv), mCreationTs(ts), mIsArchived(aIsArchived), mTitleString(aTitle), mHasTitle(false)
 {}
 
+ChatRoom::~ChatRoom()
+{
+    if (mIsIndexed)
+    {
+        parent.unindexRoom(*this);
+    }
+}
+
 //chatd::Listener
 void ChatRoom::onLastMessageTsUpdated(uint32_t ts)
 {
@@ -2088,6 +2219,11 @@ void ChatRoom::onLastMessageTsUpdated(uint32_t ts)
     }, parent.mKarereClient.appCtx);
 }
 
+void ChatRoom::onLastMessageTsChanged()
+{
+    parent.onLastMessageTsChanged(*this);
+}
+
 ApiPromise ChatRoom::requestGrantAccess(mega::MegaNode *node, mega::MegaHandle userHandle)
 {
     return parent.mKarereClient.api.call(&::mega::MegaApi::grantAccessInChat, chatid(), node, userHandle);
@@ -2106,10 +2242,12 @@ bool ChatRoom::isChatdChatInitialized()
 strongvelope::ProtocolHandler* Client::newStrongvelope(karere::Id chatid, bool isPublic,
         std::shared_ptr<std::string> unifiedKey, int isUnifiedKeyEncrypted, karere::Id ph)
 {
-    return new strongvelope::ProtocolHandler(mMyHandle,
+    strongvelope::ProtocolHandler* crypto = new strongvelope::ProtocolHandler(mMyHandle,
          StaticBuffer(mMyPrivCu25519, 32), StaticBuffer(mMyPrivEd25519, 32),
          *mUserAttrCache, db, chatid, isPublic, unifiedKey,
          isUnifiedKeyEncrypted, ph, appCtx);
+    crypto->setDecryptWorkers(mDecryptWorkers.get());
+    return crypto;
 }
 
 void ChatRoom::createChatdChat(const karere::SetOfIds& initialUsers, bool isPublic,
@@ -2270,7 +2408,7 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const mega::MegaTextChat& aCh
     mMemberNamesResolved = promise::when(promises);
 
     // Save Chatroom into DB
-    auto db = parent.mKarereClient.db;
+    auto& db = parent.mKarereClient.db;
     bool isPublicChat = aChat.isPublicChat();
     db.query("insert or replace into chats(chatid, shard, peer, peer_priv, "
              "own_priv, ts_created, archived, mode) values(?,?,-1,0,?,?,?,?)",
@@ -2362,7 +2500,7 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const uint64_t& chatid,
     unifiedKeyBuf.append(unifiedKey->data(), unifiedKey->size());
 
     //save to db
-    auto db = parent.mKarereClient.db;
+    auto& db = parent.mKarereClient.db;
     db.query(
         "insert or replace into chats(chatid, shard, peer, peer_priv, "
         "own_priv, ts_created, mode, unified_key) values(?,?,-1,0,?,?,2,?)",
@@ -2640,6 +2778,7 @@ promise::Promise<void> GroupChatRoom::addMember(uint64_t userid, chatd::Priv pri
     else
     {
         mPeers.emplace(userid, new Member(*this, userid, priv)); //usernames will be updated when the Member object gets the username attribute
+        parent.onPeersChanged(*this);
     }
     if (saveToDb)
     {
@@ -2650,6 +2789,17 @@ promise::Promise<void> GroupChatRoom::addMember(uint64_t userid, chatd::Priv pri
     return mPeers[userid]->nameResolved();
 }
 
+std::vector<uint64_t> GroupChatRoom::peerHandles() const
+{
+    std::vector<uint64_t> handles;
+    handles.reserve(mPeers.size());
+    for (auto& peer: mPeers)
+    {
+        handles.push_back(peer.first);  // MemberMap is sorted by handle
+    }
+    return handles;
+}
+
 bool GroupChatRoom::removeMember(uint64_t userid)
 {
     KR_LOG_DEBUG("GroupChatRoom[%s]: Removed member %s", ID_CSTR(mChatid), ID_CSTR(userid));
@@ -2663,6 +2813,7 @@ bool GroupChatRoom::removeMember(uint64_t userid)
 
     delete it->second;
     mPeers.erase(it);
+    parent.onPeersChanged(*this);
     parent.mKarereClient.db.query("delete from chat_peers where chatid=? and userid=?", mChatid, userid);
 
     return true;
@@ -2747,38 +2898,69 @@ ChatRoomList::ChatRoomList(Client& aClient)
 
 void ChatRoomList::loadFromDb()
 {
-    auto db = mKarereClient.db;
+    cleanupPreviewsFromDb();
+    std::vector<DbRow> rows;
+    readFromDb(mKarereClient.db, rows);
+    loadFromRows(rows);
+}
 
+void ChatRoomList::cleanupPreviewsFromDb()
+{
     //We need to ensure that the DB does not contain any record related with a preview
-    SqliteStmt stmtPreviews(db, "select chatid from chats where mode = '2'");
+    std::vector<Id> previews;
+    SqliteStmt stmtPreviews(mKarereClient.db, "select chatid from chats where mode = '2'");
     while(stmtPreviews.step())
     {
-        Id chatid = stmtPreviews.uint64Col(0);
+        previews.push_back(stmtPreviews.uint64Col(0));
+    }
+    for (Id chatid: previews)
+    {
         previewCleanup(chatid);
     }
+}
 
+void ChatRoomList::readFromDb(SqliteDb& db, std::vector<DbRow>& rows)
+{
     SqliteStmt stmt(db, "select chatid, ts_created ,shard, own_priv, peer, peer_priv, title, archived, mode, unified_key from chats");
     while(stmt.step())
     {
-        auto chatid = stmt.uint64Col(0);
+        rows.emplace_back();
+        DbRow& row = rows.back();
+        row.chatid = stmt.uint64Col(0);
+        row.tsCreated = stmt.intCol(1);
+        row.shard = stmt.intCol(2);
+        row.ownPriv = stmt.intCol(3);
+        row.peer = stmt.uint64Col(4);
+        row.peerPriv = stmt.intCol(5);
+        stmt.blobCol(6, row.title);
+        row.archived = stmt.intCol(7);
+        row.mode = stmt.intCol(8);
+        stmt.blobCol(9, row.unifiedKey);
+    }
+}
+
+void ChatRoomList::loadFromRows(std::vector<DbRow>& rows)
+{
+    for (DbRow& row: rows)
+    {
+        auto chatid = row.chatid;
         if (find(chatid) != end())
         {
             KR_LOG_WARNING("ChatRoomList: Attempted to load from db cache a chatid that is already in memory");
             continue;
         }
-        auto peer = stmt.uint64Col(4);
+        auto peer = row.peer;
         ChatRoom* room;
         if (peer != uint64_t(-1))
         {
-            room = new PeerChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), peer, (chatd::Priv)stmt.intCol(5), stmt.intCol(1), stmt.intCol(7));
+            room = new PeerChatRoom(*this, chatid, row.shard, (chatd::Priv)row.ownPriv, peer, (chatd::Priv)row.peerPriv, row.tsCreated, row.archived);
         }
         else
         {
             std::shared_ptr<std::string> unifiedKey;
             int isUnifiedKeyEncrypted = strongvelope::kDecrypted;
 
-            Buffer unifiedKeyBuf;
-            stmt.blobCol(9, unifiedKeyBuf);
+            Buffer& unifiedKeyBuf = row.unifiedKey;
             if (!unifiedKeyBuf.empty())
             {
                 const char *pos = unifiedKeyBuf.buf();
@@ -2794,8 +2976,7 @@ void ChatRoomList::loadFromDb()
             std::string auxTitle;
             int isTitleEncrypted = strongvelope::kDecrypted;
 
-            Buffer titleBuf;
-            stmt.blobCol(6, titleBuf);
+            Buffer& titleBuf = row.title;
             if (!titleBuf.empty())
             {
                 const char *posTitle = titleBuf.buf();
@@ -2804,9 +2985,10 @@ void ChatRoomList::loadFromDb()
                 auxTitle.assign(posTitle, len);
             }
 
-            room = new GroupChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), stmt.intCol(1), stmt.intCol(7), auxTitle, isTitleEncrypted, stmt.intCol(8), unifiedKey, isUnifiedKeyEncrypted);
+            room = new GroupChatRoom(*this, chatid, row.shard, (chatd::Priv)row.ownPriv, row.tsCreated, row.archived, auxTitle, isTitleEncrypted, row.mode, unifiedKey, isUnifiedKeyEncrypted);
         }
         emplace(chatid, room);
+        indexRoom(*room);
     }
 }
 
@@ -2856,9 +3038,92 @@ ChatRoom* ChatRoomList::addRoom(const mega::MegaTextChat& apiRoom)
 #endif
     emplace(chatid, room);
     assert(ret.second); //we should not have that room
+    indexRoom(*room);
     return room;
 }
 
+void ChatRoomList::indexRoom(ChatRoom& room)
+{
+    assert(!room.mIsIndexed);
+    room.mIsIndexed = true;
+    room.mIndexedTs = room.lastActivityTs();
+    mActivityIndex.emplace(room.mIndexedTs, room.chatid());
+    room.mPeersHash = peersHash(room.peerHandles());
+    mPeersIndex.emplace(room.mPeersHash, &room);
+}
+
+void ChatRoomList::unindexRoom(ChatRoom& room)
+{
+    assert(room.mIsIndexed);
+    room.mIsIndexed = false;
+    mActivityIndex.erase(std::make_pair(room.mIndexedTs, room.chatid()));
+    auto range = mPeersIndex.equal_range(room.mPeersHash);
+    for (auto it = range.first; it != range.second; it++)
+    {
+        if (it->second == &room)
+        {
+            mPeersIndex.erase(it);
+            break;
+        }
+    }
+}
+
+void ChatRoomList::onPeersChanged(ChatRoom& room)
+{
+    if (!room.mIsIndexed)
+    {
+        return; // still being loaded, it will be indexed once added to the list
+    }
+
+    unindexRoom(room);
+    indexRoom(room);
+}
+
+void ChatRoomList::onLastMessageTsChanged(ChatRoom& room)
+{
+    if (!room.mIsIndexed)
+    {
+        return; // still being loaded, it will be indexed once added to the list
+    }
+
+    int64_t ts = room.lastActivityTs();
+    if (ts != room.mIndexedTs)
+    {
+        mActivityIndex.erase(std::make_pair(room.mIndexedTs, room.chatid()));
+        room.mIndexedTs = ts;
+        mActivityIndex.emplace(ts, room.chatid());
+    }
+}
+
+std::vector<ChatRoom*> ChatRoomList::findByPeers(std::vector<uint64_t> peers) const
+{
+    std::sort(peers.begin(), peers.end());
+    peers.erase(std::unique(peers.begin(), peers.end()), peers.end());
+
+    std::vector<ChatRoom*> rooms;
+    auto range = mPeersIndex.equal_range(peersHash(peers));
+    for (auto it = range.first; it != range.second; it++)
+    {
+        if (it->second->peerHandles() == peers)  // discard hash collisions
+        {
+            rooms.push_back(it->second);
+        }
+    }
+    return rooms;
+}
+
+uint64_t ChatRoomList::peersHash(const std::vector<uint64_t>& sortedPeers)
+{
+    // FNV-1a, a word at a time
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint64_t peer: sortedPeers)
+    {
+        hash ^= peer;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
 void ChatRoom::notifyExcludedFromChat()
 {
     if (mAppChatHandler)
@@ -3267,6 +3532,8 @@ void ChatRoom::setAppChatHandler(IApp::IChatHandler* handler)
 
     mAppChatHandler = handler;
     chatd::DbInterface* dummyIntf = nullptr;
+    // load the history of a dormant chat while we are still the listener, the app gets it from RAM
+    mChat->activate();
 // mAppChatHandler->init() may rely on some events, so we need to set mChatWindow as listener before
 // calling init(). This is safe, as and we will not get any async events before we
 //return to the event loop
@@ -3557,7 +3824,7 @@ bool GroupChatRoom::previewMode() const
 
 void ChatRoomList::previewCleanup(Id chatid)
 {
-    auto db = mKarereClient.db;
+    auto& db = mKarereClient.db;
     if (db.isOpen())   // upon karere::Client destruction, DB is already closed
     {
         db.query("delete from chat_peers where chatid = ?", chatid);
@@ -3589,7 +3856,7 @@ bool GroupChatRoom::syncMembers(const mega::MegaTextChat& chat)
         }
     }
 
-    auto db = parent.mKarereClient.db;
+    auto& db = parent.mKarereClient.db;
     bool peersChanged = false;
     for (auto ourIt = mPeers.begin(); ourIt != mPeers.end();)
     {
@@ -3880,12 +4147,26 @@ ContactList::ContactList(Client& aClient)
 
 void ContactList::loadFromDb()
 {
-    SqliteStmt stmt(client.db, "select userid, email, visibility, since from contacts");
+    std::vector<DbRow> rows;
+    readFromDb(client.db, rows);
+    loadFromRows(rows);
+}
+
+void ContactList::readFromDb(SqliteDb& db, std::vector<DbRow>& rows)
+{
+    SqliteStmt stmt(db, "select userid, email, visibility, since from contacts");
     while(stmt.step())
     {
-        auto userid = stmt.uint64Col(0);
-        Contact *contact = new Contact(*this, userid, stmt.stringCol(1), stmt.intCol(2), stmt.int64Col(3), nullptr);
-        this->emplace(userid, contact);
+        rows.push_back(DbRow{stmt.uint64Col(0), stmt.stringCol(1), stmt.intCol(2), stmt.int64Col(3)});
+    }
+}
+
+void ContactList::loadFromRows(std::vector<DbRow>& rows)
+{
+    for (DbRow& row: rows)
+    {
+        Contact *contact = new Contact(*this, row.userid, row.email, row.visibility, row.since, nullptr);
+        this->emplace(row.userid, contact);
     }
 }
 
@@ -4418,6 +4699,7 @@ void InitStats::onCanceled()
     // clear maps to free some memory
     mStageShardStats.clear();
     mStageStats.clear();
+    mLoadStageStats.clear();
     KR_LOG_WARNING("Init stats have been cancelled");
 }
 
@@ -4443,6 +4725,7 @@ std::string InitStats::onCompleted(long long numNodes, size_t numChats, size_t n
     // clear maps to free some memory
     mStageShardStats.clear();
     mStageStats.clear();
+    mLoadStageStats.clear();
 
     return json;
 }
@@ -4571,6 +4854,16 @@ void InitStats::stageEnd(uint8_t stage)
     mStageStats[stage] = currentTime() - mStageStats[stage];
 }
 
+void InitStats::setLoadStageElapsed(uint8_t stage, mega::dstime elapsed)
+{
+    if (mCompleted)
+    {
+        return;
+    }
+
+    mLoadStageStats[stage] = elapsed;
+}
+
 void InitStats::setInitState(uint8_t state)
 {
     if (mCompleted)
@@ -4627,6 +4920,18 @@ std::string InitStats::shardStageToString(uint8_t stage)
     }
 }
 
+std::string InitStats::loadStageToString(uint8_t stage)
+{
+    switch(stage)
+    {
+        case kStatsLoadUserAttrs: return "Load user attributes";
+        case kStatsLoadContacts: return "Load contacts";
+        case kStatsLoadChats: return "Load chats";
+        case kStatsApplyCache: return "Apply cache";
+        default: return "(unknown)";
+    }
+}
+
 std::string InitStats::toJson()
 {
     std::string result;
@@ -4659,6 +4964,26 @@ std::string InitStats::toJson()
         stageArray.PushBack(jSonStage, jSonDocument.GetAllocator());
     }
 
+    // Generate stages of the load of the cache array (they overlap: not added to the total elapsed)
+    rapidjson::Value loadStageArray(rapidjson::kArrayType);
+    for (StageMap::const_iterator itStages = mLoadStageStats.begin(); itStages != mLoadStageStats.end(); itStages++)
+    {
+        rapidjson::Value jSonStage(rapidjson::kObjectType);
+        uint8_t stage = itStages->first;
+
+        jsonValue.SetInt64(stage);
+        jSonStage.AddMember(rapidjson::Value("stg"), jsonValue, jSonDocument.GetAllocator());
+
+        std::string tag = loadStageToString(stage);
+        rapidjson::Value stageTag(rapidjson::kStringType);
+        stageTag.SetString(tag.c_str(), tag.length(), jSonDocument.GetAllocator());
+        jSonStage.AddMember(rapidjson::Value("tag"), stageTag, jSonDocument.GetAllocator());
+
+        jsonValue.SetInt64(itStages->second);
+        jSonStage.AddMember(rapidjson::Value("elap"), jsonValue, jSonDocument.GetAllocator());
+        loadStageArray.PushBack(jSonStage, jSonDocument.GetAllocator());
+    }
+
     // Generate sharded stages array
     rapidjson::Value shardStagesArray(rapidjson::kArrayType);
     StageShardMap::iterator itshstgs;
@@ -4740,6 +5065,9 @@ std::string InitStats::toJson()
     // Add sharded stages array
     jSonObject.AddMember(rapidjson::Value("shstgs"), shardStagesArray, jSonDocument.GetAllocator());
 
+    // Add stages of the load of the cache array
+    jSonObject.AddMember(rapidjson::Value("ldstgs"), loadStageArray, jSonDocument.GetAllocator());
+
     jSonDocument.PushBack(jSonObject, jSonDocument.GetAllocator());
     rapidjson::StringBuffer buffer;
     rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
@@ -5,6 +5,8 @@
 #include "sdkApi.h"
 #include <memory>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <type_traits>
 #include <retryHandler.h>
 #include "userAttrCache.h"
@@ -31,7 +33,7 @@
 
 namespace mega { class MegaTextChat; class MegaTextChatList; }
 
-namespace strongvelope { class ProtocolHandler; }
+namespace strongvelope { class ProtocolHandler; class DecryptWorkerPool; }
 
 struct sqlite3;
 class Buffer;
@@ -82,6 +84,11 @@ protected:
     bool mIsArchived;
     std::string mTitleString;   // decrypted `ct` or title from member-names
     bool mHasTitle;             // only true if chat has custom topic (`ct`)
+    // keys of this room in the indexes of ChatRoomList (see ChatRoomList::indexRoom())
+    bool mIsIndexed = false;
+    uint64_t mPeersHash = 0;
+    int64_t mIndexedTs = 0;
+    friend class ChatRoomList;
     void notifyTitleChanged();
     void notifyChatModeChanged();
     void switchListenerToApp();
@@ -122,7 +129,7 @@ public:
              unsigned char shard, chatd::Priv ownPriv, int64_t ts, bool isArchived,
              const std::string& aTitle=std::string());
 
-    virtual ~ChatRoom(){}
+    virtual ~ChatRoom();
 
     /** @brief returns the chatd::Chat chat object associated with the room */
     chatd::Chat& chat() { return *mChat; }
@@ -142,6 +149,14 @@ public:
     /** @brief Returns the creation timestamp of the chatroom */
     int64_t getCreationTs() const { return mCreationTs; }
 
+    /** @brief Returns the timestamp of the last message, or the creation
+     * timestamp if there are no messages */
+    int64_t lastActivityTs() const { return mChat ? mChat->lastMessageTs() : mCreationTs; }
+
+    /** @brief Returns the handles of the members of the chatroom, except our own
+     * user, in ascending order */
+    virtual std::vector<uint64_t> peerHandles() const = 0;
+
     bool isCallActive() const;
 
     /** @brief The chatd shart number for that chatroom */
@@ -215,6 +230,7 @@ public:
     virtual void init(chatd::Chat& messages, chatd::DbInterface *&dbIntf);
     virtual void onLastTextMessageUpdated(const chatd::LastTextMsg& msg);
     virtual void onLastMessageTsUpdated(uint32_t ts);
+    virtual void onLastMessageTsChanged();
     virtual void onExcludedFromRoom() {}
     virtual void onOnlineStateChange(chatd::ChatState state);
     virtual void onMsgOrderVerificationFail(const chatd::Message& msg, chatd::Idx idx, const std::string& errmsg);
@@ -273,6 +289,7 @@ public:
     virtual IApp::IChatListItem* roomGui() { return mRoomGui; }
     /** @brief The userid of the other person in the 1on1 chat */
     uint64_t peer() const { return mPeer; }
+    virtual std::vector<uint64_t> peerHandles() const { return std::vector<uint64_t>(1, mPeer); }
     chatd::Priv peerPrivilege() const { return mPeerPriv; }
 
     /**
@@ -392,6 +409,7 @@ public:
 
     /** @brief Returns the map of the users in the chatroom, except our own user */
     const MemberMap& peers() const { return mPeers; }
+    virtual std::vector<uint64_t> peerHandles() const;
 
 
     /** @brief Removes the specifid user from the chatroom. You must have
@@ -456,17 +474,57 @@ public:
  */
 class ChatRoomList: public std::map<uint64_t, ChatRoom*> //don't use shared_ptr here as we want to be able to immediately delete a chatroom once the API tells us it's deleted
 {
-/** @cond PRIVATE */
 public:
+    /** @brief Pairs of (last activity timestamp, chatid), most recent first */
+    typedef std::set<std::pair<int64_t, uint64_t>, std::greater<std::pair<int64_t, uint64_t>>> ActivityIndex;
+
+    /** @brief Returns all chatrooms sorted by last activity (see \c ChatRoom::lastActivityTs) */
+    const ActivityIndex& byActivity() const { return mActivityIndex; }
+
+    /** @brief Returns the chatrooms whose members, except our own user, are exactly \c peers */
+    std::vector<ChatRoom*> findByPeers(std::vector<uint64_t> peers) const;
+
+/** @cond PRIVATE */
     Client& mKarereClient;
     void addMissingRoomsFromApi(const mega::MegaTextChatList& rooms, karere::SetOfIds& chatids);
     ChatRoom* addRoom(const mega::MegaTextChat &room);
     void removeRoomPreview(Id chatid);
     ChatRoomList(Client& aClient);
     ~ChatRoomList();
+
+    /** @brief A chatroom cached in db */
+    struct DbRow
+    {
+        uint64_t chatid;
+        int tsCreated;
+        int shard;
+        int ownPriv;
+        uint64_t peer;
+        int peerPriv;
+        Buffer title;
+        int archived;
+        int mode;
+        Buffer unifiedKey;
+    };
+    /** @brief Reads the chatrooms cached in db. It may be called from any thread, with a connection of its own */
+    static void readFromDb(SqliteDb& db, std::vector<DbRow>& rows);
+    /** @brief Creates the chatrooms read by \c readFromDb */
+    void loadFromRows(std::vector<DbRow>& rows);
     void loadFromDb();
+    void cleanupPreviewsFromDb();
     void previewCleanup(karere::Id chatid);
     void onChatsUpdate(mega::MegaTextChatList& chats);
+
+    // indexes are kept up to date by the rooms themselves, once added to the list
+    void indexRoom(ChatRoom& room);
+    void unindexRoom(ChatRoom& room);
+    void onPeersChanged(ChatRoom& room);
+    void onLastMessageTsChanged(ChatRoom& room);
+    static uint64_t peersHash(const std::vector<uint64_t>& sortedPeers);
+
+protected:
+    ActivityIndex mActivityIndex;
+    std::unordered_multimap<uint64_t, ChatRoom*> mPeersIndex;
 /** @endcond PRIVATE */
 };
 
@@ -567,6 +625,19 @@ public:
     /** @cond PRIVATE */
     ContactList(Client& aClient);
     ~ContactList();
+
+    /** @brief A contact cached in db */
+    struct DbRow
+    {
+        uint64_t userid;
+        std::string email;
+        int visibility;
+        int64_t since;
+    };
+    /** @brief Reads the contacts cached in db. It may be called from any thread, with a connection of its own */
+    static void readFromDb(SqliteDb& db, std::vector<DbRow>& rows);
+    /** @brief Creates the contacts read by \c readFromDb */
+    void loadFromRows(std::vector<DbRow>& rows);
     void loadFromDb();
     void syncWithApi(mega::MegaUserList& users);
     const std::string* getUserEmail(uint64_t userid) const;
@@ -642,8 +713,9 @@ class InitStats
          * - Version 1: Initial version
          * - Version 2: Fix errors and discard atypical values
          * - Version 3: Implement DNS, Chatd and Presenced Ip/Url cache
+         * - Version 4: Add stages of the load of the local cache
          */
-        const uint32_t INITSTATSVERSION = 3;
+        const uint32_t INITSTATSVERSION = 4;
 
         /** @brief Init states in init stats */
         enum
@@ -674,6 +746,16 @@ class InitStats
             kStatsLoginChatd        = 3
         };
 
+        /** @brief Stages of the load of the local cache, within kStatsInit.
+         * The tables are read concurrently, so the stages overlap */
+        enum
+        {
+            kStatsLoadUserAttrs     = 0,
+            kStatsLoadContacts      = 1,
+            kStatsLoadChats         = 2,
+            kStatsApplyCache        = 3     // creation of the objects from the rows read, in the karere thread
+        };
+
         std::string onCompleted(long long numNodes, size_t numChats, size_t numContacts);
         bool isCompleted() const;
         void onCanceled();
@@ -689,6 +771,12 @@ class InitStats
         /** @brief Set the init state */
         void setInitState(uint8_t state);
 
+        /** @brief Set the elapsed time of a stage of the load of the local cache */
+        void setLoadStageElapsed(uint8_t stage, mega::dstime elapsed);
+
+        /** @brief Returns the current time of the clock in milliseconds */
+        static mega::dstime currentTime();
+
 
         /*  Shard Stages Methods */
 
@@ -736,6 +824,9 @@ private:
     /** @brief Maps sharded stages to statistics */
     StageShardMap mStageShardStats;
 
+    /** @brief Maps stages of the load of the local cache to elapsed time */
+    StageMap mLoadStageStats;
+
     /** @brief Number of nodes in the account */
     long long int mNumNodes = 0;
 
@@ -754,15 +845,15 @@ private:
 
     /* Auxiliar methods */
 
-    /** @brief Returns the current time of the clock in milliseconds */
-    static mega::dstime currentTime();
-
     /** @brief  Returns a string with the associated tag to the stage **/
     std::string stageToString(uint8_t stage);
 
     /** @brief  Returns a string with the associated tag to the stage **/
     std::string shardStageToString(uint8_t stage);
 
+    /** @brief  Returns a string with the associated tag to the stage **/
+    std::string loadStageToString(uint8_t stage);
+
     /** @brief Returns a string that contains init stats in JSON format */
     std::string toJson();
 
@@ -875,6 +966,9 @@ public:
     SqliteDb db;                // db-layer interface
     DNScache mDnsCache;         // dns cache
 
+    // verifies and decrypts history in parallel (shared by all chats, so it must outlive them)
+    std::unique_ptr<strongvelope::DecryptWorkerPool> mDecryptWorkers;
+
     std::unique_ptr<chatd::Client> mChatdClient;
 
 #ifndef KARERE_DISABLE_WEBRTC
@@ -1102,6 +1196,10 @@ public:
     promise::Promise<karere::Id>
     createGroupChat(std::vector<std::pair<uint64_t, chatd::Priv>> peers, bool publicchat, const char *title = NULL);
     void setCommitMode(bool commitEach);
+
+    /** @brief Sets the number of threads that verify and decrypt history fetched from
+     * chatd, ahead of the in-order processing of messages. Zero disables them */
+    void setDecryptThreads(unsigned count);
     bool commitEach();
     void saveDb();  // forces a commit
 
@@ -1147,6 +1245,18 @@ protected:
     // db-related methods
     std::string dbPath(const std::string& sid) const;
     bool openDb(const std::string& sid);
+
+    /** @brief Rows of the tables of the local cache loaded at startup */
+    struct CacheRows
+    {
+        std::vector<UserAttrCache::DbRow> userAttrs;
+        std::vector<ContactList::DbRow> contacts;
+        std::vector<ChatRoomList::DbRow> chats;
+    };
+    /** @brief Reads the tables of \c CacheRows concurrently, each one from a thread with
+     * a read-only connection of its own. The db must be open, with no uncommitted changes
+     * @return False if any table could not be read */
+    bool readCacheInParallel(CacheRows& rows);
     void createDb();
     void wipeDb(const std::string& sid);
     void createDbSchema();
@@ -1190,6 +1300,7 @@ protected:
     // presenced listener interface
     virtual void onConnStateChange(presenced::Client::ConnState state);
     virtual void onPresenceChange(Id userid, Presence pres, bool inProgress = false);
+    virtual void onPresencesChange(const presenced::PresenceChanges& changes);
     virtual void onPresenceConfigChanged(const presenced::Config& state, bool pending);
     virtual void onPresenceLastGreenUpdated(karere::Id userid);
 
@@ -105,6 +105,12 @@ using ::mega::mega_snprintf;   // enables the calls to snprintf below which are
     #define CHATD_ASYNC_MSG_CALLBACKS 1
 #endif
 
+// Set to 1 to verify the cached unread count against the history on every
+// query. Only effective in debug builds, since it defeats the purpose of the cache
+#ifndef CHATD_CHECK_UNREAD_COUNT
+    #define CHATD_CHECK_UNREAD_COUNT 0
+#endif
+
 namespace chatd
 {
 
@@ -508,6 +514,7 @@ void Chat::login()
         if (mOldestKnownMsgId) //if we have local history
         {
             joinRangeHist(info);
+            loadPendingReactions();     // not loaded yet if the chat is dormant
             retryPendingReactions();
         }
         else
@@ -1200,7 +1207,7 @@ void Client::heartbeat()
     }
 }
 
-bool Connection::sendBuf(Buffer&& buf)
+bool Connection::sendBuf(const StaticBuffer& buf)
 {
     if (!isOnline())
         return false;
@@ -1219,8 +1226,8 @@ bool Connection::sendBuf(Buffer&& buf)
         });
     }
 
+    // the websockets layer copies the data to its output buffer
     bool rc = wsSendMessage(buf.buf(), buf.dataSize());
-    buf.free();
 
     if (!rc)
     {
@@ -1233,7 +1240,7 @@ bool Connection::sendBuf(Buffer&& buf)
 bool Connection::sendCommand(Command&& cmd)
 {
     CHATDS_LOG_DEBUG("send %s", cmd.toString().c_str());
-    bool result = sendBuf(std::move(cmd));
+    bool result = sendBuf(cmd);
     if (!result)
         CHATDS_LOG_DEBUG("Can't send, we are offline");
     return result;
@@ -1242,7 +1249,7 @@ bool Connection::sendCommand(Command&& cmd)
 bool Chat::sendCommand(Command&& cmd)
 {
     CHATID_LOG_DEBUG("send %s", cmd.toString().c_str());
-    bool result = mConnection.sendBuf(std::move(cmd));
+    bool result = mConnection.sendBuf(cmd);
     if (!result)
         CHATID_LOG_DEBUG("  Can't send, we are offline");
     return result;
@@ -1250,9 +1257,8 @@ bool Chat::sendCommand(Command&& cmd)
 
 bool Chat::sendCommand(const Command& cmd)
 {
-    Buffer buf(cmd.buf(), cmd.dataSize());
     CHATID_LOG_DEBUG("send %s", cmd.toString().c_str());
-    auto result = mConnection.sendBuf(std::move(buf));
+    auto result = mConnection.sendBuf(cmd);
     if (!result)
         CHATID_LOG_DEBUG("  Can't send, we are offline");
     return result;
@@ -1599,6 +1605,7 @@ void Chat::onDisconnect()
         mFetchRequest.pop();
         if (fetchType == FetchType::kFetchMessages)
         {
+            CALL_DB(commitHistoryBatch);
             if (mServerOldHistCbEnabled && (mServerFetchState & kHistFetchingOldFromServer))
             {
                 //app has been receiving old history from server, but we are now
@@ -1627,6 +1634,7 @@ void Chat::onDisconnect()
 
 HistSource Chat::getHistory(unsigned count)
 {
+    activate();
     if (isNotifyingOldHistFromServer())
     {
         return kHistSourceServer;
@@ -1849,6 +1857,12 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
     mLastReceivedId = info.lastRecvId;
     mLastSeenIdx = mDbInterface->getIdxOfMsgidFromHistory(mLastSeenId);
     mLastReceivedIdx = mDbInterface->getIdxOfMsgidFromHistory(mLastReceivedId);
+    int unreadCount;
+    if (mDbInterface->getUnreadCount(unreadCount))
+    {
+        mUnreadCount = unreadCount;
+        mUnreadCountValid = true;
+    }
     std::string reactionSn = mDbInterface->getReactionSn();
     if (!reactionSn.empty())
     {
@@ -1868,6 +1882,7 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
         mForwardStart = CHATD_IDX_RANGE_MIDDLE;
         CHATID_LOG_DEBUG("Db has no local history for chat");
         loadAndProcessUnsent();
+        mDormant = false;   // nothing to load
     }
     else
     {
@@ -1877,7 +1892,18 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
         CHATID_LOG_DEBUG("Db has local history: %s - %s (middle point: %u)",
             ID_CSTR(info.oldestDbId), ID_CSTR(info.newestDbId), mForwardStart);
         loadAndProcessUnsent();
-        getHistoryFromDb(initialHistoryFetchCount); // ensure we have a minimum set of messages loaded and ready
+        if (mDormant)
+        {
+            // the history is loaded on demand, but the last message is needed by the list of chats
+            if (!mLastTextMsg.isValid())
+            {
+                CALL_DB(getLastTextMessage, mForwardStart - 1, mLastTextMsg, mLastMsgTs);
+            }
+        }
+        else // the app has the chatroom open, see ChatRoom::setAppChatHandler()
+        {
+            getHistoryFromDb(initialHistoryFetchCount); // ensure we have a minimum set of messages loaded and ready
+        }
     }
 }
 Chat::~Chat()
@@ -1908,20 +1934,44 @@ void Chat::disable(bool state)
     }
 }
 
+void Chat::activate()
+{
+    if (!mDormant)
+    {
+        return;
+    }
+
+    // if called during the construction (from Listener::init()), the constructor loads the history
+    mDormant = false;
+    if (mHasMoreHistoryInDb)
+    {
+        CHATID_LOG_DEBUG("Activating chat, loading history from db");
+        getHistoryFromDb(initialHistoryFetchCount); // ensure we have a minimum set of messages loaded and ready
+    }
+}
+
 Idx Chat::getHistoryFromDb(unsigned count)
 {
     assert(mHasMoreHistoryInDb); //we are within the db range
     std::vector<Message*> messages;
     CALL_DB(fetchDbHistory, lownum()-1, count, messages);
+
+    // Load the reactions of the whole page from cache, by a single query
+    std::multimap<karere::Id, std::pair<std::string, karere::Id>> reactions;
+    if (!messages.empty())
+    {
+        // messages are fetched from newest to oldest
+        Idx newest = lownum() - 1;
+        CALL_DB(getReactionsInRange, newest - static_cast<Idx>(messages.size()) + 1, newest, reactions);
+    }
+
     for (auto msg: messages)
     {
-        // Load msg reactions from cache
-        std::multimap<std::string, karere::Id> reactions;
-        CALL_DB(getReactions, msg->id(), reactions);
-        for (auto& reaction : reactions)
+        auto range = reactions.equal_range(msg->id());
+        for (auto it = range.first; it != range.second; it++)
         {
             // Add reaction to confirmed reactions queue in message
-            msg->addReaction(reaction.first, reaction.second);
+            msg->addReaction(it->second.first, it->second.second);
         }
 
         msgIncoming(false, msg, true); //increments mLastHistFetch/DecryptCount, may reset mHasMoreHistoryInDb if this msgid == mLastKnownMsgid
@@ -1935,14 +1985,7 @@ Idx Chat::getHistoryFromDb(unsigned count)
         mNextHistFetchIdx -= static_cast<Idx>(messages.size());
     }
 
-    // Load all pending reactions stored in cache
-    std::vector<PendingReaction> pendingReactions;
-    CALL_DB(getPendingReactions, pendingReactions);
-    for (auto &auxReaction : pendingReactions)
-    {
-        // Add pending reaction to queue in chat
-        addPendingReaction(auxReaction.mReactionString, auxReaction.mReactionStringEnc, auxReaction.mMsgId, auxReaction.mStatus);
-    }
+    loadPendingReactions();
 
     CALL_LISTENER(onHistoryDone, kHistSourceDb);
 
@@ -1972,6 +2015,16 @@ void Connection::wsHandleMsgCb(char *data, size_t len)
     execCommand(StaticBuffer(data, len));
 }
 
+void Connection::wsHandleMsgBufferCb(Buffer&& msg)
+{
+    // The websockets layer assembled the frame in a buffer of its own, so received messages
+    // can reference it instead of copying their payloads. Unfragmented frames are delivered
+    // through wsHandleMsgCb(), since the data is not ours and it must be copied anyway
+    mTsLastRecv = time(NULL);
+    Buffer frame = SharedBuffer::create(std::move(msg), Message::payloadAllocator());
+    execCommand(frame, &frame);
+}
+
 void Connection::wsSendMsgCb(const char *, size_t)
 {
     assert(!mSendPromise.done());
@@ -1981,8 +2034,9 @@ void Connection::wsSendMsgCb(const char *, size_t)
 // inbound command processing
 // multiple commands can appear as one WebSocket frame, but commands never cross frame boundaries
 // CHECK: is this assumption correct on all browsers and under all circumstances?
-void Connection::execCommand(const StaticBuffer& buf)
+void Connection::execCommand(const StaticBuffer& buf, const Buffer* sharedFrame)
 {
+    assert(!sharedFrame || (sharedFrame->buf() == buf.buf() && sharedFrame->dataSize() == buf.dataSize()));
     size_t pos = 0;
 //IMPORTANT: Increment pos before calling the command handler, because the handler may throw, in which
 //case the next iteration will not advance and will execute the same command again, resulting in
@@ -2049,13 +2103,16 @@ void Connection::execCommand(const StaticBuffer& buf)
                 READ_32(keyid, 30);
                 READ_32(msglen, 34);
                 const char* msgdata = buf.readPtr(pos, msglen);
+                size_t msgOffset = pos;
                 pos += msglen;
 
                 CHATDS_LOG_DEBUG("%s: recv %s - msgid: '%s', from user '%s' with keyid %u, ts %u, tsdelta %u",
                     ID_CSTR(chatid), Command::opcodeToStr(opcode), ID_CSTR(msgid),
                     ID_CSTR(userid), keyid, ts, updated);
 
-                std::unique_ptr<Message> msg(new Message(msgid, userid, ts, updated, msgdata, msglen, false, keyid));
+                std::unique_ptr<Message> msg(sharedFrame
+                        ? new Message(msgid, userid, ts, updated, SharedBuffer::slice(*sharedFrame, msgOffset, msglen), false, keyid, Message::kMsgInvalid)
+                        : new Message(msgid, userid, ts, updated, msgdata, msglen, false, keyid));
                 msg->setEncrypted(Message::kEncryptedPending);
                 Chat& chat = mChatdClient.chats(chatid);
                 if (opcode == OP_MSGUPD)
@@ -2475,6 +2532,9 @@ void Chat::onHistDone()
     mFetchRequest.pop();
     if (fetchType == FetchType::kFetchMessages)
     {
+        CALL_DB(commitHistoryBatch);
+        CALL_CRYPTO(onHistoryFetchEnd);
+
         // We may be fetching from memory and db because of a resetHistFetch()
         // while fetching from server. In that case, we don't notify about
         // fetched messages and onHistDone()
@@ -2675,6 +2735,7 @@ void Chat::clearHistory()
 {
     initChat();
     CALL_DB(clearHistory);
+    invalidateUnreadCount();
     CALL_CRYPTO(onHistoryReload);
     CALL_LISTENER(onHistoryReloaded);
 }
@@ -2730,6 +2791,24 @@ void Chat::removePendingReaction(const string &reaction, Id msgId)
     }
 }
 
+void Chat::loadPendingReactions()
+{
+    if (mPendingReactionsLoaded)
+    {
+        return;
+    }
+
+    // Load all pending reactions stored in cache. Afterwards, they are kept in sync in memory
+    std::vector<PendingReaction> pendingReactions;
+    CALL_DB(getPendingReactions, pendingReactions);
+    for (auto &auxReaction : pendingReactions)
+    {
+        // Add pending reaction to queue in chat
+        addPendingReaction(auxReaction.mReactionString, auxReaction.mReactionStringEnc, auxReaction.mMsgId, auxReaction.mStatus);
+    }
+    mPendingReactionsLoaded = true;
+}
+
 void Chat::retryPendingReactions()
 {
     for (auto& reaction: mPendingReactions)
@@ -2757,6 +2836,12 @@ void Chat::cleanPendingReactionsOlderThan(Idx idx)
 
 void Chat::flushChatPendingReactions()
 {
+    if (!mPendingReactions.empty())
+    {
+        // the messages of the reactions must be loaded in RAM to notify their updates
+        activate();
+    }
+
     for (auto &reaction : mPendingReactions)
     {
         Idx index = msgIndexFromId(reaction.mMsgId);
@@ -2891,6 +2976,7 @@ void Chat::initChat()
 
     mHasMoreHistoryInDb = false;
     mHaveAllHistory = false;
+    mUnreadCountValid = false;
 }
 
 void Chat::requestRichLink(Message &message)
@@ -3144,6 +3230,7 @@ Message* Chat::msgSubmit(const char* msg, size_t msglen, unsigned char type, voi
 }
 void Chat::msgSubmit(Message* msg, SetOfIds recipients)
 {
+    activate();
     assert(msg->isSending());
     assert(msg->keyid == CHATD_KEYID_INVALID);
 
@@ -3675,6 +3762,7 @@ void Chat::onLastSeen(Id msgid, bool resend)
     if (idx != CHATD_IDX_INVALID)   // if msgid is known locally, notify the unread count
     {
         Idx oldLastSeenIdx = mLastSeenIdx;
+        updateUnreadCountOnSeen(oldLastSeenIdx, idx);
         mLastSeenIdx = idx;
 
         //notify about messages that have become 'seen'
@@ -3736,6 +3824,7 @@ bool Chat::setMessageSeen(Idx idx)
             Idx lowest = lownum()-1;
             notifyStart = (mLastSeenIdx < lowest) ? lowest : mLastSeenIdx;
         }
+        updateUnreadCountOnSeen(mLastSeenIdx, idx);
         mLastSeenIdx = idx;
         Idx highest = highnum();
         Idx notifyEnd = (mLastSeenIdx > highest) ? highest : mLastSeenIdx;
@@ -3771,24 +3860,41 @@ bool Chat::setMessageSeen(Id msgid)
 
 int Chat::unreadMsgCount() const
 {
-    if (mLastSeenIdx == CHATD_IDX_INVALID)
+    int count = mUnreadCountValid ? mUnreadCount : calculateUnreadCount();
+
+    // the count is negative until we know the last-seen message, or have all history
+    return (mLastSeenIdx == CHATD_IDX_INVALID && !mHaveAllHistory)
+            ? -count
+            : count;
+}
+
+int Chat::refreshUnreadCount()
+{
+    if (!mUnreadCountValid)
     {
-        if (mHaveAllHistory)
-        {
-            return mDbInterface->getUnreadMsgCountAfterIdx(mLastSeenIdx);
-        }
-        else
-        {
-            return -mDbInterface->getUnreadMsgCountAfterIdx(CHATD_IDX_INVALID);
-        }
+        mUnreadCount = calculateUnreadCount();
+        mUnreadCountValid = true;
+        storeUnreadCount();
     }
-    else if (mLastSeenIdx < lownum())
+#if CHATD_CHECK_UNREAD_COUNT && !defined(NDEBUG)
+    else
+    {
+        checkUnreadCount();
+    }
+#endif
+
+    return unreadMsgCount();
+}
+
+int Chat::calculateUnreadCount() const
+{
+    if (mLastSeenIdx == CHATD_IDX_INVALID || mLastSeenIdx < lownum())
     {
         return mDbInterface->getUnreadMsgCountAfterIdx(mLastSeenIdx);
     }
 
     Idx first = mLastSeenIdx+1;
-    unsigned count = 0;
+    int count = 0;
     auto last = highnum();
     for (Idx i=first; i<=last; i++)
     {
@@ -3802,6 +3908,78 @@ int Chat::unreadMsgCount() const
     return count;
 }
 
+void Chat::updateUnreadCount(Idx idx, bool wasUnread, bool isUnread)
+{
+    if (!mUnreadCountValid || wasUnread == isUnread)
+    {
+        return;
+    }
+
+    if (mLastSeenIdx != CHATD_IDX_INVALID && idx <= mLastSeenIdx)
+    {
+        return; // message is already seen, doesn't count
+    }
+
+    mUnreadCount += isUnread ? 1 : -1;
+    storeUnreadCount();
+}
+
+void Chat::updateUnreadCountOnSeen(Idx oldLastSeenIdx, Idx newLastSeenIdx)
+{
+    if (!mUnreadCountValid)
+    {
+        return;
+    }
+
+    // we can only discount the messages that have become seen if all of them are in RAM
+    if (oldLastSeenIdx == CHATD_IDX_INVALID
+            || oldLastSeenIdx < lownum() - 1
+            || newLastSeenIdx > highnum())
+    {
+        invalidateUnreadCount();
+        return;
+    }
+
+    for (Idx i = oldLastSeenIdx + 1; i <= newLastSeenIdx; i++)
+    {
+        if (at(i).isValidUnread(mChatdClient.myHandle()))
+        {
+            mUnreadCount--;
+        }
+    }
+    storeUnreadCount();
+}
+
+void Chat::invalidateUnreadCount()
+{
+    mUnreadCountValid = false;
+    storeUnreadCount();
+}
+
+void Chat::storeUnreadCount()
+{
+    CALL_DB(setUnreadCount, mUnreadCountValid ? mUnreadCount : -1);
+}
+
+bool Chat::checkUnreadCount()
+{
+    if (!mUnreadCountValid)
+    {
+        return true;
+    }
+
+    int count = calculateUnreadCount();
+    if (count == mUnreadCount)
+    {
+        return true;
+    }
+
+    CHATID_LOG_ERROR("checkUnreadCount: cached unread count (%d) doesn't match the history (%d), fixing it", mUnreadCount, count);
+    mUnreadCount = count;
+    storeUnreadCount();
+    return false;
+}
+
 void Chat::flushOutputQueue(bool fromStart)
 {
     if (!isLoggedIn())
@@ -3858,7 +4036,9 @@ void Chat::joinRangeHist(const ChatDbInfo& dbInfo)
     mServerFetchState = kHistFetchingNewFromServer;
 
     mFetchRequest.push(FetchType::kFetchMessages);
-    sendCommand(Command(OP_JOINRANGEHIST) + mChatId + dbInfo.oldestDbId + at(highnum()).id());
+    // a dormant chat has no history in RAM, but the newest message is the newest one in db
+    Id newestId = empty() ? dbInfo.newestDbId : at(highnum()).id();
+    sendCommand(Command(OP_JOINRANGEHIST) + mChatId + dbInfo.oldestDbId + newestId);
 }
 
 // after a reconnect, we tell the chatd the oldest and newest buffered message
@@ -3872,7 +4052,8 @@ void Chat::handlejoinRangeHist(const ChatDbInfo& dbInfo)
     Command comm (OP_HANDLEJOINRANGEHIST);
     comm.append((const char*) &ph, Id::CHATLINKHANDLE);
     mFetchRequest.push(FetchType::kFetchMessages);
-    sendCommand(comm + dbInfo.oldestDbId + at(highnum()).id());
+    Id newestId = empty() ? dbInfo.newestDbId : at(highnum()).id();
+    sendCommand(comm + dbInfo.oldestDbId + newestId);
 }
 
 Client::~Client()
@@ -3983,6 +4164,7 @@ Message* Chat::msgRemoveFromSending(Id msgxid, Id msgid)
 // msgid can be 0 in case of rejections
 Idx Chat::msgConfirm(Id msgxid, Id msgid, uint32_t timestamp)
 {
+    activate();
     Message* msg = msgRemoveFromSending(msgxid, msgid);
     if (!msg)
         return CHATD_IDX_INVALID;
@@ -4152,6 +4334,7 @@ void Chat::onHistReject()
 
 void Chat::rejectMsgupd(Id id, uint8_t serverReason)
 {
+    activate();
     if (mSending.empty())
     {
         throw std::runtime_error("rejectMsgupd: Send queue is empty");
@@ -4211,6 +4394,7 @@ void Chat::rejectGeneric(uint8_t /*opcode*/, uint8_t /*reason*/)
 
 void Chat::onMsgUpdated(Message* cipherMsg)
 {
+    activate();
 //first, if it was us who updated the message confirm the update by removing any
 //queued msgupds from sending, even if they are not the same edit (i.e. a received
 //MSGUPD from another client with out user will cancel any pending edit by our client
@@ -4331,6 +4515,7 @@ void Chat::onMsgUpdatedAfterDecrypt(time_t updateTs, bool richLinkRemoved, Messa
         idx = msgit->second;
         auto& histmsg = at(idx);
         unsigned char histType = histmsg.type;
+        bool wasUnread = histmsg.isValidUnread(client().myHandle());
 
         if ( (msg->type == Message::kMsgTruncate
               && histmsg.type == msg->type
@@ -4371,6 +4556,7 @@ void Chat::onMsgUpdatedAfterDecrypt(time_t updateTs, bool richLinkRemoved, Messa
             histmsg.ts = msg->ts;   // truncates update the `ts` instead of `update`
             histmsg.keyid = msg->keyid;
         }
+        updateUnreadCount(idx, wasUnread, histmsg.isValidUnread(client().myHandle()));
 
         if (idx > mNextHistFetchIdx)
         {
@@ -4430,6 +4616,13 @@ void Chat::onMsgUpdatedAfterDecrypt(time_t updateTs, bool richLinkRemoved, Messa
         {
             //update in db
             CALL_DB(updateMsgInHistory, msg->id(), *msg);
+
+            // messages older than RAM are already seen if the last-seen pointer is in RAM,
+            // otherwise we don't know the previous state of the message
+            if (mLastSeenIdx == CHATD_IDX_INVALID || mLastSeenIdx < lownum())
+            {
+                invalidateUnreadCount();
+            }
         }
 
         if (msg->isDeleted()) // previous type is unknown, so cannot check for attachment type here
@@ -4509,10 +4702,16 @@ void Chat::handleTruncate(const Message& msg, Idx idx)
     // if truncate was received for a message not loaded in RAM, we may have more history in DB
     mHasMoreHistoryInDb = at(lownum()).id() != mOldestKnownMsgId;
     truncateAttachmentHistory();
+    invalidateUnreadCount();
 }
 
 time_t Chat::handleRetentionTime(bool updateTimer)
 {
+    if (mRetentionTime)
+    {
+        activate(); // the oldest message in db is known once history is loaded
+    }
+
     if (!mRetentionTime || mOldestIdxInDb == CHATD_IDX_INVALID)
     {
         // If retentionTime is disabled or there's no messages to truncate
@@ -4584,6 +4783,7 @@ time_t Chat::handleRetentionTime(bool updateTimer)
 
         truncateAttachmentHistory();
     }
+    invalidateUnreadCount();
 
     if (notifyUnreadChanged)
     {
@@ -4742,6 +4942,10 @@ Message::Status Chat::getMsgStatus(const Message& msg, Idx idx) const
 Idx Chat::msgIncoming(bool isNew, Message* message, bool isLocal)
 {
     assert((isLocal && !isNew) || !isLocal);
+    if (!isLocal)
+    {
+        activate();
+    }
     auto msgid = message->id();
     assert(msgid);
     Idx idx;
@@ -4773,6 +4977,11 @@ Idx Chat::msgIncoming(bool isNew, Message* message, bool isLocal)
             //history message older than the oldest we have
             assert(isFetchingFromServer());
             assert(message->isPendingToDecrypt());
+            if (!mLastServerHistFetchCount)
+            {
+                // first message of this fetch, write the burst in bulk until HISTDONE
+                CALL_DB(beginHistoryBatch);
+            }
             mLastServerHistFetchCount++;
             if (mHasMoreHistoryInDb)
             { //we have db history that is not loaded, so we determine the index
@@ -4840,6 +5049,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
                 if (message->isEncrypted() != Message::kEncryptedNoType)
                 {
                     CALL_DB(updateMsgInHistory, message->id(), *message);   // update 'data' & 'is_encrypted'
+                    updateUnreadCount(idx, false, message->isValidUnread(mChatdClient.myHandle()));
                 }
                 msgIncomingAfterDecrypt(isNew, true, *message, idx);
             })
@@ -4869,6 +5079,15 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         return true;
     }
 
+    if (!isNew && msg.isPendingToDecrypt())
+    {
+        // old history comes in bursts: while decryption is halted on a message, the
+        // following ones can be verified and decrypted in parallel. The results are
+        // still applied here, one at a time and in order
+        mCrypto->prefetchHistoryKeys(msg.keyid);
+        mCrypto->msgDecryptAhead(&msg);
+    }
+
     if (isNew)
     {
         if (mDecryptNewHaltedAt != CHATD_IDX_INVALID)
@@ -5053,6 +5272,7 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
             mAttachmentNodes->addMessage(msg, isNew, false);
         }
         CALL_DB(addMsgToHistory, msg, idx);
+        updateUnreadCount(idx, false, msg.isValidUnread(mChatdClient.myHandle()));
         if (checkRetentionHist)
         {
             // Call after add message to history
@@ -5294,6 +5514,7 @@ void Chat::onUserLeave(Id userid)
 
 void Chat::onAddReaction(Id msgId, Id userId, std::string reaction)
 {
+    activate();
     if (reaction.empty())
     {
         CHATID_LOG_ERROR("onAddReaction: reaction received is empty. msgid: %s", ID_CSTR(msgId));
@@ -5364,6 +5585,7 @@ void Chat::onAddReaction(Id msgId, Id userId, std::string reaction)
 
 void Chat::onDelReaction(Id msgId, Id userId, std::string reaction)
 {
+    activate();
     if (reaction.empty())
     {
         CHATID_LOG_ERROR("onDelReaction: reaction received is empty. msgid: %s", ID_CSTR(msgId));
@@ -5542,6 +5764,7 @@ void Chat::onLastTextMsgUpdated(const Message& msg, Idx idx)
     assert(msg.type != Message::kMsgRevokeAttachment);
     mLastTextMsg.assign(msg, idx);
     mLastMsgTs = msg.ts;
+    onLastMsgTsChanged();
     notifyLastTextMsg();
 
 }
@@ -5562,6 +5785,12 @@ void Chat::notifyLastTextMsg()
     }
 }
 
+void Chat::onLastMsgTsChanged()
+{
+    // keep the list of chats sorted by last activity
+    CALL_LISTENER(onLastMessageTsChanged);
+}
+
 uint8_t Chat::lastTextMessage(LastTextMsg*& msg)
 {
     if (mLastTextMsg.isValid())
@@ -5598,12 +5827,13 @@ bool Chat::findLastTextMsg()
             {
                 mLastTextMsg.assign(msg, CHATD_IDX_INVALID);
                 mLastMsgTs = msg.ts;
+                onLastMsgTsChanged();
                 CHATID_LOG_DEBUG("lastTextMessage: Text message found in send queue");
                 return true;
             }
         }
     }
-    if (!empty())
+    if (!empty() || mHasMoreHistoryInDb) // a dormant chat has history only in db
     {
         //check in ram
         auto low = lownum();
@@ -5614,12 +5844,14 @@ bool Chat::findLastTextMsg()
             {
                 mLastTextMsg.assign(msg, i);
                 mLastMsgTs = msg.ts;
+                onLastMsgTsChanged();
                 CHATID_LOG_DEBUG("lastTextMessage: Text message found in RAM");
                 return true;
             }
         }
         //check in db
         CALL_DB(getLastTextMessage, lownum()-1, mLastTextMsg, mLastMsgTs);
+        onLastMsgTsChanged();
         if (mLastTextMsg.isValid())
         {
             CHATID_LOG_DEBUG("lastTextMessage: Text message found in DB");
@@ -5790,6 +6022,13 @@ const char* Message::statusNames[] =
   "Sending", "SendingManual", "ServerReceived", "ServerRejected", "Delivered", "NotSeen", "Seen"
 };
 
+BufferPool* Message::payloadAllocator()
+{
+    // Never destroyed: messages may still be alive (i.e. held by the app) during static destruction
+    static BufferPool* pool = new BufferPool();
+    return pool;
+}
+
 bool Message::hasUrl(const string &text, string &url)
 {
     std::string::size_type position = 0;
@@ -314,6 +314,13 @@ public:
      */
     virtual void onLastMessageTsUpdated(uint32_t /*ts*/) {}
 
+    /**
+     * @brief Called whenever the timestamp of the last message changes, even if it
+     * is not notified by \c onLastMessageTsUpdated. Used by the client to keep its
+     * list of chats sorted by last activity.
+     */
+    virtual void onLastMessageTsChanged() {}
+
     /**
      * @brief Called when the number of users that reacted to a message with a
      * specific reaction has changed.
@@ -482,6 +489,7 @@ protected:
     virtual void wsConnectCb();
     virtual void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len);
     virtual void wsHandleMsgCb(char *data, size_t len);
+    virtual void wsHandleMsgBufferCb(Buffer&& msg);
     virtual void wsSendMsgCb(const char *data, size_t len);
 
     void onSocketClose(int ercode, int errtype, const std::string& reason);
@@ -489,14 +497,16 @@ protected:
     void abortRetryController();
     void disconnect();
     void doConnect();
-// Destroys the buffer content
-    bool sendBuf(Buffer&& buf);
+    bool sendBuf(const StaticBuffer& buf);
     bool rejoinExistingChats();
     void resendPending();
     void join(karere::Id chatid);
     void hist(karere::Id chatid, long count);
     bool sendCommand(Command&& cmd); // used internally only for OP_HELLO
-    void execCommand(const StaticBuffer& buf);
+    /** Parses and executes the commands in \c buf. If \c sharedFrame is provided, it must
+     * reference the same data as \c buf (see SharedBuffer) and received messages will
+     * reference slices of it until they are decrypted, rather than copying their payload */
+    void execCommand(const StaticBuffer& buf, const Buffer* sharedFrame = nullptr);
     promise::Promise<void> sendKeepalive();
     void sendEcho();
     void sendCallReqDeclineNoSupport(karere::Id chatid, karere::Id callid);
@@ -777,6 +787,10 @@ protected:
     std::unique_ptr<FilteredHistory> mAttachmentNodes;
     OutputQueue mSending;
     PendingReactions mPendingReactions;
+    // pending reactions are loaded from db once, along with the first page of history or at login
+    bool mPendingReactionsLoaded = false;
+    /** @brief Whether the history in db has not been loaded yet, see \c activate() */
+    bool mDormant = true;
     OutputQueue::iterator mNextUnsent;
     bool mIsFirstJoin = true;
     std::map<karere::Id, Idx> mIdToIndexMap;
@@ -784,6 +798,10 @@ protected:
     Idx mLastReceivedIdx = CHATD_IDX_INVALID;
     karere::Id mLastSeenId;
     Idx mLastSeenIdx = CHATD_IDX_INVALID;
+    /// Number of unread messages after mLastSeenIdx (or in the whole history, if it's unknown),
+    /// maintained incrementally and persisted. Only meaningful when mUnreadCountValid is true
+    int mUnreadCount = 0;
+    bool mUnreadCountValid = false;
     Idx mLastIdxReceivedFromServer = CHATD_IDX_INVALID;
     Listener* mListener;
     ChatState mOnlineState = kChatStateOffline;
@@ -894,6 +912,7 @@ protected:
     void onJoinComplete();
     void onRetentionTimeUpdated(uint32_t period);
     void loadAndProcessUnsent();
+    void loadPendingReactions();
     void initialFetchHistory(karere::Id serverNewest);
     void requestHistoryFromServer(int32_t count);
     Idx getHistoryFromDb(unsigned count);
@@ -921,9 +940,16 @@ protected:
     void handleBroadcast(karere::Id userid, uint8_t type);
     void findAndNotifyLastTextMsg();
     void notifyLastTextMsg();
+    void onLastMsgTsChanged();
     void onInCall(karere::Id userid, uint32_t clientid);
     void onEndCall(karere::Id userid, uint32_t clientid);
     void initChat();
+    int calculateUnreadCount() const;
+    void updateUnreadCount(Idx idx, bool wasUnread, bool isUnread);
+    void updateUnreadCountOnSeen(Idx oldLastSeenIdx, Idx newLastSeenIdx);
+    void invalidateUnreadCount();
+    void storeUnreadCount();
+    bool checkUnreadCount();
     void requestRichLink(Message &message);
     void requestPendingRichLinks();
     void removePendingRichLinks();
@@ -958,6 +984,18 @@ public:
     bool empty() const { return mForwardList.empty() && mBackwardList.empty();}
     bool isDisabled() const { return mIsDisabled; }
     bool isFirstJoin() const { return mIsFirstJoin; }
+    /**
+     * @brief Whether the chat has local history, but it has not been loaded in RAM yet
+     *
+     * Chats are created dormant, unless the app has the chatroom open: only the
+     * metadata required by the list of chats (last message, unread count, seen and
+     * received pointers) is read from db. The first page of history is loaded by
+     * \c activate(), upon first access or incoming messages, edits or reactions.
+     * This way, the cost of the startup depends on the active chats only.
+     */
+    bool isDormant() const { return mDormant; }
+    /** @brief Loads the first page of history from db, if the chat is dormant */
+    void activate();
     void disable(bool state);
     /** The index of the oldest decrypted message in the RAM history buffer.
      * This will be greater than lownum() if there are not-yet-decrypted messages
@@ -1259,9 +1297,17 @@ public:
       * as more history is fetched from server.
       * Example 1: Client has 1 message pre-fetched and its msgid is the same
       * as the last-seen-msgid. The count will be returned as 0.
+      * The count is maintained incrementally and persisted, so this is a cheap call,
+      * unless it had to be invalidated: then it's calculated again, but not stored.
+      * @see refreshUnreadCount
       */
     int unreadMsgCount() const;
 
+    /** @brief Same as \c unreadMsgCount, but if the count had been invalidated,
+     * it's calculated again and stored, so the next calls are cheap.
+     */
+    int refreshUnreadCount();
+
     /** @brief Returns the text of the most-recent message in the chat that can
      * be displayed as text in the chat list. If it is not found in RAM,
      * the database will be queried. If not found there as well, server is queried,
@@ -1666,6 +1712,13 @@ public:
     /// update a message in the history buffer with the specified \c msgid
     virtual void updateMsgInHistory(karere::Id msgid, const Message& msg) = 0;
 
+    /// start collecting messages added by addMsgToHistory(), so they can be written in bulk.
+    /// Any other access to the db must see the collected messages as already written
+    virtual void beginHistoryBatch() = 0;
+
+    /// write the messages collected since beginHistoryBatch() and go back to one write per message
+    virtual void commitHistoryBatch() = 0;
+
 
 //  <<<--- Management of the SENDING QUEUE --->>>
 
@@ -1731,6 +1784,10 @@ public:
     virtual uint32_t getOldestMsgTs() = 0;
     virtual Idx getIdxOfMsgidFromHistory(karere::Id msgid) = 0;
     virtual Idx getUnreadMsgCountAfterIdx(Idx idx) = 0;
+    /// Returns the persisted unread count in \c count, or false if it's not known
+    virtual bool getUnreadCount(int& count) = 0;
+    /// Persists the unread count. A negative value marks it as unknown
+    virtual void setUnreadCount(int count) = 0;
     virtual void getLastTextMessage(Idx from, chatd::LastTextMsgState& msg, uint32_t& lastTs) = 0;
     virtual void getMessageDelta(karere::Id msgid, uint16_t *updated) = 0;
     virtual void getMessageUserKeyId(const karere::Id &msgid, karere::Id &userid, uint32_t &keyid) = 0;
@@ -1752,6 +1809,8 @@ public:
     virtual void delReaction(karere::Id msgId, karere::Id userId, const std::string &reaction) = 0;
     virtual void delPendingReaction(karere::Id msgId, const std::string &reaction) = 0;
     virtual void getReactions(karere::Id msgId, std::multimap<std::string, karere::Id>& reactions) const = 0;
+    /** Returns the reactions (pairs reaction-userid) of the messages in the range of indexes, by msgid */
+    virtual void getReactionsInRange(Idx oldest, Idx newest, std::multimap<karere::Id, std::pair<std::string, karere::Id>>& reactions) const = 0;
     virtual void getPendingReactions(std::vector<chatd::Chat::PendingReaction>& reactions) const = 0;
     virtual bool hasPendingReactions() = 0;
 
@@ -5,19 +5,133 @@
 #include "chatd.h"
 //extern sqlite3* db;
 
-class ChatdSqliteDb: public chatd::DbInterface
+namespace chatd
+{
+/** SQL of the frequent queries on the history tables. UNITARYTEST_DbQueryPlans checks
+ * that none of them requires a full table scan. The ones that run on both history and
+ * node_history take the name of the table.
+ */
+namespace sql
+{
+const char* const kHistoryRange = "select min(idx), max(idx) from history where chatid=?1";
+const char* const kHistoryRangeCount = "select min(idx), max(idx), count(*) from history where chatid = ?";
+const char* const kNodeHistoryRangeCount = "select min(idx), max(idx), count(*) from node_history where chatid=?1";
+const char* const kOldestTs = "select min(ts) from history where chatid = ?";
+const char* const kIdxByRetentionTime = "select MAX(ts), MAX(idx) from history where chatid = ? and ts <= ?";
+const char* const kMsgUserKeyId = "select userid, keyid from history where chatid = ? and msgid = ?";
+const char* const kReactedMsg = "select type, userid, keyid, idx from history where chatid = ? and msgid = ?";
+const char* const kMsgUpdated = "select updated from history where chatid = ? and msgid = ?";
+const char* const kLastTextMsg =
+        "select type, idx, data, msgid, userid, ts from history where chatid=?1 and "
+        "(length(data) > 0 OR type = ?2) and type != ?3  and type != ?4 and (idx <= ?5)"
+        "order by idx desc limit 1";
+const char* const kReactionsInRange =
+        "select h.msgid, r.reaction, r.userid from history h"
+        " join chat_reactions r on r.chatid = h.chatid and r.msgid = h.msgid"
+        " where h.chatid = ?1 and h.idx between ?2 and ?3";
+const char* const kUpdateMsgUpdated =
+        "update history set type = ?, data = ?, updated = ?, userid = ?, is_encrypted = ? where chatid = ? and msgid = ?";
+const char* const kUpdateNodeMsg = "update node_history set data = ?, updated = ?, type = ? where chatid = ? and msgid = ?";
+const char* const kTruncateRetention = "delete from history where chatid = ? and idx <= ?";
+const char* const kTruncateNodeHistory = "delete from node_history where chatid = ? and idx <= ?";
+
+inline std::string idxOfMsgid(const std::string& table)
+{
+    return "select idx from " + table + " where chatid = ? and msgid = ?";
+}
+inline std::string msgidOfIdx(const std::string& table)
+{
+    return "select msgid from " + table + " where chatid=?1 and idx=?2";
+}
+inline std::string loadMessages(const std::string& table)
+{
+    return "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted from " + table +
+            " where chatid = ?1 and idx <= ?2 order by idx desc limit ?3";
+}
+// conditions should match the ones in Message::isValidUnread()
+inline std::string unreadCount(bool afterIdx)
+{
+    std::string query = "select count(*) from history where (chatid = ?1)"
+            "and (userid != ?2)"
+            "and not (updated != 0 and length(data) = 0)"
+            "and (is_encrypted = ?3 or is_encrypted = ?4 or is_encrypted = ?5)"
+            "and (type = ?6 or type = ?7 or type = ?8 or type = ?9 or type = ?10)";
+    if (afterIdx)
+        query += " and (idx > ?11)";
+    return query;
+}
+inline std::string unreadEndCalls(bool afterIdx)
+{
+    std::string query = "select data from history where (chatid = ?1)"
+            "and (userid != ?2 )"
+            "and (ts > ?3)"
+            "and (type = ?4)";
+    if (afterIdx)
+        query += " and (idx > ?5)";
+    return query;
+}
+}
+}
+
+class ChatdSqliteDb: public chatd::DbInterface, public SqliteDb::PendingWriter
 {
 protected:
+    // max number of rows written by a single multi-row insert (11 columns each,
+    // must stay below SQLITE_MAX_VARIABLE_NUMBER, which defaults to 999)
+    enum { kHistoryBatchMaxRows = 64 };
+
+    // copy of a message received while in bulk mode, not yet written to db
+    struct PendingHistoryRow
+    {
+        chatd::Idx idx;
+        karere::Id msgid;
+        chatd::KeyId keyid;
+        unsigned char type;
+        karere::Id userid;
+        uint32_t ts;
+        uint16_t updated;
+        Buffer data;
+        chatd::BackRefId backRefId;
+        uint8_t isEncrypted;
+        PendingHistoryRow(const chatd::Message& msg, chatd::Idx aIdx)
+            : idx(aIdx), msgid(msg.id()), keyid(msg.keyid), type(msg.type), userid(msg.userid),
+              ts(msg.ts), updated(msg.updated), data(msg.buf(), msg.dataSize()),
+              backRefId(msg.backRefId), isEncrypted(msg.isEncrypted()) {}
+    };
+
     SqliteDb& mDb;
     chatd::Chat& mChat;
     std::string mSendingTblName;
     std::string mHistTblName;
+    bool mHistoryBatchMode = false;
+    std::vector<PendingHistoryRow> mHistoryBatch;
+    // range of history in db when the current batch was started (valid only if batch is not empty)
+    chatd::Idx mBatchDbLowIdx = CHATD_IDX_INVALID;
+    chatd::Idx mBatchDbHighIdx = CHATD_IDX_INVALID;
+    chatd::Idx mBatchLowIdx = CHATD_IDX_INVALID;
+    chatd::Idx mBatchHighIdx = CHATD_IDX_INVALID;
+    // unread count set while the batch is not empty, written together with it
+    bool mHasPendingUnreadCount = false;
+    int mPendingUnreadCount = -1;
 public:
     ChatdSqliteDb(chatd::Chat& chat, SqliteDb& db, const std::string& sendingTblName="sending", const std::string& histTblName="history")
         :mDb(db), mChat(chat), mSendingTblName(sendingTblName), mHistTblName(histTblName){}
+    ~ChatdSqliteDb()
+    {
+        try
+        {
+            if (!mHistoryBatch.empty())
+                mDb.flushPendingWriter();
+        }
+        catch(std::exception& e)
+        {
+            CHATD_LOG_ERROR("chatid %s: Exception writing pending history batch: %s",
+                mChat.chatId().toString().c_str(), e.what());
+        }
+    }
     virtual void getHistoryInfo(chatd::ChatDbInfo& info)
     {
-        SqliteStmt stmt(mDb, "select min(idx), max(idx) from history where chatid=?1");
+        SqliteStmt stmt(mDb, chatd::sql::kHistoryRange);
         stmt.bind(mChat.chatId()).step(); //will always return a row, even if table empty
         auto minIdx = stmt.intCol(0); //WARNING: the chatd implementation uses uint32_t values for idx.
         info.newestDbIdx = stmt.intCol(1);
@@ -26,7 +140,7 @@ public:
             memset(&info, 0, sizeof(info)); //actually need to zero only oldestDbId
             return;
         }
-        SqliteStmt stmt2(mDb, "select msgid from "+mHistTblName+" where chatid=?1 and idx=?2");
+        SqliteStmt stmt2(mDb, chatd::sql::msgidOfIdx(mHistTblName), true);
         stmt2 << mChat.chatId() << minIdx;
         stmt2.stepMustHaveData();
         info.oldestDbId = stmt2.uint64Col(0);
@@ -63,7 +177,7 @@ public:
     {
 #ifndef NDEBUG
         std::string checkQuery = "select min(idx), max(idx), count(*) from " + table + " where chatid = ?";
-        SqliteStmt stmt(mDb, checkQuery.c_str());
+        SqliteStmt stmt(mDb, checkQuery);
         stmt << mChat.chatId();
         stmt.step();
         int low = stmt.intCol(0);
@@ -74,15 +188,17 @@ public:
             CHATD_LOG_ERROR("chatid %s: addMsgToHistory: %s discontinuity detected: "
                 "index of added msg %s is not adjacent to neither end of db history: "
                 "add idx=%d, histlow=%d, histhigh=%d, histcount= %d",
-                table.c_str(), mChat.chatId().toString().c_str(), msg.id().toString().c_str(),
+                mChat.chatId().toString().c_str(), table.c_str(), msg.id().toString().c_str(),
                 idx, low, high, count);
             assert(false);
         }
 #endif
         std::string query = "insert into " + table + " (idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) " +
                                                      "values(?,?,?,?,?,?,?,?,?,?,?)";
-        mDb.query(query.c_str(), idx, mChat.chatId(), msg.id(), msg.keyid,
+        SqliteStmt insertStmt(mDb, query, true);  // one text per history table
+        insertStmt.bindV(idx, mChat.chatId(), msg.id(), msg.keyid,
             msg.type, msg.userid, msg.ts, msg.updated, msg, msg.backRefId, msg.isEncrypted());
+        insertStmt.step();
     }
 
     void addSendingItem(chatd::Chat::SendingItem& item)
@@ -111,8 +227,11 @@ public:
     {
         mDb.query("update sending set keyid = ?, key_cmd = ? where keyid = ? and chatid = ?",
                   keyid, StaticBuffer(nullptr, 0), localkeyid, mChat.chatId());
+        int changes = sqlite3_changes(mDb);
 
-        return sqlite3_changes(mDb);
+        // the key is confirmed by chatd: don't send it again after a crash
+        mDb.commitBarrier();
+        return changes;
     }
 
     virtual void addBlobsToSendingItem(uint64_t rowid,
@@ -126,6 +245,9 @@ public:
                   keyCmd ? keyCmd->keyblob() : StaticBuffer(nullptr, 0),
                   rowid);
         assertAffectedRowCount(1,"addBlobsToSendingItem");
+
+        // the message is sent right after this: it must be possible to resend it after a crash
+        mDb.commitBarrier();
     }
 
     virtual int updateSendingItemsMsgidAndOpcode(karere::Id msgxid, karere::Id msgid)
@@ -149,7 +271,123 @@ public:
     }
     virtual void addMsgToHistory(const chatd::Message& msg, chatd::Idx idx)
     {
-        addMessage(msg, idx, "history");
+        if (!mHistoryBatchMode)
+        {
+            addMessage(msg, idx, "history");
+            return;
+        }
+
+        if (mHistoryBatch.empty())
+        {
+            // we are not the pending writer yet, so this doesn't flush anything of ours
+            SqliteStmt stmt(mDb, chatd::sql::kHistoryRangeCount);
+            stmt << mChat.chatId();
+            stmt.step();
+            bool hasDbHistory = stmt.intCol(2) > 0;
+            mBatchDbLowIdx = hasDbHistory ? stmt.intCol(0) : CHATD_IDX_INVALID;
+            mBatchDbHighIdx = hasDbHistory ? stmt.intCol(1) : CHATD_IDX_INVALID;
+            if (hasDbHistory && (idx != mBatchDbLowIdx-1) && (idx != mBatchDbHighIdx+1))
+            {
+                // a batch must extend the history in db, see getOldestIdx()
+                addMessage(msg, idx, "history");
+                return;
+            }
+            mBatchLowIdx = mBatchHighIdx = idx;
+            mHistoryBatch.reserve(kHistoryBatchMaxRows);
+        }
+        else if ((idx == mBatchLowIdx-1) || (idx == mBatchHighIdx+1))
+        {
+            if (idx < mBatchLowIdx)
+                mBatchLowIdx = idx;
+            if (idx > mBatchHighIdx)
+                mBatchHighIdx = idx;
+        }
+        else
+        {
+            // not adjacent to the batch: write the batch, and then this message on its own
+            CHATD_LOG_WARNING("chatid %s: addMsgToHistory: msg %s (idx %d) is not adjacent to the batch "
+                "(batchlow=%d, batchhigh=%d), flushing it", mChat.chatId().toString().c_str(),
+                msg.id().toString().c_str(), idx, mBatchLowIdx, mBatchHighIdx);
+            mDb.flushPendingWriter();
+            addMessage(msg, idx, "history");
+            return;
+        }
+
+        mHistoryBatch.emplace_back(msg, idx);
+        mDb.setPendingWriter(this);
+        if (mHistoryBatch.size() >= kHistoryBatchMaxRows)
+        {
+            mDb.flushPendingWriter();
+        }
+    }
+
+    virtual void beginHistoryBatch()
+    {
+        mHistoryBatchMode = true;
+    }
+
+    virtual void commitHistoryBatch()
+    {
+        mHistoryBatchMode = false;
+        if (!mHistoryBatch.empty())
+        {
+            assert(mDb.pendingWriter() == this);
+            mDb.flushPendingWriter();
+        }
+    }
+
+    // Called by SqliteDb (already unregistered) before any other statement is executed
+    void flushPending() override
+    {
+        if (mHistoryBatch.empty())
+            return;
+
+        std::vector<PendingHistoryRow> rows;
+        rows.swap(mHistoryBatch);
+
+        std::string query = "insert into history (idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) values";
+        for (size_t i = 0; i < rows.size(); i++)
+        {
+            query.append(i ? ",(?,?,?,?,?,?,?,?,?,?,?)" : "(?,?,?,?,?,?,?,?,?,?,?)");
+        }
+
+        try
+        {
+            // only full batches repeat the same text
+            SqliteStmt stmt(mDb, query, rows.size() == kHistoryBatchMaxRows);
+            for (const PendingHistoryRow& row: rows)
+            {
+                stmt << row.idx << mChat.chatId() << row.msgid << row.keyid << row.type << row.userid
+                     << row.ts << row.updated << row.data << row.backRefId << row.isEncrypted;
+            }
+            stmt.step();
+        }
+        catch(std::exception& e)
+        {
+            // don't lose the whole batch because of a single wrong row
+            CHATD_LOG_WARNING("chatid %s: Bulk insert of %zu messages failed, inserting them one by one: %s",
+                mChat.chatId().toString().c_str(), rows.size(), e.what());
+            for (const PendingHistoryRow& row: rows)
+            {
+                try
+                {
+                    mDb.query("insert into history (idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) "
+                              "values(?,?,?,?,?,?,?,?,?,?,?)", row.idx, mChat.chatId(), row.msgid, row.keyid,
+                              row.type, row.userid, row.ts, row.updated, row.data, row.backRefId, row.isEncrypted);
+                }
+                catch(std::exception& e)
+                {
+                    CHATD_LOG_ERROR("chatid %s: Error adding msgid %s (idx %d) to history: %s",
+                        mChat.chatId().toString().c_str(), row.msgid.toString().c_str(), row.idx, e.what());
+                }
+            }
+        }
+
+        if (mHasPendingUnreadCount)
+        {
+            mHasPendingUnreadCount = false;
+            writeUnreadCount(mPendingUnreadCount);
+        }
     }
     virtual void updateMsgInHistory(karere::Id msgid, const chatd::Message& msg)
     {
@@ -160,15 +398,14 @@ public:
         }
         else    // "updated" instead of "ts"
         {
-            mDb.query("update history set type = ?, data = ?, updated = ?, userid = ?, is_encrypted = ? where chatid = ? and msgid = ?",
-                msg.type, msg, msg.updated, msg.userid, msg.isEncrypted(), mChat.chatId(), msgid);
+            mDb.query(chatd::sql::kUpdateMsgUpdated, msg.type, msg, msg.updated, msg.userid, msg.isEncrypted(), mChat.chatId(), msgid);
         }
         assertAffectedRowCount(1, "updateMsgInHistory");
     }
 
     virtual void getMessageDelta(karere::Id msgid, uint16_t *updated)
     {
-        SqliteStmt stmt3(mDb, "select updated from history where chatid = ? and msgid = ?");
+        SqliteStmt stmt3(mDb, chatd::sql::kMsgUpdated);
         stmt3 << mChat.chatId() << msgid;
         stmt3.stepMustHaveData();
         *updated = stmt3.intCol(0);
@@ -176,8 +413,8 @@ public:
 
     void getMessageUserKeyId(const karere::Id &msgid, karere::Id &userid, uint32_t &keyid) override
     {
-        SqliteStmt stmt(mDb, "select userid, keyid from history where msgid = ?");
-        stmt << msgid;
+        SqliteStmt stmt(mDb, chatd::sql::kMsgUserKeyId);
+        stmt << mChat.chatId() << msgid;
         stmt.stepMustHaveData("getMessageUserKeyId");
         userid = stmt.int64Col(0);
         keyid = stmt.uintCol(1);
@@ -259,8 +496,7 @@ public:
 
     virtual chatd::Idx getIdxOfMsgid(karere::Id msgid, const std::string &table)
     {
-        std::string query = "select idx from " + table + " where chatid = ? and msgid = ?";
-        SqliteStmt stmt(mDb, query.c_str());
+        SqliteStmt stmt(mDb, chatd::sql::idxOfMsgid(table), true);  // one text per history table
         stmt << mChat.chatId() << msgid;
         return (stmt.step()) ? stmt.int64Col(0) : CHATD_IDX_INVALID;
     }
@@ -272,15 +508,7 @@ public:
     virtual chatd::Idx getUnreadMsgCountAfterIdx(chatd::Idx idx)
     {
         // get the unread messages count --> conditions should match the ones in Message::isValidUnread()
-        std::string sql = "select count(*) from history where (chatid = ?1)"
-                "and (userid != ?2)"
-                "and not (updated != 0 and length(data) = 0)"
-                "and (is_encrypted = ?3 or is_encrypted = ?4 or is_encrypted = ?5)"
-                "and (type = ?6 or type = ?7 or type = ?8 or type = ?9 or type = ?10)";
-        if (idx != CHATD_IDX_INVALID)
-            sql+=" and (idx > ?11)";
-
-        SqliteStmt stmt(mDb, sql);
+        SqliteStmt stmt(mDb, chatd::sql::unreadCount(idx != CHATD_IDX_INVALID), true);
         stmt << mChat.chatId() << mChat.client().myHandle()   // skip own messages
              << chatd::Message::kNotEncrypted               // include decrypted messages
              << chatd::Message::kEncryptedMalformed         // include encrypted messages due to malformed payload
@@ -295,14 +523,7 @@ public:
         stmt.stepMustHaveData("get peer msg count");
         int32_t unReadCount = stmt.intCol(0);
 
-        sql = "select data from history where (chatid = ?1)"
-                "and (userid != ?2 )"
-                "and (ts > ?3)"
-                "and (type = ?4)";
-        if (idx != CHATD_IDX_INVALID)
-            sql+=" and (idx > ?5)";
-
-        SqliteStmt stmtEndCAll(mDb, sql);
+        SqliteStmt stmtEndCAll(mDb, chatd::sql::unreadEndCalls(idx != CHATD_IDX_INVALID), true);
         stmtEndCAll << mChat.chatId() << mChat.client().myHandle() // skip own messages
                     << chatd::kTsMissingCallUnread // skip messages older than kTsMissingCallUnread
                     << chatd::Message::kMsgCallEnd;                // include only End call messages
@@ -387,6 +608,14 @@ public:
     }
     virtual chatd::Idx getOldestIdx()
     {
+        if (!mHistoryBatch.empty())
+        {
+            // avoid flushing the batch, we know the range of history in db
+            return (mBatchDbLowIdx == CHATD_IDX_INVALID || mBatchLowIdx < mBatchDbLowIdx)
+                    ? mBatchLowIdx
+                    : mBatchDbLowIdx;
+        }
+
         SqliteStmt stmt(mDb, "select min(idx) from history where chatid = ?");
         stmt << mChat.chatId();
         stmt.stepMustHaveData(__FUNCTION__);
@@ -395,7 +624,7 @@ public:
 
     uint32_t getOldestMsgTs() override
     {
-        SqliteStmt stmt(mDb, "select min(ts) from history where chatid = ?");
+        SqliteStmt stmt(mDb, chatd::sql::kOldestTs);
         stmt << mChat.chatId();
         stmt.stepMustHaveData(__FUNCTION__);
         return stmt.uintCol(0);
@@ -406,6 +635,32 @@ public:
         mDb.query("update chats set last_seen=? where chatid=?", msgid, mChat.chatId());
         assertAffectedRowCount(1, "setLastSeen");
     }
+    bool getUnreadCount(int& count) override
+    {
+        SqliteStmt stmt(mDb, "select unread_count from chats where chatid = ?");
+        stmt << mChat.chatId();
+        if (!stmt.step() || sqlite3_column_type(stmt, 0) == SQLITE_NULL)
+            return false;
+
+        count = stmt.intCol(0);
+        return true;
+    }
+    void setUnreadCount(int count) override
+    {
+        if (!mHistoryBatch.empty())
+        {
+            // don't break the bulk insert, the count will be written after the batch
+            mPendingUnreadCount = count;
+            mHasPendingUnreadCount = true;
+            return;
+        }
+        writeUnreadCount(count);
+    }
+    void writeUnreadCount(int count)
+    {
+        mDb.query("update chats set unread_count = nullif(?, -1) where chatid = ?",
+            (count < 0) ? -1 : count, mChat.chatId());
+    }
     virtual void setLastReceived(karere::Id msgid)
     {
         mDb.query("update chats set last_recv=? where chatid=?", msgid, mChat.chatId());
@@ -429,10 +684,7 @@ public:
 
     virtual void getLastTextMessage(chatd::Idx from, chatd::LastTextMsgState& msg, uint32_t& lastTs)
     {
-        SqliteStmt stmt(mDb,
-            "select type, idx, data, msgid, userid, ts from history where chatid=?1 and "
-            "(length(data) > 0 OR type = ?2) and type != ?3  and type != ?4 and (idx <= ?5)"
-            "order by idx desc limit 1");
+        SqliteStmt stmt(mDb, chatd::sql::kLastTextMsg);
         stmt << mChat.chatId()
              << chatd::Message::kMsgTruncate
              << chatd::Message::kMsgRevokeAttachment
@@ -509,15 +761,14 @@ public:
 
     virtual void deleteMsgFromNodeHistory(const chatd::Message& msg)
     {
-        mDb.query("update node_history set data = ?, updated = ?, type = ? where chatid = ? and msgid = ?",
-                  msg, msg.updated, msg.type, mChat.chatId(), msg.id());
+        mDb.query(chatd::sql::kUpdateNodeMsg, msg, msg.updated, msg.type, mChat.chatId(), msg.id());
         assertAffectedRowCount(1, "deleteMsgFromNodeHistory");
     }
 
     bool isValidReactedMessage(const karere::Id &msgid, chatd::Idx &idx) override
     {
-        SqliteStmt stmt(mDb, "select type, userid, keyid, idx from history where msgid = ?");
-        stmt << msgid;
+        SqliteStmt stmt(mDb, chatd::sql::kReactedMsg);
+        stmt << mChat.chatId() << msgid;
         if (!stmt.step())
         {
             idx = CHATD_IDX_INVALID;
@@ -533,7 +784,7 @@ public:
     virtual void truncateNodeHistory(karere::Id id)
     {
         auto idx = getIdxOfMsgid(id, "node_history");
-        mDb.query("delete from node_history where chatid = ? and idx <= ?", mChat.chatId(), idx);
+        mDb.query(chatd::sql::kTruncateNodeHistory, mChat.chatId(), idx);
     }
 
     virtual void clearNodeHistory()
@@ -543,7 +794,7 @@ public:
 
     virtual void getNodeHistoryInfo(chatd::Idx &newest, chatd::Idx &oldest)
     {
-        SqliteStmt stmt(mDb, "select min(idx), max(idx), count(*) from node_history where chatid=?1");
+        SqliteStmt stmt(mDb, chatd::sql::kNodeHistoryRangeCount);
         stmt.bind(mChat.chatId()).step(); //will always return a row, even if table empty
 
         int count = stmt.intCol(2);
@@ -564,10 +815,7 @@ public:
 
     void loadMessages(int count, chatd::Idx idx, std::vector<chatd::Message*>& messages, const std::string &table)
     {
-        std::string query = "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted from " + table +
-                            " where chatid = ?1 and idx <= ?2 order by idx desc limit ?3";
-
-        SqliteStmt stmt(mDb, query.c_str());
+        SqliteStmt stmt(mDb, chatd::sql::loadMessages(table), true);  // one text per history table
         stmt << mChat.chatId() << idx << count;
         int i = 0;
         while(stmt.step())
@@ -656,6 +904,16 @@ public:
         }
     }
 
+    void getReactionsInRange(chatd::Idx oldest, chatd::Idx newest, std::multimap<karere::Id, std::pair<std::string, karere::Id>>& reactions) const override
+    {
+        SqliteStmt stmt(mDb, chatd::sql::kReactionsInRange);
+        stmt << mChat.chatId() << oldest << newest;
+        while (stmt.step())
+        {
+            reactions.emplace(karere::Id(stmt.uint64Col(0)), std::make_pair(stmt.stringCol(1), karere::Id(stmt.uint64Col(2))));
+        }
+    }
+
     void getPendingReactions(std::vector<chatd::Chat::PendingReaction>& reactions) const override
     {
         SqliteStmt stmt(mDb, "select reaction, encReaction, msgid, status from chat_pending_reactions where chatid = ?");
@@ -677,7 +935,7 @@ public:
     chatd::Idx getIdxByRetentionTime(const time_t ts) override
     {
         // Find the most recent msg affected by retention time if any
-        SqliteStmt stmt(mDb, "select MAX(ts), MAX(idx) from history where chatid = ? and ts <= ?");
+        SqliteStmt stmt(mDb, chatd::sql::kIdxByRetentionTime);
         stmt << mChat.chatId() << static_cast<uint32_t>(ts);
         return (stmt.step() && sqlite3_column_type(stmt, 1) != SQLITE_NULL) ? stmt.intCol(1) : CHATD_IDX_INVALID;
     }
@@ -687,7 +945,7 @@ public:
         if (idx != CHATD_IDX_INVALID)
         {
             // reactions and pending reactions in DB are removed along with messages (FK delete on cascade)
-            mDb.query("delete from history where chatid = ? and idx <= ?", mChat.chatId(), idx);
+            mDb.query(chatd::sql::kTruncateRetention, mChat.chatId(), idx);
         }
     }
 };
@@ -20,8 +20,9 @@ enum
 class Chat;
 class ICrypto
 {
+protected:
     void *appCtx;
-    
+
 public:
     ICrypto(void *ctx) : appCtx(ctx) {}
     
@@ -77,6 +78,21 @@ public:
      */
     virtual promise::Promise<Message*> msgDecrypt(Message* src) = 0;
 
+    /**
+     * @brief Hint that \c msgDecrypt() will be called for this message soon, after
+     * the preceding ones. Called for history fetched from server, which arrives in
+     * bursts, so the crypto module can start verifying and decrypting it in parallel.
+     * The message must not be modified: it's \c msgDecrypt() that sets its content.
+     */
+    virtual void msgDecryptAhead(Message* /*msg*/) {}
+
+    /**
+     * @brief Called for every message of history fetched from server, before it's
+     * decrypted, with the keyid used to encrypt it. History is fetched from newer to
+     * older, so the crypto module can load at once the keys of the range being fetched.
+     */
+    virtual void prefetchHistoryKeys(KeyId /*keyid*/) {}
+
     /**
      * @brief The chatroom connection (to the chatd server shard) state state has changed.
      */
@@ -148,6 +164,9 @@ public:
 
     virtual void onHistoryReload() = 0;
 
+    /** A fetch of history from the server has finished (HISTDONE received) */
+    virtual void onHistoryFetchEnd() {}
+
     virtual uint64_t getPublicHandle() const = 0;
 
     virtual void setPublicHandle(const uint64_t ph) = 0;
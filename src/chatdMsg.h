@@ -689,7 +689,14 @@ public:
     bool isPendingToDecrypt() const { return (mIsEncrypted == kEncryptedPending); }
     // true if message is valid, but permanently undecryptable (not transient like unknown types or keyid not found)
     bool isUndecryptable() const { return (mIsEncrypted == kEncryptedMalformed || mIsEncrypted == kEncryptedSignature); }
-    void setEncrypted(uint8_t encrypted) { mIsEncrypted = encrypted; }
+    void setEncrypted(uint8_t encrypted)
+    {
+        mIsEncrypted = encrypted;
+        if (encrypted != kEncryptedPending)
+        {
+            detach();   // stop referencing the received frame, if any
+        }
+    }
 
     explicit Message(karere::Id aMsgid, karere::Id aUserid, uint32_t aTs, uint16_t aUpdated,
           Buffer&& buf, bool aIsSending=false, KeyId aKeyid=CHATD_KEYID_INVALID,
@@ -701,15 +708,19 @@ public:
             const char* msg, size_t msglen, bool aIsSending=false,
             KeyId aKeyid=CHATD_KEYID_INVALID, unsigned char aType=kMsgInvalid, void* aUserp=nullptr,
             BackRefId aBackRefId = 0, std::vector<BackRefId> aBackRefs = std::vector<BackRefId>())
-        :Buffer(msg, msglen), mId(aMsgid), mIdIsXid(aIsSending), userid(aUserid), ts(aTs),
+        :Buffer(msg, msglen, payloadAllocator()), mId(aMsgid), mIdIsXid(aIsSending), userid(aUserid), ts(aTs),
             updated(aUpdated), keyid(aKeyid), type(aType), userp(aUserp), backRefId(aBackRefId), backRefs(aBackRefs){}
 
     Message(const Message& msg)
-        : Buffer(msg.buf(), msg.dataSize()), mId(msg.id()), mIdIsXid(msg.mIdIsXid), mIsEncrypted(msg.mIsEncrypted),
+        : Buffer(msg.buf(), msg.dataSize(), payloadAllocator()), mId(msg.id()), mIdIsXid(msg.mIdIsXid), mIsEncrypted(msg.mIsEncrypted),
           userid(msg.userid), ts(msg.ts), updated(msg.updated), keyid(msg.keyid), type(msg.type), backRefId(msg.backRefId),
           backRefs(msg.backRefs), userp(msg.userp), userFlags(msg.userFlags), richLinkRemoved(msg.richLinkRemoved)
     {}
 
+    /** @brief Size-class pool shared by the payloads of all messages received from
+     * chatd or copied in memory, so that a steady stream of messages doesn't hit malloc */
+    static BufferPool* payloadAllocator();
+
     /** @brief Returns the ManagementInfo structure contained within the message
      * content. Throws if the message is not a management message, or if the
      * size of the message contents is smaller than the size of ManagementInfo,
@@ -2,6 +2,10 @@
 #define _KARERE_DB_H
 
 #include <sqlite3.h>
+#include <chrono>
+#include <list>
+#include <string>
+#include <unordered_map>
 
 struct SqliteString
 {
@@ -16,31 +20,204 @@ struct SqliteString
 };
 class SqliteStmt;
 
+/** Per-connection cache of prepared statements, keyed by their SQL text.
+ * It's meant for SQL written as literals: text built at runtime (i.e. with a variable
+ * number of rows) is not cached by default, see SqliteStmt. Only idle statements are kept here: a statement is removed from the cache while
+ * a SqliteStmt is using it, and is returned (reset, with bindings cleared) when that
+ * SqliteStmt is destroyed. If the cache is full, the least recently used statement
+ * is finalized.
+ */
+class SqliteStmtCache
+{
+public:
+    enum { kDefaultCapacity = 64 };
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t size = 0;
+    };
+protected:
+    typedef std::list<std::pair<std::string, sqlite3_stmt*>> LruList;
+    LruList mLru;   // most recently used at front
+    std::unordered_map<std::string, LruList::iterator> mIndex;
+    size_t mCapacity;
+    Stats mStats;
+    void evictLast()
+    {
+        assert(!mLru.empty());
+        auto& last = mLru.back();
+        sqlite3_finalize(last.second);
+        mIndex.erase(last.first);
+        mLru.pop_back();
+        mStats.evictions++;
+    }
+public:
+    SqliteStmtCache(size_t capacity = kDefaultCapacity): mCapacity(capacity) {}
+    ~SqliteStmtCache() { clear(); }
+    SqliteStmtCache(const SqliteStmtCache&) = delete;
+    SqliteStmtCache& operator=(const SqliteStmtCache&) = delete;
+
+    /** Takes the statement for \c sql out of the cache. Returns nullptr on a miss,
+     * in which case the caller has to prepare it on its own */
+    sqlite3_stmt* acquire(const char* sql)
+    {
+        if (!mCapacity)
+            return nullptr;
+        auto it = mIndex.find(sql);
+        if (it == mIndex.end())
+        {
+            mStats.misses++;
+            return nullptr;
+        }
+        mStats.hits++;
+        sqlite3_stmt* stmt = it->second->second;
+        mLru.erase(it->second);
+        mIndex.erase(it);
+        return stmt;
+    }
+    /** Gives back ownership of a statement. It's reset and its bindings cleared, so it
+     * doesn't hold any lock nor reference to (possibly freed) bound data while idle */
+    void release(sqlite3_stmt* stmt)
+    {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        const char* sql = sqlite3_sql(stmt);
+        if (!mCapacity || !sql || mIndex.find(sql) != mIndex.end())
+        {
+            // same query was in use more than once at the same time, keep only one copy
+            sqlite3_finalize(stmt);
+            return;
+        }
+        if (mLru.size() >= mCapacity)
+        {
+            evictLast();
+        }
+        mLru.emplace_front(sql, stmt);
+        mIndex.emplace(mLru.front().first, mLru.begin());
+    }
+    /** Finalizes all cached statements. Must be called before closing the connection */
+    void clear()
+    {
+        for (auto& item: mLru)
+        {
+            sqlite3_finalize(item.second);
+        }
+        mLru.clear();
+        mIndex.clear();
+    }
+    void setCapacity(size_t capacity)
+    {
+        mCapacity = capacity;
+        while (mLru.size() > mCapacity)
+        {
+            evictLast();
+        }
+    }
+    size_t capacity() const { return mCapacity; }
+    Stats stats() const
+    {
+        Stats stats = mStats;
+        stats.size = mLru.size();
+        return stats;
+    }
+    void resetStats() { mStats = Stats(); }
+};
+
 class SqliteDb
 {
+public:
+    /** A writer that defers some of its rows in order to write them in bulk.
+     * The registered writer is flushed before any other statement is executed on the
+     * connection, so readers never see the db without the deferred rows.
+     */
+    class PendingWriter
+    {
+    public:
+        virtual void flushPending() = 0;
+        virtual ~PendingWriter() {}
+    };
+    /** Reason why the open transaction was committed, when not in commit-each mode */
+    enum CommitReason
+    {
+        kCommitExplicit = 0,    // commit() called by the app, or change of commit mode
+        kCommitTimer,           // commit interval elapsed
+        kCommitSize,            // pending rows or bytes threshold reached
+        kCommitBarrier,         // commitBarrier(): written data must be durable now
+        kCommitReasonCount
+    };
+    /** Metrics of the group commits done in transactional mode */
+    struct CommitStats
+    {
+        uint64_t commits = 0;
+        uint64_t byReason[kCommitReasonCount] = {};
+        uint64_t rows = 0;          // rows committed, over all commits
+        uint64_t bytes = 0;         // approximate data committed, over all commits
+        uint64_t maxBatchRows = 0;
+        uint64_t totalLatencyUs = 0;
+        uint64_t maxLatencyUs = 0;
+    };
 protected:
     friend class SqliteStmt;
     sqlite3* mDb = nullptr;
+    SqliteStmtCache mStmtCache;
+    PendingWriter* mPendingWriter = nullptr;
     bool mCommitEach = true;
     bool mHasOpenTransaction = false;
     uint16_t mCommitInterval = 20;
     time_t mLastCommitTs = 0;
+    size_t mMaxPendingRows = 2000;
+    size_t mMaxPendingBytes = 4 * 1024 * 1024;
+    int mTransactionStartChanges = 0;   // sqlite3_total_changes() when the transaction began
+    size_t mPendingBytes = 0;           // blob and text data written in the open transaction
+    CommitStats mCommitStats;
     inline int step(SqliteStmt& stmt);
     void beginTransaction()
     {
         assert(!mHasOpenTransaction);
         simpleQuery("BEGIN TRANSACTION");
         mHasOpenTransaction = true;
+        mTransactionStartChanges = sqlite3_total_changes(mDb);
+        mPendingBytes = 0;
     }
-    bool commitTransaction()
+    bool commitTransaction(CommitReason reason=kCommitExplicit)
     {
         if (!mHasOpenTransaction)
             return false;
+        size_t rows = pendingRows();
+        auto start = std::chrono::steady_clock::now();
         simpleQuery("COMMIT TRANSACTION");
+        uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count();
         mHasOpenTransaction = false;
         mLastCommitTs = time(NULL);
+
+        mCommitStats.commits++;
+        mCommitStats.byReason[reason]++;
+        mCommitStats.rows += rows;
+        mCommitStats.bytes += mPendingBytes;
+        mCommitStats.totalLatencyUs += latency;
+        if (rows > mCommitStats.maxBatchRows)
+            mCommitStats.maxBatchRows = rows;
+        if (latency > mCommitStats.maxLatencyUs)
+            mCommitStats.maxLatencyUs = latency;
+        mPendingBytes = 0;
         return true;
     }
+    /** Commits if the open transaction has reached any of the group-commit thresholds */
+    bool autoCommit()
+    {
+        if (mCommitEach || !mHasOpenTransaction)
+            return false;
+
+        if (pendingRows() >= mMaxPendingRows || mPendingBytes >= mMaxPendingBytes)
+        {
+            commit(kCommitSize);
+            return true;
+        }
+        return timedCommit();
+    }
 public:
     SqliteDb(sqlite3* db=nullptr, uint16_t commitInterval=20)
     : mDb(db), mCommitInterval(commitInterval)
@@ -80,12 +257,30 @@ public:
         }
         return true;
     }
+    /** Opens an existing db only for reading, i.e. from a background thread while the db is
+     * open for writing by another connection. In WAL mode, the writer doesn't block readers,
+     * but they only see the changes committed before they start reading */
+    bool openReadOnly(const char* fname)
+    {
+        assert(!mDb);
+        int ret = sqlite3_open_v2(fname, &mDb, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+        if (ret != SQLITE_OK)
+        {
+            sqlite3_close(mDb);
+            mDb = nullptr;
+            return false;
+        }
+        mCommitEach = true;
+        return true;
+    }
     void close()
     {
         if (!mDb)
             return;
+        flushPendingWriter();
         if (!mCommitEach)
             commitTransaction();
+        mStmtCache.clear();
         sqlite3_close(mDb);
         mDb = nullptr;
         mLastCommitTs = 0;
@@ -108,13 +303,49 @@ public:
     }
     bool commitEach() { return mCommitEach; }   // false for transactional
     void setCommitInterval(uint16_t sec) { mCommitInterval = sec; }
+    /** Sets the size thresholds that trigger a commit in transactional mode: rows changed,
+     * and blob/text bytes written, since the last commit */
+    void setCommitThresholds(size_t maxRows, size_t maxBytes)
+    {
+        mMaxPendingRows = maxRows;
+        mMaxPendingBytes = maxBytes;
+    }
+    size_t pendingRows() const
+    {
+        return mHasOpenTransaction ? (size_t)(sqlite3_total_changes(mDb) - mTransactionStartChanges) : 0;
+    }
+    size_t pendingBytes() const { return mPendingBytes; }
+    const CommitStats& commitStats() const { return mCommitStats; }
+    void resetCommitStats() { mCommitStats = CommitStats(); }
     bool hasOpenTransaction() const { return !mHasOpenTransaction; }
+    SqliteStmtCache& stmtCache() { return mStmtCache; }
+    SqliteStmtCache::Stats stmtCacheStats() const { return mStmtCache.stats(); }
+    PendingWriter* pendingWriter() const { return mPendingWriter; }
+    /** Registers \c writer as holding deferred rows. A previously registered writer
+     * is flushed first, since only one can be pending at a time */
+    void setPendingWriter(PendingWriter* writer)
+    {
+        if (mPendingWriter == writer)
+            return;
+        flushPendingWriter();
+        mPendingWriter = writer;
+    }
+    void flushPendingWriter()
+    {
+        if (!mPendingWriter)
+            return;
+        // unregister before flushing, since the writer's own statements go through step()
+        PendingWriter* writer = mPendingWriter;
+        mPendingWriter = nullptr;
+        writer->flushPending();
+    }
     operator sqlite3*() { return mDb; }
     operator const sqlite3*() const { return mDb; }
     template <class... Args>
     inline bool query(const char* sql, Args&&... args);
     void simpleQuery(const char* sql)
     {
+        flushPendingWriter();
         SqliteString err;
         auto ret = sqlite3_exec(mDb, sql, nullptr, nullptr, &err.mStr);
         if (ret == SQLITE_OK)
@@ -128,16 +359,24 @@ public:
 
         throw std::runtime_error(msg);
     }
-    void commit()
+    void commit(CommitReason reason=kCommitExplicit)
     {
         if (mCommitEach)
             return;
 
-        if (commitTransaction())
+        if (commitTransaction(reason))
         {
             beginTransaction();
         }
     }
+    /** Durability barrier: commits everything written so far, i.e. before sending data to
+     * the server whose loss would not be recoverable after a crash. In commit-each mode
+     * every statement is already durable */
+    void commitBarrier()
+    {
+        if (!mCommitEach && pendingRows())
+            commit(kCommitBarrier);
+    }
     bool timedCommit()
     {
         if (mCommitEach)
@@ -147,7 +386,7 @@ public:
         if (now - mLastCommitTs < mCommitInterval)
             return false;
 
-        commit();
+        commit(kCommitTimer);
         return true;
     }
 };
@@ -155,9 +394,12 @@ public:
 class SqliteStmt
 {
 protected:
+    friend class SqliteDb;
     sqlite3_stmt* mStmt;
     SqliteDb& mDb;
     int mLastBindCol = 0;
+    bool mCacheable;
+    size_t mBoundBytes = 0; // blob and text data bound since the last execution
     void retCheck(int code, const char* opname)
     {
         if (code != SQLITE_OK)
@@ -182,8 +424,15 @@ protected:
         return msg;
     }
 public:
-    SqliteStmt(SqliteDb& db, const char* sql):mDb(db)
+    /** If \c cacheable is true, the prepared statement is borrowed from the
+     * connection's statement cache, and returned to it upon destruction.
+     * Pass false for SQL built at runtime, whose text is not one of a small fixed set */
+    SqliteStmt(SqliteDb& db, const char* sql, bool cacheable=true)
+        :mDb(db), mCacheable(cacheable)
     {
+        mStmt = mCacheable ? db.mStmtCache.acquire(sql) : nullptr;
+        if (mStmt)
+            return;
         if (sqlite3_prepare_v2(db, sql, -1, &mStmt, nullptr) != SQLITE_OK)
         {
             const char* errMsg = sqlite3_errmsg(mDb);
@@ -194,28 +443,35 @@ public:
         }
         assert(mStmt);
     }
-    SqliteStmt(SqliteDb& db, const std::string& sql)
-        :SqliteStmt(db, sql.c_str()){}
+    /** SQL built at runtime: not cached unless requested, since each distinct text would
+     * take an entry of the cache */
+    SqliteStmt(SqliteDb& db, const std::string& sql, bool cacheable=false)
+        :SqliteStmt(db, sql.c_str(), cacheable){}
     ~SqliteStmt()
     {
-        if (mStmt)
+        if (!mStmt)
+            return;
+        // the connection may have been closed (or reopened) while we were alive
+        if (mCacheable && sqlite3_db_handle(mStmt) == mDb.mDb)
+            mDb.mStmtCache.release(mStmt);
+        else
             sqlite3_finalize(mStmt);
     }
     operator sqlite3_stmt*() { return mStmt; }
     operator const sqlite3_stmt*() const {return mStmt; }
     SqliteStmt& bind(int col, int val) { retCheck(sqlite3_bind_int(mStmt, col, val), "bind"); return *this; }
     SqliteStmt& bind(int col, int64_t val) { retCheck(sqlite3_bind_int64(mStmt, col, val), "bind"); return *this; }
-    SqliteStmt& bind(int col, const std::string& val) { retCheck(sqlite3_bind_text(mStmt, col, val.c_str(), (int)val.size(), SQLITE_STATIC), "bind"); return *this; }
-    SqliteStmt& bind(int col, const char* val, size_t size) { retCheck(sqlite3_bind_text(mStmt, col, val, size, SQLITE_STATIC), "bind"); return *this; }
-    SqliteStmt& bind(int col, const void* val, size_t size) { retCheck(sqlite3_bind_blob(mStmt, col, val, size, SQLITE_STATIC), "bind"); return *this; }
-    SqliteStmt& bind(int col, const StaticBuffer& buf) { retCheck(sqlite3_bind_blob(mStmt, col, buf.buf(), buf.dataSize(), SQLITE_STATIC), "bind"); return *this; }
+    SqliteStmt& bind(int col, const std::string& val) { retCheck(sqlite3_bind_text(mStmt, col, val.c_str(), (int)val.size(), SQLITE_STATIC), "bind"); mBoundBytes += val.size(); return *this; }
+    SqliteStmt& bind(int col, const char* val, size_t size) { retCheck(sqlite3_bind_text(mStmt, col, val, size, SQLITE_STATIC), "bind"); mBoundBytes += size; return *this; }
+    SqliteStmt& bind(int col, const void* val, size_t size) { retCheck(sqlite3_bind_blob(mStmt, col, val, size, SQLITE_STATIC), "bind"); mBoundBytes += size; return *this; }
+    SqliteStmt& bind(int col, const StaticBuffer& buf) { retCheck(sqlite3_bind_blob(mStmt, col, buf.buf(), buf.dataSize(), SQLITE_STATIC), "bind"); mBoundBytes += buf.dataSize(); return *this; }
     SqliteStmt& bind(int col, uint64_t val) { retCheck(sqlite3_bind_int64(mStmt, col, (int64_t)val), "bind"); return *this; }
     SqliteStmt& bind(int col, unsigned int val) { retCheck(sqlite3_bind_int(mStmt, col, (int)val), "bind"); return *this; }
-    SqliteStmt& bind(int col, const char* val) { retCheck(sqlite3_bind_text(mStmt, col, val, -1, SQLITE_TRANSIENT), "bind"); return *this; }
+    SqliteStmt& bind(int col, const char* val) { retCheck(sqlite3_bind_text(mStmt, col, val, -1, SQLITE_TRANSIENT), "bind"); mBoundBytes += val ? strlen(val) : 0; return *this; }
     template <class T, class... Args>
     SqliteStmt& bindV(T&& val, Args&&... args) { return bind(val).bindV(args...); }
     SqliteStmt& bindV() { return *this; }
-    SqliteStmt& clearBind() { mLastBindCol = 0; retCheck(sqlite3_clear_bindings(mStmt), "clear bindings"); return *this; }
+    SqliteStmt& clearBind() { mLastBindCol = 0; mBoundBytes = 0; retCheck(sqlite3_clear_bindings(mStmt), "clear bindings"); return *this; }
     SqliteStmt& reset() { retCheck(sqlite3_reset(mStmt), "reset"); return *this; }
     template <class T>
     SqliteStmt& bind(T&& val) { bind(++mLastBindCol, val); return *this; }
@@ -306,10 +562,16 @@ inline bool SqliteDb::query(const char* sql, Args&&... args)
 
 inline int SqliteDb::step(SqliteStmt& stmt)
 {
+    flushPendingWriter();
     auto ret = sqlite3_step(stmt);
     if (ret == SQLITE_DONE)
     {
-        timedCommit();
+        if (mHasOpenTransaction && !sqlite3_stmt_readonly(stmt))
+        {
+            mPendingBytes += stmt.mBoundBytes;
+        }
+        stmt.mBoundBytes = 0;
+        autoCommit();
     }
     return ret;
 }
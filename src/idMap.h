@@ -0,0 +1,221 @@
+#ifndef _ID_MAP_H_INCLUDED_
+#define _ID_MAP_H_INCLUDED_
+
+#include <stdint.h>
+#include <assert.h>
+#include <vector>
+#include <utility>
+#include <iterator>
+
+namespace karere
+{
+/** @brief Hash map of 64-bit handles (user handles, chatids...) to values, with open addressing.
+ *
+ * Entries are stored inline in a single array (linear probing, capacity is a power of two),
+ * so lookups and updates touch one or two cache lines and don't allocate. Removals shift
+ * back the following entries of the cluster, so there are no tombstones.
+ *
+ * The handle ~0 (\c Id::inval()) is reserved to mark empty slots and can't be used as key:
+ * it's never inserted, \c emplace() returns null for it and \c operator[] asserts.
+ * Any insertion or removal invalidates iterators and pointers to values. Iteration order
+ * is unspecified.
+ */
+template <class V>
+class IdMap
+{
+public:
+    static const uint64_t kEmptyKey = ~((uint64_t)0);
+    /** Same layout as std::pair, so code written for std::map works on iterators */
+    struct Slot
+    {
+        uint64_t first = kEmptyKey;
+        V second = V();
+    };
+
+    template <class S>
+    class IteratorBase
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef S value_type;
+        typedef ptrdiff_t difference_type;
+        typedef S* pointer;
+        typedef S& reference;
+
+        IteratorBase(S* slot, S* end): mSlot(slot), mEnd(end) { skipEmpty(); }
+        S& operator*() const { return *mSlot; }
+        S* operator->() const { return mSlot; }
+        IteratorBase& operator++() { mSlot++; skipEmpty(); return *this; }
+        IteratorBase operator++(int) { IteratorBase ret = *this; ++(*this); return ret; }
+        bool operator==(const IteratorBase& other) const { return mSlot == other.mSlot; }
+        bool operator!=(const IteratorBase& other) const { return mSlot != other.mSlot; }
+    protected:
+        S* mSlot;
+        S* mEnd;
+        void skipEmpty()
+        {
+            while (mSlot != mEnd && mSlot->first == kEmptyKey)
+                mSlot++;
+        }
+        friend class IdMap;
+    };
+    typedef IteratorBase<Slot> iterator;
+    typedef IteratorBase<const Slot> const_iterator;
+
+    IdMap() {}
+    size_t size() const { return mCount; }
+    bool empty() const { return mCount == 0; }
+    size_t capacity() const { return mSlots.size(); }
+
+    iterator begin() { return iterator(slotsBegin(), slotsEnd()); }
+    iterator end() { return iterator(slotsEnd(), slotsEnd()); }
+    const_iterator begin() const { return const_iterator(slotsBegin(), slotsEnd()); }
+    const_iterator end() const { return const_iterator(slotsEnd(), slotsEnd()); }
+
+    void clear()
+    {
+        mSlots.clear();
+        mCount = 0;
+    }
+
+    /** Makes room for \c count entries without rehashing */
+    void reserve(size_t count)
+    {
+        size_t cap = kMinCapacity;
+        while (cap * kMaxLoadNum < count * kMaxLoadDen)
+            cap <<= 1;
+        if (cap > mSlots.size())
+            rehash(cap);
+    }
+
+    /** Returns the value of the key, or null if not found */
+    V* find(uint64_t key)
+    {
+        size_t i = findSlot(key);
+        return (i == kNotFound) ? nullptr : &mSlots[i].second;
+    }
+    const V* find(uint64_t key) const
+    {
+        size_t i = findSlot(key);
+        return (i == kNotFound) ? nullptr : &mSlots[i].second;
+    }
+    bool contains(uint64_t key) const { return findSlot(key) != kNotFound; }
+
+    /** Returns the value of the key, inserting a default-constructed one if not found.
+     * The key must not be the reserved ~0: check it, or use \c emplace() */
+    V& operator[](uint64_t key)
+    {
+        assert(key != kEmptyKey);
+        return emplace(key).first->second;
+    }
+
+    /** Inserts the key with a default-constructed value, if not found.
+     * @return The slot of the key, and true if it was inserted. The slot is null
+     * if the key is the reserved ~0 */
+    std::pair<Slot*, bool> emplace(uint64_t key)
+    {
+        if (key == kEmptyKey)
+            return std::make_pair(nullptr, false);
+
+        if ((mCount + 1) * kMaxLoadDen > mSlots.size() * kMaxLoadNum)
+            rehash(mSlots.empty() ? kMinCapacity : mSlots.size() * 2);
+
+        size_t mask = mSlots.size() - 1;
+        for (size_t i = hash(key) & mask;; i = (i + 1) & mask)
+        {
+            Slot& slot = mSlots[i];
+            if (slot.first == key)
+                return std::make_pair(&slot, false);
+            if (slot.first == kEmptyKey)
+            {
+                slot.first = key;
+                mCount++;
+                return std::make_pair(&slot, true);
+            }
+        }
+    }
+
+    /** @return True if the key was found and removed */
+    bool erase(uint64_t key)
+    {
+        size_t i = findSlot(key);
+        if (i == kNotFound)
+            return false;
+
+        // shift back the entries of the cluster that would not be found anymore
+        size_t mask = mSlots.size() - 1;
+        size_t hole = i;
+        for (size_t j = (i + 1) & mask; mSlots[j].first != kEmptyKey; j = (j + 1) & mask)
+        {
+            size_t home = hash(mSlots[j].first) & mask;
+            // move it if its home slot is not in the (cyclic) range (hole, j]
+            bool inRange = (hole <= j) ? (hole < home && home <= j) : (hole < home || home <= j);
+            if (!inRange)
+            {
+                mSlots[hole] = std::move(mSlots[j]);
+                hole = j;
+            }
+        }
+        mSlots[hole] = Slot();
+        mCount--;
+        return true;
+    }
+
+protected:
+    enum { kMinCapacity = 16, kMaxLoadNum = 3, kMaxLoadDen = 4 };  // max load factor: 3/4
+    static const size_t kNotFound = (size_t)-1;
+    std::vector<Slot> mSlots;
+    size_t mCount = 0;
+
+    Slot* slotsBegin() { return mSlots.data(); }
+    Slot* slotsEnd() { return mSlots.data() + mSlots.size(); }
+    const Slot* slotsBegin() const { return mSlots.data(); }
+    const Slot* slotsEnd() const { return mSlots.data() + mSlots.size(); }
+
+    static size_t hash(uint64_t key)
+    {
+        // finalizer of MurmurHash3: handles are random, but mix them in case they are not
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return static_cast<size_t>(key);
+    }
+
+    size_t findSlot(uint64_t key) const
+    {
+        if (mSlots.empty() || key == kEmptyKey)
+            return kNotFound;
+
+        size_t mask = mSlots.size() - 1;
+        for (size_t i = hash(key) & mask;; i = (i + 1) & mask)
+        {
+            const Slot& slot = mSlots[i];
+            if (slot.first == key)
+                return i;
+            if (slot.first == kEmptyKey)
+                return kNotFound;
+        }
+    }
+
+    void rehash(size_t newCapacity)
+    {
+        assert((newCapacity & (newCapacity - 1)) == 0);
+        std::vector<Slot> old(newCapacity);
+        old.swap(mSlots);
+        size_t mask = newCapacity - 1;
+        for (Slot& slot: old)
+        {
+            if (slot.first == kEmptyKey)
+                continue;
+            size_t i = hash(slot.first) & mask;
+            while (mSlots[i].first != kEmptyKey)
+                i = (i + 1) & mask;
+            mSlots[i] = std::move(slot);
+        }
+    }
+};
+}
+
+#endif
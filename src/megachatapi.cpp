@@ -437,6 +437,11 @@ int MegaChatApi::getUserOnlineStatus(MegaChatHandle userhandle)
     return pImpl->getUserOnlineStatus(userhandle);
 }
 
+void MegaChatApi::setPresenceCoalescing(int window)
+{
+    pImpl->setPresenceCoalescing(window);
+}
+
 void MegaChatApi::setBackgroundStatus(bool background, MegaChatRequestListener *listener)
 {
     pImpl->setBackgroundStatus(background, listener);
@@ -527,6 +532,16 @@ MegaChatListItemList *MegaChatApi::getChatListItemsByPeers(MegaChatPeerList *pee
     return pImpl->getChatListItemsByPeers(peers);
 }
 
+MegaChatListItemList *MegaChatApi::getChatListItemsPage(int filter, unsigned int offset, unsigned int count)
+{
+    return pImpl->getChatListItemsPage(filter, offset, count);
+}
+
+unsigned int MegaChatApi::getChatListItemsCount(int filter)
+{
+    return pImpl->getChatListItemsCount(filter);
+}
+
 MegaChatListItem *MegaChatApi::getChatListItem(MegaChatHandle chatid)
 {
     return pImpl->getChatListItem(chatid);
@@ -989,6 +1004,11 @@ void MegaChatApi::removeChatRemoteVideoListener(MegaChatHandle chatid, MegaChatH
     pImpl->removeChatVideoListener(chatid, peerid, clientid, listener);
 }
 
+int64_t MegaChatApi::getVideoFrameCount(MegaChatHandle chatid, MegaChatHandle peerid, MegaChatHandle clientid, int type)
+{
+    return pImpl->getVideoFrameCount(chatid, peerid, clientid, type);
+}
+
 #endif
 
 void MegaChatApi::setCatchException(bool enable)
@@ -1434,6 +1454,37 @@ void MegaChatVideoListener::onChatVideoData(MegaChatApi * /*api*/, MegaChatHandl
 
 }
 
+void MegaChatVideoListener::onChatVideoFrame(MegaChatApi *api, MegaChatHandle chatid, MegaChatVideoFrame *frame)
+{
+    onChatVideoData(api, chatid, frame->getWidth(), frame->getHeight(), frame->getBuffer(), frame->getSize());
+    frame->release();
+}
+
+int MegaChatVideoFrame::getWidth() const
+{
+    return 0;
+}
+
+int MegaChatVideoFrame::getHeight() const
+{
+    return 0;
+}
+
+char *MegaChatVideoFrame::getBuffer() const
+{
+    return NULL;
+}
+
+size_t MegaChatVideoFrame::getSize() const
+{
+    return 0;
+}
+
+void MegaChatVideoFrame::release()
+{
+
+}
+
 
 void MegaChatCallListener::onChatCallUpdate(MegaChatApi * /*api*/, MegaChatCall * /*call*/)
 {
@@ -1460,6 +1511,14 @@ void MegaChatListener::onChatOnlineStatusUpdate(MegaChatApi* /*api*/, MegaChatHa
 
 }
 
+void MegaChatListener::onChatOnlineStatusesUpdate(MegaChatApi *api, int status, MegaHandleList *userhandles)
+{
+    for (int i = 0; i < userhandles->size(); i++)
+    {
+        onChatOnlineStatusUpdate(api, userhandles->get(i), status, false);
+    }
+}
+
 void MegaChatListener::onChatPresenceConfigUpdate(MegaChatApi * /*api*/, MegaChatPresenceConfig * /*config*/)
 {
 
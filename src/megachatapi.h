@@ -53,6 +53,7 @@ class MegaChatRoom;
 class MegaChatRoomListener;
 class MegaChatCall;
 class MegaChatCallListener;
+class MegaChatVideoFrame;
 class MegaChatVideoListener;
 class MegaChatListener;
 class MegaChatNotificationListener;
@@ -711,6 +712,57 @@ public:
     virtual bool isOnHold() const;
 };
 
+/**
+ * @brief Video frame lent to a MegaChatVideoListener
+ *
+ * It's received by MegaChatVideoListener::onChatVideoFrame. The SDK retains the ownership of
+ * the frame, which stays valid until MegaChatVideoFrame::release is called, so the buffer
+ * can be used without copying it.
+ */
+class MegaChatVideoFrame
+{
+public:
+    /**
+     * @brief Returns the width of the frame
+     *
+     * @return Size in pixels
+     */
+    virtual int getWidth() const;
+
+    /**
+     * @brief Returns the height of the frame
+     *
+     * @return Size in pixels
+     */
+    virtual int getHeight() const;
+
+    /**
+     * @brief Returns the buffer of the frame
+     *
+     * @return Data buffer in format ARGB: 4 bytes per pixel (total size: width * height * 4)
+     */
+    virtual char *getBuffer() const;
+
+    /**
+     * @brief Returns the size of the buffer of the frame
+     *
+     * @return Buffer size in bytes
+     */
+    virtual size_t getSize() const;
+
+    /**
+     * @brief Returns the frame to the SDK, so it can be reused for the following frames
+     *
+     * Every frame received by MegaChatVideoListener::onChatVideoFrame must be released
+     * exactly once. It can be done from any thread. The frame and its buffer must not be
+     * used afterwards.
+     */
+    virtual void release();
+
+protected:
+    virtual ~MegaChatVideoFrame() {}
+};
+
 /**
  * @brief Interface to get video frames from calls
  *
@@ -736,8 +788,33 @@ public:
      * @param size Buffer size in bytes
      *
      *  The MegaChatVideoListener retains the ownership of the buffer.
+     *
+     * The buffer is only valid until this function returns, so it has to be copied to be
+     * used later. To avoid the copy, override MegaChatVideoListener::onChatVideoFrame instead.
+     *
+     * This function is called from a dedicated thread, shared by the video of every peer.
+     * If it takes longer than the interval between frames, intermediate frames are skipped
+     * and only the newest one is delivered (see MegaChatApi::getVideoFrameCount).
      */
     virtual void onChatVideoData(MegaChatApi *api, MegaChatHandle chatid, int width, int height, char *buffer, size_t size);
+
+    /**
+     * @brief This function is called when a new image from a local or remote device is available
+     *
+     * Unlike MegaChatVideoListener::onChatVideoData, the frame stays valid after this function
+     * returns, so its buffer doesn't need to be copied. The listener must call
+     * MegaChatVideoFrame::release once it's done with the frame, so it can be reused for the
+     * following frames.
+     *
+     * By default, it calls MegaChatVideoListener::onChatVideoData and releases the frame.
+     *
+     * This function is called from the same thread than MegaChatVideoListener::onChatVideoData.
+     *
+     * @param api MegaChatApi connected to the account
+     * @param chatid MegaChatHandle that provides the video
+     * @param frame Video frame, valid until MegaChatVideoFrame::release is called
+     */
+    virtual void onChatVideoFrame(MegaChatApi *api, MegaChatHandle chatid, MegaChatVideoFrame *frame);
 };
 
 /**
@@ -2249,6 +2326,23 @@ public:
         CHAT_CONNECTION_ONLINE      = 3     /// Connection with chatd is ready and logged in
     };
 
+    enum
+    {
+        CHAT_FILTER_ALL             = 0x00, /// All chatrooms
+        CHAT_FILTER_NON_ARCHIVED    = 0x01, /// Exclude archived chatrooms
+        CHAT_FILTER_ARCHIVED        = 0x02, /// Only archived chatrooms
+        CHAT_FILTER_ACTIVE          = 0x04, /// Only active chatrooms
+        CHAT_FILTER_INACTIVE        = 0x08, /// Only inactive chatrooms
+        CHAT_FILTER_UNREAD          = 0x10  /// Only chatrooms with unread messages
+    };
+
+    enum
+    {
+        VIDEO_FRAMES_DECODED        = 0,    /// Frames decoded
+        VIDEO_FRAMES_DELIVERED      = 1,    /// Frames delivered to the MegaChatVideoListener's
+        VIDEO_FRAMES_DROPPED        = 2     /// Frames replaced by a newer one before being delivered
+    };
+
 
     // chat will reuse an existent megaApi instance (ie. the one for cloud storage)
     /**
@@ -2803,6 +2897,23 @@ public:
      */
     int getUserOnlineStatus(MegaChatHandle userhandle);
 
+    /**
+     * @brief Enables or disables the coalescing of changes in the online status of peers
+     *
+     * When many peers change their status at once (i.e. upon reconnection to the presence
+     * server), notifying every change separately may result in many updates of the UI.
+     * When coalescing is enabled, the changes are collected during a window and notified
+     * together by MegaChatListener::onChatOnlineStatusesUpdate, once per status. Only the
+     * last status of every peer is notified.
+     *
+     * Changes of the own status are always notified immediately by
+     * MegaChatListener::onChatOnlineStatusUpdate. By default, coalescing is disabled.
+     *
+     * @param window Milliseconds to collect changes before notifying them. The value 0 notifies
+     * them once the data received from the server is processed. The value -1 disables coalescing.
+     */
+    void setPresenceCoalescing(int window);
+
     /**
      * @brief Set the status of the app
      *
@@ -3094,6 +3205,49 @@ public:
      */
     MegaChatListItemList *getChatListItemsByPeers(MegaChatPeerList *peers);
 
+    /**
+     * @brief Get a page of chatrooms, sorted by last activity (most recent first)
+     *
+     * It is needed to have successfully called \c MegaChatApi::init (the initialization
+     * state should be \c MegaChatApi::INIT_OFFLINE_SESSION or \c MegaChatApi::INIT_ONLINE_SESSION)
+     * before calling this function.
+     *
+     * The last activity of a chatroom is the timestamp of its last message (see
+     * MegaChatListItem::getLastTimestamp), or its creation time if there are no messages.
+     *
+     * Only the requested page of chatrooms is built, so this function is preferable to
+     * \c getChatListItems for accounts with a large number of chatrooms.
+     *
+     * You take the ownership of the returned value
+     *
+     * @param filter Combination of the following values:
+     *  - MegaChatApi::CHAT_FILTER_ALL = 0x00
+     *  - MegaChatApi::CHAT_FILTER_NON_ARCHIVED = 0x01
+     *  - MegaChatApi::CHAT_FILTER_ARCHIVED = 0x02
+     *  - MegaChatApi::CHAT_FILTER_ACTIVE = 0x04
+     *  - MegaChatApi::CHAT_FILTER_INACTIVE = 0x08
+     *  - MegaChatApi::CHAT_FILTER_UNREAD = 0x10
+     * @param offset Number of matching chatrooms to skip
+     * @param count Maximum number of chatrooms to return
+     *
+     * @return List of MegaChatListItemList objects with up to \c count chatrooms matching the filter
+     */
+    MegaChatListItemList *getChatListItemsPage(int filter, unsigned int offset, unsigned int count);
+
+    /**
+     * @brief Return the number of chatrooms that match a filter
+     *
+     * Every chatroom is checked against the filter, so the cost of this function grows
+     * with the number of chatrooms of the account. Avoid calling it on every refresh
+     * of the list of chats.
+     *
+     * @param filter Combination of MegaChatApi::CHAT_FILTER_* values, as
+     * in \c getChatListItemsPage
+     *
+     * @return The number of chatrooms that match the filter
+     */
+    unsigned int getChatListItemsCount(int filter);
+
     /**
      * @brief Get the MegaChatListItem that has a specific handle
      *
@@ -4998,6 +5152,27 @@ public:
      * @param listener Object that is unregistered
      */
     void removeChatRemoteVideoListener(MegaChatHandle chatid, MegaChatHandle peerid, MegaChatHandle clientid, MegaChatVideoListener *listener);
+
+    /**
+     * @brief Returns a counter of the frames of the video received from a peer
+     *
+     * Listeners of the video are called from a dedicated thread. If they are slower than
+     * the incoming video, only the newest frame is delivered and the previous ones are dropped.
+     * These counters allow to detect it.
+     *
+     * Valid values for \c type are:
+     * - MegaChatApi::VIDEO_FRAMES_DECODED = 0
+     * - MegaChatApi::VIDEO_FRAMES_DELIVERED = 1
+     * - MegaChatApi::VIDEO_FRAMES_DROPPED = 2
+     *
+     * @param chatid MegaChatHandle that identifies the chat room
+     * @param peerid MegaChatHandle that identifies the peer, or MEGACHAT_INVALID_HANDLE for local video
+     * @param clientid MegaChatHandle that identifies the client, or 0 for local video
+     * @param type Counter to be returned
+     * @return Value of the counter since the video was started, or -1 if there's no video
+     * from the peer or the type is not valid
+     */
+    int64_t getVideoFrameCount(MegaChatHandle chatid, MegaChatHandle peerid, MegaChatHandle clientid, int type);
 #endif
 
     static void setCatchException(bool enable);
@@ -5700,6 +5875,21 @@ public:
      */
     virtual void onChatOnlineStatusUpdate(MegaChatApi* api, MegaChatHandle userhandle, int status, bool inProgress);
 
+    /**
+     * @brief This function is called when the online status of several users has changed
+     *
+     * It's only called when coalescing of changes is enabled (see MegaChatApi::setPresenceCoalescing).
+     * The default implementation calls MegaChatListener::onChatOnlineStatusUpdate for every user.
+     *
+     * The SDK retains the ownership of the mega::MegaHandleList in the third parameter. It
+     * will be valid until this function returns. If you want to save it, use MegaHandleList::copy
+     *
+     * @param api MegaChatApi connected to the account
+     * @param status New online status of the users
+     * @param userhandles mega::MegaHandleList with the handles of the users whose online status has changed
+     */
+    virtual void onChatOnlineStatusesUpdate(MegaChatApi* api, int status, mega::MegaHandleList *userhandles);
+
     /**
      * @brief This function is called when the presence configuration has changed
      *
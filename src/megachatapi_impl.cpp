@@ -81,6 +81,11 @@ MegaChatApiImpl::~MegaChatApiImpl()
     thread.join();
     delete request;
 
+#ifndef KARERE_DISABLE_WEBRTC
+    // stop delivering video frames before listeners go away
+    mVideoDelivery.reset();
+#endif
+
     for (auto it = chatPeerListItemHandler.begin(); it != chatPeerListItemHandler.end(); it++)
     {
         delete *it;
@@ -111,8 +116,13 @@ void MegaChatApiImpl::init(MegaChatApi *chatApi, MegaApi *megaApi)
     this->mClient = NULL;
     this->terminating = false;
     this->waiter = new MegaChatWaiter();
+    // created before the thread starts, so timers can be set from any thread from now on
+    mTimerWheel.reset(new karere::TimerWheel(((MegaChatWaiter *)waiter)->eventloop, sdkMutex));
     this->websocketsIO = new MegaWebsocketsIO(sdkMutex, waiter, megaApi, this);
     this->reqtag = 0;
+#ifndef KARERE_DISABLE_WEBRTC
+    mVideoDelivery.reset(new MegaChatVideoDelivery(this));
+#endif
 
     //Start blocking thread
     threadExit = 0;
@@ -136,6 +146,7 @@ void *MegaChatApiImpl::threadEntryPoint(void *param)
 
 void MegaChatApiImpl::loop()
 {
+    mTimerWheel->setLoopThread();
     sdkMutex.lock();
     while (true)
     {
@@ -156,6 +167,16 @@ void MegaChatApiImpl::loop()
             assert(eventQueue.isEmpty() || (eventQueue.size() == 1));
             sendPendingEvents();
 
+            EventQueue::Stats stats = eventQueue.stats();
+            API_LOG_DEBUG("Event queue: %lu events dispatched, max depth: %lu, latency (avg/max): %lu/%lu us",
+                          (unsigned long)stats.popped, (unsigned long)stats.maxDepth,
+                          (unsigned long)(stats.popped ? stats.totalLatencyUs / stats.popped : 0),
+                          (unsigned long)stats.maxLatencyUs);
+
+            // the loop doesn't run after this: let a last iteration free the uv timer of the wheel
+            mTimerWheel->close();
+            uv_run(((MegaChatWaiter *)waiter)->eventloop, UV_RUN_NOWAIT);
+
             sdkMutex.unlock();
             break;
         }
@@ -2039,6 +2060,7 @@ void MegaChatApiImpl::sendPendingRequests()
 
 void MegaChatApiImpl::sendPendingEvents()
 {
+    // drain everything queued so far in a single pass, with no locking per event
     void *msg;
     while ((msg = eventQueue.pop()))
     {
@@ -2142,6 +2164,7 @@ void MegaChatApiImpl::createKarereClient()
         uint8_t caps = karere::kClientIsMobile | karere::kClientSupportLastGreen;
 #endif
         mClient = new karere::Client(*megaApi, websocketsIO, *this, megaApi->getBasePath(), caps, this);
+        mClient->presenced().setPresenceCoalescing(mPresenceCoalescingWindow);
         terminating = false;
     }
 }
@@ -2553,7 +2576,7 @@ void MegaChatApiImpl::fireOnChatSessionUpdate(MegaChatHandle chatid, MegaChatHan
     session->removeChanges();
 }
 
-void MegaChatApiImpl::fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid, int width, int height, char *buffer)
+void MegaChatApiImpl::fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid, MegaChatVideoFramePrivate *frame)
 {
     std::map<MegaChatHandle, MegaChatPeerVideoListener_map>::iterator it = videoListeners.find(chatid);
     if (it != videoListeners.end())
@@ -2565,7 +2588,9 @@ void MegaChatApiImpl::fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle
                  videoListenerIterator != peerVideoIterator->second.end();
                  videoListenerIterator++)
             {
-                (*videoListenerIterator)->onChatVideoData(chatApi, chatid, width, height, buffer, width * height * 4);
+                // released by the listener, by MegaChatVideoFrame::release()
+                MegaChatVideoFramePool::addRef(frame);
+                (*videoListenerIterator)->onChatVideoFrame(chatApi, chatid, frame);
             }
         }
     }
@@ -2599,6 +2624,14 @@ void MegaChatApiImpl::fireOnChatOnlineStatusUpdate(MegaChatHandle userhandle, in
     }
 }
 
+void MegaChatApiImpl::fireOnChatOnlineStatusesUpdate(int status, MegaHandleList *userhandles)
+{
+    for(set<MegaChatListener *>::iterator it = listeners.begin(); it != listeners.end() ; it++)
+    {
+        (*it)->onChatOnlineStatusesUpdate(chatApi, status, userhandles);
+    }
+}
+
 void MegaChatApiImpl::fireOnChatPresenceConfigUpdate(MegaChatPresenceConfig *config)
 {
     for(set<MegaChatListener *>::iterator it = listeners.begin(); it != listeners.end() ; it++)
@@ -2841,6 +2874,22 @@ int MegaChatApiImpl::getUserOnlineStatus(MegaChatHandle userhandle)
     return status;
 }
 
+void MegaChatApiImpl::setPresenceCoalescing(int window)
+{
+    sdkMutex.lock();
+    mPresenceCoalescingWindow = window;
+    sdkMutex.unlock();
+
+    // pending changes may be notified: do it from the karere thread
+    marshallCall([this, window]()
+    {
+        if (mClient && !terminating)
+        {
+            mClient->presenced().setPresenceCoalescing(window);
+        }
+    }, this);
+}
+
 void MegaChatApiImpl::setBackgroundStatus(bool background, MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SET_BACKGROUND_STATUS, listener);
@@ -3068,47 +3117,69 @@ MegaChatListItemList *MegaChatApiImpl::getChatListItemsByPeers(MegaChatPeerList
 
     if (mClient && !terminating)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        std::vector<uint64_t> handles;
+        handles.reserve(peers->size());
+        for (int i = 0; i < peers->size(); i++)
         {
-            bool sameParticipants = true;
-            if (it->second->isGroup())
-            {
-                GroupChatRoom *chatroom = (GroupChatRoom*) it->second;
-                if ((int)chatroom->peers().size() != peers->size())
-                {
-                    continue;
-                }
+            handles.push_back(peers->getPeerHandle(i));
+        }
 
-                for (int i = 0; i < peers->size(); i++)
-                {
-                    // if the peer in the list is part of the members in the chatroom...
-                    MegaChatHandle uh = peers->getPeerHandle(i);
-                    if (chatroom->peers().find(uh) == chatroom->peers().end())
-                    {
-                        sameParticipants = false;
-                        break;
-                    }
-                }
-                if (sameParticipants == true)
-                {
-                    items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-                }
+        for (ChatRoom *room : mClient->chats->findByPeers(std::move(handles)))
+        {
+            items->addChatListItem(new MegaChatListItemPrivate(*room));
+        }
+    }
+
+    sdkMutex.unlock();
+
+    return items;
+}
+
+bool MegaChatApiImpl::matchesChatListFilter(ChatRoom &room, int filter)
+{
+    if (((filter & MegaChatApi::CHAT_FILTER_NON_ARCHIVED) && room.isArchived())
+            || ((filter & MegaChatApi::CHAT_FILTER_ARCHIVED) && !room.isArchived())
+            || ((filter & MegaChatApi::CHAT_FILTER_ACTIVE) && !room.isActive())
+            || ((filter & MegaChatApi::CHAT_FILTER_INACTIVE) && room.isActive()))
+    {
+        return false;
+    }
+
+    // checked last, since it's the most expensive condition: if the cached count has been
+    // invalidated, it's counted from db. It's not refreshed, a list getter doesn't write to db
+    return !(filter & MegaChatApi::CHAT_FILTER_UNREAD) || room.chat().unreadMsgCount();
+}
 
+MegaChatListItemList *MegaChatApiImpl::getChatListItemsPage(int filter, unsigned int offset, unsigned int count)
+{
+    MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
+
+    sdkMutex.lock();
+
+    if (mClient && !terminating)
+    {
+        ChatRoomList &chats = *mClient->chats;
+        for (auto &entry : chats.byActivity())
+        {
+            if (!count)
+            {
+                break;
             }
-            else    // 1on1
+
+            ChatRoom *room = chats.at(entry.second);
+            if (!matchesChatListFilter(*room, filter))
             {
-                if (peers->size() != 1)
-                {
-                    continue;
-                }
+                continue;
+            }
 
-                PeerChatRoom *chatroom = (PeerChatRoom*) it->second;
-                if (chatroom->peer() == peers->getPeerHandle(0))
-                {
-                    items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-                }
+            if (offset)
+            {
+                offset--;
+                continue;
             }
+
+            items->addChatListItem(new MegaChatListItemPrivate(*room));
+            count--;
         }
     }
 
@@ -3117,6 +3188,29 @@ MegaChatListItemList *MegaChatApiImpl::getChatListItemsByPeers(MegaChatPeerList
     return items;
 }
 
+unsigned int MegaChatApiImpl::getChatListItemsCount(int filter)
+{
+    unsigned int count = 0;
+
+    sdkMutex.lock();
+
+    if (mClient && !terminating)
+    {
+        // there are no indexes by archived/active/unread state: every room is checked
+        for (auto &entry : *mClient->chats)
+        {
+            if (matchesChatListFilter(*entry.second, filter))
+            {
+                count++;
+            }
+        }
+    }
+
+    sdkMutex.unlock();
+
+    return count;
+}
+
 MegaChatListItem *MegaChatApiImpl::getChatListItem(MegaChatHandle chatid)
 {
     MegaChatListItemPrivate *item = NULL;
@@ -3146,7 +3240,7 @@ int MegaChatApiImpl::getUnreadChats()
         for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
         {
             ChatRoom *room = it->second;
-            if (!room->isArchived() && !room->previewMode() && room->chat().unreadMsgCount())
+            if (!room->isArchived() && !room->previewMode() && room->chat().refreshUnreadCount())
             {
                 count++;
             }
@@ -3239,7 +3333,7 @@ MegaChatListItemList *MegaChatApiImpl::getUnreadChatListItems()
         for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
         {
             ChatRoom *room = it->second;
-            if (!room->isArchived() && room->chat().unreadMsgCount())
+            if (!room->isArchived() && room->chat().refreshUnreadCount())
             {
                 items->addChatListItem(new MegaChatListItemPrivate(*it->second));
             }
@@ -4474,6 +4568,27 @@ void MegaChatApiImpl::removeChatVideoListener(MegaChatHandle chatid, MegaChatHan
     videoMutex.unlock();
 }
 
+int64_t MegaChatApiImpl::getVideoFrameCount(MegaChatHandle chatid, MegaChatHandle peerid, MegaChatHandle clientid, int type)
+{
+    std::shared_ptr<MegaChatVideoStream> stream = mVideoDelivery->findStream(chatid, peerid, static_cast<uint32_t>(clientid));
+    if (!stream)
+    {
+        return -1;
+    }
+
+    switch (type)
+    {
+        case MegaChatApi::VIDEO_FRAMES_DECODED:
+            return stream->framesDecoded;
+        case MegaChatApi::VIDEO_FRAMES_DELIVERED:
+            return stream->framesDelivered;
+        case MegaChatApi::VIDEO_FRAMES_DROPPED:
+            return stream->framesDropped;
+        default:
+            return -1;
+    }
+}
+
 #endif  // webrtc
 
 void MegaChatApiImpl::removeChatListener(MegaChatListener *listener)
@@ -4927,6 +5042,28 @@ void MegaChatApiImpl::onPresenceChanged(Id userid, Presence pres, bool inProgres
     fireOnChatOnlineStatusUpdate(userid.val, pres.status(), inProgress);
 }
 
+void MegaChatApiImpl::onPresencesChanged(const presenced::PresenceChanges &changes)
+{
+    API_LOG_INFO("Presence of %zu users has been changed", changes.size());
+
+    // one notification per status, with all the users that changed to it
+    std::map<int, std::unique_ptr<MegaHandleList>> usersByStatus;
+    for (auto& change: changes)
+    {
+        std::unique_ptr<MegaHandleList>& users = usersByStatus[change.second.status()];
+        if (!users)
+        {
+            users.reset(MegaHandleList::createInstance());
+        }
+        users->addMegaHandle(change.first.val);
+    }
+
+    for (auto& item: usersByStatus)
+    {
+        fireOnChatOnlineStatusesUpdate(item.first, item.second.get());
+    }
+}
+
 void MegaChatApiImpl::onPresenceConfigChanged(const presenced::Config &state, bool pending)
 {
     MegaChatPresenceConfigPrivate *config = new MegaChatPresenceConfigPrivate(state, pending);
@@ -4982,54 +5119,83 @@ void ChatRequestQueue::removeListener(MegaChatRequestListener *listener)
     mutex.unlock();
 }
 
-void EventQueue::push(void *transfer)
+EventQueue::EventQueue()
+    : mHead(new Node), mTail(mHead.load()), mSize(0), mMaxSize(0),
+      mPushed(0), mPopped(0), mTotalLatencyUs(0), mMaxLatencyUs(0)
 {
-    mutex.lock();
-    events.push_back(transfer);
-    mutex.unlock();
 }
 
-void EventQueue::push_front(void *event)
+EventQueue::~EventQueue()
 {
-    mutex.lock();
-    events.push_front(event);
-    mutex.unlock();
+    // pending events are not processed nor freed, as before
+    while (mTail)
+    {
+        Node *next = mTail->next.load(std::memory_order_relaxed);
+        delete mTail;
+        mTail = next;
+    }
+}
+
+void EventQueue::push(void *event)
+{
+    Node *node = new Node(event);
+    size_t size = mSize.fetch_add(1, std::memory_order_relaxed) + 1;
+    size_t maxSize = mMaxSize.load(std::memory_order_relaxed);
+    while (size > maxSize && !mMaxSize.compare_exchange_weak(maxSize, size, std::memory_order_relaxed));
+    mPushed.fetch_add(1, std::memory_order_relaxed);
+
+    // the node is visible to the consumer only when linked to the previous one
+    Node *prev = mHead.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
 }
 
 void* EventQueue::pop()
 {
-    mutex.lock();
-    if(events.empty())
+    Node *tail = mTail;
+    Node *next = tail->next.load(std::memory_order_acquire);
+    if (!next)
     {
-        mutex.unlock();
+        // empty, or a producer is in the middle of a push(). In the latter case,
+        // it will notify the waiter afterwards, so the event won't be missed
         return NULL;
     }
-    void* event = events.front();
-    events.pop_front();
-    mutex.unlock();
+
+    void *event = next->event;
+    uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - next->ts).count();
+    mTail = next;   // `next` becomes the new stub
+    delete tail;
+
+    mSize.fetch_sub(1, std::memory_order_relaxed);
+    mPopped.fetch_add(1, std::memory_order_relaxed);
+    mTotalLatencyUs.fetch_add(latency, std::memory_order_relaxed);
+    if (latency > mMaxLatencyUs.load(std::memory_order_relaxed))
+    {
+        mMaxLatencyUs.store(latency, std::memory_order_relaxed);    // single consumer, no race
+    }
+
     return event;
 }
 
 bool EventQueue::isEmpty()
 {
-    bool ret;
-
-    mutex.lock();
-    ret = events.empty();
-    mutex.unlock();
-
-    return ret;
+    return !size();
 }
 
 size_t EventQueue::size()
 {
-    size_t ret;
-
-    mutex.lock();
-    ret = events.size();
-    mutex.unlock();
+    return mSize.load(std::memory_order_relaxed);
+}
 
-    return ret;
+EventQueue::Stats EventQueue::stats() const
+{
+    Stats stats;
+    stats.pushed = mPushed.load(std::memory_order_relaxed);
+    stats.popped = mPopped.load(std::memory_order_relaxed);
+    stats.depth = mSize.load(std::memory_order_relaxed);
+    stats.maxDepth = mMaxSize.load(std::memory_order_relaxed);
+    stats.totalLatencyUs = mTotalLatencyUs.load(std::memory_order_relaxed);
+    stats.maxLatencyUs = mMaxLatencyUs.load(std::memory_order_relaxed);
+    return stats;
 }
 
 MegaChatRequestPrivate::MegaChatRequestPrivate(int type, MegaChatRequestListener *listener)
@@ -6087,36 +6253,293 @@ void MegaChatCallPrivate::setOnHold(bool onHold)
     this->changed |= MegaChatCall::CHANGE_TYPE_CALL_ON_HOLD;
 }
 
+// header of the block of a frame, rounded up so the pixels start in a new cache line
+static const size_t kVideoFrameHeaderSize = (sizeof(MegaChatVideoFramePrivate) + MegaChatVideoFramePrivate::kBufferAlignment - 1)
+        & ~(size_t)(MegaChatVideoFramePrivate::kBufferAlignment - 1);
+
+void MegaChatVideoFramePrivate::release()
+{
+    MegaChatVideoFramePool::release(this);
+}
+
+MegaChatVideoFramePrivate *MegaChatVideoFramePrivate::create(int width, int height)
+{
+    // new[] only guarantees the alignment of the fundamental types: allocate extra room
+    // to place the frame at the start of a cache line
+    size_t size = (size_t)width * height * 4;  // in format ARGB: 4 bytes per pixel
+    ::mega::byte *block = new ::mega::byte[kBufferAlignment - 1 + kVideoFrameHeaderSize + size];
+    uintptr_t start = ((uintptr_t)block + kBufferAlignment - 1) & ~(uintptr_t)(kBufferAlignment - 1);
+    MegaChatVideoFramePrivate *frame = new ((void *)start) MegaChatVideoFramePrivate;
+    frame->mBlock = block;
+    frame->buffer = (::mega::byte *)start + kVideoFrameHeaderSize;
+    frame->width = width;
+    frame->height = height;
+    return frame;
+}
+
+void MegaChatVideoFramePrivate::destroy(MegaChatVideoFramePrivate *frame)
+{
+    ::mega::byte *block = frame->mBlock;
+    frame->~MegaChatVideoFramePrivate();
+    delete [] block;
+}
+
+MegaChatVideoFramePool::~MegaChatVideoFramePool()
+{
+    for (MegaChatVideoFramePrivate *frame: mFreeFrames)
+    {
+        MegaChatVideoFramePrivate::destroy(frame);
+    }
+}
+
+MegaChatVideoFramePrivate *MegaChatVideoFramePool::acquire(int width, int height)
+{
+    MegaChatVideoFramePrivate *frame = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (width != mWidth || height != mHeight)
+        {
+            // resolution changed: frames of the previous one won't be used anymore
+            for (MegaChatVideoFramePrivate *oldFrame: mFreeFrames)
+            {
+                MegaChatVideoFramePrivate::destroy(oldFrame);
+            }
+            mFreeFrames.clear();
+            mWidth = width;
+            mHeight = height;
+        }
+
+        if (!mFreeFrames.empty())
+        {
+            frame = mFreeFrames.back();
+            mFreeFrames.pop_back();
+            mStats.reused++;
+        }
+        else
+        {
+            mStats.allocated++;
+        }
+    }
+
+    if (!frame)
+    {
+        frame = MegaChatVideoFramePrivate::create(width, height);
+    }
+    frame->mPool = shared_from_this();
+    frame->mRefs = 1;
+    return frame;
+}
+
+void MegaChatVideoFramePool::addRef(MegaChatVideoFramePrivate *frame)
+{
+    frame->mRefs++;
+}
+
+void MegaChatVideoFramePool::release(MegaChatVideoFramePrivate *frame)
+{
+    if (--frame->mRefs > 0)
+    {
+        return;
+    }
+
+    // the frame may hold the last reference to the pool
+    std::shared_ptr<MegaChatVideoFramePool> pool;
+    pool.swap(frame->mPool);
+    pool->recycle(frame);
+}
+
+void MegaChatVideoFramePool::recycle(MegaChatVideoFramePrivate *frame)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (frame->width == mWidth && frame->height == mHeight && mFreeFrames.size() < kMaxPooledFrames)
+        {
+            mFreeFrames.push_back(frame);
+            return;
+        }
+    }
+    MegaChatVideoFramePrivate::destroy(frame);
+}
+
+MegaChatVideoFramePool::Stats MegaChatVideoFramePool::stats()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+}
+
+MegaChatVideoStream::MegaChatVideoStream(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid)
+    : chatid(chatid), peerid(peerid), clientid(clientid),
+      framesDecoded(0), framesDelivered(0), framesDropped(0)
+{
+}
+
+MegaChatVideoStream::~MegaChatVideoStream()
+{
+    if (mPendingFrame)
+    {
+        MegaChatVideoFramePool::release(mPendingFrame);
+    }
+}
+
+MegaChatVideoDelivery::MegaChatVideoDelivery(MegaChatApiImpl *chatApi)
+    : mChatApi(chatApi)
+{
+}
+
+MegaChatVideoDelivery::~MegaChatVideoDelivery()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mExit = true;
+    }
+    mCondition.notify_one();
+    if (mThread.joinable())
+    {
+        mThread.join();
+    }
+}
+
+std::shared_ptr<MegaChatVideoStream> MegaChatVideoDelivery::openStream(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid)
+{
+    std::shared_ptr<MegaChatVideoStream> stream = std::make_shared<MegaChatVideoStream>(chatid, peerid, clientid);
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStreams[StreamKey(chatid, chatd::EndpointId(peerid, clientid))] = stream;
+    if (!mThread.joinable())
+    {
+        mThread = std::thread(&MegaChatVideoDelivery::loop, this);
+    }
+    return stream;
+}
+
+void MegaChatVideoDelivery::closeStream(const std::shared_ptr<MegaChatVideoStream>& stream)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mStreams.find(StreamKey(stream->chatid, chatd::EndpointId(stream->peerid, stream->clientid)));
+        if (it != mStreams.end() && it->second == stream)
+        {
+            mStreams.erase(it);
+        }
+    }
+
+    // the stream may be still queued: don't deliver its last frame
+    MegaChatVideoFramePrivate *frame = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(stream->mMutex);
+        std::swap(frame, stream->mPendingFrame);
+    }
+    if (frame)
+    {
+        MegaChatVideoFramePool::release(frame);
+    }
+
+    API_LOG_DEBUG("Video stream of peer %s (client: %u) in chat %s closed. Frames decoded: %llu, delivered: %llu, dropped: %llu",
+                  karere::Id(stream->peerid).toString().c_str(), stream->clientid, karere::Id(stream->chatid).toString().c_str(),
+                  (unsigned long long)stream->framesDecoded, (unsigned long long)stream->framesDelivered,
+                  (unsigned long long)stream->framesDropped);
+}
+
+void MegaChatVideoDelivery::post(const std::shared_ptr<MegaChatVideoStream>& stream, MegaChatVideoFramePrivate *frame)
+{
+    stream->framesDecoded++;
+
+    MegaChatVideoFramePrivate *dropped = frame;
+    bool queue;
+    {
+        std::lock_guard<std::mutex> lock(stream->mMutex);
+        std::swap(dropped, stream->mPendingFrame);
+        queue = !stream->mQueued;
+        stream->mQueued = true;
+    }
+
+    if (dropped)
+    {
+        // the listeners didn't take the previous frame yet: the newest one replaces it
+        stream->framesDropped++;
+        MegaChatVideoFramePool::release(dropped);
+    }
+
+    if (queue)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mQueue.push_back(stream);
+        }
+        mCondition.notify_one();
+    }
+}
+
+std::shared_ptr<MegaChatVideoStream> MegaChatVideoDelivery::findStream(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mStreams.find(StreamKey(chatid, chatd::EndpointId(peerid, clientid)));
+    return (it != mStreams.end()) ? it->second : nullptr;
+}
+
+void MegaChatVideoDelivery::loop()
+{
+    for (;;)
+    {
+        std::shared_ptr<MegaChatVideoStream> stream;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this]() { return mExit || !mQueue.empty(); });
+            if (mExit)
+            {
+                return;
+            }
+            stream = std::move(mQueue.front());
+            mQueue.pop_front();
+        }
+
+        MegaChatVideoFramePrivate *frame = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(stream->mMutex);
+            std::swap(frame, stream->mPendingFrame);
+            stream->mQueued = false;
+        }
+        if (!frame)
+        {
+            continue;   // closed before being delivered
+        }
+
+        mChatApi->videoMutex.lock();
+        mChatApi->fireOnChatVideoData(stream->chatid, stream->peerid, stream->clientid, frame);
+        mChatApi->videoMutex.unlock();
+        stream->framesDelivered++;
+        MegaChatVideoFramePool::release(frame);
+    }
+}
+
 MegaChatVideoReceiver::MegaChatVideoReceiver(MegaChatApiImpl *chatApi, rtcModule::ICall *call, MegaChatHandle peerid, uint32_t clientid)
+    : mFramePool(std::make_shared<MegaChatVideoFramePool>())
 {
     this->chatApi = chatApi;
     chatid = call->chat().chatId();
     this->peerid = peerid;
     this->clientid = clientid;
+    mStream = chatApi->videoDelivery().openStream(chatid, peerid, clientid);
 }
 
 MegaChatVideoReceiver::~MegaChatVideoReceiver()
 {
+    chatApi->videoDelivery().closeStream(mStream);
+    MegaChatVideoFramePool::Stats stats = mFramePool->stats();
+    API_LOG_DEBUG("Video receiver for chat %s destroyed. Frames allocated: %llu, reused: %llu",
+                  karere::Id(chatid).toString().c_str(), (unsigned long long)stats.allocated, (unsigned long long)stats.reused);
 }
 
 void* MegaChatVideoReceiver::getImageBuffer(unsigned short width, unsigned short height, void*& userData)
 {
-    MegaChatVideoFrame *frame = new MegaChatVideoFrame;
-    frame->width = width;
-    frame->height = height;
-    frame->buffer = new ::mega::byte[width * height * 4];  // in format ARGB: 4 bytes per pixel
+    MegaChatVideoFramePrivate *frame = mFramePool->acquire(width, height);
     userData = frame;
     return frame->buffer;
 }
 
 void MegaChatVideoReceiver::frameComplete(void *userData)
 {
-    chatApi->videoMutex.lock();
-    MegaChatVideoFrame *frame = (MegaChatVideoFrame *)userData;
-    chatApi->fireOnChatVideoData(chatid, peerid, clientid, frame->width, frame->height, (char *)frame->buffer);
-    chatApi->videoMutex.unlock();
-    delete [] frame->buffer;
-    delete frame;
+    // listeners are called from the delivery thread, not to block the decoding one
+    chatApi->videoDelivery().post(mStream, (MegaChatVideoFramePrivate *)userData);
 }
 
 void MegaChatVideoReceiver::onVideoAttach()
@@ -7371,7 +7794,7 @@ MegaChatListItemPrivate::MegaChatListItemPrivate(ChatRoom &chatroom)
 {
     this->chatid = chatroom.chatid();
     this->title = chatroom.titleString();
-    this->unreadCount = chatroom.chat().unreadMsgCount();
+    this->unreadCount = chatroom.chat().refreshUnreadCount();
     this->group = chatroom.isGroup();
     this->mPublicChat = chatroom.publicChat();
     this->mPreviewMode = chatroom.previewMode();
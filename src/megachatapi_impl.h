@@ -42,7 +42,15 @@
 #include <sdkApi.h>
 #include <karereCommon.h>
 #include <logger.h>
+#include <timerWheel.h>
 #include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include "net/libwebsocketsIO.h"
 #include "waiter/libuvWaiter.h"
 
@@ -294,12 +302,143 @@ protected:
     bool mIsCaller;
 };
 
-class MegaChatVideoFrame
+class MegaChatVideoFramePool;
+
+/**
+ * @brief Video frame decoded into an ARGB buffer (4 bytes per pixel)
+ *
+ * The frame and its buffer are allocated in a single block: the buffer follows the
+ * frame, starting in a new cache line. Frames are reference counted and return to
+ * their pool when the last reference is released (see \c MegaChatVideoFramePool::release).
+ */
+class MegaChatVideoFramePrivate : public MegaChatVideoFrame
+{
+public:
+    enum { kBufferAlignment = 64 };     // size of a cache line
+    unsigned char *buffer = nullptr;
+    int width = 0;
+    int height = 0;
+
+    size_t size() const { return (size_t)width * height * 4; }
+    int getWidth() const override { return width; }
+    int getHeight() const override { return height; }
+    char *getBuffer() const override { return (char *)buffer; }
+    size_t getSize() const override { return size(); }
+    void release() override;
+
+protected:
+    std::atomic<int> mRefs;
+    std::shared_ptr<MegaChatVideoFramePool> mPool;   // keeps the pool alive while frames are in use
+    ::mega::byte *mBlock = nullptr;                  // allocated block, the frame is aligned within it
+
+    MegaChatVideoFramePrivate(): mRefs(0) {}
+    ~MegaChatVideoFramePrivate() {}
+    static MegaChatVideoFramePrivate *create(int width, int height);
+    static void destroy(MegaChatVideoFramePrivate *frame);
+    friend class MegaChatVideoFramePool;
+};
+
+/**
+ * @brief Pool of recycled video frames of a video stream
+ *
+ * Frames of the current resolution are kept, up to \c kMaxPooledFrames, so that
+ * a steady stream doesn't allocate a buffer per frame. When the resolution changes,
+ * the frames of the previous one are freed.
+ *
+ * Frames can be acquired by the decoding thread and released by any thread.
+ */
+class MegaChatVideoFramePool : public std::enable_shared_from_this<MegaChatVideoFramePool>
+{
+public:
+    enum { kMaxPooledFrames = 4 };
+
+    struct Stats
+    {
+        uint64_t allocated = 0;     // frames allocated
+        uint64_t reused = 0;        // frames taken from the pool
+    };
+
+    ~MegaChatVideoFramePool();
+
+    /** Returns a frame with one reference, owned by the caller */
+    MegaChatVideoFramePrivate *acquire(int width, int height);
+    static void addRef(MegaChatVideoFramePrivate *frame);
+    /** Releases a reference to the frame. The last one returns the frame to its pool */
+    static void release(MegaChatVideoFramePrivate *frame);
+    Stats stats();
+
+protected:
+    std::mutex mMutex;
+    int mWidth = 0;
+    int mHeight = 0;
+    std::vector<MegaChatVideoFramePrivate *> mFreeFrames;
+    Stats mStats;
+
+    void recycle(MegaChatVideoFramePrivate *frame);
+};
+
+/**
+ * @brief Mailbox of the frames of a video stream, pending to be delivered to listeners
+ *
+ * It holds a single frame: a frame that is not delivered yet when the next one is
+ * decoded gets dropped, so slow listeners don't delay the following frames.
+ */
+class MegaChatVideoStream
+{
+public:
+    MegaChatVideoStream(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid);
+    ~MegaChatVideoStream();
+
+    const MegaChatHandle chatid;
+    const MegaChatHandle peerid;
+    const uint32_t clientid;
+
+    std::atomic<uint64_t> framesDecoded;
+    std::atomic<uint64_t> framesDelivered;
+    std::atomic<uint64_t> framesDropped;
+
+protected:
+    std::mutex mMutex;
+    MegaChatVideoFramePrivate *mPendingFrame = nullptr;
+    bool mQueued = false;   // in the queue of the delivery thread
+    friend class MegaChatVideoDelivery;
+};
+
+/**
+ * @brief Delivers the frames of the video streams to the MegaChatVideoListener's
+ *
+ * Listeners are called from a dedicated thread (started by the first stream), instead
+ * of the decoding threads of WebRTC, so a slow listener doesn't stall the decoding
+ * of the video of every peer. Frames are delivered with MegaChatApiImpl::videoMutex
+ * locked, as before, so listeners are not called after being removed.
+ */
+class MegaChatVideoDelivery
 {
 public:
-    unsigned char *buffer;
-    int width;
-    int height;
+    MegaChatVideoDelivery(MegaChatApiImpl *chatApi);
+    ~MegaChatVideoDelivery();
+
+    std::shared_ptr<MegaChatVideoStream> openStream(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid);
+    void closeStream(const std::shared_ptr<MegaChatVideoStream>& stream);
+
+    /** Queues the frame to be delivered, taking over the reference of the caller */
+    void post(const std::shared_ptr<MegaChatVideoStream>& stream, MegaChatVideoFramePrivate *frame);
+
+    /** Returns the stream of the peer's video, or null if there's no stream */
+    std::shared_ptr<MegaChatVideoStream> findStream(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid);
+
+protected:
+    typedef std::pair<MegaChatHandle, chatd::EndpointId> StreamKey;
+
+    MegaChatApiImpl *mChatApi;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<std::shared_ptr<MegaChatVideoStream>> mQueue;
+    std::map<StreamKey, std::shared_ptr<MegaChatVideoStream>> mStreams;
+    std::thread mThread;
+    bool mExit = false;
+
+    void loop();
 };
 
 class MegaChatVideoReceiver : public rtcModule::IVideoRenderer
@@ -326,6 +465,8 @@ protected:
     MegaChatHandle chatid;
     MegaChatHandle peerid;
     uint32_t clientid;
+    std::shared_ptr<MegaChatVideoFramePool> mFramePool;
+    std::shared_ptr<MegaChatVideoStream> mStream;
 };
 
 #endif
@@ -905,19 +1046,57 @@ class ChatRequestQueue
         void removeListener(MegaChatRequestListener *listener);
 };
 
-//Thread safe transfer queue
+// Thread safe event queue: lock-free, multiple producers (any thread calling
+// marshallCall()) and a single consumer (the MegaChatApi thread)
 class EventQueue
 {
-protected:
-    std::deque<void *> events;
-    std::mutex mutex;
-
 public:
+    struct Stats
+    {
+        uint64_t pushed = 0;
+        uint64_t popped = 0;
+        size_t depth = 0;               // events currently queued
+        size_t maxDepth = 0;
+        uint64_t totalLatencyUs = 0;    // accumulated enqueue-to-dispatch time of popped events
+        uint64_t maxLatencyUs = 0;
+    };
+
+    EventQueue();
+    ~EventQueue();
+
+    // can be called from any thread
     void push(void* event);
-    void push_front(void *event);
-    void* pop();
     bool isEmpty();
     size_t size();
+    Stats stats() const;
+
+    // only from the consumer thread
+    void* pop();
+
+protected:
+    struct Node
+    {
+        std::atomic<Node*> next;
+        void* event;
+        std::chrono::steady_clock::time_point ts;
+        Node(void* aEvent = nullptr) : next(nullptr), event(aEvent), ts(std::chrono::steady_clock::now()) {}
+    };
+
+    // producers append at mHead, the consumer takes from mTail. mTail always
+    // points to an already consumed node (initially a stub)
+    std::atomic<Node*> mHead;
+    char mPadding[64];  // keep producers and consumer on different cache lines
+    Node* mTail;
+
+    std::atomic<size_t> mSize;
+    std::atomic<size_t> mMaxSize;
+    std::atomic<uint64_t> mPushed;
+    std::atomic<uint64_t> mPopped;
+    std::atomic<uint64_t> mTotalLatencyUs;
+    std::atomic<uint64_t> mMaxLatencyUs;
+
+    EventQueue(const EventQueue&) = delete;
+    EventQueue& operator=(const EventQueue&) = delete;
 };
 
 class MegaChatApiImpl :
@@ -933,6 +1112,9 @@ public:
     std::recursive_mutex sdkMutex;
     std::recursive_mutex videoMutex;
     mega::Waiter *waiter;
+
+    /** Timers of the loop of the waiter, see karere::setTimeout() */
+    karere::TimerWheel &timerWheel() { return *mTimerWheel; }
 private:
     MegaChatApi *chatApi;
     mega::MegaApi *megaApi;
@@ -940,6 +1122,15 @@ private:
     karere::Client *mClient;
     bool terminating;
 
+    // window to coalesce presence changes, applied to the client when it's created
+    int mPresenceCoalescingWindow = presenced::Client::kCoalescingDisabled;
+
+#ifndef KARERE_DISABLE_WEBRTC
+    std::unique_ptr<MegaChatVideoDelivery> mVideoDelivery;
+#endif
+
+    std::unique_ptr<karere::TimerWheel> mTimerWheel;
+
     mega::MegaThread thread;
     int threadExit;
     static void *threadEntryPoint(void *param);
@@ -975,6 +1166,7 @@ private:
     void cleanChatHandlers();
 
     static int convertInitState(int state);
+    static bool matchesChatListFilter(karere::ChatRoom &room, int filter);
 
 public:
     static void megaApiPostMessage(void* msg, void* ctx);
@@ -1036,6 +1228,7 @@ public:
     void removeChatCallListener(MegaChatCallListener *listener);
     void addChatVideoListener(MegaChatHandle chatid, MegaChatHandle peerid, MegaChatHandle clientid, MegaChatVideoListener *listener);
     void removeChatVideoListener(MegaChatHandle chatid, MegaChatHandle peerid, MegaChatHandle clientid, MegaChatVideoListener *listener);
+    int64_t getVideoFrameCount(MegaChatHandle chatid, MegaChatHandle peerid, MegaChatHandle clientid, int type);
 #endif
 
     // MegaChatRequestListener callbacks
@@ -1050,13 +1243,16 @@ public:
     void fireOnChatSessionUpdate(MegaChatHandle chatid, MegaChatHandle callid, MegaChatSessionPrivate *session);
 
     // MegaChatVideoListener callbacks
-    void fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid, int width, int height, char*buffer);
+    void fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid, MegaChatVideoFramePrivate *frame);
+
+    MegaChatVideoDelivery &videoDelivery() { return *mVideoDelivery; }
 #endif
 
     // MegaChatListener callbacks (specific ones)
     void fireOnChatListItemUpdate(MegaChatListItem *item);
     void fireOnChatInitStateUpdate(int newState);
     void fireOnChatOnlineStatusUpdate(MegaChatHandle userhandle, int status, bool inProgress);
+    void fireOnChatOnlineStatusesUpdate(int status, ::mega::MegaHandleList *userhandles);
     void fireOnChatPresenceConfigUpdate(MegaChatPresenceConfig *config);
     void fireOnChatPresenceLastGreenUpdated(MegaChatHandle userhandle, int lastGreen);
     void fireOnChatConnectionStateUpdate(MegaChatHandle chatid, int newState);
@@ -1091,6 +1287,7 @@ public:
     bool isSignalActivityRequired();
 
     int getUserOnlineStatus(MegaChatHandle userhandle);
+    void setPresenceCoalescing(int window);
     void setBackgroundStatus(bool background, MegaChatRequestListener *listener = NULL);
     int getBackgroundStatus();
 
@@ -1110,6 +1307,8 @@ public:
     MegaChatRoom *getChatRoomByUser(MegaChatHandle userhandle);
     MegaChatListItemList *getChatListItems();
     MegaChatListItemList *getChatListItemsByPeers(MegaChatPeerList *peers);
+    MegaChatListItemList *getChatListItemsPage(int filter, unsigned int offset, unsigned int count);
+    unsigned int getChatListItemsCount(int filter);
     MegaChatListItem *getChatListItem(MegaChatHandle chatid);
     int getUnreadChats();
     MegaChatListItemList *getActiveChatListItems();
@@ -1208,6 +1407,7 @@ public:
     virtual IApp::IChatHandler *createChatHandler(karere::ChatRoom &chat);
     virtual IApp::IChatListHandler *chatListHandler();
     virtual void onPresenceChanged(karere::Id userid, karere::Presence pres, bool inProgress);
+    virtual void onPresencesChanged(const presenced::PresenceChanges& changes);
     virtual void onPresenceConfigChanged(const presenced::Config& state, bool pending);
     virtual void onPresenceLastGreenUpdated(karere::Id userid, uint16_t lastGreen);
 #ifndef KARERE_DISABLE_WEBRTC
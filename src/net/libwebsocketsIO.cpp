@@ -3,6 +3,7 @@
 
 #include <mega/http.h>
 #include <assert.h>
+#include <algorithm>
 
 using namespace std;
 
@@ -161,26 +162,23 @@ LibwebsocketsClient::~LibwebsocketsClient()
 
 void LibwebsocketsClient::appendMessageFragment(char *data, size_t len, size_t remaining)
 {
-    if (!recbuffer.size() && remaining)
+    size_t required = recbuffer.dataSize() + len + remaining;
+    if (required > recbuffer.bufSize())
     {
-        recbuffer.reserve(len + remaining);
+        // grow geometrically, since big messages may arrive in many fragments
+        recbuffer.reserve(std::max(len + remaining, recbuffer.dataSize()));
     }
     recbuffer.append(data, len);
 }
 
 bool LibwebsocketsClient::hasFragments()
 {
-    return recbuffer.size();
+    return recbuffer.dataSize();
 }
 
-const char *LibwebsocketsClient::getMessage()
+Buffer&& LibwebsocketsClient::takeMessage()
 {
-    return recbuffer.data();
-}
-
-size_t LibwebsocketsClient::getMessageLength()
-{
-    return recbuffer.size();
+    return std::move(recbuffer);
 }
 
 void LibwebsocketsClient::resetMessage()
@@ -430,11 +428,12 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
                 {
                     WEBSOCKETS_LOG_DEBUG("Fragmented data completed");
                     client->appendMessageFragment((char *)data, len, 0);
-                    data = (void *)client->getMessage();
-                    len = client->getMessageLength();
+                    client->wsHandleMsgBufferCb(client->takeMessage());
+                }
+                else
+                {
+                    client->wsHandleMsgCb((char *)data, len);
                 }
-                
-                client->wsHandleMsgCb((char *)data, len);
                 client->resetMessage();
             }
             else
@@ -35,13 +35,12 @@ public:
     virtual ~LibwebsocketsClient();
     
 protected:
-    std::string recbuffer;
+    Buffer recbuffer;
     std::string sendbuffer;
 
     void appendMessageFragment(char *data, size_t len, size_t remaining);
     bool hasFragments();
-    const char *getMessage();
-    size_t getMessageLength();
+    Buffer&& takeMessage();
     void resetMessage();
     const char *getOutputBuffer();
     size_t getOutputBufferLength();
@@ -53,6 +53,13 @@ void WebsocketsClientImpl::wsHandleMsgCb(char *data, size_t len)
     client->wsHandleMsgCb(data, len);
 }
 
+void WebsocketsClientImpl::wsHandleMsgBufferCb(Buffer&& msg)
+{
+    WebsocketsIO::MutexGuard lock(this->mutex);
+    WEBSOCKETS_LOG_DEBUG("Received %d bytes", msg.dataSize());
+    client->wsHandleMsgBufferCb(std::move(msg));
+}
+
 void WebsocketsClientImpl::wsSendMsgCb(const char *data, size_t len)
 {
     WebsocketsIO::MutexGuard lock(this->mutex);
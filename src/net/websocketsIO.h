@@ -129,6 +129,9 @@ public:
     virtual void wsConnectCb() = 0;
     virtual void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len) = 0;
     virtual void wsHandleMsgCb(char *data, size_t len) = 0;
+    // Called instead of wsHandleMsgCb() when the websockets layer had to assemble the message
+    // in a buffer of its own, whose ownership is handed over to avoid copying it again
+    virtual void wsHandleMsgBufferCb(Buffer&& msg) { wsHandleMsgCb(msg.buf(), msg.dataSize()); }
     virtual void wsSendMsgCb(const char *data, size_t len) = 0;
 };
 
@@ -146,6 +149,7 @@ public:
     void wsConnectCb();
     void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len);
     void wsHandleMsgCb(char *data, size_t len);
+    void wsHandleMsgBufferCb(Buffer&& msg);
     void wsSendMsgCb(const char *data, size_t len);
     
     virtual bool wsSendMessage(char *msg, size_t len) = 0;
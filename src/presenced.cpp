@@ -1,5 +1,7 @@
 #include "presenced.h"
 #include "chatClient.h"
+#include <algorithm>
+#include <iterator>
 
 using namespace std;
 using namespace promise;
@@ -101,18 +103,112 @@ void Client::pushPeers()
         return;
     }
 
-    size_t numPeers = mContacts.size();
-    size_t totalSize = sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint64_t) * numPeers;
+    std::vector<uint64_t> peers;
+    peers.reserve(mContacts.size());
+    for (auto it = mContacts.begin(); it != mContacts.end(); it++)
+    {
+        peers.emplace_back(it->first);
+    }
+    std::sort(peers.begin(), peers.end());
+
+    size_t fullSize = peersCommandSize(peers.size());
+    if (mSentPeersValid)
+    {
+        // presenced already has a list for this connection: send the differences, if smaller
+        std::vector<uint64_t> added;
+        std::vector<uint64_t> removed;
+        std::set_difference(peers.begin(), peers.end(), mSentPeers.begin(), mSentPeers.end(), std::back_inserter(added));
+        std::set_difference(mSentPeers.begin(), mSentPeers.end(), peers.begin(), peers.end(), std::back_inserter(removed));
+
+        // if the list didn't change, an empty SNADDPEERS still updates the scsn
+        bool sendAdded = !added.empty() || removed.empty();
+        size_t deltaSize = (sendAdded ? peersCommandSize(added.size()) : 0)
+                + (removed.empty() ? 0 : peersCommandSize(removed.size()));
+        if (deltaSize < fullSize)
+        {
+            // the updated scsn goes with the delta, even if it's only one of them
+            bool sent = true;
+            if (!removed.empty())
+            {
+                sent = sendPeers(OP_SNDELPEERS, removed);
+            }
+            if (sent && sendAdded)
+            {
+                sent = sendPeers(OP_SNADDPEERS, added);
+            }
+            if (!sent)
+            {
+                return;     // the next connection will start with the full list
+            }
 
-    Command cmd(OP_SNSETPEERS, totalSize);
+            PRESENCED_LOG_DEBUG("pushPeers: %zu peers added and %zu removed, %zu bytes saved",
+                                added.size(), removed.size(), fullSize - deltaSize);
+            mPeerSyncStats.bytesSaved += fullSize - deltaSize;
+            if (added.empty() && removed.empty())
+            {
+                mPeerSyncStats.unchanged++;
+            }
+            else
+            {
+                mPeerSyncStats.deltas++;
+            }
+            return;
+        }
+    }
+
+    mPeerSyncStats.fullSets++;
+    sendPeers(OP_SNSETPEERS, peers);
+}
+
+size_t Client::peersCommandSize(size_t numPeers)
+{
+    return 1 + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint64_t) * numPeers;
+}
+
+bool Client::sendPeers(uint8_t opcode, const std::vector<uint64_t>& peers)
+{
+    assert(mLastScsn.isValid());
+    size_t totalSize = peersCommandSize(peers.size());
+    Command cmd(opcode, totalSize - 1);
     cmd.append<uint64_t>(mLastScsn.val);
-    cmd.append<uint32_t>(numPeers);
-    for (auto it = mContacts.begin(); it != mContacts.end(); it++)
+    cmd.append<uint32_t>(static_cast<uint32_t>(peers.size()));
+    for (uint64_t peer: peers)
     {
-        cmd.append<uint64_t>(it->first);
+        cmd.append<uint64_t>(peer);
     }
 
-    sendCommand(std::move(cmd));
+    if (!sendCommand(std::move(cmd)))
+    {
+        // the next connection will start with the full list
+        mSentPeersValid = false;
+        mSentPeers.clear();
+        return false;
+    }
+    mPeerSyncStats.bytesSent += totalSize;
+
+    // keep track of the list that presenced has now
+    if (opcode == OP_SNSETPEERS)
+    {
+        mSentPeers = peers;     // already sorted
+        mSentPeersValid = true;
+    }
+    else if (mSentPeersValid)
+    {
+        for (uint64_t peer: peers)
+        {
+            auto it = std::lower_bound(mSentPeers.begin(), mSentPeers.end(), peer);
+            bool found = (it != mSentPeers.end() && *it == peer);
+            if (opcode == OP_SNADDPEERS && !found)
+            {
+                mSentPeers.insert(it, peer);
+            }
+            else if (opcode == OP_SNDELPEERS && found)
+            {
+                mSentPeers.erase(it);
+            }
+        }
+    }
+    return true;
 }
 
 void Client::wsConnectCb()
@@ -217,30 +313,32 @@ bool Client::setLastGreenVisible(bool enable)
 bool Client::requestLastGreen(Id userid)
 {
     // Avoid send OP_LASTGREEN if user is ex-contact or has never been a contact
-    if (isExContact(userid) || !isContact(userid))
+    if (!userid.isValid() || isExContact(userid) || !isContact(userid))
     {
         return false;
     }
 
     // Reset user last green or insert an entry in the map if not exists
-    mPeersLastGreen[userid.val] = 0;
+    mPeers[userid.val].lastGreen = 0;
 
     return sendCommand(Command(OP_LASTGREEN) + userid);
 }
 
 time_t Client::getLastGreen(Id userid)
 {
-    std::map<uint64_t, time_t>::iterator it = mPeersLastGreen.find(userid.val);
-    if (it != mPeersLastGreen.end())
-    {
-        return it->second;
-    }
-    return 0;
+    const PeerState* peer = mPeers.find(userid.val);
+    return peer ? peer->lastGreen : 0;
 }
 
 bool Client::updateLastGreen(Id userid, time_t lastGreen)
 {
-    time_t &auxLastGreen = mPeersLastGreen[userid.val];
+    if (!userid.isValid())
+    {
+        PRESENCED_LOG_ERROR("updateLastGreen: invalid userid, ignoring it");
+        return false;
+    }
+
+    time_t &auxLastGreen = mPeers[userid.val].lastGreen;
     if (lastGreen >= auxLastGreen)
     {
         auxLastGreen = lastGreen;
@@ -536,18 +634,13 @@ bool Client::sendKeepalive(time_t now)
 
 bool Client::isExContact(uint64_t userid)
 {
-    auto it = mContacts.find(userid);
-    if (it == mContacts.end() || (it != mContacts.end() && it->second != ::mega::MegaUser::VISIBILITY_HIDDEN))
-    {
-        return false;
-    }
-
-    return true;
+    const int* visibility = mContacts.find(userid);
+    return visibility && *visibility == ::mega::MegaUser::VISIBILITY_HIDDEN;
 }
 
 bool Client::isContact(uint64_t userid)
 {
-    return (mContacts.find(userid) != mContacts.end());
+    return mContacts.contains(userid);
 }
 
 void Client::onUsersUpdate(::mega::MegaApi *api, ::mega::MegaUserList *usersUpdated)
@@ -591,9 +684,14 @@ void Client::onUsersUpdate(::mega::MegaApi *api, ::mega::MegaUserList *usersUpda
             {
                 continue;
             }
+            if (userid == Id::inval())
+            {
+                PRESENCED_LOG_ERROR("Contact update with an invalid userid, ignoring it");
+                continue;
+            }
 
-            auto it = mContacts.find(userid);
-            if (it == mContacts.end())
+            int* visibility = mContacts.find(userid);
+            if (!visibility)
             {
                 // new contact
                 mContacts[userid] = newVisibility;
@@ -605,13 +703,13 @@ void Client::onUsersUpdate(::mega::MegaApi *api, ::mega::MegaUserList *usersUpda
             else    // existing (ex)contact
             {
                 // Update visibility
-                int oldVisibility = it->second;
-                it->second = newVisibility;
+                int oldVisibility = *visibility;
+                *visibility = newVisibility;
 
                 if (newVisibility == ::mega::MegaUser::VISIBILITY_INACTIVE)
                 {
                     // user cancelled the account
-                    mContacts.erase(it);
+                    mContacts.erase(userid);
                     if (oldVisibility == ::mega::MegaUser::VISIBILITY_VISIBLE)
                     {
                         // Send delPeer only if an active contact cancelled the account
@@ -665,6 +763,7 @@ void Client::onEvent(::mega::MegaApi *api, ::mega::MegaEvent *event)
 
             mLastScsn = scsn;
             mContacts.clear();
+            mContacts.reserve(contacts->size());
 
             // initialize the list of contacts
             for (int i = 0; i < contacts->size(); i++)
@@ -675,6 +774,11 @@ void Client::onEvent(::mega::MegaApi *api, ::mega::MegaEvent *event)
                 {
                     continue;
                 }
+                if (userid == Id::inval())
+                {
+                    PRESENCED_LOG_ERROR("Contact with an invalid userid, ignoring it");
+                    continue;
+                }
 
                 int visibility = user->getVisibility();
                 mContacts[userid] = visibility; // add ex-contacts to identify them
@@ -865,13 +969,13 @@ void Client::retryPendingConnection(bool disconnect, bool refreshURL)
     }
 }
 
-bool Client::sendBuf(Buffer&& buf)
+bool Client::sendBuf(const StaticBuffer& buf)
 {
     if (!isOnline())
         return false;
     
+    // the websockets layer copies the data to its output buffer
     bool rc = wsSendMessage(buf.buf(), buf.dataSize());
-    buf.free();  //just in case, as it's content is xor-ed with the websock datamask so it's unusable
     mTsLastSend = time(NULL);
     return rc && isOnline();
 }
@@ -880,7 +984,7 @@ bool Client::sendCommand(Command&& cmd)
 {
     if (krLoggerWouldLog(krLogChannel_presenced, krLogLevelDebug))
         logSend(cmd);
-    bool result = sendBuf(std::move(cmd));
+    bool result = sendBuf(cmd);
     if (!result)
         PRESENCED_LOG_DEBUG("  Can't send, we are offline");
     return result;
@@ -888,10 +992,9 @@ bool Client::sendCommand(Command&& cmd)
 
 bool Client::sendCommand(const Command& cmd)
 {
-    Buffer buf(cmd.buf(), cmd.dataSize());
     if (krLoggerWouldLog(krLogChannel_presenced, krLogLevelDebug))
         logSend(cmd);
-    auto result = sendBuf(std::move(buf));
+    auto result = sendBuf(cmd);
     if (!result)
         PRESENCED_LOG_DEBUG("  Can't send, we are offline");
     return result;
@@ -1109,6 +1212,11 @@ Client::~Client()
     mApi->sdk.removeGlobalListener(this);
 
     disconnect();
+    if (mCoalescingTimer)
+    {
+        cancelTimeout(mCoalescingTimer, mKarereClient->appCtx);
+        mCoalescingTimer = 0;
+    }
     CALL_LISTENER(onDestroy); //we don't delete because it may have its own idea of its lifetime (i.e. it could be a GUI class)
 }
 
@@ -1160,6 +1268,11 @@ void Client::handleMessage(const StaticBuffer& buf)
                 READ_ID(userid, 1);
                 PRESENCED_LOG_DEBUG("recv PEERSTATUS - user '%s' with presence %s",
                     ID_CSTR(userid), Presence::toString(pres));
+                if (!userid.isValid())
+                {
+                    PRESENCED_LOG_ERROR("recv PEERSTATUS for an invalid userid, ignoring it");
+                    break;
+                }
                 updatePeerPresence(userid, pres);
                 break;
             }
@@ -1216,10 +1329,15 @@ void Client::handleMessage(const StaticBuffer& buf)
                 READ_ID(userid, 0);
                 READ_16(lastGreen, 8);
                 PRESENCED_LOG_DEBUG("recv LASTGREEN - user '%s' last green %d", ID_CSTR(userid), lastGreen);
+                if (!userid.isValid())
+                {
+                    PRESENCED_LOG_ERROR("recv LASTGREEN for an invalid userid, ignoring it");
+                    break;
+                }
 
                 // convert the received minutes into a UNIX timestamp
                 time_t lastGreenTs = time(NULL) - (lastGreen * 60);
-                mPeersLastGreen[userid] = lastGreenTs;
+                mPeers[userid].lastGreen = lastGreenTs;
 
                 CALL_LISTENER(onPresenceLastGreenUpdated, userid);
                 break;
@@ -1263,6 +1381,10 @@ void Client::setConnState(ConnState newState)
     {
         mHeartbeatEnabled = false;
 
+        // a new connection starts without any list of peers
+        mSentPeersValid = false;
+        mSentPeers.clear();
+
         // if a socket is opened, close it immediately
         if (wsIsConnected())
         {
@@ -1329,18 +1451,14 @@ void Client::addPeers(const std::vector<karere::Id> &peers)
         return;
     }
 
-    assert(mLastScsn.isValid());
-    size_t totalSize = sizeof(uint64_t) + sizeof(uint32_t) + (peers.size() * sizeof(uint64_t));
-    Command cmd(OP_SNADDPEERS, static_cast<uint8_t>(totalSize));
-    cmd.append<uint64_t>(mLastScsn.val);
-    cmd.append<uint32_t>(static_cast<uint32_t>(peers.size()));
+    std::vector<uint64_t> peerList;
+    peerList.reserve(peers.size());
     for (size_t i = 0; i < peers.size(); i++)
     {
-        auto it = mContacts.find(peers.at(i));
-        assert (it != mContacts.end() && it->second == ::mega::MegaUser::VISIBILITY_VISIBLE);
-        cmd.append<uint64_t>(peers.at(i).val);
+        assert(mContacts.find(peers.at(i)) && *mContacts.find(peers.at(i)) == ::mega::MegaUser::VISIBILITY_VISIBLE);
+        peerList.emplace_back(peers.at(i).val);
     }
-    sendCommand(std::move(cmd));
+    sendPeers(OP_SNADDPEERS, peerList);
 }
 
 void Client::removePeers(const std::vector<karere::Id> &peers)
@@ -1354,45 +1472,123 @@ void Client::removePeers(const std::vector<karere::Id> &peers)
         return;
     }
 
-    assert(mLastScsn.isValid());
-    size_t totalSize = sizeof(uint64_t) + sizeof(uint32_t) + (peers.size() * sizeof(uint64_t));
-    Command cmd(OP_SNDELPEERS, static_cast<uint8_t>(totalSize));
-    cmd.append<uint64_t>(mLastScsn.val);
-    cmd.append<uint32_t>(static_cast<uint32_t>(peers.size()));
+    std::vector<uint64_t> peerList;
+    peerList.reserve(peers.size());
     for (size_t i = 0; i < peers.size(); i++)
     {
-        auto it = mContacts.find(peers.at(i));
-        assert (it == mContacts.end() || it->second == ::mega::MegaUser::VISIBILITY_HIDDEN);
-        mPeersLastGreen.erase(peers.at(i).val); // Remove peer from mPeersLastGreen map if exists
-        cmd.append<uint64_t>(peers.at(i).val);
+        assert(!mContacts.find(peers.at(i)) || *mContacts.find(peers.at(i)) == ::mega::MegaUser::VISIBILITY_HIDDEN);
+        PeerState* peer = mPeers.find(peers.at(i).val);
+        if (peer)
+        {
+            peer->lastGreen = 0;    // forget last green of the peer, if known
+        }
+        peerList.emplace_back(peers.at(i).val);
         updatePeerPresence(peers.at(i), Presence::kUnknown);
     }
-    sendCommand(std::move(cmd));
+    sendPeers(OP_SNDELPEERS, peerList);
 }
 
 void Client::updatePeerPresence(karere::Id peer, karere::Presence pres)
 {
-    mPeersPresence[peer] = pres;
+    if (!peer.isValid())
+    {
+        PRESENCED_LOG_ERROR("updatePeerPresence: invalid userid, ignoring it");
+        return;
+    }
+
+    mPeers[peer].presence = pres;
 
     // Do not notify if the peer is ex-contact or has never been contact
     // (except updating to unknown when a contact becomes ex-contact)
-    bool exContact = isExContact(peer);
-    bool contact = isContact(peer);
+    const int* visibility = mContacts.find(peer);
+    bool contact = (visibility != nullptr);
+    bool exContact = contact && *visibility == ::mega::MegaUser::VISIBILITY_HIDDEN;
     if (peer == mKarereClient->myHandle()
             || (contact && !exContact)
             || (exContact && pres.status() == Presence::kUnknown))
     {
-        CALL_LISTENER(onPresenceChange, peer, pres);
+        if (mCoalescingWindow == kCoalescingDisabled || peer == mKarereClient->myHandle())
+        {
+            CALL_LISTENER(onPresenceChange, peer, pres);
+            return;
+        }
+
+        mPendingPresences[peer] = pres;
+        auto wptr = weakHandle();
+        if (mCoalescingWindow == kCoalescingEndOfFrame)
+        {
+            if (!mCoalescingFlushPending)
+            {
+                mCoalescingFlushPending = true;
+                marshallCall([this, wptr]()
+                {
+                    if (wptr.deleted())
+                        return;
+
+                    mCoalescingFlushPending = false;
+                    flushPresenceChanges();
+                }, mKarereClient->appCtx);
+            }
+        }
+        else if (!mCoalescingTimer)
+        {
+            mCoalescingTimer = setTimeout([this, wptr]()
+            {
+                if (wptr.deleted())
+                    return;
+
+                mCoalescingTimer = 0;
+                flushPresenceChanges();
+            }, mCoalescingWindow, mKarereClient->appCtx);
+        }
+    }
+}
+
+void Client::flushPresenceChanges()
+{
+    if (mCoalescingTimer)
+    {
+        cancelTimeout(mCoalescingTimer, mKarereClient->appCtx);
+        mCoalescingTimer = 0;
+    }
+
+    if (mPendingPresences.empty())
+    {
+        return;
+    }
+
+    PresenceChanges changes;
+    changes.reserve(mPendingPresences.size());
+    for (auto it = mPendingPresences.begin(); it != mPendingPresences.end(); it++)
+    {
+        changes.emplace_back(it->first, it->second);
     }
+    mPendingPresences.clear();
+
+    PRESENCED_LOG_DEBUG("Notifying %zu coalesced presence changes", changes.size());
+    CALL_LISTENER(onPresencesChange, changes);
 }
 
-karere::Presence Client::peerPresence(karere::Id peer) const
+void Client::setPresenceCoalescing(int window)
 {
-    auto it = mPeersPresence.find(peer);
-    if (it == mPeersPresence.end())
+    if (window < kCoalescingDisabled)
     {
-        return karere::Presence::kUnknown;
+        window = kCoalescingDisabled;
     }
-    return it->second;
+
+    if (window == mCoalescingWindow)
+    {
+        return;
+    }
+
+    PRESENCED_LOG_DEBUG("setPresenceCoalescing(): %d -> %d", mCoalescingWindow, window);
+    flushPresenceChanges();
+    mCoalescingWindow = window;
+}
+
+karere::Presence Client::peerPresence(karere::Id peer) const
+{
+    const PeerState* state = mPeers.find(peer);
+    return state ? state->presence : karere::Presence(karere::Presence::kUnknown);
 }
 }
@@ -3,10 +3,13 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
+#include <utility>
 #include <buffer.h>
 #include <base/promise.h>
 #include <base/timers.hpp>
 #include <karereId.h>
+#include <idMap.h>
 #include <url.h>
 #include <base/trackDelete.h>
 #include <net/websocketsIO.h>
@@ -77,6 +80,9 @@ inline const char* Presence::toString(Code pres)
 
 namespace presenced
 {
+/** List of users and their new presence, notified together */
+typedef std::vector<std::pair<karere::Id, karere::Presence>> PresenceChanges;
+
 enum {
     kKeepaliveSendInterval = 25,
     kKeepaliveReplyTimeout = 15,
@@ -287,7 +293,7 @@ private:
 public:
     Command(): Buffer(){}
     Command(Command&& other): Buffer(std::forward<Buffer>(other)) {assert(!other.buf() && !other.bufSize() && !other.dataSize());}
-    Command(uint8_t opcode, uint8_t reserve=10): Buffer(reserve+1) { write(0, opcode); }
+    Command(uint8_t opcode, size_t reserve=10): Buffer(reserve+1) { write(0, opcode); }
     template<class T>
     Command&& operator+(const T& val)
     {
@@ -324,6 +330,24 @@ public:
     };
     enum: uint16_t { kProtoVersion = 0x0001 };
 
+    /** Values of the window to coalesce notifications of presence changes
+     * (see \c setPresenceCoalescing). Positive values are milliseconds */
+    enum: int
+    {
+        kCoalescingDisabled = -1,   // every change is notified immediately (default)
+        kCoalescingEndOfFrame = 0   // notified once the data received (or the current task) is processed
+    };
+
+    /** Counters of the synchronization of the list of peers with presenced */
+    struct PeerSyncStats
+    {
+        uint64_t fullSets = 0;      // SNSETPEERS sent
+        uint64_t deltas = 0;        // SNADDPEERS/SNDELPEERS sent instead of a SNSETPEERS
+        uint64_t unchanged = 0;     // empty SNADDPEERS sent instead, only to update the scsn
+        uint64_t bytesSent = 0;     // bytes of all the commands above
+        uint64_t bytesSaved = 0;    // bytes of the SNSETPEERS avoided, minus the bytes of the deltas
+    };
+
     /* We need to save presenced url in cache in order to improve app performance,
      * so we need to assign a value to shard field to identify it uniquely, since
      * the DNS cache also stores the URLs for chatd shards 0, 1 and 2.
@@ -381,20 +405,47 @@ protected:
     /** True if a new configuration (PREFS) has been sent, but not yet acknowledged */
     bool mPrefsAckWait = false;
 
-    /** Map of userids (key) and presence (value) of any user wich we're allowed to receive it's presence */
-    std::map<uint64_t, karere::Presence> mPeersPresence;
+    /** State of a peer known by presenced */
+    struct PeerState
+    {
+        /** Presence of any user wich we're allowed to receive it's presence */
+        karere::Presence presence;
+        /** Last green of any contact or any user in our groupchats, except ex-contacts (0 if unknown) */
+        time_t lastGreen = 0;
+    };
 
-    /** Map of userids (key) and last green (value) of any contact or any user in our groupchats, except ex-contacts */
-    std::map<uint64_t, time_t> mPeersLastGreen;
+    /** Map of userids (key) and their presence and last green (value) */
+    karere::IdMap<PeerState> mPeers;
 
     /** Map of userid of contacts (key) and their visibility (value) (updated only from API)
      * @note: ex-contacts are included.
      */
-    std::map<uint64_t, int> mContacts;
+    karere::IdMap<int> mContacts;
 
     /** Sequence-number for the list of peers and contacts above (initialized upon completion of catch-up phase) */
     karere::Id mLastScsn = karere::Id::inval();
 
+    /** Sorted list of peers that presenced has for the current connection, as result of
+     * the SNSETPEERS, SNADDPEERS and SNDELPEERS sent. Only valid if \c mSentPeersValid */
+    std::vector<uint64_t> mSentPeers;
+
+    /** False until a SNSETPEERS is sent in the current connection */
+    bool mSentPeersValid = false;
+
+    PeerSyncStats mPeerSyncStats;
+
+    /** Window to coalesce notifications of presence changes of peers (see \c setPresenceCoalescing) */
+    int mCoalescingWindow = kCoalescingDisabled;
+
+    /** Last presence of the peers whose changes are pending to be notified */
+    karere::IdMap<karere::Presence> mPendingPresences;
+
+    /** Handler of the timer to notify pending changes, if a window in milliseconds is set */
+    megaHandle mCoalescingTimer = 0;
+
+    /** True if the notification of pending changes is already scheduled at the end of the current task */
+    bool mCoalescingFlushPending = false;
+
     void setConnState(ConnState newState);
 
     virtual void wsConnectCb();
@@ -408,7 +459,7 @@ protected:
     void handleMessage(const StaticBuffer& buf); // Destroys the buffer content
     bool sendCommand(Command&& cmd);
     bool sendCommand(const Command& cmd);    
-    bool sendBuf(Buffer&& buf);
+    bool sendBuf(const StaticBuffer& buf);
     void logSend(const Command& cmd);
 
     void login();
@@ -423,6 +474,8 @@ protected:
     void addPeers(const std::vector<karere::Id> &peers);
     void removePeers(const std::vector<karere::Id> &peers);
     void pushPeers();
+    bool sendPeers(uint8_t opcode, const std::vector<uint64_t>& peers);
+    static size_t peersCommandSize(size_t numPeers);
     bool isExContact(uint64_t userid);
     bool isContact(uint64_t userid);
 
@@ -480,6 +533,22 @@ public:
     void updatePeerPresence(karere::Id peer, karere::Presence pres);
     karere::Presence peerPresence(karere::Id peer) const;
 
+    /**
+     * @brief Enables or disables the coalescing of notifications of presence changes of peers
+     *
+     * When enabled, the changes are collected and notified together by Listener::onPresencesChange,
+     * only the last presence of each peer, once the window elapses. Changes of the own presence are
+     * always notified immediately. Pending changes are notified when the window is changed.
+     *
+     * @param window kCoalescingDisabled, kCoalescingEndOfFrame or a window in milliseconds
+     */
+    void setPresenceCoalescing(int window);
+    int presenceCoalescing() const { return mCoalescingWindow; }
+
+    /** Notifies the pending changes of presence, if any, when coalescing is enabled */
+    void flushPresenceChanges();
+    const PeerSyncStats& peerSyncStats() const { return mPeerSyncStats; }
+
     /** @brief Updates user last green if it's more recent than the current value.*/
     bool updateLastGreen(karere::Id userid, time_t lastGreen);
     time_t getLastGreen(karere::Id userid);
@@ -492,6 +561,14 @@ class Listener
 public:
     virtual void onConnStateChange(Client::ConnState state) = 0;
     virtual void onPresenceChange(karere::Id userid, karere::Presence pres, bool inProgress = false) = 0;
+    /** Presence changes of peers coalesced by the client (see Client::setPresenceCoalescing) */
+    virtual void onPresencesChange(const PresenceChanges& changes)
+    {
+        for (auto& change: changes)
+        {
+            onPresenceChange(change.first, change.second);
+        }
+    }
     virtual void onPresenceConfigChanged(const Config& Config, bool pending) = 0;
     virtual void onPresenceLastGreenUpdated(karere::Id userid) = 0;
     virtual void onDestroy(){}
@@ -77,6 +77,8 @@ struct Sample
     } cstats;   // connection-stats
 };
 
+class SampleStore;
+
 class IConnInfo
 {
 public:
@@ -93,9 +95,10 @@ public:
     virtual bool isCaller() const = 0;
     virtual karere::Id callId() const = 0;
     virtual size_t sampleCnt() const = 0;
-    virtual const std::vector<Sample*>* samples() const = 0;
+    virtual const SampleStore* samples() const = 0;
     virtual const IConnInfo* connInfo() const = 0;
     virtual void toJson(std::string&) const = 0;
+    virtual void toBinary(std::string&) const = 0;
     virtual ~IRtcStats(){}
 };
 
@@ -43,11 +43,8 @@ Recorder::Recorder(Session& sess, int scanPeriod, int maxSamplePeriod)
 
 void Recorder::addSample()
 {
-    Sample* sample = mCurrSample.release();
-    assert(sample);
-    mStats->mSamples.push_back(sample);
-    mCurrSample.reset(new Sample(*sample));
-    resetBwCalculators();
+    // the current sample keeps accumulating from the values of the added one
+    mStats->mSamples.push_back(*mCurrSample);
 }
 void Recorder::resetBwCalculators()
 {
@@ -118,7 +115,7 @@ bool Recorder::checkShouldAddSample()
         return true;
     }
 
-    Sample *last = mStats->mSamples.back();
+    const Sample *last = &mStats->mSamples.back();
 
     mCurrSample->astats.plDifference = mCurrSample->astats.r.pl - last->astats.r.pl;
     if (mCurrSample->astats.plDifference)
@@ -295,7 +292,7 @@ void Recorder::onStats(const webrtc::StatsReports &data)
 
     if (onSample)
     {
-        if ((mStats->mSamples.size() == 1) && shouldAddSample) //first sample that we just added
+        if ((mStats->mSamples.totalCount() == 1) && shouldAddSample) //first sample that we just added
             onSample(&(mStats->mConnInfo), 0);
         onSample(mCurrSample.get(), 1);
     }
@@ -337,128 +334,215 @@ Recorder::~Recorder()
 {
 }
 
-RtcStats::~RtcStats()
+const char* SampleStore::columnName(unsigned column)
+{
+    static const char* names[kColumnCount] =
+    {
+#define RTCSTATS_COLUMN_NAME(column, member) #column,
+        RTCSTATS_SAMPLE_COLUMNS(RTCSTATS_COLUMN_NAME)
+#undef RTCSTATS_COLUMN_NAME
+    };
+    return (column < kColumnCount) ? names[column] : nullptr;
+}
+
+void SampleStore::push_back(const Sample& sample)
+{
+    if (mBlocks.empty() || mBlocks.back().count == kBlockSize)
+    {
+        if (mSize + kBlockSize > kMaxSamples)
+        {
+            mSize -= mBlocks.front().count;
+            mBlocks.pop_front();
+        }
+        mBlocks.emplace_back();
+        memset(mLastValues, 0, sizeof(mLastValues));
+    }
+
+    Block& block = mBlocks.back();
+#define RTCSTATS_COLUMN_ENCODE(column, member)                                      \
+    {                                                                               \
+        int64_t value = toColumnValue(sample.member);                               \
+        appendVarint(block.columns[kCol_##column], zigzagEncode(value - mLastValues[kCol_##column])); \
+        mLastValues[kCol_##column] = value;                                         \
+    }
+    RTCSTATS_SAMPLE_COLUMNS(RTCSTATS_COLUMN_ENCODE)
+#undef RTCSTATS_COLUMN_ENCODE
+    block.count++;
+    mSize++;
+    mTotalCount++;
+    mLast = sample;
+}
+
+size_t SampleStore::encodedSize() const
 {
-    for (unsigned int i = 0; i < mSamples.size(); i++)
+    size_t size = 0;
+    for (const Block& block: mBlocks)
     {
-        delete mSamples[i];
+        for (const std::string& column: block.columns)
+        {
+            size += column.size();
+        }
     }
+    return size;
+}
 
-    mSamples.clear();
+static void jsonAddSamples(JsonWriter& json, const char* name, const SampleStore& samples, unsigned column)
+{
+    json.beginArray(name);
+    samples.forEachValue(column, [&json](int64_t value) { json.addInt(value); });
+    json.endArray();
 }
 
-const char* decToString(float v)
+static void jsonAddBwInfo(JsonWriter& json, const SampleStore& samples, unsigned btColumn, unsigned bpsColumn, unsigned abpsColumn)
 {
-    static char buf[128];
-    int integerPart = static_cast<int>(v);
-    int decimalPart = static_cast<int>(fabs((v - integerPart)) * 10.0);
-    snprintf(buf, 127, "%d.%d", integerPart, decimalPart);
-    return buf;
+    jsonAddSamples(json, "bt", samples, btColumn);
+    jsonAddSamples(json, "bps", samples, bpsColumn);
+    jsonAddSamples(json, "abps", samples, abpsColumn);
 }
 
-#define JSON_ADD_STR(name, val) json.append("\"" #name "\":\"").append(val)+="\",";
-#define JSON_ADD_INT(name, val) json.append("\"" #name "\":").append(std::to_string((long)val))+=',';
-#define JSON_ADD_DECNUM(name, val) json.append("\"" #name "\":").append(decToStr(val))+=',';
-
-#define JSON_SUBOBJ(name) json+="\"" name "\":{";
-#define JSON_END_SUBOBJ() json[json.size()-1]='}'; json+=','
-
-#define JSON_ADD_SAMPLES_WITH_CONV(path, name, conv)   \
-    json.append("\"" #name "\":[");    \
-    if (mSamples.empty())              \
-        json+=']';                     \
-    else                               \
-    {                                  \
-        for (auto sample: mSamples)    \
-            json.append(conv(sample->path name))+=","; \
-        json[json.size()-1]=']';       \
-    }\
-    json+=',';
-
-#define JSON_ADD_SAMPLES(path, name) JSON_ADD_SAMPLES_WITH_CONV(path, name, std::to_string)
-#define JSON_ADD_DEC_SAMPLES(path, name) JSON_ADD_SAMPLES_WITH_CONV(path, name, decToString)
-
-#define JSON_ADD_BWINFO(path)           \
-    JSON_ADD_SAMPLES(path., bt);        \
-    JSON_ADD_SAMPLES(path., bps);       \
-    JSON_ADD_SAMPLES(path., abps)
-
-void RtcStats::toJson(std::string& json) const
+void RtcStats::toJson(std::string& out) const
 {
-    json.reserve(10240);
-    json ="{";
-    JSON_ADD_STR(cid, mCallId.toString());
-    JSON_ADD_STR(sid, mSessionId.toString());
-    JSON_ADD_INT(ts, round((float)mStartTs/1000));
-    JSON_ADD_INT(dur, round((float)mDur/1000));
-    JSON_SUBOBJ("samples");
-        JSON_ADD_SAMPLES(, ts);
-        JSON_ADD_SAMPLES(, lq);
-        JSON_ADD_SAMPLES(, f);
-        JSON_SUBOBJ("v");
-            JSON_ADD_SAMPLES(vstats., rtt);
-            JSON_SUBOBJ("s");
-                JSON_ADD_BWINFO(vstats.s);
-                JSON_ADD_SAMPLES(vstats.s., fps);
-                JSON_ADD_SAMPLES(vstats.s., cfps);
-                JSON_ADD_SAMPLES(vstats.s., width);
-                JSON_ADD_SAMPLES(vstats.s., height);
-                JSON_ADD_DEC_SAMPLES(vstats.s., el);
-                JSON_ADD_SAMPLES(vstats.s., bwav);
-                JSON_ADD_SAMPLES(vstats.s., gbps);
-            JSON_END_SUBOBJ();
-            JSON_SUBOBJ("r");
-                JSON_ADD_BWINFO(vstats.r);
-                JSON_ADD_SAMPLES(vstats.r., pl);
-                JSON_ADD_SAMPLES(vstats.r., jtr);
-                JSON_ADD_SAMPLES(vstats.r., fps);
-                JSON_ADD_SAMPLES(vstats.r., dly);
-                JSON_ADD_SAMPLES(vstats.r., width);
-                JSON_ADD_SAMPLES(vstats.r., height);
-                JSON_ADD_SAMPLES(vstats.r., firtx);
-                JSON_ADD_SAMPLES(vstats.r., plitx);
-                JSON_ADD_SAMPLES(vstats.r., nacktx);
-            JSON_END_SUBOBJ(); //r
-        JSON_END_SUBOBJ(); //v
-        JSON_SUBOBJ("a");
-            JSON_ADD_SAMPLES(astats., rtt);
-            JSON_SUBOBJ("s");
-                JSON_ADD_BWINFO(astats.s);
-            JSON_END_SUBOBJ();
-            JSON_SUBOBJ("r");
-                JSON_ADD_BWINFO(astats.r);
-                JSON_ADD_SAMPLES(astats.r., jtr);
-                JSON_ADD_SAMPLES(astats.r., pl);
-                JSON_ADD_SAMPLES(astats.r., dly);
-                JSON_ADD_SAMPLES(astats.r., al);
-            JSON_END_SUBOBJ();
-        JSON_END_SUBOBJ(); //a
-    JSON_END_SUBOBJ(); //samples
-    JSON_ADD_STR(bws, mDeviceInfo);
-    JSON_ADD_INT(rly, mConnInfo.mRly);
-    JSON_ADD_INT(rrly, mConnInfo.mRRly);
-    JSON_ADD_STR(proto, mConnInfo.mProto);
-    JSON_ADD_INT(isJoiner, mIsJoiner);
-    JSON_ADD_STR(caid, mIsJoiner ? mOwnAnonId.toString() : mPeerAnonId.toString());
-    JSON_ADD_STR(aaid, mIsJoiner ? mPeerAnonId.toString() : mOwnAnonId.toString());
-    JSON_ADD_STR(termRsn, mTermRsn);
-    JSON_ADD_INT(grp, mIsGroupCall ? 1 : 0);
+    // ~40 arrays of values of a few digits, plus the fields of the session
+    JsonWriter json(out, 1024 + mSamples.size() * 40 * 6);
+    json.beginObject();
+    json.addStr("cid", mCallId.toString());
+    json.addStr("sid", mSessionId.toString());
+    json.addInt("ts", round((float)mStartTs/1000));
+    json.addInt("dur", round((float)mDur/1000));
+    json.beginObject("samples");
+        jsonAddSamples(json, "ts", mSamples, SampleStore::kCol_ts);
+        jsonAddSamples(json, "lq", mSamples, SampleStore::kCol_lq);
+        jsonAddSamples(json, "f", mSamples, SampleStore::kCol_f);
+        json.beginObject("v");
+            jsonAddSamples(json, "rtt", mSamples, SampleStore::kCol_v_rtt);
+            json.beginObject("s");
+                jsonAddBwInfo(json, mSamples, SampleStore::kCol_v_s_bt, SampleStore::kCol_v_s_bps, SampleStore::kCol_v_s_abps);
+                jsonAddSamples(json, "fps", mSamples, SampleStore::kCol_v_s_fps);
+                jsonAddSamples(json, "cfps", mSamples, SampleStore::kCol_v_s_cfps);
+                jsonAddSamples(json, "width", mSamples, SampleStore::kCol_v_s_width);
+                jsonAddSamples(json, "height", mSamples, SampleStore::kCol_v_s_height);
+                json.beginArray("el");
+                mSamples.forEachValue(SampleStore::kCol_v_s_el, [&json](int64_t value)
+                {
+                    float el;
+                    SampleStore::fromColumnValue(value, el);
+                    json.addDecimal(static_cast<int64_t>(el * 10));
+                });
+                json.endArray();
+                jsonAddSamples(json, "bwav", mSamples, SampleStore::kCol_v_s_bwav);
+                jsonAddSamples(json, "gbps", mSamples, SampleStore::kCol_v_s_gbps);
+            json.endObject();
+            json.beginObject("r");
+                jsonAddBwInfo(json, mSamples, SampleStore::kCol_v_r_bt, SampleStore::kCol_v_r_bps, SampleStore::kCol_v_r_abps);
+                jsonAddSamples(json, "pl", mSamples, SampleStore::kCol_v_r_pl);
+                jsonAddSamples(json, "jtr", mSamples, SampleStore::kCol_v_r_jtr);
+                jsonAddSamples(json, "fps", mSamples, SampleStore::kCol_v_r_fps);
+                jsonAddSamples(json, "dly", mSamples, SampleStore::kCol_v_r_dly);
+                jsonAddSamples(json, "width", mSamples, SampleStore::kCol_v_r_width);
+                jsonAddSamples(json, "height", mSamples, SampleStore::kCol_v_r_height);
+                jsonAddSamples(json, "firtx", mSamples, SampleStore::kCol_v_r_firtx);
+                jsonAddSamples(json, "plitx", mSamples, SampleStore::kCol_v_r_plitx);
+                jsonAddSamples(json, "nacktx", mSamples, SampleStore::kCol_v_r_nacktx);
+            json.endObject(); //r
+        json.endObject(); //v
+        json.beginObject("a");
+            jsonAddSamples(json, "rtt", mSamples, SampleStore::kCol_a_rtt);
+            json.beginObject("s");
+                jsonAddBwInfo(json, mSamples, SampleStore::kCol_a_s_bt, SampleStore::kCol_a_s_bps, SampleStore::kCol_a_s_abps);
+            json.endObject();
+            json.beginObject("r");
+                jsonAddBwInfo(json, mSamples, SampleStore::kCol_a_r_bt, SampleStore::kCol_a_r_bps, SampleStore::kCol_a_r_abps);
+                jsonAddSamples(json, "jtr", mSamples, SampleStore::kCol_a_r_jtr);
+                jsonAddSamples(json, "pl", mSamples, SampleStore::kCol_a_r_pl);
+                jsonAddSamples(json, "dly", mSamples, SampleStore::kCol_a_r_dly);
+                jsonAddSamples(json, "al", mSamples, SampleStore::kCol_a_r_al);
+            json.endObject();
+        json.endObject(); //a
+    json.endObject(); //samples
+    json.addStr("bws", mDeviceInfo);
+    json.addInt("rly", mConnInfo.mRly);
+    json.addInt("rrly", mConnInfo.mRRly);
+    json.addStr("proto", mConnInfo.mProto);
+    json.addInt("isJoiner", mIsJoiner);
+    json.addStr("caid", mIsJoiner ? mOwnAnonId.toString() : mPeerAnonId.toString());
+    json.addStr("aaid", mIsJoiner ? mPeerAnonId.toString() : mOwnAnonId.toString());
+    json.addStr("termRsn", mTermRsn);
+    json.addInt("grp", mIsGroupCall ? 1 : 0);
     if (mIceDisconnections > 0)
     {
-        JSON_SUBOBJ("hicc");
-        JSON_ADD_INT(cnt, mIceDisconnections);
-        JSON_ADD_INT(maxDur, mMaxIceDisconnectionTime);
-        JSON_END_SUBOBJ();
+        json.beginObject("hicc");
+        json.addInt("cnt", mIceDisconnections);
+        json.addInt("maxDur", mMaxIceDisconnectionTime);
+        json.endObject();
     }
 
     if (mReconnections > 0)
     {
-        JSON_SUBOBJ("reconn");
-        JSON_ADD_INT(cnt, mReconnections);
-        JSON_ADD_STR(prevSid, mPreviousSessionId.toString());
-        JSON_END_SUBOBJ();
+        json.beginObject("reconn");
+        json.addInt("cnt", mReconnections);
+        json.addStr("prevSid", mPreviousSessionId.toString());
+        json.endObject();
+    }
+    json.endObject(); //all
+}
+
+static void binaryAddStr(std::string& out, const std::string& value)
+{
+    SampleStore::appendVarint(out, value.size());
+    out.append(value);
+}
+
+void RtcStats::toBinary(std::string& out) const
+{
+    out.clear();
+    out.reserve(256 + mSamples.encodedSize() + SampleStore::kColumnCount * 16);
+    out.append("RTS");
+    out += static_cast<char>(1);   // version
+    SampleStore::appendVarint(out, mSamples.size());
+    SampleStore::appendVarint(out, SampleStore::kColumnCount);
+
+    // deltas restart at every block of the store: encode them again, relative to the previous sample
+    std::string column;
+    column.reserve(mSamples.size() * 2);
+    for (unsigned i = 0; i < SampleStore::kColumnCount; i++)
+    {
+        column.clear();
+        int64_t last = 0;
+        mSamples.forEachValue(i, [&column, &last](int64_t value)
+        {
+            SampleStore::appendVarint(column, SampleStore::zigzagEncode(value - last));
+            last = value;
+        });
+        binaryAddStr(out, SampleStore::columnName(i));
+        binaryAddStr(out, column);
+    }
+
+    std::vector<std::pair<const char*, std::string>> fields =
+    {
+        { "cid", mCallId.toString() },
+        { "sid", mSessionId.toString() },
+        { "ts", std::to_string(mStartTs) },
+        { "dur", std::to_string(mDur) },
+        { "bws", mDeviceInfo },
+        { "rly", std::to_string(mConnInfo.mRly) },
+        { "rrly", std::to_string(mConnInfo.mRRly) },
+        { "proto", mConnInfo.mProto },
+        { "isJoiner", std::to_string(mIsJoiner) },
+        { "caid", mIsJoiner ? mOwnAnonId.toString() : mPeerAnonId.toString() },
+        { "aaid", mIsJoiner ? mPeerAnonId.toString() : mOwnAnonId.toString() },
+        { "termRsn", mTermRsn },
+        { "grp", std::to_string(mIsGroupCall ? 1 : 0) },
+        { "hicc.cnt", std::to_string(mIceDisconnections) },
+        { "hicc.maxDur", std::to_string(mMaxIceDisconnectionTime) },
+        { "reconn.cnt", std::to_string(mReconnections) },
+        { "reconn.prevSid", mPreviousSessionId.toString() }
+    };
+    SampleStore::appendVarint(out, fields.size());
+    for (const auto& field: fields)
+    {
+        binaryAddStr(out, field.first);
+        binaryAddStr(out, field.second);
     }
-    json[json.size()-1]='}'; //all
 }
 }
 }
@@ -2,6 +2,7 @@
 #define RTCSTATS_H
 #include "webrtcAdapter.h"
 #include "IRtcStats.h"
+#include "rtcStatsStore.h"
 #include "ITypesImpl.h"
 #include <timers.hpp>
 #include <karereId.h>
@@ -61,21 +62,29 @@ public:
     karere::Id mPeerAnonId;
     std::string mDeviceInfo;
     bool mIsGroupCall;
-    std::vector<Sample*> mSamples;
+    SampleStore mSamples;
     ConnInfo mConnInfo;
     unsigned long mMaxIceDisconnectionTime = 0;
     unsigned int mIceDisconnections = 0;
     karere::Id mPreviousSessionId;
     unsigned int mReconnections = 0;
-    ~RtcStats();
     //IRtcStats implementation
     virtual const std::string& termRsn() const { return mTermRsn; }
     virtual bool isCaller() const { return !mIsJoiner; }
     virtual karere::Id callId() const { return mCallId; }
     virtual size_t sampleCnt() const { return mSamples.size(); }
-    virtual const std::vector<Sample*>* samples() const { return &mSamples; }
+    virtual const SampleStore* samples() const { return &mSamples; }
     virtual const IConnInfo* connInfo() const { return &mConnInfo; }
     virtual void toJson(std::string& out) const;
+    /**
+     * Compact binary export of the stats, with the exact values of the samples:
+     * "RTS" <version.1> <sampleCount.varint> <columnCount.varint>
+     * then every column: <name.str> <size.varint> <zigzag varints of the deltas between consecutive samples>
+     * (floats, like v_s_el, as the bits of their IEEE 754 single precision value)
+     * then <fieldCount.varint> and every field of the JSON that is not a sample (ts and dur in ms): <name.str> <value.str>
+     * where <str> is <length.varint><chars>
+     */
+    virtual void toBinary(std::string& out) const;
 };
 
 class Recorder: public rtc::RefCountedObject<webrtc::StatsObserver>
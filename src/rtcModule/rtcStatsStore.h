@@ -0,0 +1,282 @@
+#ifndef RTCSTATSSTORE_H
+#define RTCSTATSSTORE_H
+
+#include "IRtcStats.h"
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <deque>
+
+namespace rtcModule
+{
+namespace stats
+{
+
+/** Columns of the samples: X(column, member of Sample) */
+#define RTCSTATS_SAMPLE_COLUMNS(X)      \
+    X(ts,           ts)                 \
+    X(lq,           lq)                 \
+    X(f,            f)                  \
+    X(v_rtt,        vstats.rtt)         \
+    X(v_r_bt,       vstats.r.bt)        \
+    X(v_r_bps,      vstats.r.bps)       \
+    X(v_r_abps,     vstats.r.abps)      \
+    X(v_r_pl,       vstats.r.pl)        \
+    X(v_r_fps,      vstats.r.fps)       \
+    X(v_r_dly,      vstats.r.dly)       \
+    X(v_r_jtr,      vstats.r.jtr)       \
+    X(v_r_width,    vstats.r.width)     \
+    X(v_r_height,   vstats.r.height)    \
+    X(v_r_bwav,     vstats.r.bwav)      \
+    X(v_r_firtx,    vstats.r.firtx)     \
+    X(v_r_plitx,    vstats.r.plitx)     \
+    X(v_r_nacktx,   vstats.r.nacktx)    \
+    X(v_s_bt,       vstats.s.bt)        \
+    X(v_s_bps,      vstats.s.bps)       \
+    X(v_s_abps,     vstats.s.abps)      \
+    X(v_s_gbps,     vstats.s.gbps)      \
+    X(v_s_fps,      vstats.s.fps)       \
+    X(v_s_cfps,     vstats.s.cfps)      \
+    X(v_s_width,    vstats.s.width)     \
+    X(v_s_height,   vstats.s.height)    \
+    X(v_s_el,       vstats.s.el)        \
+    X(v_s_bwav,     vstats.s.bwav)      \
+    X(v_s_tebr,     vstats.s.targetEncBitrate) \
+    X(a_rtt,        astats.rtt)         \
+    X(a_pld,        astats.plDifference) \
+    X(a_r_bt,       astats.r.bt)        \
+    X(a_r_bps,      astats.r.bps)       \
+    X(a_r_abps,     astats.r.abps)      \
+    X(a_r_pl,       astats.r.pl)        \
+    X(a_r_jtr,      astats.r.jtr)       \
+    X(a_r_dly,      astats.r.dly)       \
+    X(a_r_al,       astats.r.al)        \
+    X(a_s_bt,       astats.s.bt)        \
+    X(a_s_bps,      astats.s.bps)       \
+    X(a_s_abps,     astats.s.abps)      \
+    X(c_rtt,        cstats.rtt)         \
+    X(c_r_bt,       cstats.r.bt)        \
+    X(c_r_bps,      cstats.r.bps)       \
+    X(c_r_abps,     cstats.r.abps)      \
+    X(c_s_bt,       cstats.s.bt)        \
+    X(c_s_bps,      cstats.s.bps)       \
+    X(c_s_abps,     cstats.s.abps)
+
+/** @brief Samples of the stats of a session, stored by columns
+ *
+ * Every member of the samples is stored as a column of integers (floats are stored
+ * as the bits of their value, so they are restored exactly), encoded as the zigzag
+ * varint of the difference with the previous sample. Most members change slowly or
+ * not at all, so a sample takes a few dozens of bytes instead of a heap-allocated Sample.
+ *
+ * Samples are stored in blocks of \c kBlockSize. When there are \c kMaxSamples, the
+ * oldest block is dropped, so a very long session doesn't grow without bound.
+ */
+class SampleStore
+{
+public:
+    enum: unsigned
+    {
+#define RTCSTATS_COLUMN_ENUM(column, member) kCol_##column,
+        RTCSTATS_SAMPLE_COLUMNS(RTCSTATS_COLUMN_ENUM)
+#undef RTCSTATS_COLUMN_ENUM
+        kColumnCount
+    };
+    enum { kBlockSize = 256, kMaxSamples = 64 * kBlockSize };
+
+    /** Name of the column, as used by the binary export */
+    static const char* columnName(unsigned column);
+
+    void push_back(const Sample& sample);
+    /** Number of samples stored */
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+    /** Number of samples added, including the dropped ones */
+    size_t totalCount() const { return mTotalCount; }
+    /** The last sample added. The store must not be empty */
+    const Sample& back() const { return mLast; }
+    /** Bytes used by the encoded columns */
+    size_t encodedSize() const;
+
+    /** Calls func(int64_t value) for every value of the column, from oldest to newest */
+    template <class F>
+    void forEachValue(unsigned column, F&& func) const
+    {
+        for (const Block& block: mBlocks)
+        {
+            const std::string& data = block.columns[column];
+            size_t pos = 0;
+            int64_t value = 0;
+            for (unsigned i = 0; i < block.count; i++)
+            {
+                value += zigzagDecode(readVarint(data, pos));
+                func(value);
+            }
+        }
+    }
+
+    /** Decodes the samples, from oldest to newest, calling func(const Sample&) for each one */
+    template <class F>
+    void forEachSample(F&& func) const
+    {
+        for (const Block& block: mBlocks)
+        {
+            size_t pos[kColumnCount] = {};
+            int64_t values[kColumnCount] = {};
+            for (unsigned i = 0; i < block.count; i++)
+            {
+                Sample sample;
+#define RTCSTATS_COLUMN_DECODE(column, member)                                                          \
+                values[kCol_##column] += zigzagDecode(readVarint(block.columns[kCol_##column], pos[kCol_##column])); \
+                fromColumnValue(values[kCol_##column], sample.member);
+                RTCSTATS_SAMPLE_COLUMNS(RTCSTATS_COLUMN_DECODE)
+#undef RTCSTATS_COLUMN_DECODE
+                func(static_cast<const Sample&>(sample));
+            }
+        }
+    }
+
+    /** Integer stored in the column of a member of the samples */
+    template <typename T>
+    static int64_t toColumnValue(T value) { return static_cast<int64_t>(value); }
+    static int64_t toColumnValue(float value)
+    {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+    /** Member of the samples from the integer stored in its column */
+    template <typename T>
+    static void fromColumnValue(int64_t value, T& out) { out = static_cast<T>(value); }
+    static void fromColumnValue(int64_t value, float& out)
+    {
+        uint32_t bits = static_cast<uint32_t>(value);
+        memcpy(&out, &bits, sizeof(out));
+    }
+
+    static void appendVarint(std::string& out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out += static_cast<char>((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        out += static_cast<char>(value);
+    }
+    static uint64_t readVarint(const std::string& data, size_t& pos)
+    {
+        uint64_t value = 0;
+        for (unsigned shift = 0; pos < data.size() && shift < 64; shift += 7)
+        {
+            uint8_t byte = static_cast<uint8_t>(data[pos++]);
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        return value;
+    }
+    static uint64_t zigzagEncode(int64_t value) { return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63); }
+    static int64_t zigzagDecode(uint64_t value) { return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1); }
+
+protected:
+    struct Block
+    {
+        unsigned count = 0;
+        std::string columns[kColumnCount];
+    };
+    std::deque<Block> mBlocks;
+    int64_t mLastValues[kColumnCount];  // last values of the current block, deltas are relative to them
+    size_t mSize = 0;
+    size_t mTotalCount = 0;
+    Sample mLast;
+};
+
+/** @brief Writer of JSON into a string, without intermediate strings
+ *
+ * Separators between members and elements are added automatically.
+ */
+class JsonWriter
+{
+public:
+    JsonWriter(std::string& out, size_t sizeHint): mOut(out)
+    {
+        mOut.clear();
+        mOut.reserve(sizeHint);
+    }
+    void beginObject(const char* name = nullptr) { key(name); mOut += '{'; }
+    void endObject() { mOut += '}'; }
+    void beginArray(const char* name = nullptr) { key(name); mOut += '['; }
+    void endArray() { mOut += ']'; }
+    void addInt(const char* name, int64_t value) { key(name); appendInt(value); }
+    void addStr(const char* name, const std::string& value)
+    {
+        key(name);
+        mOut += '"';
+        appendEscaped(value);
+        mOut += '"';
+    }
+    /** Element of an array */
+    void addInt(int64_t value) { key(nullptr); appendInt(value); }
+    /** Element of an array, of a number with one decimal, scaled by 10 */
+    void addDecimal(int64_t tenths)
+    {
+        key(nullptr);
+        if (tenths < 0)
+        {
+            mOut += '-';
+            tenths = -tenths;
+        }
+        appendInt(tenths / 10);
+        mOut += '.';
+        mOut += static_cast<char>('0' + tenths % 10);
+    }
+
+protected:
+    std::string& mOut;
+
+    void key(const char* name)
+    {
+        if (!mOut.empty())
+        {
+            char last = mOut.back();
+            if (last != '{' && last != '[' && last != ':')
+                mOut += ',';
+        }
+        if (name)
+        {
+            mOut += '"';
+            mOut += name;
+            mOut += "\":";
+        }
+    }
+    void appendInt(int64_t value)
+    {
+        char buf[24];
+        char* end = buf + sizeof(buf);
+        char* pos = end;
+        uint64_t abs = (value < 0) ? (0 - static_cast<uint64_t>(value)) : static_cast<uint64_t>(value);
+        do
+        {
+            *--pos = static_cast<char>('0' + abs % 10);
+            abs /= 10;
+        } while (abs);
+        if (value < 0)
+            *--pos = '-';
+        mOut.append(pos, end - pos);
+    }
+    void appendEscaped(const std::string& value)
+    {
+        for (char c: value)
+        {
+            if (c == '"' || c == '\\')
+                mOut += '\\';
+            else if (static_cast<unsigned char>(c) < 0x20)
+                continue;
+            mOut += c;
+        }
+    }
+};
+
+}
+}
+#endif
@@ -4014,15 +4014,15 @@ Session::~Session()
 void Session::pollStats()
 {
     mRtcConn->GetStats(static_cast<webrtc::StatsObserver*>(mStatRecorder.get()), nullptr, mStatRecorder->getStatsLevel());
-    unsigned int statsSize = mStatRecorder->mStats->mSamples.size();
+    unsigned int statsSize = mStatRecorder->mStats->mSamples.totalCount();
     if (statsSize != mPreviousStatsSize)
     {
-        manageNetworkQuality(mStatRecorder->mStats->mSamples.back());
+        manageNetworkQuality(&mStatRecorder->mStats->mSamples.back());
         mPreviousStatsSize = statsSize;
     }
 }
 
-void Session::manageNetworkQuality(stats::Sample *sample)
+void Session::manageNetworkQuality(const stats::Sample *sample)
 {
     int previousNetworkquality = mNetworkQuality;
     mNetworkQuality = sample->lq;
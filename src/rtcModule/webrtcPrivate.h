@@ -143,7 +143,7 @@ public:
     void pollStats();
     artc::myPeerConnection<Session> rtcConn() const { return mRtcConn; }
     virtual bool videoReceived() const { return mVideoReceived; }
-    void manageNetworkQuality(stats::Sample* sample);
+    void manageNetworkQuality(const stats::Sample* sample);
     void createRtcConn();
     promise::Promise<void> processSdpOfferSendAnswer();
     void forceDestroy();
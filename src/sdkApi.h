@@ -11,7 +11,10 @@
 #include "base/trackDelete.h"
 #include <logger.h>
 #include <string.h>
+#include <mutex>
+#include <vector>
 #include "karereCommon.h" //for KR_LOG_DEBUG
+#include "karereId.h"
 
 typedef std::shared_ptr<::mega::MegaRequest> ReqResult;
 typedef promise::Promise<ReqResult> ApiPromise;
@@ -114,6 +117,94 @@ public:
     }
 };
 
+class MyBatchListener;
+
+/** @brief Results of a batch of requests, see MyMegaApi::fetchUserAttrs()
+ *
+ * Results are queued from the SDK's thread, and delivered to the app's thread together:
+ * a single marshalled call delivers all the results received until it's processed,
+ * instead of one call per request.
+ */
+class BatchResults: public std::enable_shared_from_this<BatchResults>
+{
+public:
+    BatchResults(void *ctx, karere::DeleteTrackable::Handle wptr) : appCtx(ctx), wptr(wptr) { }
+    /** Called from the SDK's thread */
+    void push(MyBatchListener* listener, ::mega::MegaRequest* request, int errCode)
+    {
+        bool first;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            first = mResults.empty();
+            mResults.push_back(Result{listener, std::shared_ptr<::mega::MegaRequest>(request->copy()), errCode});
+        }
+        if (!first)
+            return; // already scheduled
+
+        auto self = shared_from_this();
+        karere::marshallCall([self]()
+        {
+            self->deliver();
+        }, appCtx);
+    }
+
+protected:
+    struct Result
+    {
+        MyBatchListener* listener;
+        ReqResult request;
+        int errCode;
+    };
+    void *appCtx;
+    karere::DeleteTrackable::Handle wptr;
+    std::mutex mMutex;
+    std::vector<Result> mResults;
+
+    inline void deliver();
+};
+
+/** @brief Listener of a request of a batch. Its promise is resolved by \c BatchResults */
+class MyBatchListener: public ::mega::MegaRequestListener
+{
+    std::shared_ptr<BatchResults> mResults;
+
+public:
+    MyBatchListener(const std::shared_ptr<BatchResults>& results) : mResults(results) { }
+    ApiPromise mPromise;
+    virtual void onRequestFinish(::mega::MegaApi* /*api*/, ::mega::MegaRequest *request, ::mega::MegaError* e)
+    {
+        mResults->push(this, request, e->getErrorCode());
+    }
+};
+
+inline void BatchResults::deliver()
+{
+    std::vector<Result> results;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        results.swap(mResults);
+    }
+
+    for (Result& result: results)
+    {
+        std::unique_ptr<MyBatchListener> listener(result.listener);
+        if (wptr.deleted() || listener->mPromise.done())
+            continue;
+
+        if (result.errCode != ::mega::MegaError::API_OK)
+        {
+            std::string errmsg = "Mega API error ";
+            errmsg.append(std::to_string(result.errCode)).append(" (")
+                  .append(::mega::MegaError::getErrorString(result.errCode))+=')';
+            listener->mPromise.reject(errmsg, result.errCode, ERRTYPE_MEGASDK);
+        }
+        else
+        {
+            listener->mPromise.resolve(result.request);
+        }
+    }
+}
+
 class MyMegaLogger: public ::mega::MegaLogger
 {
     virtual void log(const char * /*time*/, int loglevel, const char *source, const char *message)
@@ -173,7 +264,31 @@ public:
         return listener->mPromise;
     }
 
-    ~MyMegaApi()
+    /** @brief A user attribute, or the email of a user, requested by \c fetchUserAttrs() */
+    struct UserAttrRequest
+    {
+        enum { kEmail = -1 };
+        karere::Id user;
+        int type;               // MegaApi::USER_ATTR_xxx, or kEmail for getUserEmail()
+        karere::Id ph;          // public handle of the chat in preview mode, or Id::inval()
+        ApiPromise promise;     // resolved with the result of the request
+    };
+
+    /** @brief Sends the requests to the SDK at once, so they can go in the same request
+     * to the API, and delivers their results to the app's thread in batches as well
+     */
+    void fetchUserAttrs(std::vector<UserAttrRequest>& requests)
+    {
+        auto results = std::make_shared<BatchResults>(appCtx, getDelTracker());
+        for (UserAttrRequest& request: requests)
+        {
+            auto listener = new MyBatchListener(results);
+            request.promise = listener->mPromise;
+            sendUserAttrRequest(request, listener);
+        }
+    }
+
+    virtual ~MyMegaApi()
     {
         if (logging)
         {
@@ -182,6 +297,21 @@ public:
         mLogger.reset();
         KR_LOG_DEBUG("Deleted SDK logger");
     }
+
+protected:
+    /** Virtual, so the SDK can be mocked to run the users of the API offline */
+    virtual void sendUserAttrRequest(const UserAttrRequest& request, ::mega::MegaRequestListener* listener)
+    {
+        if (request.type == UserAttrRequest::kEmail)
+        {
+            sdk.getUserEmail(request.user.val, listener);
+            return;
+        }
+
+        std::string ph = request.ph.toString(karere::Id::CHATLINKHANDLE);
+        sdk.getChatUserAttribute(request.user.toString().c_str(), request.type,
+                                 request.ph.isValid() ? ph.c_str() : NULL, listener);
+    }
 };
 
 #endif // SDKAPI_H
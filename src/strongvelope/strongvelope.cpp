@@ -24,6 +24,7 @@
 #include "strongvelope.h"
 #include "cryptofunctions.h"
 #include <ctime>
+#include <algorithm>
 #include "sodium.h"
 #include "tlvstore.h"
 #include <userAttrCache.h>
@@ -117,6 +118,13 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
     }
     Id chatid = mProtoHandler.chatid;   // for the log below
     STRONGVELOPE_LOG_DEBUG("Decrypting msg %s", outMsg.id().toString().c_str());
+    std::string cleartext = decryptPayload(key);
+    parsePayload(StaticBuffer(cleartext, false), outMsg);
+    outMsg.setEncrypted(Message::kNotEncrypted);
+}
+
+std::string ParsedMessage::decryptPayload(const StaticBuffer& key) const
+{
     Key<32> derivedNonce;
     // deriveNonceSecret() needs at least 32 bytes output buffer
     deriveNonceSecret(nonce, derivedNonce);
@@ -124,10 +132,8 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
     // For AES CRT mode, we take the first 12 bytes as the nonce,
     // and the remaining 4 bytes as the counter, which is initialized to zero
     *reinterpret_cast<uint32_t*>(derivedNonce.buf()+SVCRYPTO_NONCE_SIZE) = 0;
-    std::string cleartext = aesCTRDecrypt(std::string(payload.buf(), payload.dataSize()),
+    return aesCTRDecrypt(std::string(payload.buf(), payload.dataSize()),
         key, derivedNonce);
-    parsePayload(StaticBuffer(cleartext, false), outMsg);
-    outMsg.setEncrypted(Message::kNotEncrypted);
 }
 
 /**
@@ -521,10 +527,10 @@ ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
     int isUnifiedKeyEncrypted, karere::Id ph, void *ctx)
 : chatd::ICrypto(ctx), mOwnHandle(ownHandle), myPrivCu25519(privCu25519),
   myPrivEd25519(privEd25519), mUserAttrCache(userAttrCache),
-  mDb(db), chatid(aChatId), mPh(ph)
+  mDb(db), mKeyCache(db, aChatId), chatid(aChatId), mPh(ph)
 {
     getPubKeyFromPrivKey(myPrivEd25519, kKeyTypeEd25519, myPubEd25519);
-    loadKeysFromDb();
+    // send keys are loaded from db on demand, see SendKeyCache::find()
     loadUnconfirmedKeysFromDb();
 
     if (isPublic)
@@ -606,10 +612,8 @@ ProtocolHandler::reactionEncrypt(const Message &msg, const std::string &reaction
     }
     else
     {
-        UserKeyId ukid(msg.userid, msg.keyid);
-        auto it = mKeys.find(ukid);
-        assert(it != mKeys.end());
-        data = it->second.key;
+        data = getKeyIfAvailable(msg.userid, msg.keyid);
+        assert(data);
     }
 
     // Inside this function str_to_a32 and a32_to_str calls must be done with type <T> = <uint32_t>
@@ -707,26 +711,205 @@ unsigned int ProtocolHandler::getCacheVersion() const
     return mCacheVersion;
 }
 
-void ProtocolHandler::loadKeysFromDb()
+SendKeyCache::Entry* SendKeyCache::find(UserKeyId ukid, uint32_t prefetch)
 {
-    SqliteStmt stmt(mDb, "select userid, keyid, key from sendkeys where chatid=?");
-    stmt << chatid;
+    auto it = mKeys.find(ukid);
+    if (it != mKeys.end())
+    {
+        mStats.hits++;
+    }
+    else if (mMissing.find(ukid) != mMissing.end())
+    {
+        mStats.missing++;
+        return nullptr;
+    }
+    else
+    {
+        mStats.misses++;
+        prefetch = static_cast<uint32_t>(std::min<size_t>(std::max<uint32_t>(prefetch, 1), mMaxResident));
+        KeyId minKeyid = (ukid.keyid >= prefetch) ? ukid.keyid - prefetch + 1 : 0;
+        this->prefetch(ukid.user, minKeyid, ukid.keyid);
+        it = mKeys.find(ukid);
+        if (it == mKeys.end())
+        {
+            if (mMissing.size() >= kMaxMissingKeys)
+            {
+                mMissing.clear();
+            }
+            mMissing.insert(ukid);
+            return nullptr;
+        }
+    }
+
+    Entry& entry = it->second;
+    if (entry.key)
+    {
+        touch(ukid, entry);
+    }
+    return &entry;
+}
+
+SendKeyCache::Entry& SendKeyCache::findOrAdd(UserKeyId ukid)
+{
+    Entry* entry = find(ukid, 1);
+    if (entry)
+    {
+        return *entry;
+    }
+    mMissing.erase(ukid);
+    return mKeys[ukid];
+}
+
+SendKeyCache::Entry* SendKeyCache::get(UserKeyId ukid)
+{
+    auto it = mKeys.find(ukid);
+    return (it != mKeys.end()) ? &it->second : nullptr;
+}
+
+size_t SendKeyCache::prefetch(karere::Id userid, KeyId minKeyid, KeyId maxKeyid)
+{
+    SqliteStmt stmt(mDb, "select keyid, key from sendkeys where chatid=? and userid=? and keyid between ? and ? "
+                    "order by keyid asc");
+    stmt << mChatid << userid << minKeyid << maxKeyid;
+    size_t count = 0;
+    while(stmt.step())
+    {
+        auto key = std::make_shared<SendKey>();
+        stmt.blobCol(1, *key);
+        count += load(UserKeyId(userid, stmt.uintCol(0)), key);
+    }
+    mStats.loaded += count;
+    evict();
+    return count;
+}
+
+size_t SendKeyCache::prefetchRange(KeyId minKeyid, KeyId maxKeyid)
+{
+    SqliteStmt stmt(mDb, "select userid, keyid, key from sendkeys where chatid=? and keyid between ? and ? "
+                    "order by keyid asc");
+    stmt << mChatid << minKeyid << maxKeyid;
+    size_t count = 0;
     while(stmt.step())
     {
         auto key = std::make_shared<SendKey>();
         stmt.blobCol(2, *key);
-        Id userid(stmt.uint64Col(0));
-        uint32_t keyid = stmt.uintCol(1);
+        count += load(UserKeyId(stmt.uint64Col(0), stmt.uintCol(1)), key);
+    }
+    mStats.loaded += count;
+    evict();
+    return count;
+}
 
-#ifndef NDEBUG
-        auto ret =
-#endif
-        mKeys.emplace(std::piecewise_construct,
-            std::forward_as_tuple(userid, keyid),
-            std::forward_as_tuple(key));
-        assert(ret.second);
+bool SendKeyCache::load(UserKeyId ukid, const std::shared_ptr<SendKey>& key)
+{
+    mMissing.erase(ukid);
+    auto ret = mKeys.emplace(std::piecewise_construct,
+        std::forward_as_tuple(ukid), std::forward_as_tuple());
+    Entry& entry = ret.first->second;
+    if (entry.key)
+    {
+        return false;   // already in memory
     }
-    STRONGVELOPE_LOG_DEBUG("(%" PRId64 "): Loaded %zu send keys from database", chatid, mKeys.size());
+
+    // if the key is being decrypted, it was received twice: addDecryptedKey() will
+    // check both are the same
+    entry.key = key;
+    if (!entry.inLru)   // about to be used: the newest one ends up the most recent
+    {
+        mLru.push_front(ukid);
+        entry.lruPos = mLru.begin();
+        entry.inLru = true;
+    }
+    return true;
+}
+
+void SendKeyCache::touch(UserKeyId ukid, Entry& entry)
+{
+    assert(entry.key);
+    if (entry.inLru)
+    {
+        mLru.splice(mLru.begin(), mLru, entry.lruPos);
+        return;
+    }
+
+    mLru.push_front(ukid);
+    entry.lruPos = mLru.begin();
+    entry.inLru = true;
+    evict();
+}
+
+void SendKeyCache::evict()
+{
+    // the most recent key is never evicted: the caller may be using its entry
+    auto it = mLru.end();
+    while (mLru.size() > mMaxResident && it != std::next(mLru.begin()))
+    {
+        --it;
+        auto kit = mKeys.find(*it);
+        assert(kit != mKeys.end());
+        if (kit->second.pms)
+        {
+            continue;   // received again and being decrypted: keep it until compared
+        }
+        it = mLru.erase(it);
+        mKeys.erase(kit);
+        mStats.evictions++;
+    }
+}
+
+void SendKeyCache::erase(UserKeyId ukid)
+{
+    auto it = mKeys.find(ukid);
+    if (it == mKeys.end())
+    {
+        return;
+    }
+    if (it->second.inLru)
+    {
+        mLru.erase(it->second.lruPos);
+    }
+    mKeys.erase(it);
+}
+
+void SendKeyCache::setMaxResident(size_t maxKeys)
+{
+    mMaxResident = std::max<size_t>(maxKeys, 1);
+    evict();
+}
+
+void ProtocolHandler::prefetchHistoryKeys(KeyId keyid)
+{
+    if (keyid == CHATD_KEYID_INVALID || (keyid >= mHistoryKeyidMin && keyid <= mHistoryKeyidMax))
+    {
+        return;
+    }
+
+    // history is fetched from newer to older: load the keys of the older messages of
+    // the range, but no more than fit in memory
+    KeyId window = static_cast<KeyId>(std::min<size_t>(SendKeyCache::kKeyPrefetchWindow, mKeyCache.maxResident()));
+    KeyId minKeyid = (keyid >= window) ? keyid - window + 1 : 0;
+    size_t count = mKeyCache.prefetchRange(minKeyid, keyid);
+    STRONGVELOPE_LOG_DEBUG("(%" PRId64 "): Prefetched %zu send keys with keyid in [%u, %u] for history",
+                           chatid, count, minKeyid, keyid);
+
+    if (mHistoryKeyidMin <= mHistoryKeyidMax
+            && keyid + 1 >= mHistoryKeyidMin && minKeyid <= mHistoryKeyidMax + 1)
+    {
+        // contiguous with the range already loaded
+        mHistoryKeyidMin = std::min(mHistoryKeyidMin, minKeyid);
+        mHistoryKeyidMax = std::max(mHistoryKeyidMax, keyid);
+    }
+    else
+    {
+        mHistoryKeyidMin = minKeyid;
+        mHistoryKeyidMax = keyid;
+    }
+}
+
+void ProtocolHandler::resetHistoryKeyRange()
+{
+    mHistoryKeyidMin = CHATD_KEYID_MAX;
+    mHistoryKeyidMax = CHATD_KEYID_INVALID;
 }
 
 void ProtocolHandler::loadUnconfirmedKeysFromDb()
@@ -1040,6 +1223,56 @@ ProtocolHandler::msgEncrypt(Message* msg, const SetOfIds &recipients, MsgCommand
 void ProtocolHandler::onHistoryReload()
 {
     mCacheVersion++;
+    pruneDecryptJobs(mHistoryFetchCount + 1);
+    resetHistoryKeyRange();
+}
+
+void ProtocolHandler::onHistoryFetchEnd()
+{
+    // jobs are consumed by msgDecrypt() right away, unless decryption is halted
+    // waiting for a key: keep the ones of this fetch, but not of the previous ones
+    pruneDecryptJobs(mHistoryFetchCount);
+    mHistoryFetchCount++;
+    resetHistoryKeyRange();
+}
+
+void ProtocolHandler::onOnlineStateChange(chatd::ChatState state)
+{
+    if (state == chatd::kChatStateOffline || state == chatd::kChatStateConnecting)
+    {
+        // history will be fetched again upon reconnection
+        pruneDecryptJobs(mHistoryFetchCount + 1);
+        resetHistoryKeyRange();
+
+        const DecryptStats& stats = decryptStats();
+        if (stats.fastPath || stats.slowPath || stats.ahead)
+        {
+            const SendKeyCache::Stats& keyStats = keyCacheStats();
+            STRONGVELOPE_LOG_DEBUG("(%" PRId64 "): Decrypted messages: %" PRIu64 " fast path, %" PRIu64 " slow path, %" PRIu64 " ahead."
+                " Send keys: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " known missing, %" PRIu64 " loaded, %" PRIu64 " evicted, %zu resident",
+                chatid, stats.fastPath, stats.slowPath, stats.ahead,
+                keyStats.hits, keyStats.misses, keyStats.missing, keyStats.loaded, keyStats.evictions, residentKeyCount());
+        }
+    }
+}
+
+void ProtocolHandler::pruneDecryptJobs(unsigned int olderThanFetch)
+{
+    // msgDecrypt() decrypts on its own the messages without a job. Promises of jobs
+    // already queued are kept, they are resolved when the job is done
+    for (auto it = mDecryptJobs.begin(); it != mDecryptJobs.end();)
+    {
+        if (it->second->historyFetch < olderThanFetch)
+        {
+            it = mDecryptJobs.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+    mAheadSendKey.reset();
+    mAheadEdKey.reset();
 }
 
 promise::Promise<Message*> ProtocolHandler::handleManagementMessage(
@@ -1133,6 +1366,45 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
             return Promise<Message*>(message);
         }
 
+        // already verified and decrypted (or in progress) by msgDecryptAhead()
+        auto jobIt = mDecryptJobs.find(message->id());
+        if (jobIt != mDecryptJobs.end())
+        {
+            std::shared_ptr<DecryptJob> job = jobIt->second;
+            mDecryptJobs.erase(jobIt);
+            if (job->updated == message->updated && job->cacheVersion == cacheVersion)
+            {
+                return msgDecryptWithJob(job, message);
+            }
+            // the message was edited or the history reloaded meanwhile --> decrypt it again
+        }
+
+        // Fast path: if both keys are already available, decrypt synchronously
+        std::shared_ptr<SendKey> sendKey = (message->userid != karere::Id::COMMANDER())
+                ? getKeyIfAvailable(message->userid, message->keyid)
+                : nullptr;
+        Buffer* edKey = sendKey
+                ? mUserAttrCache.getDataNow(message->userid, ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY, mPh)
+                : nullptr;
+        if (edKey)
+        {
+            ParsedMessage parsedMsg(*message, *this);
+            if (parsedMsg.type < Message::kMsgManagementLowest
+                    || parsedMsg.type > Message::kMsgManagementHighest)
+            {
+                mDecryptStats.fastPath++;
+                message->type = parsedMsg.type;
+                if (!parsedMsg.verifySignature(*edKey, *sendKey))
+                {
+                    return ::promise::Error("Signature invalid for message "+
+                                          message->id().toString(), EINVAL, SVCRYPTO_ESIGNATURE);
+                }
+                parsedMsg.symmetricDecrypt(*sendKey, *message);
+                return message;
+            }
+            // management messages are rare: parse it again below
+        }
+
         // Get type
         auto parsedMsg = std::make_shared<ParsedMessage>(*message, *this);
         message->type = parsedMsg->type;
@@ -1153,6 +1425,7 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
         // Get keyid
         uint32_t keyid = message->keyid;
         auto ctx = std::make_shared<Context>();
+        mDecryptStats.slowPath++;
 
         promise::Promise<std::shared_ptr<SendKey>> symPms;
         if (keyid == CHATD_KEYID_INVALID)   // message was posted while open mode
@@ -1210,9 +1483,233 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
     }
 }
 
+void ProtocolHandler::msgDecryptAhead(Message* message)
+{
+    if (!mDecryptWorkers || message->empty() || message->userid == karere::Id::COMMANDER()
+            || mDecryptJobs.size() >= DecryptWorkerPool::kMaxQueuedJobs
+            || mDecryptJobs.find(message->id()) != mDecryptJobs.end())
+    {
+        return;
+    }
+
+    std::shared_ptr<ParsedMessage> parsedMsg;
+    try
+    {
+        parsedMsg = std::make_shared<ParsedMessage>(*message, *this);
+    }
+    catch(std::runtime_error&)
+    {
+        return; // msgDecrypt() will report the error
+    }
+
+    if (parsedMsg->type >= Message::kMsgManagementLowest
+            && parsedMsg->type <= Message::kMsgManagementHighest)
+    {
+        return; // management messages are not signed with the send key
+    }
+
+    // only if keys are already available: otherwise msgDecrypt() waits for them.
+    // Consecutive messages are usually from the same sender, with the same key
+    UserKeyId ukid(message->userid, message->keyid);
+    if (!mAheadSendKey || ukid < mAheadKeyId || mAheadKeyId < ukid)
+    {
+        std::shared_ptr<SendKey> sendKey = getKeyIfAvailable(message->userid, message->keyid);
+        if (!sendKey)
+            return;
+        mAheadKeyId = ukid;
+        mAheadSendKey = sendKey;
+    }
+
+    if (!mAheadEdKey || mAheadSender != parsedMsg->sender)
+    {
+        Buffer* edKey = mUserAttrCache.getDataNow(parsedMsg->sender,
+            ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY, mPh);
+        if (!edKey)
+            return;
+        mAheadSender = parsedMsg->sender;
+        mAheadEdKey = std::make_shared<EcKey>(*edKey);
+    }
+
+    auto job = std::make_shared<DecryptJob>();
+    job->id = ++mLastDecryptJobId;
+    job->historyFetch = mHistoryFetchCount;
+    job->msgid = message->id();
+    job->parsedMsg = parsedMsg;
+    job->sendKey = mAheadSendKey;
+    job->edKey = mAheadEdKey;
+    job->updated = message->updated;
+    job->cacheVersion = mCacheVersion;
+    if (submitDecryptJob(job))
+    {
+        mDecryptJobs[job->msgid] = job;
+    }
+    // else --> the pool is busy or disabled: msgDecrypt() will do the work
+}
+
+bool ProtocolHandler::submitDecryptJob(const std::shared_ptr<DecryptJob>& job)
+{
+    void* ctx = appCtx;
+    auto wptr = weakHandle();
+    return mDecryptWorkers->submit([this, job, ctx, wptr]()
+    {
+        runDecryptJob(*job);
+        marshallCall([this, job, wptr]()
+        {
+            if (wptr.deleted())
+                return;
+            onDecryptJobDone(*job);
+        }, ctx);
+    });
+}
+
+void ProtocolHandler::onDecryptJobDone(const DecryptJob& job)
+{
+    auto it = mDecryptJobPromises.find(job.id);
+    if (it == mDecryptJobPromises.end())
+        return;   // nobody waits for it (yet)
+
+    promise::Promise<void> pms = it->second;
+    mDecryptJobPromises.erase(it);
+    pms.resolve();
+}
+
+void ProtocolHandler::runDecryptJob(DecryptJob& job)
+{
+    job.verified = job.parsedMsg->verifySignature(*job.edKey, *job.sendKey);
+    if (job.verified && !job.parsedMsg->payload.empty())
+    {
+        job.cleartext = job.parsedMsg->decryptPayload(*job.sendKey);
+    }
+    job.done = true;
+}
+
+Promise<Message*> ProtocolHandler::msgDecryptWithJob(const std::shared_ptr<DecryptJob>& job, Message* message)
+{
+    message->type = job->parsedMsg->type;
+    mDecryptStats.ahead++;
+    if (job->done)
+    {
+        return applyDecryptJob(*job, message);
+    }
+
+    auto wptr = weakHandle();
+    unsigned int cacheVersion = mCacheVersion;
+    return mDecryptJobPromises[job->id].then([this, wptr, job, message, cacheVersion]() -> promise::Promise<Message*>
+    {
+        if (wptr.deleted())
+        {
+            return ::promise::Error("msgDecrypt: strongvelop deleted, ignore message", EINVAL, SVCRYPTO_EEXPIRED);
+        }
+
+        if (cacheVersion != mCacheVersion)
+        {
+            return ::promise::Error("msgDecrypt: history was reloaded, ignore message", EINVAL, SVCRYPTO_ENOMSG);
+        }
+
+        return applyDecryptJob(*job, message);
+    });
+}
+
+Promise<Message*> ProtocolHandler::applyDecryptJob(DecryptJob& job, Message* message)
+{
+    if (!job.verified)
+    {
+        return ::promise::Error("Signature invalid for message "+
+                              message->id().toString(), EINVAL, SVCRYPTO_ESIGNATURE);
+    }
+
+    if (job.parsedMsg->payload.empty())
+    {
+        message->clear();
+    }
+    else
+    {
+        job.parsedMsg->parsePayload(StaticBuffer(job.cleartext, false), *message);
+    }
+    message->setEncrypted(Message::kNotEncrypted);
+    return message;
+}
+
+DecryptWorkerPool::DecryptWorkerPool(unsigned threadCount)
+{
+    setThreadCount(threadCount);
+}
+
+DecryptWorkerPool::~DecryptWorkerPool()
+{
+    stop();
+}
+
+unsigned DecryptWorkerPool::defaultThreadCount()
+{
+    unsigned cores = std::thread::hardware_concurrency();
+    return (cores > 1) ? std::min(cores - 1, 4u) : 0;
+}
+
+void DecryptWorkerPool::setThreadCount(unsigned threadCount)
+{
+    stop();
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStopping = false;
+    for (unsigned i = 0; i < threadCount; i++)
+    {
+        mThreads.emplace_back(&DecryptWorkerPool::run, this);
+    }
+}
+
+bool DecryptWorkerPool::submit(std::function<void()>&& job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mThreads.empty() || mStopping || mJobs.size() >= kMaxQueuedJobs)
+        {
+            return false;
+        }
+        mJobs.push_back(std::move(job));
+    }
+    mCondition.notify_one();
+    return true;
+}
+
+void DecryptWorkerPool::run()
+{
+    for (;;)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this]() { return mStopping || !mJobs.empty(); });
+            if (mJobs.empty())
+            {
+                return; // stopping, and every queued job is done: someone may be waiting for it
+            }
+            job = std::move(mJobs.front());
+            mJobs.pop_front();
+        }
+        job();
+    }
+}
+
+void DecryptWorkerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mCondition.notify_all();
+    for (std::thread& thread: mThreads)
+    {
+        thread.join();
+    }
+    mThreads.clear();
+}
+
 void ProtocolHandler::onKeyReceived(KeyId keyid, Id sender, Id receiver,
                                     const char* data, uint16_t dataLen, bool isEncrypted)
 {
+    // keys missing in db until now may have been received in the same NEWKEY
+    mKeyCache.clearMissing();
+
     UserKeyId ukid(sender, keyid);
     if (!isEncrypted)
     {
@@ -1233,7 +1730,7 @@ void ProtocolHandler::onKeyReceived(KeyId keyid, Id sender, Id receiver,
     }
 
     // check if key is already being decrypted (received twice)
-    auto& entry = mKeys[ukid];
+    KeyEntry& entry = mKeyCache.findOrAdd(ukid);
     if (entry.pms)
     {
         STRONGVELOPE_LOG_WARNING("Key %d from user %s is already being decrypted", keyid, sender.toString().c_str());
@@ -1256,11 +1753,18 @@ void ProtocolHandler::onKeyReceived(KeyId keyid, Id sender, Id receiver,
         wptr.throwIfDeleted();
         STRONGVELOPE_LOG_ERROR("Removing key entry for key %u - decryptKey() failed with error '%s'", ukid.keyid, err.what());
 
-        auto it = mKeys.find(ukid);
-        assert(it != mKeys.end());
-        assert(it->second.pms);
-        it->second.pms->reject(err);
-        mKeys.erase(it);
+        KeyEntry* entry = mKeyCache.get(ukid);
+        assert(entry && entry->pms);
+        auto pms = entry->pms;
+        if (entry->key) // already known: keep the key, only discard the promise
+        {
+            entry->pms.reset();
+        }
+        else
+        {
+            mKeyCache.erase(ukid);
+        }
+        pms->reject(err);
         return err;
     });
 }
@@ -1270,7 +1774,8 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
     assert(key->dataSize() == SVCRYPTO_KEY_SIZE);
     STRONGVELOPE_LOG_DEBUG("Adding key %lld of user %s", ukid.keyid, ukid.user.toString().c_str());
 
-    auto& entry = mKeys[ukid];
+    // the key may be known but not in memory: check it against the one in db
+    KeyEntry& entry = mKeyCache.findOrAdd(ukid);
     if (entry.key)  // if KeyEntry already had a decrypted key assigned to it...
     {
         if (memcmp(entry.key->buf(), key->buf(), SVCRYPTO_KEY_SIZE))
@@ -1294,30 +1799,43 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
     }
 
     // finally, notify anyone waiting for decryption of the received key (if decryption was asynchronous)
-    if (entry.pms)
+    std::shared_ptr<SendKey> decryptedKey = entry.key;
+    auto pms = entry.pms;
+    entry.pms.reset();
+    mKeyCache.touch(ukid, entry);  // may evict other keys, but not this one
+    if (pms)
     {
-        entry.pms->resolve(entry.key);
-        entry.pms.reset();
+        pms->resolve(decryptedKey);
     }
 }
+std::shared_ptr<SendKey> ProtocolHandler::getKeyIfAvailable(karere::Id userid, uint32_t keyid)
+{
+    if (keyid == CHATD_KEYID_INVALID)   // message was posted while open mode
+    {
+        return mUnifiedKeyDecrypted.succeeded() ? mUnifiedKeyDecrypted.value() : nullptr;
+    }
+
+    KeyEntry* entry = mKeyCache.find(UserKeyId(userid, keyid));
+    return entry ? entry->key : nullptr;
+}
+
 promise::Promise<std::shared_ptr<SendKey>>
 ProtocolHandler::getKey(UserKeyId ukid)
 {
-    auto kit = mKeys.find(ukid);
-    if (kit == mKeys.end())
+    KeyEntry* entry = mKeyCache.find(ukid);
+    if (!entry)
     {
         return ::promise::Error("Key with id "+std::to_string(ukid.keyid)+
         " from user "+ukid.user.toString()+" not found", EINVAL, SVCRYPTO_ENOKEY);
     }
 
-    auto& entry = kit->second;
-    if (entry.key)  // key is available
+    if (entry->key)  // key is available
     {
-        return entry.key;
+        return entry->key;
     }
-    else if (entry.pms) // key is being decrypted
+    else if (entry->pms) // key is being decrypted
     {
-        return (*entry.pms);
+        return (*entry->pms);
     }
     else
     {
@@ -1340,9 +1858,9 @@ void ProtocolHandler::onKeyConfirmed(KeyId localkeyid, KeyId keyid)
     UserKeyId userKeyId(mOwnHandle, keyid);
     std::shared_ptr<SendKey> confirmedKey = entry.key;
     assert(entry.localKeyid == localkeyid);
-    assert(mKeys.find(userKeyId) == mKeys.end());
+    assert(!mKeyCache.get(userKeyId));
 
-    // add confirmed key to mKeys
+    // add confirmed key to the cache
     addDecryptedKey(userKeyId, confirmedKey);
 
     // check if confirmed key is the currentKey
@@ -9,7 +9,15 @@
 #define STRONGVELOPE_H_
 #include <vector>
 #include <map>
+#include <set>
+#include <list>
 #include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
 #include <assert.h>
 #include <iostream>
 #include <buffer.h>
@@ -186,6 +194,8 @@ struct ParsedMessage: public karere::DeleteTrackable
     void parsePayload(const StaticBuffer& data, chatd::Message& msg);
     void parsePayloadWithUtfBackrefs(const StaticBuffer& data, chatd::Message& msg);
     void symmetricDecrypt(const StaticBuffer& key, chatd::Message& outMsg);
+    /** Decrypts the payload. Doesn't access the ProtocolHandler, so it can run in any thread */
+    std::string decryptPayload(const StaticBuffer& key) const;
     promise::Promise<chatd::Message*> decryptChatTitle(chatd::Message* msg, bool msgCanBeDeleted);
 };
 
@@ -245,33 +255,166 @@ struct UserKeyId
     }
 };
 
-class TlvWriter;
-extern const std::string SVCRYPTO_PAIRWISE_KEY;
-void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output, const std::string& padString=SVCRYPTO_PAIRWISE_KEY);
-
 /**
- * @brief The ProtocolHandler class implements ICrypto.
- * @see chatd::ICrypto for more details.
+ * @brief Bounded cache of the decrypted send keys of a chat
+ *
+ * Received and confirmed keys are persisted in the `sendkeys` table. Only a bounded
+ * subset is resident in memory, and the rest are loaded from db on demand, along with
+ * the preceding keys of the same user, or of all users for a history range.
+ * Keys not found in db are remembered as missing until \c clearMissing() is called,
+ * upon reception of new keys, so a missing key is looked up in db only once.
  */
-class ProtocolHandler: public chatd::ICrypto, public karere::DeleteTrackable
+class SendKeyCache
 {
-protected:
+public:
     /**
-     * @brief The KeyEntry struct represents a Key in the map of keys (mKeys)
+     * @brief The Entry struct represents a key in the cache.
      * If the received key is still encrypted (because the required public key
-     * has to be fetched from API), then a promise will be attached to this KeyEntry.key
+     * has to be fetched from API), then a promise will be attached to this Entry.
      * Such promise will be resolved once the key is successfully decrypted.
      * If decryption fails, then the promise will be rejected.
      * For new keys getting confirmed, the promise is never used.
+     * Decrypted keys are resident in the LRU list and can be evicted,
+     * since they are also persisted in the db and can be loaded again on demand.
      */
-    struct KeyEntry
+    struct Entry
     {
         std::shared_ptr<SendKey> key;
         std::shared_ptr<promise::Promise<std::shared_ptr<SendKey>>> pms;
-        KeyEntry(){}
-        KeyEntry(const std::shared_ptr<SendKey>& aKey): key(aKey){}
+        std::list<UserKeyId>::iterator lruPos;
+        bool inLru = false;
+        Entry(){}
+        Entry(const std::shared_ptr<SendKey>& aKey): key(aKey){}
     };
 
+    /** Counters of the cache */
+    struct Stats
+    {
+        uint64_t hits = 0;          // key found in memory
+        uint64_t misses = 0;        // key not in memory: looked up in db
+        uint64_t missing = 0;       // key known to be missing: not looked up in db again
+        uint64_t loaded = 0;        // keys loaded from db (including the prefetched ones)
+        uint64_t evictions = 0;     // keys removed from memory to honor the limit
+    };
+
+    enum
+    {
+        /** Default maximum number of decrypted send keys kept in memory per chat */
+        kDefaultMaxResidentKeys = 256,
+        /** When a key is not in memory, the older keys of the same user, up to this
+         * number, are loaded along with it: history is fetched from newer to older */
+        kKeyPrefetchWindow = 32,
+        /** Maximum number of keys remembered as missing in db */
+        kMaxMissingKeys = 256
+    };
+
+    SendKeyCache(SqliteDb& db, karere::Id chatid): mDb(db), mChatid(chatid) {}
+
+    /**
+     * @brief Returns the entry of the key, loading it from db (and the preceding
+     * \c prefetch - 1 keys of the same user) if it's not in memory.
+     * @return The entry, or null if the key is unknown
+     */
+    Entry* find(UserKeyId ukid, uint32_t prefetch = kKeyPrefetchWindow);
+
+    /** Returns the entry of the key, loaded from db if needed, or a new empty entry */
+    Entry& findOrAdd(UserKeyId ukid);
+
+    /** Returns the entry of the key only if it's in memory. It's not looked up in db */
+    Entry* get(UserKeyId ukid);
+
+    /** Marks the decrypted key as the most recently used, and evicts the least
+     * recently used ones if the limit is exceeded. It never evicts \c entry */
+    void touch(UserKeyId ukid, Entry& entry);
+
+    /** Removes the entry from memory, not from db */
+    void erase(UserKeyId ukid);
+
+    /**
+     * @brief Loads from db the keys of \c userid with keyid in [minKeyid, maxKeyid]
+     * that are not in memory yet.
+     * @return The number of keys loaded
+     */
+    size_t prefetch(karere::Id userid, chatd::KeyId minKeyid, chatd::KeyId maxKeyid);
+
+    /**
+     * @brief Loads from db the keys of any user with keyid in [minKeyid, maxKeyid]
+     * that are not in memory yet, so the messages of a history range are decrypted
+     * without a db lookup per key.
+     * @return The number of keys loaded
+     */
+    size_t prefetchRange(chatd::KeyId minKeyid, chatd::KeyId maxKeyid);
+
+    /** Forgets the keys known to be missing, so they are looked up in db again */
+    void clearMissing() { mMissing.clear(); }
+
+    /** Sets the maximum number of decrypted keys kept in memory (minimum 1).
+     * Keys in excess are evicted, least recently used first */
+    void setMaxResident(size_t maxKeys);
+    size_t maxResident() const { return mMaxResident; }
+    size_t residentCount() const { return mLru.size(); }
+    const Stats& stats() const { return mStats; }
+
+protected:
+    SqliteDb& mDb;
+    karere::Id mChatid;
+    std::map<UserKeyId, Entry> mKeys;
+    // decrypted keys in mKeys, most recently used first
+    std::list<UserKeyId> mLru;
+    std::set<UserKeyId> mMissing;
+    size_t mMaxResident = kDefaultMaxResidentKeys;
+    Stats mStats;
+
+    /** Adds the key loaded from db, unless it's already in memory */
+    bool load(UserKeyId ukid, const std::shared_ptr<SendKey>& key);
+    void evict();
+};
+
+class TlvWriter;
+extern const std::string SVCRYPTO_PAIRWISE_KEY;
+void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output, const std::string& padString=SVCRYPTO_PAIRWISE_KEY);
+
+/**
+ * @brief Bounded pool of threads that verify and decrypt messages ahead of time.
+ *
+ * Jobs only work on their own copies of the data (signature verification and AES),
+ * so they don't access the ProtocolHandler nor the chatd::Message. Their completion
+ * is notified in the app's thread by the jobs themselves, via marshallCall().
+ */
+class DecryptWorkerPool
+{
+public:
+    enum { kMaxQueuedJobs = 1024 };
+    explicit DecryptWorkerPool(unsigned threadCount = defaultThreadCount());
+    ~DecryptWorkerPool();
+    /** Waits for the queued jobs to complete and restarts with \c threadCount threads.
+     * Zero disables the pool: jobs are not accepted anymore */
+    void setThreadCount(unsigned threadCount);
+    unsigned threadCount() const { return static_cast<unsigned>(mThreads.size()); }
+    /** Queues a job. Returns false if the pool is disabled or its queue is full */
+    bool submit(std::function<void()>&& job);
+    /** One thread less than the number of cores, up to 4 */
+    static unsigned defaultThreadCount();
+
+protected:
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<std::function<void()>> mJobs;
+    std::vector<std::thread> mThreads;
+    bool mStopping = false;
+    void run();
+    void stop();
+};
+
+/**
+ * @brief The ProtocolHandler class implements ICrypto.
+ * @see chatd::ICrypto for more details.
+ */
+class ProtocolHandler: public chatd::ICrypto, public karere::DeleteTrackable
+{
+protected:
+    typedef SendKeyCache::Entry KeyEntry;
+
     // own keys
     karere::Id mOwnHandle;
     EcKey myPrivCu25519;
@@ -304,7 +447,11 @@ protected:
     std::vector<NewKeyEntry> mUnconfirmedKeys;
 
     // received and confirmed keys (doesn't include unconfirmed keys)
-    std::map<UserKeyId, KeyEntry> mKeys;
+    SendKeyCache mKeyCache;
+
+    // keyids of the history range fetched so far, whose keys were already prefetched (empty if min > max)
+    chatd::KeyId mHistoryKeyidMin = CHATD_KEYID_MAX;
+    chatd::KeyId mHistoryKeyidMax = CHATD_KEYID_INVALID;
 
     // cache of symmetric keys (pubCu255 * privCu255)
     std::map<karere::Id, std::shared_ptr<SendKey>> mSymmKeyCache;
@@ -317,6 +464,50 @@ protected:
     std::shared_ptr<UnifiedKey> mUnifiedKey;
     promise::Promise<std::shared_ptr<UnifiedKey>> mUnifiedKeyDecrypted;
 
+    /**
+     * @brief The DecryptJob struct holds a message being verified and decrypted by
+     * the DecryptWorkerPool. Its fields are not accessed by the app's thread until
+     * \c done is set. It holds no promise, since a job may be released by a worker:
+     * the ones waiting for it are in mDecryptJobPromises, resolved in the app's thread.
+     */
+    struct DecryptJob
+    {
+        uint64_t id;
+        unsigned int historyFetch;     // value of mHistoryFetchCount when it was created
+        karere::Id msgid;
+        std::shared_ptr<ParsedMessage> parsedMsg;
+        std::shared_ptr<SendKey> sendKey;
+        std::shared_ptr<EcKey> edKey;   // shared by the jobs of consecutive messages from the same sender
+        uint16_t updated;
+        unsigned int cacheVersion;
+        bool verified = false;
+        std::string cleartext;
+        std::atomic<bool> done{false};
+    };
+
+    DecryptWorkerPool* mDecryptWorkers = nullptr;
+    std::map<karere::Id, std::shared_ptr<DecryptJob>> mDecryptJobs;   // by msgid
+    std::map<uint64_t, promise::Promise<void>> mDecryptJobPromises;     // by id of the job
+    uint64_t mLastDecryptJobId = 0;
+    unsigned int mHistoryFetchCount = 0;
+    // keys of the last message decrypted ahead, likely the same for the next ones
+    UserKeyId mAheadKeyId = UserKeyId(karere::Id::inval(), CHATD_KEYID_INVALID);
+    std::shared_ptr<SendKey> mAheadSendKey;
+    karere::Id mAheadSender = karere::Id::inval();
+    std::shared_ptr<EcKey> mAheadEdKey;
+
+public:
+    /** Counters of how messages were decrypted by \c msgDecrypt() (management messages excluded) */
+    struct DecryptStats
+    {
+        uint64_t fastPath = 0;  // keys already available: decrypted synchronously, without promises
+        uint64_t slowPath = 0;  // waited for keys, or for their promises
+        uint64_t ahead = 0;     // decrypted in advance by msgDecryptAhead()
+    };
+
+protected:
+    DecryptStats mDecryptStats;
+
 public:
     karere::Id chatid;
     karere::Id mPh = karere::Id::inval();     // it's only valid during preview mode (required to fetch user-attributes)
@@ -333,9 +524,20 @@ public:
         decryptKey(std::shared_ptr<Buffer>& key, karere::Id sender, karere::Id receiver);
 
     unsigned int getCacheVersion() const;
+    const DecryptStats& decryptStats() const { return mDecryptStats; }
+    const SendKeyCache::Stats& keyCacheStats() const { return mKeyCache.stats(); }
+    size_t residentKeyCount() const { return mKeyCache.residentCount(); }
+
+    /** Sets the maximum number of decrypted send keys kept in memory (minimum 1).
+     * Keys in excess are evicted, least recently used first */
+    void setMaxResidentKeys(size_t maxKeys) { mKeyCache.setMaxResident(maxKeys); }
+
+    /** Sets the pool used by \c msgDecryptAhead(). If null, messages are only decrypted
+     * by \c msgDecrypt() */
+    void setDecryptWorkers(DecryptWorkerPool* workers) { mDecryptWorkers = workers; }
 
 protected:
-    void loadKeysFromDb();
+    void resetHistoryKeyRange();
 
     /**
      * @brief Load unconfirmed keys stored in cache
@@ -347,6 +549,8 @@ protected:
     void loadUnconfirmedKeysFromDb();
 
     promise::Promise<std::shared_ptr<SendKey>> getKey(UserKeyId ukid);
+    /** Returns the key if it's already decrypted (loading it from db if needed), or null otherwise */
+    std::shared_ptr<SendKey> getKeyIfAvailable(karere::Id userid, uint32_t keyid);
     void addDecryptedKey(UserKeyId ukid, const std::shared_ptr<SendKey>& key);
     /**
      * Updates our own sender key. Done when a message is sent and users
@@ -392,11 +596,20 @@ protected:
 
     void fetchUserKeys(karere::Id userid);
 
+    bool submitDecryptJob(const std::shared_ptr<DecryptJob>& job);
+    static void runDecryptJob(DecryptJob& job);
+    void onDecryptJobDone(const DecryptJob& job);
+    void pruneDecryptJobs(unsigned int olderThanFetch);
+    promise::Promise<chatd::Message*> msgDecryptWithJob(const std::shared_ptr<DecryptJob>& job, chatd::Message* msg);
+    promise::Promise<chatd::Message*> applyDecryptJob(DecryptJob& job, chatd::Message* msg);
+
 public:
 //chatd::ICrypto interface
     promise::Promise<std::pair<chatd::MsgCommand*, chatd::KeyCommand*>>
     msgEncrypt(chatd::Message *message, const karere::SetOfIds &recipients, chatd::MsgCommand* msgCmd) override;
     promise::Promise<chatd::Message*> msgDecrypt(chatd::Message* message) override;
+    void msgDecryptAhead(chatd::Message* message) override;
+    void prefetchHistoryKeys(chatd::KeyId keyid) override;
     void onKeyReceived(chatd::KeyId keyid, karere::Id sender,
         karere::Id receiver, const char* data, uint16_t dataLen, bool isEncrypted) override;
     void onKeyConfirmed(chatd::KeyId localkeyid, chatd::KeyId keyid) override;
@@ -419,6 +632,8 @@ public:
     bool isPublicChat() const override;
     void setPrivateChatMode() override;
     void onHistoryReload() override;
+    void onHistoryFetchEnd() override;
+    void onOnlineStateChange(chatd::ChatState state) override;
     uint64_t getPublicHandle() const override;
     void setPublicHandle(const uint64_t ph) override;
     karere::UserAttrCache& userAttrCache() override;
@@ -90,7 +90,7 @@ Buffer* getDataNotImpl(const ::mega::MegaRequest& /*req*/)
 
 UserAttrCache::~UserAttrCache()
 {
-    mClient.api.sdk.removeGlobalListener(this);
+    mApi.sdk.removeGlobalListener(this);
 }
 
 UserAttrDescMap gUserAttrDescsMap =
@@ -190,21 +190,36 @@ void UserAttrCache::dbWriteNull(UserAttrPair key)
     UACACHE_LOG_DEBUG("dbWriteNull attr %s as NULL", key.toString().c_str());
 }
 
-UserAttrCache::UserAttrCache(Client& aClient): mClient(aClient)
+void UserAttrCache::readFromDb(SqliteDb& db, std::vector<DbRow>& rows)
 {
-    //load all attributes from db
-    SqliteStmt stmt(mClient.db, "select userid, type, data from userattrs");
+    SqliteStmt stmt(db, "select userid, type, data from userattrs");
     while(stmt.step())
     {
         std::unique_ptr<Buffer> data(new Buffer((size_t)sqlite3_column_bytes(stmt, 2)));
         stmt.blobCol(2, *data);
-        UserAttrPair key(stmt.uint64Col(0), stmt.intCol(1));
+        rows.push_back(DbRow{stmt.uint64Col(0), stmt.intCol(1), std::move(data)});
+    }
+}
+
+UserAttrCache::UserAttrCache(Client& aClient, std::vector<DbRow>* rows, MyMegaApi* api)
+    : mClient(aClient), mApi(api ? *api : aClient.api)
+{
+    //load all attributes from db
+    std::vector<DbRow> dbRows;
+    if (!rows)
+    {
+        readFromDb(mClient.db, dbRows);
+        rows = &dbRows;
+    }
+    for (DbRow& row: *rows)
+    {
+        UserAttrPair key(row.userid, row.type);
         emplace(std::make_pair(key, std::make_shared<UserAttrCacheItem>(
-                *this, data.release(), kCacheFetchNotPending)));
+                *this, row.data.release(), kCacheFetchNotPending)));
 //        UACACHE_LOG_DEBUG("loaded attr %s", key.toString().c_str());
     }
     UACACHE_LOG_DEBUG("loaded %zu entries from db", size());
-    mClient.api.sdk.addGlobalListener(this);
+    mApi.sdk.addGlobalListener(this);
 }
 
 const char* attrName(uint8_t type)
@@ -394,57 +409,94 @@ void UserAttrCache::fetchAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheIte
         case USER_ATTR_FULLNAME:
             fetchUserFullName(key, item);
             break;
-        case USER_ATTR_EMAIL:
-            fetchEmail(key, item);
-            break;
         default:
-            fetchStandardAttr(key, item);
+            queueFetch(key, item);
             break;
     }
 }
-void UserAttrCache::fetchStandardAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
+void UserAttrCache::queueFetch(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
 {
-    auto wptr = weakHandle();
-
-    // We need to create an aux var to store ph in heap instead of stack in order to avoid stack-use-after-scope
-    std::string auxPh = key.mPh.toString(Id::CHATLINKHANDLE);
-    const char *ph = key.mPh.isValid() ? auxPh.c_str() : NULL;
-
-    mClient.api.call(&::mega::MegaApi::getChatUserAttribute,
-        key.user.toString().c_str(), (int)key.attrType, ph)
-    .then([wptr, this, key, item](ReqResult result)
+    if (!mQueuedFetches.emplace(key, item).second)
     {
-        wptr.throwIfDeleted();
-        auto& desc = gUserAttrDescsMap.at(key.attrType);
-        item->data.reset(desc.getData(*result));
-        item->resolve(key);
-    })
-    .fail([wptr, this, key, item](const ::promise::Error& err)
+        mFetchStats.deduplicated++;
+        return;
+    }
+    if (mQueuedFetches.size() > 1)
     {
-        wptr.throwIfDeleted();
-        item->error(key, err.code());
-        return err;
-    });
+        return; // already scheduled
+    }
+
+    // opening a chat requests the attributes of all its members in a row: send them together
+    auto wptr = weakHandle();
+    marshallCall([wptr, this]()
+    {
+        if (wptr.deleted())
+            return;
+        flushFetches();
+    }, mClient.appCtx);
 }
 
-void UserAttrCache::fetchEmail(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
+void UserAttrCache::flushFetches()
 {
-    auto wptr = weakHandle();
-    mClient.api.call(&::mega::MegaApi::getUserEmail,
-        key.user.val)
-    .then([wptr, this, key, item](ReqResult result)
+    std::map<UserAttrPair, std::shared_ptr<UserAttrCacheItem>> queued;
+    queued.swap(mQueuedFetches);
+    if (queued.empty())
     {
-        wptr.throwIfDeleted();
-        auto email = result->getEmail();
-        item->data.reset(new Buffer(email, strlen(email)));
-        item->resolve(key);
-    })
-    .fail([wptr, this, key, item](const ::promise::Error& err)
+        return;
+    }
+
+    std::vector<MyMegaApi::UserAttrRequest> requests;
+    requests.reserve(queued.size());
+    for (auto& fetch: queued)
     {
-        wptr.throwIfDeleted();
-        item->error(key, err.code());
-        return err;
-    });
+        const UserAttrPair& key = fetch.first;
+        int type = (key.attrType == USER_ATTR_EMAIL) ? MyMegaApi::UserAttrRequest::kEmail : key.attrType;
+        requests.push_back(MyMegaApi::UserAttrRequest{key.user, type, key.mPh, ApiPromise()});
+    }
+
+    mFetchStats.batches++;
+    mFetchStats.requests += requests.size();
+    mFetchStats.maxBatchSize = std::max<uint64_t>(mFetchStats.maxBatchSize, requests.size());
+    mFetchStats.inFlight += requests.size();
+    mFetchStats.maxInFlight = std::max(mFetchStats.maxInFlight, mFetchStats.inFlight);
+    UACACHE_LOG_DEBUG("Fetching %zu attributes in a batch (%lu in flight)",
+                      requests.size(), (unsigned long)mFetchStats.inFlight);
+    mApi.fetchUserAttrs(requests);
+
+    auto wptr = weakHandle();
+    size_t i = 0;
+    for (auto& fetch: queued)
+    {
+        UserAttrPair key = fetch.first;
+        std::shared_ptr<UserAttrCacheItem> item = fetch.second;
+        requests[i++].promise
+        .then([wptr, this, key, item](ReqResult result)
+        {
+            wptr.throwIfDeleted();
+            mFetchStats.inFlight--;
+            if (key.attrType == USER_ATTR_EMAIL)
+            {
+                auto email = result->getEmail();
+                item->data.reset(new Buffer(email, strlen(email)));
+            }
+            else
+            {
+                auto& desc = gUserAttrDescsMap.at(key.attrType);
+                item->data.reset(desc.getData(*result));
+            }
+            item->resolve(key);
+        })
+        .fail([wptr, this, key, item](const ::promise::Error& err)
+        {
+            wptr.throwIfDeleted();
+            if (err.type() == ERRTYPE_MEGASDK) // otherwise, the result was received but not valid
+            {
+                mFetchStats.inFlight--;
+            }
+            item->error(key, err.code());
+            return err;
+        });
+    }
 }
 
 void UserAttrCache::fetchUserFullName(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
@@ -536,6 +588,16 @@ void UserAttrCache::onLogOut()
     mIsLoggedIn = false;
 }
 
+Buffer* UserAttrCache::getDataNow(uint64_t user, unsigned attrType, uint64_t ph)
+{
+    auto it = find(UserAttrPair(user, attrType, ph));
+    if (it == end() || it->second->pending == kCacheFetchNewPending)
+    {
+        return nullptr;
+    }
+    return it->second->data.get();
+}
+
 promise::Promise<Buffer*>
 UserAttrCache::getAttr(uint64_t user, unsigned attrType, uint64_t ph)
 {
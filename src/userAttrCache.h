@@ -4,12 +4,16 @@
 #include "karereId.h"
 #include <megaapi.h>
 #include <list>
+#include <memory>
+#include <vector>
 #include <promise.h>
 #include <base/trackDelete.h>
 
 #define UACACHE_LOG_DEBUG(fmtString,...) KARERE_LOG_DEBUG(krLogChannel_uacache, fmtString, ##__VA_ARGS__)
 
 class Buffer;
+class SqliteDb;
+class MyMegaApi;
 
 namespace mega
 {
@@ -126,17 +130,34 @@ struct UserAttrCacheItem
 class UserAttrCache: public std::map<UserAttrPair, std::shared_ptr<UserAttrCacheItem>>,
                      public ::mega::MegaGlobalListener, public karere::DeleteTrackable
 {
+public:
+    /** @brief Statistics of the fetches of attributes from the API */
+    struct FetchStats
+    {
+        uint64_t requests = 0;      // attributes requested to the API
+        uint64_t deduplicated = 0;  // fetches of attributes already queued, not requested again
+        uint64_t batches = 0;       // batches of requests sent to the API
+        uint64_t maxBatchSize = 0;
+        uint64_t inFlight = 0;      // requests without result yet
+        uint64_t maxInFlight = 0;
+    };
+
 protected:
     Client& mClient;
+    MyMegaApi& mApi;
     bool mIsLoggedIn = false;
+    // attributes to fetch, queued during the current tick and requested together by flushFetches()
+    std::map<UserAttrPair, std::shared_ptr<UserAttrCacheItem>> mQueuedFetches;
+    FetchStats mFetchStats;
     void dbWrite(UserAttrPair key, const Buffer& data);
     void dbWriteNull(UserAttrPair key);
     void dbInvalidateItem(UserAttrPair item);
     void fetchAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
 //actual attrib fetch backend functions
     void fetchUserFullName(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
-    void fetchStandardAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
-    void fetchEmail(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
+    /** Queues the fetch of a standard attribute or the email, to be sent with the rest of the tick */
+    void queueFetch(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
+    void flushFetches();
 //==
     void onUserAttrChange(uint64_t userid, int changed);
     void onUserAttrChange(::mega::MegaUser& user);
@@ -160,7 +181,21 @@ public:
      * if it has not been assigned a valid value, as returned by \c getAttr()
      */
     typedef UserAttrReqCb::WeakRefHandle Handle;
-    UserAttrCache(Client& aClient);
+
+    /** @brief An attribute cached in db */
+    struct DbRow
+    {
+        uint64_t userid;
+        int type;
+        std::unique_ptr<Buffer> data;
+    };
+    /** @brief Reads all the attributes cached in db. It may be called from any thread, with a connection of its own */
+    static void readFromDb(SqliteDb& db, std::vector<DbRow>& rows);
+
+    /** @brief Creates the cache with the attributes cached in db. If \c rows is provided,
+     * they are taken from there instead of being read from db. If \c api is provided,
+     * attributes are fetched through it instead of the API of the client */
+    UserAttrCache(Client& aClient, std::vector<DbRow>* rows = nullptr, MyMegaApi* api = nullptr);
     ~UserAttrCache();
     /** @brief gets the attribute \c attrType of user \c user. When the attribute
      * is successfully obtained, the callback \c will be called with a Buffer object, containing
@@ -178,6 +213,10 @@ public:
      * is implicitly one-shot, as a promise can be resolved only once.
      */
     promise::Promise<Buffer*> getAttr(uint64_t user, unsigned attrType, uint64_t ph = Id::inval());
+    /** @brief Returns the attribute if it's already in the cache, without fetching it nor
+     * registering any callback. Returns \c nullptr if it's not available yet, or the fetch failed.
+     */
+    Buffer* getDataNow(uint64_t user, unsigned attrType, uint64_t ph = Id::inval());
     /** @brief Unregisters an attribute request/subsequent callbacks.
      * It can be a not-yet-fetched single shot request as well. Use this method
      * to unsubscribe from further calling the corresponding callback.
@@ -185,6 +224,7 @@ public:
      * request is currently registered (expired one-shot for example).
      */
     bool removeCb(Handle handle);
+    const FetchStats& fetchStats() const { return mFetchStats; }
 };
 
 }
@@ -0,0 +1,609 @@
+/**
+ * @file tests/bench/chatd_bench.cpp
+ * @brief Offline benchmark of the chatd protocol stack
+ *
+ * Feeds a stream of chatd frames (synthetic, or recorded in a file) into
+ * chatd::Connection through a mock WebsocketsIO, with a stub ICrypto that
+ * treats payloads as plain text and an in-memory history database. No network
+ * connection nor MEGA account is required.
+ *
+ * Usage: chatd_bench [--history N] [--messages N] [--seed N]
+ *                    [--save <file>] [--replay <file>]
+ *
+ * Frame files are a sequence of records: frame length (uint32, little endian)
+ * followed by the frame data, as received from chatd. When replaying a file,
+ * the chat is created with the chatid of its first command, which must be a JOIN.
+ *
+ * (c) 2020 by Mega Limited, Wellsford, New Zealand
+ *
+ * This file is part of the MEGA SDK - Client Access Engine.
+ *
+ * Applications using the MEGA API must present a valid application key
+ * and comply with the the rules set forth in the Terms of Service.
+ *
+ * The MEGA SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * @copyright Simplified (2-clause) BSD License.
+ *
+ * You should have received a copy of the license along with this
+ * program.
+ */
+
+#include <megaapi.h>
+#include "../../src/megachatapi_impl.h"
+#include "../../src/chatClient.h"
+#include "../../src/chatd.h"
+#include "../../src/chatdDb.h"
+#include "../../src/chatdICrypto.h"
+#include "../../src/net/websocketsIO.h"
+#include "../../src/base/gcmpp.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <new>
+#include <random>
+#include <thread>
+#include <sys/stat.h>
+
+static const std::string APPLICATION_KEY = "MBoVFSyZ";
+static const std::string USER_AGENT_DESCRIPTION = "MEGAChatBench";
+static const int kBenchShard = 0;
+static const unsigned kFramesPerCall = 256;     // frames processed per marshalled call
+static const unsigned kOldMsgPerFrame = 32;     // chatd sends history in bursts
+static const unsigned kBenchUsers = 10;
+
+// Heap allocations done by the chat thread (the only one that parses frames)
+static thread_local uint64_t tAllocCount = 0;
+
+void* operator new(size_t size)
+{
+    tAllocCount++;
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+// Runs func in the chat thread, where karere objects live, and waits for it to complete
+static megachat::MegaChatApiImpl* gChatApiImpl = nullptr;
+
+template <class F>
+void runInChatThread(F&& func)
+{
+    std::promise<void> done;
+    karere::marshallCall([&func, &done]()
+    {
+        func();
+        done.set_value();
+    }, gChatApiImpl);
+    done.get_future().wait();
+}
+
+// ---- Mock network layer ----
+
+class BenchWebsocketsClientImpl: public WebsocketsClientImpl
+{
+public:
+    std::atomic<bool> mJoinSent{false};
+    uint64_t mBytesSent = 0;
+
+    BenchWebsocketsClientImpl(WebsocketsIO::Mutex& mutex, WebsocketsClient* client, void* appCtx)
+        : WebsocketsClientImpl(mutex, client), mAppCtx(appCtx) {}
+
+    virtual bool wsSendMessage(char* msg, size_t len)
+    {
+        mBytesSent += len;
+        if (len && msg[0] == chatd::OP_JOIN)
+        {
+            mJoinSent = true;
+        }
+        if (!mWritePending)
+        {
+            // the real socket notifies once per batch of written data, asynchronously
+            mWritePending = true;
+            karere::marshallCall([this]()
+            {
+                mWritePending = false;
+                wsSendMsgCb(nullptr, 0);
+            }, mAppCtx);
+        }
+        return true;
+    }
+    virtual void wsDisconnect(bool /*immediate*/) { mConnected = false; }
+    virtual bool wsIsConnected() { return mConnected; }
+
+    void connected()
+    {
+        mConnected = true;
+        wsConnectCb();
+    }
+
+protected:
+    void* mAppCtx;
+    bool mConnected = false;
+    bool mWritePending = false;
+};
+
+class BenchWebsocketsIO: public WebsocketsIO
+{
+public:
+    BenchWebsocketsClientImpl* mConnection = nullptr;
+
+    BenchWebsocketsIO(Mutex& mutex, ::mega::MegaApi* megaApi, void* ctx)
+        : WebsocketsIO(mutex, megaApi, ctx) {}
+    virtual void addevents(::mega::Waiter*, int) {}
+
+protected:
+    virtual bool wsResolveDNS(const char* /*hostname*/, std::function<void(int, const std::vector<std::string>&, const std::vector<std::string>&)> f)
+    {
+        karere::marshallCall([f]()
+        {
+            f(0, std::vector<std::string>(1, "127.0.0.1"), std::vector<std::string>());
+        }, appCtx);
+        return true;
+    }
+    virtual WebsocketsClientImpl* wsConnect(const char* /*ip*/, const char* /*host*/,
+                                           int /*port*/, const char* /*path*/, bool /*ssl*/,
+                                           WebsocketsClient* client)
+    {
+        BenchWebsocketsClientImpl* conn = new BenchWebsocketsClientImpl(mutex, client, appCtx);
+        mConnection = conn;
+        karere::marshallCall([conn]()
+        {
+            conn->connected();
+        }, appCtx);
+        return conn;
+    }
+    virtual int wsGetNoNameErrorCode() { return -1; }
+};
+
+// ---- Stubs of the app and crypto layers ----
+
+class BenchApp: public karere::IApp, public karere::IApp::IChatListHandler
+{
+public:
+    virtual karere::IApp::IChatListHandler* chatListHandler() { return this; }
+    virtual IGroupChatListItem* addGroupChatItem(karere::GroupChatRoom&) { return nullptr; }
+    virtual void removeGroupChatItem(IGroupChatListItem&) {}
+    virtual IPeerChatListItem* addPeerChatItem(karere::PeerChatRoom&) { return nullptr; }
+    virtual void removePeerChatItem(IPeerChatListItem&) {}
+    virtual void onPresenceConfigChanged(const presenced::Config&, bool) {}
+    virtual void onPresenceLastGreenUpdated(karere::Id, uint16_t) {}
+#ifndef KARERE_DISABLE_WEBRTC
+    virtual rtcModule::ICallHandler* onIncomingCall(rtcModule::ICall&, karere::AvFlags) { return nullptr; }
+#endif
+};
+
+// Payloads are not encrypted: the message content is the payload itself
+class BenchCrypto: public chatd::ICrypto
+{
+public:
+    BenchCrypto(karere::Client& client): chatd::ICrypto(client.appCtx), mClient(client) {}
+    virtual void setUsers(karere::SetOfIds*) {}
+    virtual ::promise::Promise<std::pair<chatd::MsgCommand*, chatd::KeyCommand*>>
+    msgEncrypt(chatd::Message*, const karere::SetOfIds&, chatd::MsgCommand*)
+    {
+        return ::promise::Error("BenchCrypto: sending messages is not supported");
+    }
+    virtual ::promise::Promise<chatd::Message*> msgDecrypt(chatd::Message* msg)
+    {
+        if (!msg->empty())
+        {
+            msg->type = chatd::Message::kMsgNormal;
+        }
+        msg->setEncrypted(chatd::Message::kNotEncrypted);
+        return ::promise::Promise<chatd::Message*>(msg);
+    }
+    virtual void onKeyReceived(chatd::KeyId, karere::Id, karere::Id, const char*, uint16_t, bool) {}
+    virtual void onKeyConfirmed(chatd::KeyId, chatd::KeyId) {}
+    virtual void onKeyRejected() {}
+    virtual void resetSendKey() {}
+    virtual void randomBytes(void* buf, size_t bufsize) const
+    {
+        for (size_t i = 0; i < bufsize; i++)
+        {
+            static_cast<uint8_t*>(buf)[i] = static_cast<uint8_t>(rand());
+        }
+    }
+    virtual ::promise::Promise<std::shared_ptr<Buffer>> encryptChatTitle(const std::string&, uint64_t, bool)
+    {
+        return ::promise::Error("BenchCrypto: not supported");
+    }
+    virtual ::promise::Promise<chatd::KeyCommand*> encryptUnifiedKeyForAllParticipants(uint64_t)
+    {
+        return ::promise::Error("BenchCrypto: not supported");
+    }
+    virtual ::promise::Promise<std::string> decryptChatTitleFromApi(const Buffer&)
+    {
+        return ::promise::Error("BenchCrypto: not supported");
+    }
+    virtual ::promise::Promise<std::string> encryptUnifiedKeyToUser(karere::Id)
+    {
+        return ::promise::Error("BenchCrypto: not supported");
+    }
+    virtual ::promise::Promise<std::string> decryptUnifiedKey(std::shared_ptr<Buffer>&, uint64_t, uint64_t)
+    {
+        return ::promise::Error("BenchCrypto: not supported");
+    }
+    virtual ::promise::Promise<std::shared_ptr<std::string>> getUnifiedKey()
+    {
+        return ::promise::Error("BenchCrypto: not supported");
+    }
+    virtual bool previewMode() { return false; }
+    virtual bool isPublicChat() const { return false; }
+    virtual void setPrivateChatMode() {}
+    virtual void onHistoryReload() {}
+    virtual uint64_t getPublicHandle() const { return karere::Id::inval(); }
+    virtual void setPublicHandle(const uint64_t) {}
+    virtual karere::UserAttrCache& userAttrCache() { return mClient.userAttrCache(); }
+    virtual std::shared_ptr<Buffer> reactionEncrypt(const chatd::Message&, const std::string& reaction)
+    {
+        return std::make_shared<Buffer>(reaction.data(), reaction.size());
+    }
+    virtual ::promise::Promise<std::shared_ptr<Buffer>> reactionDecrypt(const karere::Id&, const karere::Id&, const chatd::KeyId&, const std::string& reaction)
+    {
+        return ::promise::Promise<std::shared_ptr<Buffer>>(std::make_shared<Buffer>(reaction.data(), reaction.size()));
+    }
+
+protected:
+    karere::Client& mClient;
+};
+
+class BenchListener: public chatd::Listener
+{
+public:
+    BenchListener(SqliteDb& db): mDb(db) {}
+    virtual void init(chatd::Chat& chat, chatd::DbInterface*& dbIntf)
+    {
+        dbIntf = new ChatdSqliteDb(chat, mDb);
+    }
+    virtual void onOnlineStateChange(chatd::ChatState state) { mState = state; }
+    virtual void onRecvNewMessage(chatd::Idx, chatd::Message&, chatd::Message::Status) { mNewMessages++; }
+    virtual void onRecvHistoryMessage(chatd::Idx, chatd::Message&, chatd::Message::Status, bool) { mHistMessages++; }
+
+    std::atomic<int> mState{chatd::kChatStateOffline};
+    uint64_t mNewMessages = 0;
+    uint64_t mHistMessages = 0;
+
+protected:
+    SqliteDb& mDb;
+};
+
+// ---- Frame generation ----
+
+class FrameGenerator
+{
+public:
+    FrameGenerator(karere::Id chatid, unsigned seed)
+        : mChatid(chatid), mRandom(seed)
+    {
+        for (unsigned i = 0; i < kBenchUsers; i++)
+        {
+            mUsers.push_back(karere::Id(0x1000 + i));
+        }
+    }
+
+    // Frames sent by chatd after a JOIN with empty history, followed by a
+    // live stream of new messages, edits, SEEN/RECEIVED and reactions updates
+    std::vector<Buffer> generate(unsigned historyCount, unsigned newCount)
+    {
+        std::vector<Buffer> frames;
+        uint32_t ts = 1500000000;
+
+        Buffer joins;
+        for (karere::Id user: mUsers)
+        {
+            joins.append(chatd::Command(chatd::OP_JOIN) + mChatid + user + (int8_t)chatd::PRIV_FULL);
+        }
+        frames.push_back(std::move(joins));
+
+        // history is sent newest first
+        Buffer burst;
+        unsigned inBurst = 0;
+        for (unsigned i = 0; i < historyCount; i++)
+        {
+            burst.append(message(chatd::OP_OLDMSG, karere::Id(mNextMsgid + historyCount - i), ts - i * 60, 0));
+            if (++inBurst == kOldMsgPerFrame)
+            {
+                frames.push_back(std::move(burst));
+                burst = Buffer();
+                inBurst = 0;
+            }
+        }
+        burst.append(chatd::Command(chatd::OP_HISTDONE) + mChatid);
+        frames.push_back(std::move(burst));
+        mNextMsgid += historyCount + 1;
+
+        uint64_t rsn = 1;
+        for (unsigned i = 0; i < newCount; i++)
+        {
+            karere::Id msgid(mNextMsgid++);
+            ts += 5;
+            frames.push_back(message(chatd::OP_NEWMSG, msgid, ts, 0));
+            if (i % 10 == 9)
+            {
+                frames.push_back(message(chatd::OP_MSGUPD, karere::Id(msgid.val - 3), ts - 15, 20));
+            }
+            if (i % 20 == 19)
+            {
+                frames.push_back(chatd::Command(chatd::OP_SEEN) + mChatid + msgid);
+                frames.push_back(chatd::Command(chatd::OP_RECEIVED) + mChatid + msgid);
+            }
+            if (i % 50 == 49)
+            {
+                frames.push_back(chatd::Command(chatd::OP_REACTIONSN) + mChatid + karere::Id(rsn++));
+            }
+        }
+        return frames;
+    }
+
+protected:
+    karere::Id mChatid;
+    std::vector<karere::Id> mUsers;
+    std::mt19937 mRandom;
+    uint64_t mNextMsgid = 0x100000;
+
+    chatd::Command message(uint8_t opcode, karere::Id msgid, uint32_t ts, uint16_t updated)
+    {
+        // mostly short texts, with some longer ones
+        size_t len = (mRandom() % 10) ? 16 + mRandom() % 128 : 256 + mRandom() % 1024;
+        std::string text;
+        text.reserve(len);
+        for (size_t i = 0; i < len; i++)
+        {
+            text += static_cast<char>('a' + mRandom() % 26);
+        }
+
+        chatd::Command cmd(opcode, 64 + len);
+        cmd + mChatid + mUsers[mRandom() % mUsers.size()] + msgid + ts + updated
+            + (uint32_t)CHATD_KEYID_INVALID + (uint32_t)len + text;
+        return cmd;
+    }
+};
+
+static bool saveFrames(const std::string& path, const std::vector<Buffer>& frames)
+{
+    std::ofstream out(path, std::ios::binary);
+    for (const Buffer& frame: frames)
+    {
+        uint32_t len = static_cast<uint32_t>(frame.dataSize());
+        out.write(reinterpret_cast<const char*>(&len), sizeof(len));
+        out.write(frame.buf(), frame.dataSize());
+    }
+    return out.good();
+}
+
+static bool loadFrames(const std::string& path, std::vector<Buffer>& frames)
+{
+    std::ifstream in(path, std::ios::binary);
+    uint32_t len;
+    while (in.read(reinterpret_cast<char*>(&len), sizeof(len)))
+    {
+        Buffer frame(len, len);
+        if (!in.read(frame.buf(), len))
+        {
+            return false;
+        }
+        frames.push_back(std::move(frame));
+    }
+    return in.eof();
+}
+
+// ---- Measurements ----
+
+struct OpcodeStats
+{
+    uint64_t commands = 0;
+    std::vector<double> latenciesUs;   // per command
+};
+
+struct FrameCommand
+{
+    uint8_t opcode;
+    size_t offset;
+    size_t size;
+};
+
+// Splits the frame in its commands, so they can be fed (and timed) one by one
+static std::vector<FrameCommand> frameCommands(const Buffer& frame)
+{
+    std::vector<FrameCommand> commands;
+    size_t pos = 0;
+    while (pos < frame.dataSize())
+    {
+        uint8_t opcode = frame.read<uint8_t>(pos);
+        size_t len;
+        switch (opcode)
+        {
+            case chatd::OP_JOIN: len = 17; break;
+            case chatd::OP_OLDMSG:
+            case chatd::OP_NEWMSG:
+            case chatd::OP_MSGUPD: len = 38 + frame.read<uint32_t>(pos + 35); break;
+            case chatd::OP_SEEN:
+            case chatd::OP_RECEIVED:
+            case chatd::OP_REACTIONSN: len = 16; break;
+            case chatd::OP_HISTDONE: len = 8; break;
+            default:
+                // can't tell the length of the rest: attribute it to this command
+                commands.push_back(FrameCommand{opcode, pos, frame.dataSize() - pos});
+                return commands;
+        }
+        commands.push_back(FrameCommand{opcode, pos, 1 + len});
+        pos += 1 + len;
+    }
+    return commands;
+}
+
+static double percentile(std::vector<double>& values, double p)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t i = static_cast<size_t>(p * (values.size() - 1) + 0.5);
+    return values[i];
+}
+
+int main(int argc, char** argv)
+{
+    unsigned historyCount = 2000;
+    unsigned newCount = 10000;
+    unsigned seed = 1;
+    std::string savePath, replayPath;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        std::string value = (i + 1 < argc) ? argv[i + 1] : "";
+        if (arg == "--history" && !value.empty()) { historyCount = std::stoul(value); i++; }
+        else if (arg == "--messages" && !value.empty()) { newCount = std::stoul(value); i++; }
+        else if (arg == "--seed" && !value.empty()) { seed = std::stoul(value); i++; }
+        else if (arg == "--save" && !value.empty()) { savePath = value; i++; }
+        else if (arg == "--replay" && !value.empty()) { replayPath = value; i++; }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--history N] [--messages N] [--seed N] [--save <file>] [--replay <file>]" << std::endl;
+            return 1;
+        }
+    }
+
+    karere::Id chatid(0x4242424242424242);
+    std::vector<Buffer> frames;
+    if (!replayPath.empty())
+    {
+        if (!loadFrames(replayPath, frames) || frames.empty() || frames[0].dataSize() < 9
+                || frames[0].read<uint8_t>(0) != chatd::OP_JOIN)
+        {
+            std::cerr << "Failed to load frames from " << replayPath << std::endl;
+            return 1;
+        }
+        chatid = frames[0].read<uint64_t>(1);
+    }
+    else
+    {
+        frames = FrameGenerator(chatid, seed).generate(historyCount, newCount);
+    }
+    if (!savePath.empty() && !saveFrames(savePath, frames))
+    {
+        std::cerr << "Failed to save frames to " << savePath << std::endl;
+        return 1;
+    }
+
+    std::string path = "./bench_tmp/";
+    mkdir(path.c_str(), 0700);
+
+    ::mega::MegaApi* megaApi = new ::mega::MegaApi(APPLICATION_KEY.c_str(), path.c_str(), USER_AGENT_DESCRIPTION.c_str());
+    gChatApiImpl = new megachat::MegaChatApiImpl(nullptr, megaApi);
+    WebsocketsIO::Mutex wsMutex;
+    BenchWebsocketsIO websocketsIO(wsMutex, megaApi, gChatApiImpl);
+    BenchApp app;
+
+    SqliteDb db;
+    if (!db.open(":memory:", false))
+    {
+        std::cerr << "Failed to open in-memory database" << std::endl;
+        return 1;
+    }
+    db.simpleQuery(karere::gDbSchema);
+    BenchListener listener(db);
+
+    karere::Client* client = nullptr;
+    chatd::Chat* chat = nullptr;
+    runInChatThread([&]()
+    {
+        client = new karere::Client(*megaApi, &websocketsIO, app, path, 0, gChatApiImpl);
+        client->initWithAnonymousSession();
+        client->mDnsCache.addRecord(kBenchShard, "wss://chatd.bench.invalid/bench", false);
+
+        karere::SetOfIds users;
+        users.insert(karere::Id(0x1000));
+        chat = &client->mChatdClient->createChat(chatid, kBenchShard, &listener, users,
+                                                 new BenchCrypto(*client), 1500000000, true);
+        chat->connect();
+    });
+
+    // wait for the client to JOIN the chat, so the server's response can be replayed
+    for (int i = 0; i < 1000 && !(websocketsIO.mConnection && websocketsIO.mConnection->mJoinSent); i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (!websocketsIO.mConnection || !websocketsIO.mConnection->mJoinSent)
+    {
+        std::cerr << "Timeout waiting for the chat to join" << std::endl;
+        return 1;
+    }
+
+    std::map<uint8_t, OpcodeStats> stats;
+    uint64_t messages = 0;
+    uint64_t allocs = 0;
+    double totalUs = 0;
+    BufferPool::Stats poolStart = chatd::Message::payloadAllocator()->stats();
+    for (size_t first = 0; first < frames.size(); first += kFramesPerCall)
+    {
+        size_t last = std::min(frames.size(), first + kFramesPerCall);
+        runInChatThread([&]()
+        {
+            uint64_t allocStart = tAllocCount;
+            for (size_t i = first; i < last; i++)
+            {
+                // commands never cross frames, so they can be executed one at a time
+                Buffer& frame = frames[i];
+                for (const FrameCommand& command: frameCommands(frame))
+                {
+                    auto start = std::chrono::steady_clock::now();
+                    websocketsIO.mConnection->wsHandleMsgCb(frame.buf() + command.offset, command.size);
+                    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+                    totalUs += us;
+
+                    OpcodeStats& opStats = stats[command.opcode];
+                    opStats.commands++;
+                    opStats.latenciesUs.push_back(us);
+                    if (command.opcode == chatd::OP_OLDMSG || command.opcode == chatd::OP_NEWMSG || command.opcode == chatd::OP_MSGUPD)
+                    {
+                        messages++;
+                    }
+                }
+            }
+            allocs += tAllocCount - allocStart;
+        });
+    }
+    BufferPool::Stats poolEnd = chatd::Message::payloadAllocator()->stats();
+
+    std::cout << "Frames: " << frames.size() << "   Messages: " << messages
+              << "   Time: " << totalUs / 1000 << " ms" << std::endl;
+    std::cout << "Messages/second: " << (totalUs ? messages * 1e6 / totalUs : 0) << std::endl;
+    std::cout << "Heap allocations (new) per message: " << (messages ? (double)allocs / messages : 0)
+              << "   Payload mallocs per message: " << (messages ? (double)(poolEnd.mallocs - poolStart.mallocs) / messages : 0)
+              << std::endl;
+    std::cout << "Received by app - history: " << listener.mHistMessages << "   new: " << listener.mNewMessages << std::endl;
+    for (auto& item: stats)
+    {
+        std::cout << "  " << chatd::Command::opcodeToStr(item.first)
+                  << "\tcount: " << item.second.commands
+                  << "\tp50: " << percentile(item.second.latenciesUs, 0.5) << " us"
+                  << "\tp99: " << percentile(item.second.latenciesUs, 0.99) << " us" << std::endl;
+    }
+
+    runInChatThread([&]()
+    {
+        client->terminate(true);
+        delete client;
+    });
+    delete gChatApiImpl;
+    delete megaApi;
+    return 0;
+}
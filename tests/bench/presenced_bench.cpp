@@ -0,0 +1,295 @@
+/**
+ * @file tests/bench/presenced_bench.cpp
+ * @brief Offline benchmark of the processing of presence updates
+ *
+ * Replays a burst of PEERSTATUS commands, like the one received from presenced
+ * after a reconnection, through presenced::Client::handleMessage(). Every peer
+ * is a contact, so every update is notified to the listener. Additionally, the
+ * lookups and updates done per peer are timed on std::map and on karere::IdMap,
+ * to compare the containers without the overhead of the parsing and callbacks.
+ * No network connection nor MEGA account is required.
+ *
+ * Usage: presenced_bench [--peers N] [--rounds N] [--coalesce <ms>] [--verbose]
+ *
+ * With --coalesce, notifications are coalesced with the given window (0 for the
+ * end of every frame), as set by presenced::Client::setPresenceCoalescing().
+ *
+ * (c) 2020 by Mega Limited, Wellsford, New Zealand
+ *
+ * This file is part of the MEGA SDK - Client Access Engine.
+ *
+ * Applications using the MEGA API must present a valid application key
+ * and comply with the the rules set forth in the Terms of Service.
+ *
+ * The MEGA SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * @copyright Simplified (2-clause) BSD License.
+ *
+ * You should have received a copy of the license along with this
+ * program.
+ */
+
+#include <megaapi.h>
+#include "../../src/megachatapi_impl.h"
+#include "../../src/chatClient.h"
+#include "../../src/presenced.h"
+#include "../../src/idMap.h"
+#include "../../src/net/websocketsIO.h"
+
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <map>
+#include <random>
+#include <thread>
+#include <sys/stat.h>
+
+static const std::string APPLICATION_KEY = "MBoVFSyZ";
+static const std::string USER_AGENT_DESCRIPTION = "MEGAChatBench";
+
+// Runs func in the chat thread, where karere objects live, and waits for it to complete
+static megachat::MegaChatApiImpl* gChatApiImpl = nullptr;
+
+template <class F>
+void runInChatThread(F&& func)
+{
+    std::promise<void> done;
+    karere::marshallCall([&func, &done]()
+    {
+        func();
+        done.set_value();
+    }, gChatApiImpl);
+    done.get_future().wait();
+}
+
+// The client never connects: commands are injected directly
+class BenchWebsocketsIO: public WebsocketsIO
+{
+public:
+    BenchWebsocketsIO(Mutex& mutex, ::mega::MegaApi* megaApi, void* ctx)
+        : WebsocketsIO(mutex, megaApi, ctx) {}
+    virtual void addevents(::mega::Waiter*, int) {}
+
+protected:
+    virtual bool wsResolveDNS(const char*, std::function<void(int, const std::vector<std::string>&, const std::vector<std::string>&)>)
+    {
+        return false;
+    }
+    virtual WebsocketsClientImpl* wsConnect(const char*, const char*, int, const char*, bool, WebsocketsClient*)
+    {
+        return nullptr;
+    }
+    virtual int wsGetNoNameErrorCode() { return -1; }
+};
+
+class BenchApp: public karere::IApp, public karere::IApp::IChatListHandler
+{
+public:
+    virtual karere::IApp::IChatListHandler* chatListHandler() { return this; }
+    virtual IGroupChatListItem* addGroupChatItem(karere::GroupChatRoom&) { return nullptr; }
+    virtual void removeGroupChatItem(IGroupChatListItem&) {}
+    virtual IPeerChatListItem* addPeerChatItem(karere::PeerChatRoom&) { return nullptr; }
+    virtual void removePeerChatItem(IPeerChatListItem&) {}
+    virtual void onPresenceConfigChanged(const presenced::Config&, bool) {}
+    virtual void onPresenceLastGreenUpdated(karere::Id, uint16_t) {}
+#ifndef KARERE_DISABLE_WEBRTC
+    virtual rtcModule::ICallHandler* onIncomingCall(rtcModule::ICall&, karere::AvFlags) { return nullptr; }
+#endif
+};
+
+class BenchPresencedListener: public presenced::Listener
+{
+public:
+    uint64_t mPresenceChanges = 0;
+    uint64_t mNotifications = 0;
+    virtual void onConnStateChange(presenced::Client::ConnState) {}
+    virtual void onPresenceChange(karere::Id, karere::Presence, bool) { mPresenceChanges++; mNotifications++; }
+    virtual void onPresencesChange(const presenced::PresenceChanges& changes)
+    {
+        mPresenceChanges += changes.size();
+        mNotifications++;
+    }
+    virtual void onPresenceConfigChanged(const presenced::Config&, bool) {}
+    virtual void onPresenceLastGreenUpdated(karere::Id) {}
+};
+
+// Gives access to the incoming path and to the list of contacts
+class BenchPresencedClient: public presenced::Client
+{
+public:
+    BenchPresencedClient(karere::Client& client, presenced::Listener& listener)
+        : presenced::Client(&client.api, &client, listener, 0) {}
+
+    void addContact(uint64_t userid) { mContacts[userid] = ::mega::MegaUser::VISIBILITY_VISIBLE; }
+    void handleFrame(Buffer& frame) { handleMessage(frame); }
+};
+
+// Same operations per PEERSTATUS as presenced::Client: update the presence, check the contact
+template <class PeersMap, class ContactsMap>
+static double timeUpdates(PeersMap& peers, ContactsMap& contacts, const std::vector<uint64_t>& userids, unsigned rounds)
+{
+    auto start = std::chrono::steady_clock::now();
+    uint64_t notified = 0;
+    for (unsigned r = 0; r < rounds; r++)
+    {
+        karere::Presence pres = (r % 2) ? karere::Presence::kAway : karere::Presence::kOnline;
+        for (uint64_t userid: userids)
+        {
+            peers[userid].presence = pres;
+            notified += contacts.find(userid) ? 1 : 0;
+        }
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (notified != (uint64_t)userids.size() * rounds)
+    {
+        std::cerr << "Unexpected number of contacts found" << std::endl;
+    }
+    return ms;
+}
+
+struct PeerState
+{
+    karere::Presence presence;
+    time_t lastGreen = 0;
+};
+
+// std::map::find() returns an iterator, IdMap::find() a pointer: adapt std::map to the latter
+struct StdContacts
+{
+    std::map<uint64_t, int> map;
+    const int* find(uint64_t userid) const
+    {
+        auto it = map.find(userid);
+        return (it == map.end()) ? nullptr : &it->second;
+    }
+};
+
+int main(int argc, char** argv)
+{
+    unsigned numPeers = 50000;
+    unsigned rounds = 10;
+    bool verbose = false;
+    int coalescing = presenced::Client::kCoalescingDisabled;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        std::string value = (i + 1 < argc) ? argv[i + 1] : "";
+        if (arg == "--peers" && !value.empty()) { numPeers = std::stoul(value); i++; }
+        else if (arg == "--rounds" && !value.empty()) { rounds = std::stoul(value); i++; }
+        else if (arg == "--coalesce" && !value.empty()) { coalescing = std::stoi(value); i++; }
+        else if (arg == "--verbose") { verbose = true; }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--peers N] [--rounds N] [--coalesce <ms>] [--verbose]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (!verbose)
+    {
+        // a debug line per PEERSTATUS would dominate the measurement
+        karere::gLogger.logChannels[krLogChannel_presenced].logLevel = krLogLevelError;
+    }
+
+    std::mt19937_64 rng(1);
+    std::vector<uint64_t> userids(numPeers);
+    for (uint64_t& userid: userids)
+    {
+        do { userid = rng(); } while (userid == karere::Id::inval().val);
+    }
+
+    // one frame per round, as presenced sends the burst: <opcode.1><presence.1><userid.8>
+    std::vector<Buffer> frames(rounds);
+    for (unsigned r = 0; r < rounds; r++)
+    {
+        karere::Presence::Code pres = (r % 2) ? karere::Presence::kAway : karere::Presence::kOnline;
+        frames[r].reserve(numPeers * 10);
+        for (uint64_t userid: userids)
+        {
+            frames[r].append<uint8_t>(presenced::OP_PEERSTATUS);
+            frames[r].append<uint8_t>(pres);
+            frames[r].append<uint64_t>(userid);
+        }
+    }
+
+    std::string path = "./bench_tmp/";
+    mkdir(path.c_str(), 0700);
+
+    ::mega::MegaApi* megaApi = new ::mega::MegaApi(APPLICATION_KEY.c_str(), path.c_str(), USER_AGENT_DESCRIPTION.c_str());
+    gChatApiImpl = new megachat::MegaChatApiImpl(nullptr, megaApi);
+    WebsocketsIO::Mutex wsMutex;
+    BenchWebsocketsIO websocketsIO(wsMutex, megaApi, gChatApiImpl);
+    BenchApp app;
+    BenchPresencedListener listener;
+
+    karere::Client* client = nullptr;
+    BenchPresencedClient* presencedClient = nullptr;
+    runInChatThread([&]()
+    {
+        client = new karere::Client(*megaApi, &websocketsIO, app, path, 0, gChatApiImpl);
+        client->initWithAnonymousSession();
+        presencedClient = new BenchPresencedClient(*client, listener);
+        presencedClient->setPresenceCoalescing(coalescing);
+        for (uint64_t userid: userids)
+        {
+            presencedClient->addContact(userid);
+        }
+    });
+
+    double totalMs = 0;
+    double firstMs = 0;
+    for (unsigned r = 0; r < rounds; r++)
+    {
+        runInChatThread([&]()
+        {
+            auto start = std::chrono::steady_clock::now();
+            presencedClient->handleFrame(frames[r]);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            totalMs += ms;
+            if (r == 0)
+            {
+                firstMs = ms;
+            }
+        });
+    }
+
+    // wait for the window to elapse, so coalesced changes are notified
+    if (coalescing > 0)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(coalescing * 2));
+    }
+    runInChatThread([]() {});
+
+    uint64_t updates = (uint64_t)numPeers * rounds;
+    std::cout << "Peers: " << numPeers << "   Rounds: " << rounds
+              << "   Presence changes notified: " << listener.mPresenceChanges
+              << "   Listener calls: " << listener.mNotifications << std::endl;
+    std::cout << "handleMessage - first burst: " << firstMs << " ms   average burst: " << totalMs / rounds
+              << " ms   per update: " << (updates ? totalMs * 1e6 / updates : 0) << " ns" << std::endl;
+
+    std::map<uint64_t, PeerState> stdPeers;
+    StdContacts stdContacts;
+    karere::IdMap<PeerState> idPeers;
+    karere::IdMap<int> idContacts;
+    for (uint64_t userid: userids)
+    {
+        stdContacts.map[userid] = ::mega::MegaUser::VISIBILITY_VISIBLE;
+        idContacts[userid] = ::mega::MegaUser::VISIBILITY_VISIBLE;
+    }
+    double stdMs = timeUpdates(stdPeers, stdContacts, userids, rounds);
+    double idMs = timeUpdates(idPeers, idContacts, userids, rounds);
+    std::cout << "Container only - std::map: " << stdMs * 1e6 / updates << " ns/update   IdMap: "
+              << idMs * 1e6 / updates << " ns/update   speedup: " << (idMs ? stdMs / idMs : 0) << "x" << std::endl;
+
+    runInChatThread([&]()
+    {
+        delete presencedClient;
+        client->terminate(true);
+        delete client;
+    });
+    delete gChatApiImpl;
+    delete megaApi;
+    return 0;
+}
@@ -0,0 +1,259 @@
+/**
+ * @file tests/bench/timers_bench.cpp
+ * @brief Stress benchmark of timers with many concurrent timeouts
+ *
+ * Sets a large number of one-shot timers with random delays on a libuv loop,
+ * cancels a part of them, and runs the loop until the rest have fired. It's done
+ * with karere::TimerWheel, as used by setTimeout(), and with the previous scheme of
+ * a uv_timer_t allocated per timer, registered in a map guarded by a mutex.
+ * Reports the cost of insertions and cancellations, the CPU time of the loop and
+ * how late the timers fired. No MEGA account nor network is required.
+ *
+ * Usage: timers_bench [--timers N] [--max-delay <ms>] [--cancel <percent>]
+ *
+ * (c) 2020 by Mega Limited, Wellsford, New Zealand
+ *
+ * This file is part of the MEGA SDK - Client Access Engine.
+ *
+ * Applications using the MEGA API must present a valid application key
+ * and comply with the the rules set forth in the Terms of Service.
+ *
+ * The MEGA SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * @copyright Simplified (2-clause) BSD License.
+ *
+ * You should have received a copy of the license along with this
+ * program.
+ */
+
+#include "../../src/base/timerWheel.h"
+
+#include <uv.h>
+#include <chrono>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Stats
+{
+    double insertMs = 0;
+    double cancelMs = 0;
+    double runMs = 0;
+    double cpuMs = 0;
+    uint64_t fired = 0;
+    uint64_t totalLateness = 0;
+    uint64_t maxLateness = 0;
+
+    void onFired(uv_loop_t* loop, uint64_t due)
+    {
+        uint64_t now = uv_now(loop);
+        uint64_t late = (now > due) ? now - due : 0;
+        fired++;
+        totalLateness += late;
+        if (late > maxLateness)
+        {
+            maxLateness = late;
+        }
+    }
+};
+
+static double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Previous implementation: a uv timer per timeout, and a registry to cancel them by handle
+class UvTimers
+{
+public:
+    explicit UvTimers(uv_loop_t* loop): mLoop(loop) {}
+
+    megaHandle setTimeout(std::function<void()>&& cb, unsigned timeMs)
+    {
+        Timer* timer = new Timer;
+        timer->owner = this;
+        timer->cb = std::move(cb);
+        timer->uvTimer.data = timer;
+        {
+            std::lock_guard<std::recursive_mutex> lock(mMutex);
+            timer->handle = ++mLastHandle;
+            mTimers[timer->handle] = timer;
+        }
+        uv_timer_init(mLoop, &timer->uvTimer);
+        uv_timer_start(&timer->uvTimer, [](uv_timer_t* handle)
+        {
+            Timer* timer = static_cast<Timer*>(handle->data);
+            timer->owner->onTimer(timer);
+        }, timeMs, 0);
+        return timer->handle;
+    }
+
+    bool cancelTimeout(megaHandle handle)
+    {
+        Timer* timer;
+        {
+            std::lock_guard<std::recursive_mutex> lock(mMutex);
+            auto it = mTimers.find(handle);
+            if (it == mTimers.end())
+            {
+                return false;
+            }
+            timer = it->second;
+            mTimers.erase(it);
+        }
+        uv_timer_stop(&timer->uvTimer);
+        close(timer);
+        return true;
+    }
+
+protected:
+    struct Timer
+    {
+        uv_timer_t uvTimer;
+        UvTimers* owner;
+        std::function<void()> cb;
+        megaHandle handle;
+    };
+    uv_loop_t* mLoop;
+    std::recursive_mutex mMutex;
+    std::unordered_map<megaHandle, Timer*> mTimers;
+    megaHandle mLastHandle = 0;
+
+    void onTimer(Timer* timer)
+    {
+        {
+            std::lock_guard<std::recursive_mutex> lock(mMutex);
+            mTimers.erase(timer->handle);
+        }
+        timer->cb();
+        close(timer);
+    }
+    static void close(Timer* timer)
+    {
+        uv_close((uv_handle_t*)&timer->uvTimer, [](uv_handle_t* handle)
+        {
+            delete static_cast<Timer*>(handle->data);
+        });
+    }
+};
+
+template <class SetFunc, class CancelFunc>
+static Stats runBench(uv_loop_t* loop, const std::vector<unsigned>& delays, unsigned cancelPercent,
+                      SetFunc&& setTimeout, CancelFunc&& cancelTimeout)
+{
+    Stats stats;
+    std::mt19937 rng(2);
+    std::vector<megaHandle> toCancel;
+    toCancel.reserve(delays.size() * cancelPercent / 100 + 1);
+
+    uv_update_time(loop);
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned delay: delays)
+    {
+        uint64_t due = uv_now(loop) + delay;
+        megaHandle handle = setTimeout([&stats, loop, due]() { stats.onFired(loop, due); }, delay);
+        if (rng() % 100 < cancelPercent)
+        {
+            toCancel.push_back(handle);
+        }
+    }
+    stats.insertMs = elapsedMs(start);
+
+    start = std::chrono::steady_clock::now();
+    for (megaHandle handle: toCancel)
+    {
+        cancelTimeout(handle);
+    }
+    stats.cancelMs = elapsedMs(start);
+
+    start = std::chrono::steady_clock::now();
+    std::clock_t cpuStart = std::clock();
+    uv_run(loop, UV_RUN_DEFAULT);
+    stats.cpuMs = 1000.0 * (std::clock() - cpuStart) / CLOCKS_PER_SEC;
+    stats.runMs = elapsedMs(start);
+    return stats;
+}
+
+static void printStats(const char* name, const Stats& stats, size_t timers, size_t canceled)
+{
+    std::cout << name << std::endl
+              << "  insert: " << (timers ? stats.insertMs * 1e6 / timers : 0) << " ns/timer"
+              << "   cancel: " << (canceled ? stats.cancelMs * 1e6 / canceled : 0) << " ns/timer" << std::endl
+              << "  loop: " << stats.runMs << " ms, CPU " << stats.cpuMs << " ms"
+              << "   fired: " << stats.fired
+              << "   lateness (avg/max): " << (stats.fired ? (double)stats.totalLateness / stats.fired : 0)
+              << "/" << stats.maxLateness << " ms" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned numTimers = 100000;
+    unsigned maxDelay = 2000;
+    unsigned cancelPercent = 50;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        std::string value = (i + 1 < argc) ? argv[i + 1] : "";
+        if (arg == "--timers" && !value.empty()) { numTimers = std::stoul(value); i++; }
+        else if (arg == "--max-delay" && !value.empty()) { maxDelay = std::stoul(value); i++; }
+        else if (arg == "--cancel" && !value.empty()) { cancelPercent = std::stoul(value); i++; }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--timers N] [--max-delay <ms>] [--cancel <percent>]" << std::endl;
+            return 1;
+        }
+    }
+    if (cancelPercent > 100)
+    {
+        cancelPercent = 100;
+    }
+
+    std::mt19937 rng(1);
+    std::vector<unsigned> delays(numTimers);
+    for (unsigned& delay: delays)
+    {
+        delay = 1 + rng() % (maxDelay ? maxDelay : 1);
+    }
+    size_t expectedCanceled = (size_t)numTimers * cancelPercent / 100;
+    std::cout << "Timers: " << numTimers << "   Max delay: " << maxDelay
+              << " ms   Canceled: ~" << cancelPercent << "%" << std::endl;
+
+    uv_loop_t loop;
+    uv_loop_init(&loop);
+
+    {
+        std::recursive_mutex mutex;
+        karere::TimerWheel wheel(&loop, mutex);
+        wheel.setLoopThread();
+        Stats stats = runBench(&loop, delays, cancelPercent,
+            [&wheel](std::function<void()>&& cb, unsigned delay)
+            {
+                return wheel.add(std::move(cb), delay, false);
+            },
+            [&wheel](megaHandle handle) { return wheel.cancel(handle); });
+        printStats("TimerWheel", stats, numTimers, expectedCanceled);
+        std::cout << "  timer nodes allocated: " << wheel.poolSize() << std::endl;
+        wheel.close();
+        uv_run(&loop, UV_RUN_DEFAULT);  // free the uv timer of the wheel
+    }
+
+    {
+        UvTimers timers(&loop);
+        Stats stats = runBench(&loop, delays, cancelPercent,
+            [&timers](std::function<void()>&& cb, unsigned delay)
+            {
+                return timers.setTimeout(std::move(cb), delay);
+            },
+            [&timers](megaHandle handle) { return timers.cancelTimeout(handle); });
+        printStats("uv_timer_t per timer", stats, numTimers, expectedCanceled);
+    }
+
+    uv_loop_close(&loop);
+    return 0;
+}
@@ -0,0 +1,335 @@
+/**
+ * @file tests/bench/userattr_bench.cpp
+ * @brief Offline benchmark of the fetching of user attributes
+ *
+ * Simulates the opening of big group chats: the full name, email and Ed25519 key
+ * of every member are requested from karere::UserAttrCache, and a part of the
+ * members are in more than one chat. The SDK is replaced by a mock of MyMegaApi,
+ * that answers every request after a simulated round trip to the API: the requests
+ * received while a round trip is in progress are answered together by the next one.
+ * Reports the requests sent, the batches and requests in flight of the cache, and
+ * the time until all the callbacks are called. No network connection nor MEGA
+ * account is required.
+ *
+ * Usage: userattr_bench [--members N] [--chats N] [--latency <ms>] [--verbose]
+ *
+ * (c) 2020 by Mega Limited, Wellsford, New Zealand
+ *
+ * This file is part of the MEGA SDK - Client Access Engine.
+ *
+ * Applications using the MEGA API must present a valid application key
+ * and comply with the the rules set forth in the Terms of Service.
+ *
+ * The MEGA SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * @copyright Simplified (2-clause) BSD License.
+ *
+ * You should have received a copy of the license along with this
+ * program.
+ */
+
+#include <megaapi.h>
+#include "../../src/megachatapi_impl.h"
+#include "../../src/chatClient.h"
+#include "../../src/userAttrCache.h"
+#include "../../src/net/websocketsIO.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <sys/stat.h>
+
+static const std::string APPLICATION_KEY = "MBoVFSyZ";
+static const std::string USER_AGENT_DESCRIPTION = "MEGAChatBench";
+
+// Runs func in the chat thread, where karere objects live, and waits for it to complete
+static megachat::MegaChatApiImpl* gChatApiImpl = nullptr;
+
+template <class F>
+void runInChatThread(F&& func)
+{
+    std::promise<void> done;
+    karere::marshallCall([&func, &done]()
+    {
+        func();
+        done.set_value();
+    }, gChatApiImpl);
+    done.get_future().wait();
+}
+
+// The client never connects
+class BenchWebsocketsIO: public WebsocketsIO
+{
+public:
+    BenchWebsocketsIO(Mutex& mutex, ::mega::MegaApi* megaApi, void* ctx)
+        : WebsocketsIO(mutex, megaApi, ctx) {}
+    virtual void addevents(::mega::Waiter*, int) {}
+
+protected:
+    virtual bool wsResolveDNS(const char*, std::function<void(int, const std::vector<std::string>&, const std::vector<std::string>&)>)
+    {
+        return false;
+    }
+    virtual WebsocketsClientImpl* wsConnect(const char*, const char*, int, const char*, bool, WebsocketsClient*)
+    {
+        return nullptr;
+    }
+    virtual int wsGetNoNameErrorCode() { return -1; }
+};
+
+class BenchApp: public karere::IApp, public karere::IApp::IChatListHandler
+{
+public:
+    virtual karere::IApp::IChatListHandler* chatListHandler() { return this; }
+    virtual IGroupChatListItem* addGroupChatItem(karere::GroupChatRoom&) { return nullptr; }
+    virtual void removeGroupChatItem(IGroupChatListItem&) {}
+    virtual IPeerChatListItem* addPeerChatItem(karere::PeerChatRoom&) { return nullptr; }
+    virtual void removePeerChatItem(IPeerChatListItem&) {}
+    virtual void onPresenceConfigChanged(const presenced::Config&, bool) {}
+    virtual void onPresenceLastGreenUpdated(karere::Id, uint16_t) {}
+#ifndef KARERE_DISABLE_WEBRTC
+    virtual rtcModule::ICallHandler* onIncomingCall(rtcModule::ICall&, karere::AvFlags) { return nullptr; }
+#endif
+};
+
+// Result of a mocked request: only what UserAttrCache reads from it
+class BenchRequest: public ::mega::MegaRequest
+{
+public:
+    BenchRequest(int type, const std::string& text): mType(type), mText(text) {}
+    virtual ::mega::MegaRequest* copy() { return new BenchRequest(*this); }
+    virtual int getType() const { return mType; }
+    virtual const char* getText() const { return mText.c_str(); }
+    virtual const char* getEmail() const { return mText.c_str(); }
+
+protected:
+    int mType;
+    std::string mText;
+};
+
+// Answers the requests from a thread of its own, as the SDK does
+class BenchMegaApi: public MyMegaApi
+{
+public:
+    uint64_t mRequests = 0;
+    uint64_t mRoundTrips = 0;
+
+    BenchMegaApi(::mega::MegaApi& sdk, void* ctx, unsigned latencyMs)
+        : MyMegaApi(sdk, ctx, false), mLatencyMs(latencyMs), mThread([this]() { run(); })
+    {}
+    ~BenchMegaApi()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mExit = true;
+        }
+        mCondVar.notify_one();
+        mThread.join();
+    }
+
+protected:
+    struct Pending
+    {
+        int type;
+        ::mega::MegaRequestListener* listener;
+    };
+    unsigned mLatencyMs;
+    std::mutex mMutex;
+    std::condition_variable mCondVar;
+    std::vector<Pending> mPending;
+    bool mExit = false;
+    std::thread mThread;
+
+    virtual void sendUserAttrRequest(const UserAttrRequest& request, ::mega::MegaRequestListener* listener)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mPending.push_back(Pending{request.type, listener});
+            mRequests++;
+        }
+        mCondVar.notify_one();
+    }
+
+    void run()
+    {
+        // 43 chars of base64, as the SDK returns the public keys
+        const std::string key(43, 'A');
+        ::mega::MegaError ok(::mega::MegaError::API_OK);
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (true)
+        {
+            mCondVar.wait(lock, [this]() { return mExit || !mPending.empty(); });
+            if (mExit)
+            {
+                break;
+            }
+
+            // one round trip to the API for all the requests sent until now
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(mLatencyMs));
+            lock.lock();
+            std::vector<Pending> pending;
+            pending.swap(mPending);
+            mRoundTrips++;
+            lock.unlock();
+
+            for (Pending& req: pending)
+            {
+                if (req.type == UserAttrRequest::kEmail)
+                {
+                    BenchRequest result(::mega::MegaRequest::TYPE_GET_USER_EMAIL, "member@example.com");
+                    req.listener->onRequestFinish(&sdk, &result, &ok);
+                }
+                else
+                {
+                    bool isKey = (req.type == ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY
+                                  || req.type == ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY);
+                    BenchRequest result(::mega::MegaRequest::TYPE_GET_ATTR_USER, isKey ? key : "Name");
+                    req.listener->onRequestFinish(&sdk, &result, &ok);
+                }
+            }
+            lock.lock();
+        }
+    }
+};
+
+struct Completion
+{
+    uint64_t expected = 0;
+    uint64_t received = 0;
+    uint64_t failed = 0;
+    std::promise<void> done;
+};
+
+int main(int argc, char** argv)
+{
+    unsigned numMembers = 500;
+    unsigned numChats = 4;
+    unsigned latencyMs = 50;
+    bool verbose = false;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        std::string value = (i + 1 < argc) ? argv[i + 1] : "";
+        if (arg == "--members" && !value.empty()) { numMembers = std::stoul(value); i++; }
+        else if (arg == "--chats" && !value.empty()) { numChats = std::stoul(value); i++; }
+        else if (arg == "--latency" && !value.empty()) { latencyMs = std::stoul(value); i++; }
+        else if (arg == "--verbose") { verbose = true; }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--members N] [--chats N] [--latency <ms>] [--verbose]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (!verbose)
+    {
+        // a debug line per attribute would dominate the measurement
+        karere::gLogger.logChannels[krLogChannel_uacache].logLevel = krLogLevelError;
+    }
+
+    // members of every chat: half of them are also in the previous chat
+    std::mt19937_64 rng(1);
+    std::vector<std::vector<uint64_t>> chats(numChats);
+    for (unsigned c = 0; c < numChats; c++)
+    {
+        for (unsigned m = 0; m < numMembers; m++)
+        {
+            uint64_t userid;
+            if (c && (m % 2))
+            {
+                userid = chats[c - 1][m];
+            }
+            else
+            {
+                do { userid = rng(); } while (userid == karere::Id::inval().val || !userid);
+            }
+            chats[c].push_back(userid);
+        }
+    }
+    static const unsigned attrs[] = { karere::USER_ATTR_FULLNAME, karere::USER_ATTR_EMAIL,
+                                      ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY };
+    static const unsigned numAttrs = sizeof(attrs) / sizeof(attrs[0]);
+
+    std::string path = "./bench_tmp/";
+    mkdir(path.c_str(), 0700);
+
+    ::mega::MegaApi* megaApi = new ::mega::MegaApi(APPLICATION_KEY.c_str(), path.c_str(), USER_AGENT_DESCRIPTION.c_str());
+    gChatApiImpl = new megachat::MegaChatApiImpl(nullptr, megaApi);
+    WebsocketsIO::Mutex wsMutex;
+    BenchWebsocketsIO websocketsIO(wsMutex, megaApi, gChatApiImpl);
+    BenchApp app;
+    BenchMegaApi benchApi(*megaApi, gChatApiImpl, latencyMs);
+
+    karere::Client* client = nullptr;
+    karere::UserAttrCache* cache = nullptr;
+    runInChatThread([&]()
+    {
+        client = new karere::Client(*megaApi, &websocketsIO, app, path, 0, gChatApiImpl);
+        client->initWithAnonymousSession();
+        cache = new karere::UserAttrCache(*client, nullptr, &benchApi);
+    });
+
+    // every chat is opened in a tick of its own, as the app would do
+    Completion completion;
+    completion.expected = (uint64_t)numChats * numMembers * numAttrs;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned c = 0; c < numChats; c++)
+    {
+        runInChatThread([&, c]()
+        {
+            for (uint64_t userid: chats[c])
+            {
+                for (unsigned attr: attrs)
+                {
+                    cache->getAttr(userid, attr, &completion, [](Buffer* data, void* userp)
+                    {
+                        Completion* completion = static_cast<Completion*>(userp);
+                        if (!data)
+                        {
+                            completion->failed++;
+                        }
+                        if (++completion->received == completion->expected)
+                        {
+                            completion->done.set_value();
+                        }
+                    }, true);
+                }
+            }
+        });
+    }
+    completion.done.get_future().wait();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    karere::UserAttrCache::FetchStats stats;
+    runInChatThread([&]()
+    {
+        stats = cache->fetchStats();
+    });
+
+    std::cout << "Chats: " << numChats << "   Members per chat: " << numMembers
+              << "   Latency: " << latencyMs << " ms" << std::endl;
+    std::cout << "getAttr() calls: " << completion.expected << "   failed: " << completion.failed
+              << "   time until all resolved: " << ms << " ms" << std::endl;
+    std::cout << "Requests to the API: " << benchApi.mRequests << " (" << stats.requests << " by the cache, "
+              << stats.deduplicated << " deduplicated)   round trips: " << benchApi.mRoundTrips << std::endl;
+    std::cout << "Batches: " << stats.batches << "   max batch size: " << stats.maxBatchSize
+              << "   avg batch size: " << (stats.batches ? (double)stats.requests / stats.batches : 0)
+              << "   max in flight: " << stats.maxInFlight << "   in flight now: " << stats.inFlight << std::endl;
+
+    runInChatThread([&]()
+    {
+        delete cache;
+        client->terminate(true);
+        delete client;
+    });
+    delete gChatApiImpl;
+    delete megaApi;
+    return 0;
+}
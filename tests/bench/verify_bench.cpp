@@ -0,0 +1,202 @@
+/**
+ * @file tests/bench/verify_bench.cpp
+ * @brief Microbenchmark of the verification of message signatures
+ *
+ * Measures the Ed25519 verifications per second of strongvelope messages when
+ * verified inline (in the app's thread), and one per job in the DecryptWorkerPool,
+ * as ProtocolHandler does for history fetched from chatd.
+ *
+ * Usage: verify_bench [--messages N] [--threads N]
+ *
+ * (c) 2020 by Mega Limited, Wellsford, New Zealand
+ *
+ * This file is part of the MEGA SDK - Client Access Engine.
+ *
+ * Applications using the MEGA API must present a valid application key
+ * and comply with the the rules set forth in the Terms of Service.
+ *
+ * The MEGA SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * @copyright Simplified (2-clause) BSD License.
+ *
+ * You should have received a copy of the license along with this
+ * program.
+ */
+
+#include "../../src/buffer.h"
+#include "../../src/strongvelope/strongvelope.h"
+
+#include <sodium.h>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const std::string kSignaturePrefix = "strongvelopesig";
+static const unsigned kSenders = 8;
+
+struct SignedMessage
+{
+    unsigned sender;
+    uint8_t type;
+    Buffer sendKey;
+    Buffer content;
+    Buffer signature;
+};
+
+// Same signed data as ParsedMessage::verifySignature()
+static bool verify(const SignedMessage& msg, const StaticBuffer& pubKey, Buffer& signedData)
+{
+    signedData.clear();
+    signedData.append(kSignaturePrefix.c_str(), kSignaturePrefix.size())
+              .append<uint8_t>(strongvelope::SVCRYPTO_PROTOCOL_VERSION)
+              .append<uint8_t>(msg.type)
+              .append(msg.sendKey)
+              .append(msg.content);
+    return crypto_sign_verify_detached(msg.signature.ubuf(), signedData.ubuf(),
+                                       signedData.dataSize(), pubKey.ubuf()) == 0;
+}
+
+// Counts completions, like the marshalled calls that notify the app's thread
+class Completion
+{
+public:
+    void add(size_t count)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mDone += count;
+        mNotifications++;
+        mCondition.notify_one();
+    }
+    void wait(size_t count)
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCondition.wait(lock, [this, count]() { return mDone >= count; });
+    }
+    size_t notifications() const { return mNotifications; }
+
+protected:
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    size_t mDone = 0;
+    size_t mNotifications = 0;
+};
+
+// Submits a job, retrying while the queue of the pool is full
+template <class F>
+static void submit(strongvelope::DecryptWorkerPool& pool, F&& job)
+{
+    while (!pool.submit(job))
+    {
+        std::this_thread::yield();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    unsigned messageCount = 20000;
+    unsigned threads = std::max(1u, strongvelope::DecryptWorkerPool::defaultThreadCount());
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        std::string value = (i + 1 < argc) ? argv[i + 1] : "";
+        if (arg == "--messages" && !value.empty()) { messageCount = std::stoul(value); i++; }
+        else if (arg == "--threads" && !value.empty()) { threads = std::stoul(value); i++; }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--messages N] [--threads N]" << std::endl;
+            return 1;
+        }
+    }
+    if (sodium_init() < 0 || !threads)
+    {
+        std::cerr << "Failed to init libsodium, or invalid parameters" << std::endl;
+        return 1;
+    }
+
+    std::vector<Buffer> pubKeys;
+    std::vector<Buffer> privKeys;
+    for (unsigned i = 0; i < kSenders; i++)
+    {
+        pubKeys.emplace_back(crypto_sign_PUBLICKEYBYTES, crypto_sign_PUBLICKEYBYTES);
+        privKeys.emplace_back(crypto_sign_SECRETKEYBYTES, crypto_sign_SECRETKEYBYTES);
+        crypto_sign_keypair(pubKeys.back().ubuf(), privKeys.back().ubuf());
+    }
+
+    // consecutive messages from the same sender, as usual in a conversation
+    std::vector<SignedMessage> messages(messageCount);
+    Buffer signedData;
+    for (unsigned i = 0; i < messageCount; i++)
+    {
+        SignedMessage& msg = messages[i];
+        msg.sender = (i / 5) % kSenders;
+        msg.type = 0;
+        msg.sendKey = Buffer(strongvelope::SVCRYPTO_KEY_SIZE, strongvelope::SVCRYPTO_KEY_SIZE);
+        randombytes_buf(msg.sendKey.buf(), msg.sendKey.dataSize());
+        size_t len = 64 + randombytes_uniform(256);
+        msg.content = Buffer(len, len);
+        randombytes_buf(msg.content.buf(), len);
+
+        signedData.clear();
+        signedData.append(kSignaturePrefix.c_str(), kSignaturePrefix.size())
+                  .append<uint8_t>(strongvelope::SVCRYPTO_PROTOCOL_VERSION)
+                  .append<uint8_t>(msg.type)
+                  .append(msg.sendKey)
+                  .append(msg.content);
+        msg.signature = Buffer(crypto_sign_BYTES, crypto_sign_BYTES);
+        crypto_sign_detached(msg.signature.ubuf(), nullptr, signedData.ubuf(), signedData.dataSize(),
+                             privKeys[msg.sender].ubuf());
+    }
+    messages[messageCount / 2].content.buf()[0] ^= 1;   // one tampered message must fail
+
+    std::vector<char> results(messageCount);
+    auto report = [&results](const char* mode, double seconds, size_t notifications)
+    {
+        size_t invalid = 0;
+        for (char valid: results)
+        {
+            invalid += !valid;
+        }
+        std::cout << mode << ":\t" << static_cast<uint64_t>(results.size() / seconds) << " verifications/s"
+                  << "   (completions: " << notifications << ", invalid signatures: " << invalid << ")" << std::endl;
+    };
+
+    // inline, in a single thread
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < messageCount; i++)
+    {
+        Buffer data(kSignaturePrefix.size() + messages[i].sendKey.dataSize() + messages[i].content.dataSize() + 2);
+        results[i] = verify(messages[i], pubKeys[messages[i].sender], data);
+    }
+    report("inline", std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), messageCount);
+
+    strongvelope::DecryptWorkerPool pool(threads);
+    std::cout << "Worker threads: " << threads << std::endl;
+
+    // one job per message
+    {
+        std::fill(results.begin(), results.end(), 0);
+        Completion completion;
+        start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < messageCount; i++)
+        {
+            submit(pool, [&messages, &pubKeys, &results, &completion, i]()
+            {
+                Buffer data(kSignaturePrefix.size() + messages[i].sendKey.dataSize() + messages[i].content.dataSize() + 2);
+                results[i] = verify(messages[i], pubKeys[messages[i].sender], data);
+                completion.add(1);
+            });
+        }
+        completion.wait(messageCount);
+        report("pool", std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), completion.notifications());
+    }
+
+    return 0;
+}
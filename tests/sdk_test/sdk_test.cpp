@@ -4,6 +4,13 @@
 #include "../../src/chatd.h"
 #include "../../src/megachatapi.h"
 #include "../../src/karereCommon.h" // for logging with karere facility
+#include "../../src/db.h"
+#include "../../src/chatdDb.h"
+#include "../../src/strongvelope/strongvelope.h"
+#include "../../src/idMap.h"
+#ifndef KARERE_DISABLE_WEBRTC
+#include "../../src/rtcModule/rtcStats.h"
+#endif
 
 #include <signal.h>
 #include <stdio.h>
@@ -34,6 +41,7 @@ int main(int argc, char **argv)
     EXECUTE_TEST(t.TEST_GroupChatManagement(0, 1), "TEST Groupchat management");
     EXECUTE_TEST(t.TEST_Reactions(0, 1), "TEST Chat Reactions");
     EXECUTE_TEST(t.TEST_RetentionHistory(0, 1), "TEST Retention history");
+    EXECUTE_TEST(t.TEST_DormantChat(0, 1), "TEST Dormant chat");
     EXECUTE_TEST(t.TEST_ClearHistory(0, 1), "TEST Clear history");
     EXECUTE_TEST(t.TEST_GroupLastMessage(0, 1), "TEST Last message (group)");
 
@@ -66,6 +74,18 @@ int main(int argc, char **argv)
     MegaChatApiUnitaryTest unitaryTest;
     std::cout << "[========] Unitary tests " << std::endl;
     unitaryTest.UNITARYTEST_ParseUrl();
+    unitaryTest.UNITARYTEST_DbQueryPlans();
+    unitaryTest.UNITARYTEST_BufferPool();
+    unitaryTest.UNITARYTEST_SharedBuffer();
+    unitaryTest.UNITARYTEST_DbGroupCommit();
+    unitaryTest.UNITARYTEST_DbStmtCache();
+    unitaryTest.UNITARYTEST_DecryptWorkerPool();
+    unitaryTest.UNITARYTEST_SendKeyCache();
+    unitaryTest.UNITARYTEST_IdMap();
+#ifndef KARERE_DISABLE_WEBRTC
+    unitaryTest.UNITARYTEST_RtcStatsStore();
+    unitaryTest.UNITARYTEST_RtcStatsBinary();
+#endif
     std::cout << "[========] End Unitary tests " << std::endl;
 
     return t.mFailedTests + unitaryTest.mFailedTests;
@@ -2869,6 +2889,177 @@ void MegaChatApiTest::TEST_RetentionHistory(unsigned int a1, unsigned int a2)
     delete chatroomListener;
 }
 
+/**
+ * @brief TEST_DormantChat
+ *
+ * Requirements:
+ *      - Both accounts should be contacts
+ * (if not accomplished, the test automatically solves them)
+ *
+ * This test does the following:
+ * - Select or create a group chat room
+ * - Set secondary account chat room privilege to STANDARD
+ * - Send a couple of messages
+ * - Close the chatrooms and logout (keeping the cache)
+ * + Send a message
+ * - Resume the session, without opening the chatroom (the chat is dormant)
+ * - Check the message sent while offline is the last message of the chat
+ * + Send a message
+ * - Check the message has been received without opening the chatroom
+ * - Open the chatroom and check the history contains the messages
+ * - Close the chatroom, logout (keeping the cache) and resume the session
+ * - Set retention time to 5 seconds, without opening the chatroom
+ * - Sleep 30 seconds
+ * + Check history has been cleared
+ * - Open the chatroom and check history has been cleared
+ * - Set retention time to zero (disabled)
+ * - Close the chatrooms
+ **/
+void MegaChatApiTest::TEST_DormantChat(unsigned int a1, unsigned int a2)
+{
+    // Login both accounts
+    ::mega::unique_ptr<char[]>sessionPrimary(login(a1));
+    ::mega::unique_ptr<char[]>sessionSecondary(login(a2));
+
+    // Prepare peers, privileges...
+    ::mega::unique_ptr<MegaUser>user(megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str()));
+    if (!user || (user->getVisibility() != MegaUser::VISIBILITY_VISIBLE))
+    {
+        makeContact(a1, a2);
+        user.reset(megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str()));
+    }
+
+    // Get a group chatroom with both users
+    MegaChatHandle uh = user->getHandle();
+    ::mega::unique_ptr<MegaChatPeerList> peers(MegaChatPeerList::createInstance());
+    peers->addPeer(uh, MegaChatPeerList::PRIV_STANDARD);
+    MegaChatHandle chatid = getGroupChatRoom(a1, a2, peers.get());
+
+    // Open chatroom
+    TestChatRoomListener *chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
+    ASSERT_CHAT_TEST(megaChatApi[a1]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a1+1));
+    ASSERT_CHAT_TEST(megaChatApi[a2]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a2+1));
+    ::mega::unique_ptr <MegaChatRoom> chatroom (megaChatApi[a1]->getChatRoom(chatid));
+    ::mega::unique_ptr<char[]> chatidB64(megaApi[a1]->handleToBase64(chatid));
+    ASSERT_CHAT_TEST(chatroom, "Cannot get chatroom for id" + std::string(chatidB64.get()));
+
+    // Set secondary account priv to STANDARD, so it can send messages
+    if (chatroom->getPeerPrivilegeByHandle(uh) != MegaChatRoom::PRIV_STANDARD)
+    {
+        bool *flagUpdatePeerPermision = &requestFlagsChat[a1][MegaChatRequest::TYPE_UPDATE_PEER_PERMISSIONS]; *flagUpdatePeerPermision = false;
+        bool *peerUpdated0 = &peersUpdated[a1]; *peerUpdated0 = false;
+        bool *peerUpdated1 = &peersUpdated[a2]; *peerUpdated1 = false;
+        bool *mngMsgRecv = &chatroomListener->msgReceived[a1]; *mngMsgRecv = false;
+        megaChatApi[a1]->updateChatPermissions(chatid, uh, MegaChatRoom::PRIV_STANDARD);
+        ASSERT_CHAT_TEST(waitForResponse(flagUpdatePeerPermision), "Timeout expired for update privilege of peer");
+        ASSERT_CHAT_TEST(!lastErrorChat[a1], "Failed to update privilege of peer Error: " + lastErrorMsgChat[a1] + " (" + std::to_string(lastErrorChat[a1]) + ")");
+        ASSERT_CHAT_TEST(waitForResponse(peerUpdated0), "Timeout expired for receiving peer update");
+        ASSERT_CHAT_TEST(waitForResponse(peerUpdated1), "Timeout expired for receiving peer update");
+        ASSERT_CHAT_TEST(waitForResponse(mngMsgRecv), "Timeout expired for receiving management message");
+    }
+
+    // Send a couple of messages
+    std::string messageToSend = "Msg from " + mAccounts[a1].getEmail();
+    for (int i = 0; i < 2; i++)
+    {
+        delete sendTextMessageOrUpdate(a1, a2, chatid, messageToSend, chatroomListener);
+    }
+
+    // Close the chatroom and logout, keeping the cache
+    megaChatApi[a1]->closeChatRoom(chatid, chatroomListener);
+    logout(a1, false);
+
+    // Send a message while the primary account is offline
+    messageToSend = "Msg from " + mAccounts[a2].getEmail();
+    bool *flagConfirmed = &chatroomListener->msgConfirmed[a2]; *flagConfirmed = false;
+    ::mega::unique_ptr<MegaChatMessage> msgSent(megaChatApi[a2]->sendMessage(chatid, messageToSend.c_str()));
+    ASSERT_CHAT_TEST(msgSent, "Failed to send message");
+    ASSERT_CHAT_TEST(waitForResponse(flagConfirmed), "Timeout expired for receiving confirmation by server");
+    MegaChatHandle offlineMsgId = chatroomListener->mConfirmedMessageHandle[a2];
+    ASSERT_CHAT_TEST(offlineMsgId != MEGACHAT_INVALID_HANDLE, "Wrong message id for sent message");
+
+    // Resume the session: the chat is dormant, with no history in RAM, so
+    // JOINRANGEHIST must be sent from the newest message in cache
+    bool *itemUpdated = &chatItemUpdated[a1];
+    ::mega::unique_ptr<char[]> session(login(a1, sessionPrimary.get()));
+    ::mega::unique_ptr<MegaChatListItem> item;
+    while (true)
+    {
+        *itemUpdated = false;
+        item.reset(megaChatApi[a1]->getChatListItem(chatid));
+        if (item && item->getLastMessageId() == offlineMsgId)
+        {
+            break;
+        }
+        ASSERT_CHAT_TEST(waitForResponse(itemUpdated), "Message sent while offline not received by account " + std::to_string(a1+1));
+    }
+
+    // Receive a message in the dormant chat: it activates the chat
+    flagConfirmed = &chatroomListener->msgConfirmed[a2]; *flagConfirmed = false;
+    msgSent.reset(megaChatApi[a2]->sendMessage(chatid, messageToSend.c_str()));
+    ASSERT_CHAT_TEST(msgSent, "Failed to send message");
+    ASSERT_CHAT_TEST(waitForResponse(flagConfirmed), "Timeout expired for receiving confirmation by server");
+    MegaChatHandle msgId = chatroomListener->mConfirmedMessageHandle[a2];
+    ASSERT_CHAT_TEST(msgId != MEGACHAT_INVALID_HANDLE, "Wrong message id for sent message");
+    while (true)
+    {
+        *itemUpdated = false;
+        item.reset(megaChatApi[a1]->getChatListItem(chatid));
+        if (item && item->getLastMessageId() == msgId)
+        {
+            break;
+        }
+        ASSERT_CHAT_TEST(waitForResponse(itemUpdated), "Message not received by account " + std::to_string(a1+1));
+    }
+    ::mega::unique_ptr<MegaChatMessage> msgReceived(megaChatApi[a1]->getMessage(chatid, msgId));   // chat is active, so the message is in RAM
+    ASSERT_CHAT_TEST(msgReceived, "Failed to retrieve the message received in a dormant chat");
+    ASSERT_CHAT_TEST(!strcmp(messageToSend.c_str(), msgReceived->getContent()), "Content of message received doesn't match the content of sent message");
+
+    // Open the chatroom and check the history contains the messages
+    ASSERT_CHAT_TEST(megaChatApi[a1]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a1+1));
+    int count = loadHistory(a1, chatid, chatroomListener);
+    ASSERT_CHAT_TEST(count >= 4, "Wrong count of messages: " + std::to_string(count));
+    msgReceived.reset(megaChatApi[a1]->getMessage(chatid, offlineMsgId));
+    ASSERT_CHAT_TEST(msgReceived, "Failed to retrieve the message sent while offline");
+
+    // Close the chatroom, logout and resume the session, so the chat is dormant again
+    megaChatApi[a1]->closeChatRoom(chatid, chatroomListener);
+    logout(a1, false);
+    session.reset(login(a1, sessionPrimary.get()));
+
+    // Set retention time to 5 seconds, without opening the chatroom
+    bool *retentionTimeChanged1 = &chatroomListener->retentionTimeUpdated[a2]; *retentionTimeChanged1 = false;
+    bool *flagTruncated1 = &chatroomListener->retentionHistoryTruncated[a2]; *flagTruncated1 = false;
+    bool *flagChatRetentionTime = &requestFlagsChat[a1][MegaChatRequest::TYPE_SET_RETENTION_TIME]; *flagChatRetentionTime = false;
+    megaChatApi[a1]->setChatRetentionTime(chatid, 5);
+    ASSERT_CHAT_TEST(waitForResponse(flagChatRetentionTime), "Timeout expired set chat retention time");
+    ASSERT_CHAT_TEST(lastErrorChat[a1] == MegaChatError::ERROR_OK, "Set retention time: Unexpected error. Error:" + std::string(lastErrorMsgChat[a1]));
+    ASSERT_CHAT_TEST(waitForResponse(retentionTimeChanged1), "Timeout expired for receiving chatroom update");
+
+    // Wait a considerable time period to ensure that retentionTime has been processed successfully
+    sleep(chatd::Client::kMinRetentionTimeout + 10);
+    ASSERT_CHAT_TEST(waitForResponse(flagTruncated1), "Retention history autotruncate hasn't been received for account" + std::to_string(a2+1) + " after timeout: " +  std::to_string(maxTimeout) + " seconds");
+
+    // Open the chatroom and check the history of the dormant chat has been cleared
+    ASSERT_CHAT_TEST(megaChatApi[a1]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a1+1));
+    ASSERT_CHAT_TEST(!loadHistory(a1, chatid, chatroomListener), "History should be empty after retention history autotruncate");
+
+    // Disable retention time
+    bool *retentionTimeChanged0 = &chatroomListener->retentionTimeUpdated[a1]; *retentionTimeChanged0 = false;
+    retentionTimeChanged1 = &chatroomListener->retentionTimeUpdated[a2]; *retentionTimeChanged1 = false;
+    flagChatRetentionTime = &requestFlagsChat[a1][MegaChatRequest::TYPE_SET_RETENTION_TIME]; *flagChatRetentionTime = false;
+    megaChatApi[a1]->setChatRetentionTime(chatid, 0);
+    ASSERT_CHAT_TEST(waitForResponse(flagChatRetentionTime), "Timeout expired set chat retention time");
+    ASSERT_CHAT_TEST(lastErrorChat[a1] == MegaChatError::ERROR_OK, "Set retention time: Unexpected error. Error:" + std::string(lastErrorMsgChat[a1]));
+    ASSERT_CHAT_TEST(waitForResponse(retentionTimeChanged0), "Timeout expired for receiving chatroom update");
+    ASSERT_CHAT_TEST(waitForResponse(retentionTimeChanged1), "Timeout expired for receiving chatroom update");
+
+    // Close the chatrooms
+    megaChatApi[a1]->closeChatRoom(chatid, chatroomListener);
+    megaChatApi[a2]->closeChatRoom(chatid, chatroomListener);
+    delete chatroomListener;
+}
+
 /**
  * @brief TEST_ChangeMyOwnName
  *
@@ -4859,6 +5050,35 @@ void MegaLoggerTest::log(int loglevel, const char *message)
     testlog  << message;
 }
 
+MegaChatApiUnitaryTest::Checks::Checks(MegaChatApiUnitaryTest& test, const std::string& name)
+    : mTest(test), mName(name)
+{
+    std::cout << "          TEST - " << mName << std::endl;
+    mTest.mOKTests ++;
+}
+
+void MegaChatApiUnitaryTest::Checks::check(bool condition, const std::string& what)
+{
+    mExecutedTests ++;
+    if (!condition)
+    {
+        mFailureTests ++;
+        std::cout << "         [" << " FAILED " << mName << "] " << what << std::endl;
+        LOG_debug << "Failed check of " << mName << ": " << what;
+    }
+}
+
+bool MegaChatApiUnitaryTest::Checks::finish()
+{
+    if (mFailureTests > 0)
+    {
+        mTest.mFailedTests ++;
+    }
+
+    std::cout << "          TEST - " << mName << " - Executed Tests : " << mExecutedTests << "   Failure Tests : " << mFailureTests << std::endl;
+    return !mFailureTests;
+}
+
 bool MegaChatApiUnitaryTest::UNITARYTEST_ParseUrl()
 {
     // Test cases
@@ -4982,6 +5202,592 @@ bool MegaChatApiUnitaryTest::UNITARYTEST_ParseUrl()
     return succesful;
 }
 
+bool MegaChatApiUnitaryTest::UNITARYTEST_DbQueryPlans()
+{
+    Checks checks(*this, "Query plans of history tables");
+
+    // Frequent queries on history tables (see ChatdSqliteDb). None of them should require a full table scan
+    std::vector<std::string> queries = {
+        chatd::sql::kHistoryRange,
+        chatd::sql::kHistoryRangeCount,
+        chatd::sql::kNodeHistoryRangeCount,
+        chatd::sql::kOldestTs,
+        chatd::sql::kIdxByRetentionTime,
+        chatd::sql::kMsgUserKeyId,
+        chatd::sql::kReactedMsg,
+        chatd::sql::kMsgUpdated,
+        chatd::sql::kLastTextMsg,
+        chatd::sql::kReactionsInRange,
+        chatd::sql::kUpdateMsgUpdated,
+        chatd::sql::kUpdateNodeMsg,
+        chatd::sql::kTruncateRetention,
+        chatd::sql::kTruncateNodeHistory,
+        chatd::sql::unreadCount(false),
+        chatd::sql::unreadCount(true),
+        chatd::sql::unreadEndCalls(false),
+        chatd::sql::unreadEndCalls(true)
+    };
+    for (const char* table : {"history", "node_history"})
+    {
+        queries.push_back(chatd::sql::idxOfMsgid(table));
+        queries.push_back(chatd::sql::msgidOfIdx(table));
+        queries.push_back(chatd::sql::loadMessages(table));
+    }
+
+    SqliteDb db;
+    if (!db.open(":memory:"))
+    {
+        checks.check(false, "open db");
+        return checks.finish();
+    }
+    db.simpleQuery(karere::gDbSchema);
+
+    for (const std::string& query : queries)
+    {
+        SqliteStmt stmt(db, "explain query plan " + query);
+        while (stmt.step())
+        {
+            // i.e. "SCAN history" or, for older versions of sqlite, "SCAN TABLE history"
+            std::string detail = stmt.stringCol(3);
+            if (query.find("(ts)") != std::string::npos)
+            {
+                // timestamp lookups should be resolved by index history_chatid_ts only
+                checks.check(detail.find("COVERING INDEX") != std::string::npos, "query plan " + query + " --> " + detail);
+                continue;
+            }
+
+            if (detail.compare(0, 5, "SCAN ") != 0)
+            {
+                continue;
+            }
+
+            std::string table = detail.substr(5);
+            if (table.compare(0, 6, "TABLE ") == 0)
+            {
+                table = table.substr(6);
+            }
+            table = table.substr(0, table.find(' '));
+            checks.check(table != "history" && table != "node_history" && table != "chat_reactions",
+                         "full table scan in query " + query + " --> " + detail);
+        }
+    }
+    db.close();
+
+    return checks.finish();
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_BufferPool()
+{
+    std::cout << "          TEST - BufferPool allocations per message" << std::endl;
+    mOKTests ++;
+    int failureTests = 0;
+    const unsigned int kMessages = 20000;
+    const unsigned int kWindow = 256;    // messages kept alive, as in the RAM history window
+
+    // Synthetic stream of message payloads: mostly short texts, some attachments and some large ones
+    std::vector<size_t> sizes;
+    unsigned int seed = 1;
+    for (unsigned int i = 0; i < kMessages; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        unsigned int r = (seed >> 16) % 100;
+        sizes.push_back((r < 80) ? 40 + r * 4 : ((r < 98) ? 400 + r * 20 : 6000 + r));
+    }
+    std::string data(16384, 'x');
+
+    // A pool that caches nothing behaves as plain malloc/free, and is used as reference
+    BufferPool mallocPool(0);
+    BufferPool pool;
+    BufferPool* allocators[] = { &mallocPool, &pool };
+    uint64_t mallocs[2];
+    for (int a = 0; a < 2; a++)
+    {
+        std::deque<Buffer> window;
+        for (unsigned int i = 0; i < kMessages; i++)
+        {
+            // received ciphertext, replaced by its (shorter) plaintext once decrypted, as chatd::Message
+            window.emplace_back(data.data(), sizes[i], allocators[a]);
+            window.back().assign(data.data(), sizes[i] / 2);
+            window.back().append(data.data(), sizes[i]);
+            if (window.back().dataSize() != sizes[i] / 2 + sizes[i]
+                    || memcmp(window.back().buf(), data.data(), window.back().dataSize()))
+            {
+                failureTests ++;
+                std::cout << "         [" << " FAILED Buffer content" << "] size: " << sizes[i] << std::endl;
+                break;
+            }
+            if (window.size() > kWindow)
+            {
+                window.pop_front();
+            }
+        }
+        mallocs[a] = allocators[a]->stats().mallocs;
+    }
+
+    std::cout << "          Allocations per message - malloc: " << (double)mallocs[0] / kMessages
+              << "   BufferPool: " << (double)mallocs[1] / kMessages << std::endl;
+    if (mallocs[1] * 10 > mallocs[0])
+    {
+        failureTests ++;
+        std::cout << "         [" << " FAILED BufferPool" << "] mallocs: " << mallocs[1] << " reference: " << mallocs[0] << std::endl;
+    }
+
+    if (failureTests > 0)
+    {
+        mFailedTests ++;
+    }
+
+    std::cout << "          TEST - BufferPool allocations per message - Failure Tests : " << failureTests << std::endl;
+    return !failureTests;
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_SharedBuffer()
+{
+    Checks checks(*this, "SharedBuffer slices");
+
+    BufferPool pool;
+    Buffer frame = SharedBuffer::create(Buffer("0123456789abcdefghij", 20), &pool);
+    SharedBuffer* shared = static_cast<SharedBuffer*>(frame.allocator());
+    {
+        Buffer msg1 = SharedBuffer::slice(frame, 2, 5);
+        Buffer msg2 = SharedBuffer::slice(frame, 10, 4);
+        checks.check(shared->refCount() == 3 && msg1.isShared() && msg1.dataEquals("23456", 5), "slice");
+
+        // growing or reassigning a slice (i.e. when decrypted) must stop referencing the frame
+        msg1.append("XYZ", 3);
+        checks.check(!msg1.isShared() && msg1.allocator() == &pool && msg1.dataEquals("23456XYZ", 8), "append to slice");
+        msg2.assign("zz", 2);
+        checks.check(!msg2.isShared() && shared->refCount() == 1, "assign to slice");
+
+        Buffer msg3 = SharedBuffer::slice(frame, 0, 3);
+        msg3.write(0, "A", 1);
+        checks.check(msg3.isShared() && msg3.dataEquals("A12", 3) && frame.buf()[0] == 'A', "write in place");
+
+        // the frame must survive while any slice references it
+        frame.free();
+        checks.check(shared->refCount() == 1 && msg3.dataEquals("A12", 3), "release frame");
+        msg3.detach();
+        checks.check(!msg3.isShared() && msg3.dataEquals("A12", 3), "detach");
+    }
+
+    return checks.finish();
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_DbGroupCommit()
+{
+    Checks checks(*this, "Db group commit");
+
+    SqliteDb db;
+    if (!db.open(":memory:", false))
+    {
+        checks.check(false, "open db");
+        return checks.finish();
+    }
+    db.simpleQuery("create table items(id integer, data blob)");
+    db.setCommitInterval(3600);
+    db.setCommitThresholds(100, 1024 * 1024);
+    db.resetCommitStats();
+
+    Buffer data(400, 400);
+    for (int i = 0; i < 1000; i++)
+    {
+        db.query("insert into items(id, data) values(?, ?)", i, data);
+    }
+    const SqliteDb::CommitStats& stats = db.commitStats();
+    checks.check(stats.byReason[SqliteDb::kCommitSize] == 10 && stats.rows == 1000
+          && stats.maxBatchRows == 100 && !db.pendingRows(), "row threshold");
+
+    db.setCommitThresholds(100000, 1000);
+    db.query("insert into items(id, data) values(?, ?)", 1000, data);
+    db.query("insert into items(id, data) values(?, ?)", 1001, data);
+    checks.check(db.pendingBytes() == 800 && db.pendingRows() == 2, "pending bytes");
+    db.query("insert into items(id, data) values(?, ?)", 1002, data);
+    checks.check(stats.byReason[SqliteDb::kCommitSize] == 11 && !db.pendingBytes(), "bytes threshold");
+
+    {
+        SqliteStmt stmt(db, "select count(*) from items");
+        stmt.stepMustHaveData();
+        checks.check(stmt.intCol(0) == 1003 && !db.pendingRows() && stats.commits == 11, "reads are not counted");
+    }
+
+    db.commitBarrier();
+    checks.check(!stats.byReason[SqliteDb::kCommitBarrier], "barrier without pending rows");
+    db.query("delete from items where id = ?", 1002);
+    db.commitBarrier();
+    checks.check(stats.byReason[SqliteDb::kCommitBarrier] == 1 && !db.pendingRows(), "barrier");
+    db.close();
+
+    return checks.finish();
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_DbStmtCache()
+{
+    Checks checks(*this, "Db statement cache");
+
+    SqliteDb db;
+    if (!db.open(":memory:"))
+    {
+        checks.check(false, "open db");
+        return checks.finish();
+    }
+    db.simpleQuery("create table items(id integer, name text)");
+    for (int i = 0; i < 10; i++)
+    {
+        db.query("insert into items(id, name) values(?, ?)", i, "item");
+    }
+    SqliteStmtCache::Stats before = db.stmtCacheStats();
+    sqlite3_stmt* prepared = nullptr;
+    for (int i = 0; i < 3; i++)
+    {
+        // left in the middle of the results, and the second parameter is bound only once
+        SqliteStmt stmt(db, "select id, ?2 from items where id >= ?1 order by id");
+        if (!i)
+        {
+            stmt.bind(1, 5).bind(2, "bound");
+            prepared = stmt;
+        }
+        else
+        {
+            stmt.bind(1, 0);
+        }
+        bool ok = stmt.step() && stmt.intCol(0) == (i ? 0 : 5)
+                && sqlite3_column_type(stmt, 1) == (i ? SQLITE_NULL : SQLITE_TEXT);
+        checks.check(ok && (sqlite3_stmt*)stmt == prepared, "reused statement is reset, bindings cleared");
+    }
+    SqliteStmtCache::Stats stats = db.stmtCacheStats();
+    checks.check(stats.hits - before.hits == 2 && stats.misses - before.misses == 1, "hits and misses");
+
+    // an idle cached statement doesn't keep the table locked
+    db.simpleQuery("drop table items");
+    db.simpleQuery("create table items(id integer, name text)");
+
+    // SQL built at runtime is not cached
+    before = db.stmtCacheStats();
+    for (int i = 0; i < 100; i++)
+    {
+        SqliteStmt stmt(db, "select " + std::to_string(i));
+        stmt.step();
+    }
+    stats = db.stmtCacheStats();
+    checks.check(stats.size == before.size && stats.misses == before.misses, "dynamic SQL");
+
+    // the cache is bounded, the least recently used statement is finalized
+    static const char* queries[] =
+    {
+        "select 1", "select 2", "select 3", "select 4", "select 5", "select 6"
+    };
+    db.stmtCache().setCapacity(4);
+    before = db.stmtCacheStats();
+    for (const char* sql: queries)
+    {
+        SqliteStmt stmt(db, sql);
+        stmt.step();
+    }
+    {
+        SqliteStmt stmt(db, queries[5]);
+    }
+    stats = db.stmtCacheStats();
+    checks.check(stats.size == 4 && stats.evictions - before.evictions >= 2
+                 && stats.hits - before.hits == 1, "capacity");
+    db.close();
+
+    return checks.finish();
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_DecryptWorkerPool()
+{
+    Checks checks(*this, "Decrypt worker pool");
+
+    std::atomic<int> done(0);
+    int queued = 0;
+    strongvelope::DecryptWorkerPool pool(3);
+    for (int i = 0; i < 2000; i++)
+    {
+        queued += pool.submit([&done]() { done++; });
+    }
+    checks.check(queued >= strongvelope::DecryptWorkerPool::kMaxQueuedJobs, "submit");
+
+    // restarting the pool must not drop queued jobs, since their completion is awaited
+    pool.setThreadCount(2);
+    checks.check(done == queued && pool.threadCount() == 2, "queued jobs complete");
+
+    pool.setThreadCount(0);
+    checks.check(!pool.submit([]() {}), "disabled pool");
+
+    return checks.finish();
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_SendKeyCache()
+{
+    Checks checks(*this, "Send key cache");
+
+    SqliteDb db;
+    if (!db.open(":memory:"))
+    {
+        checks.check(false, "open db");
+        return checks.finish();
+    }
+    db.simpleQuery("create table sendkeys(chatid int64 not null, userid int64 not null, keyid int32 not null, "
+                   "key blob not null, ts int not null, UNIQUE(chatid, userid, keyid))");
+
+    // keys 1..100 of the chat, even keyids sent by userA and odd ones by userB
+    karere::Id chatid(1), userA(2), userB(3);
+    for (uint32_t keyid = 1; keyid <= 100; keyid++)
+    {
+        strongvelope::SendKey key;
+        memset(key.buf(), (int)keyid, key.dataSize());
+        db.query("insert into sendkeys(chatid, userid, keyid, key, ts) values(?,?,?,?,?)",
+                 chatid, (keyid % 2) ? userB : userA, keyid, key, 0);
+    }
+
+    strongvelope::SendKeyCache cache(db, chatid);
+    typedef strongvelope::UserKeyId UserKeyId;
+
+    // a miss loads the preceding keys of the same user, so the next lookups are hits
+    strongvelope::SendKeyCache::Entry* entry = cache.find(UserKeyId(userA, 100));
+    bool ok = entry && entry->key && (unsigned char)entry->key->buf()[0] == 100;
+    checks.check(ok && cache.stats().misses == 1 && cache.stats().loaded == 16, "miss");
+    entry = cache.find(UserKeyId(userA, 70));
+    ok = entry && entry->key && (unsigned char)entry->key->buf()[0] == 70;
+    checks.check(ok && cache.stats().hits == 1 && cache.stats().misses == 1, "hit");
+    checks.check(!cache.find(UserKeyId(userB, 100)) && cache.stats().misses == 2, "key of another user");
+
+    // a missing key is looked up in db only once, until new keys are received
+    uint64_t loaded = cache.stats().loaded;
+    checks.check(!cache.find(UserKeyId(userA, 102)) && !cache.find(UserKeyId(userA, 102))
+                 && cache.stats().misses == 3 && cache.stats().missing == 1, "missing key");
+    strongvelope::SendKeyCache::Entry& added = cache.findOrAdd(UserKeyId(userA, 102));
+    checks.check(!added.key && cache.find(UserKeyId(userA, 102)) == &added, "missing key added");
+    cache.erase(UserKeyId(userA, 102));
+    checks.check(!cache.find(UserKeyId(userA, 104)) && cache.stats().misses == 4, "missing key 2");
+    db.query("insert into sendkeys(chatid, userid, keyid, key, ts) values(?,?,?,?,?)",
+             chatid, userA, 104, strongvelope::SendKey(), 0);
+    checks.check(!cache.find(UserKeyId(userA, 104)) && cache.stats().misses == 4, "missing key not looked up");
+    cache.clearMissing();
+    checks.check(cache.find(UserKeyId(userA, 104)) && cache.stats().misses == 5
+                 && cache.stats().loaded == loaded + 1, "missing key after new keys");
+
+    // keys of all users in a history range
+    checks.check(cache.prefetchRange(1, 10) == 10 && cache.get(UserKeyId(userB, 1))
+                 && cache.get(UserKeyId(userA, 10)) && cache.prefetchRange(1, 10) == 0, "history range");
+
+    // least recently used keys are evicted, the most recent one is kept
+    size_t resident = cache.residentCount();
+    uint64_t evictions = cache.stats().evictions;
+    cache.find(UserKeyId(userA, 70));
+    cache.setMaxResident(4);
+    checks.check(cache.residentCount() == 4 && cache.stats().evictions - evictions == resident - 4
+                 && cache.get(UserKeyId(userA, 70)) && !cache.get(UserKeyId(userA, 100)), "eviction");
+
+    // the window of prefetched keys is bounded by the maximum resident: keyids 96..99
+    loaded = cache.stats().loaded;
+    checks.check(cache.find(UserKeyId(userB, 99)) && cache.stats().loaded - loaded == 2
+                 && cache.residentCount() == 4, "bounded prefetch");
+    db.close();
+
+    return checks.finish();
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_IdMap()
+{
+    Checks checks(*this, "IdMap");
+
+    // random inserts and removals, checked against std::map (few keys, so clusters are frequent)
+    karere::IdMap<int> map;
+    std::map<uint64_t, int> reference;
+    uint64_t seed = 1;
+    bool consistent = true;
+    for (int i = 0; i < 20000; i++)
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t key = (seed >> 33) % 500;
+        if ((seed >> 20) & 1)
+        {
+            map[key] = i;
+            reference[key] = i;
+        }
+        else
+        {
+            consistent &= (map.erase(key) == (reference.erase(key) == 1));
+        }
+    }
+    checks.check(consistent, "erase result");
+    checks.check(map.size() == reference.size(), "size");
+
+    size_t iterated = 0;
+    for (auto it = map.begin(); it != map.end(); it++)
+    {
+        auto refIt = reference.find(it->first);
+        consistent &= (refIt != reference.end() && refIt->second == it->second);
+        iterated++;
+    }
+    checks.check(consistent && iterated == reference.size(), "iteration");
+
+    for (uint64_t key = 0; key < 500; key++)
+    {
+        const int* value = map.find(key);
+        auto refIt = reference.find(key);
+        consistent &= (refIt == reference.end()) ? !value : (value && *value == refIt->second);
+    }
+    checks.check(consistent, "find");
+
+    // the reserved key is never inserted
+    size_t size = map.size();
+    checks.check(!map.emplace(karere::IdMap<int>::kEmptyKey).first && map.size() == size
+                 && !map.contains(karere::IdMap<int>::kEmptyKey), "reserved key");
+
+    map.clear();
+    checks.check(map.empty() && !map.find(1) && map.begin() == map.end(), "clear");
+
+    return checks.finish();
+}
+
+#ifndef KARERE_DISABLE_WEBRTC
+bool MegaChatApiUnitaryTest::UNITARYTEST_RtcStatsStore()
+{
+    Checks checks(*this, "RtcStatsStore");
+
+    using rtcModule::stats::Sample;
+    using rtcModule::stats::SampleStore;
+
+    // values going up and down, spanning several blocks
+    unsigned count = SampleStore::kBlockSize * 2 + 10;
+    std::vector<Sample> reference(count);
+    SampleStore store;
+    for (unsigned i = 0; i < count; i++)
+    {
+        Sample& sample = reference[i];
+        sample.ts = i * 1000;
+        sample.vstats.rtt = (i % 7) * 50 - 100;
+        sample.vstats.r.bt = (long)i * 123456;
+        sample.vstats.s.el = (i % 100) / 10.0f;
+        sample.astats.plDifference = (i % 2) ? -3 : 3;
+        store.push_back(sample);
+    }
+    checks.check(store.size() == count && store.totalCount() == count, "size");
+    checks.check(store.back().ts == reference.back().ts, "last sample");
+
+    unsigned i = 0;
+    bool consistent = true;
+    store.forEachSample([&](const Sample& sample)
+    {
+        const Sample& expected = reference[i++];
+        consistent &= sample.ts == expected.ts && sample.vstats.rtt == expected.vstats.rtt
+                && sample.vstats.r.bt == expected.vstats.r.bt && sample.astats.plDifference == expected.astats.plDifference
+                && sample.vstats.s.el == expected.vstats.s.el;
+    });
+    checks.check(consistent && i == count, "decoded samples");
+    checks.check(store.encodedSize() < count * sizeof(Sample) / 4, "encoded size");
+
+    // the oldest blocks are dropped beyond the limit
+    for (unsigned j = count; j < SampleStore::kMaxSamples + SampleStore::kBlockSize; j++)
+    {
+        store.push_back(reference.back());
+    }
+    checks.check(store.size() <= SampleStore::kMaxSamples && store.totalCount() == SampleStore::kMaxSamples + SampleStore::kBlockSize, "bounded size");
+    int64_t first = -1;
+    store.forEachValue(SampleStore::kCol_ts, [&first](int64_t ts) { if (first < 0) first = ts; });
+    checks.check(first > 0, "oldest samples dropped");
+
+    return checks.finish();
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_RtcStatsBinary()
+{
+    Checks checks(*this, "RtcStatsBinary");
+
+    using rtcModule::stats::Sample;
+    using rtcModule::stats::SampleStore;
+
+    rtcModule::stats::RtcStats stats;
+    stats.mIsJoiner = true;
+    stats.mSper = 1000;
+    stats.mStartTs = 1600000000123;
+    stats.mDur = 61499;    // would round to 61 seconds in the JSON
+    stats.mIsGroupCall = false;
+    stats.mTermRsn = "hangup";
+
+    // elapsed times that are not whole seconds, and encode usages with more than one decimal
+    unsigned count = SampleStore::kBlockSize * 2 + 10;
+    std::vector<Sample> reference(count);
+    for (unsigned i = 0; i < count; i++)
+    {
+        Sample& sample = reference[i];
+        sample.ts = i * 1000 + (i % 3) * 333 + 7;
+        sample.vstats.rtt = (i % 7) * 50 - 100;
+        sample.vstats.s.el = (i % 100) / 3.0f;
+        sample.astats.plDifference = (i % 2) ? -3 : 3;
+        sample.cstats.r.bt = (long)i * 123456;
+        stats.mSamples.push_back(sample);
+    }
+
+    std::string data;
+    stats.toBinary(data);
+
+    // decode the export
+    size_t pos = 4;
+    checks.check(data.compare(0, 3, "RTS") == 0 && data[3] == 1, "header");
+    auto readStr = [&data, &pos]()
+    {
+        size_t size = SampleStore::readVarint(data, pos);
+        std::string value = data.substr(pos, size);
+        pos += size;
+        return value;
+    };
+    size_t sampleCount = SampleStore::readVarint(data, pos);
+    size_t columnCount = SampleStore::readVarint(data, pos);
+    checks.check(sampleCount == count && columnCount == SampleStore::kColumnCount, "counts");
+    std::map<std::string, std::vector<int64_t>> columns;
+    for (size_t i = 0; i < columnCount; i++)
+    {
+        std::string name = readStr();
+        std::string column = readStr();
+        std::vector<int64_t>& values = columns[name];
+        size_t columnPos = 0;
+        int64_t value = 0;
+        while (columnPos < column.size())
+        {
+            value += SampleStore::zigzagDecode(SampleStore::readVarint(column, columnPos));
+            values.push_back(value);
+        }
+    }
+    std::map<std::string, std::string> fields;
+    size_t fieldCount = SampleStore::readVarint(data, pos);
+    for (size_t i = 0; i < fieldCount; i++)
+    {
+        std::string name = readStr();
+        fields[name] = readStr();
+    }
+    checks.check(pos == data.size(), "size");
+
+    // every column is the one of the store
+    bool sameColumns = columns.size() == SampleStore::kColumnCount;
+    for (unsigned i = 0; i < SampleStore::kColumnCount; i++)
+    {
+        std::vector<int64_t> expected;
+        stats.mSamples.forEachValue(i, [&expected](int64_t value) { expected.push_back(value); });
+        sameColumns &= columns[SampleStore::columnName(i)] == expected;
+    }
+    checks.check(sameColumns, "columns");
+
+    // and the samples are the ones recorded, including the elapsed time
+    bool sameSamples = columns["ts"].size() == count && columns["v_s_el"].size() == count;
+    for (unsigned i = 0; sameSamples && i < count; i++)
+    {
+        float el;
+        SampleStore::fromColumnValue(columns["v_s_el"][i], el);
+        sameSamples &= columns["ts"][i] == reference[i].ts && el == reference[i].vstats.s.el
+                && columns["v_rtt"][i] == reference[i].vstats.rtt && columns["a_pld"][i] == reference[i].astats.plDifference
+                && columns["c_r_bt"][i] == reference[i].cstats.r.bt;
+    }
+    checks.check(sameSamples, "samples");
+    checks.check(fields["ts"] == "1600000000123" && fields["dur"] == "61499", "start and duration");
+    checks.check(fields["termRsn"] == "hangup" && fields["isJoiner"] == "1", "fields");
+
+    return checks.finish();
+}
+#endif
+
 TestMegaRequestListener::TestMegaRequestListener(MegaApi *megaApi, MegaChatApi *megaChatApi)
     : RequestListener(megaApi, megaChatApi)
 {
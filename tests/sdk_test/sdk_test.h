@@ -239,6 +239,7 @@ public:
     void TEST_LastMessage(unsigned int a1, unsigned int a2);
     void TEST_GroupLastMessage(unsigned int a1, unsigned int a2);
     void TEST_RetentionHistory(unsigned int a1, unsigned int a2);
+    void TEST_DormantChat(unsigned int a1, unsigned int a2);
     void TEST_ChangeMyOwnName(unsigned int a1);
 #ifndef KARERE_DISABLE_WEBRTC
     void TEST_Calls(unsigned int a1, unsigned int a2);
@@ -464,7 +465,36 @@ private:
 class MegaChatApiUnitaryTest
 {
 public:
+    /** Checks of a unitary test: prints and counts the failed ones, and the result of the test */
+    class Checks
+    {
+    public:
+        Checks(MegaChatApiUnitaryTest& test, const std::string& name);
+        void check(bool condition, const std::string& what);
+        /** Prints the summary and updates the counters of \c test. Returns true if all checks passed */
+        bool finish();
+        int failures() const { return mFailureTests; }
+
+    private:
+        MegaChatApiUnitaryTest& mTest;
+        std::string mName;
+        int mExecutedTests = 0;
+        int mFailureTests = 0;
+    };
+
     bool UNITARYTEST_ParseUrl();
+    bool UNITARYTEST_DbQueryPlans();
+    bool UNITARYTEST_BufferPool();
+    bool UNITARYTEST_SharedBuffer();
+    bool UNITARYTEST_DbGroupCommit();
+    bool UNITARYTEST_DbStmtCache();
+    bool UNITARYTEST_DecryptWorkerPool();
+    bool UNITARYTEST_SendKeyCache();
+    bool UNITARYTEST_IdMap();
+#ifndef KARERE_DISABLE_WEBRTC
+    bool UNITARYTEST_RtcStatsStore();
+    bool UNITARYTEST_RtcStatsBinary();
+#endif
 
     unsigned mOKTests = 0;
     unsigned mFailedTests = 0;